@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <sched.h>
+#include <dirent.h>
+#include "sobel_alg.h"
+#include "frame_pool.h"
+#include "affinity.h"
+
+static int enabled;
+static cpu_set_t start_mask;   // what threads not given a CPU run on
+static cpu_set_t allowed;      // the cpuset, isolated CPUs included
+static cpu_set_t isolated;
+static int compute[CPU_SETSIZE]; // --cpus, in order
+static int ncompute;
+static int next_compute;       // round robin cursor, shared by every pool
+static int num_nodes = 1;
+static int rt_failed;
+
+// Dedicated CPU the calling thread was pinned to, -1 if none
+static __thread int self_cpu = -1;
+
+// Parses a kernel style CPU list ("0-3,6"). Returns -1 if malformed.
+static int parseCpus(const char *list, cpu_set_t *set)
+{
+  const char *p = list;
+
+  CPU_ZERO(set);
+  while (*p != '\0' && *p != '\n') {
+    char *end;
+    long lo = strtol(p, &end, 10), hi = lo;
+    if (end == p || lo < 0) {
+      return -1;
+    }
+    p = end;
+    if (*p == '-') {
+      hi = strtol(p + 1, &end, 10);
+      if (end == p + 1 || hi < lo) {
+        return -1;
+      }
+      p = end;
+    }
+    if (hi >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long c = lo; c <= hi; c++) {
+      CPU_SET(c, set);
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0' && *p != '\n') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Reads a CPU list file from sysfs or cgroupfs. An empty file is an empty set.
+static int readCpus(const char *path, cpu_set_t *set)
+{
+  char line[4096];
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    return -1;
+  }
+  if (fgets(line, sizeof(line), f) == NULL) {
+    line[0] = '\0';
+  }
+  fclose(f);
+  return parseCpus(line, set);
+}
+
+// CPUs of this process's cpuset, from its cgroup (v2, then the v1 cpuset
+// controller), or every online CPU without one
+static void cpusetCpus(cpu_set_t *set)
+{
+  char line[1024], path[1280];
+  int found = -1;
+  FILE *f = fopen("/proc/self/cgroup", "r");
+
+  while (f != NULL && found != 0 && fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "0::", 3) == 0) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpuset.cpus.effective", line + 3);
+      found = readCpus(path, set);
+    } else if (strstr(line, ":cpuset:") != NULL) {
+      snprintf(path, sizeof(path), "/sys/fs/cgroup/cpuset%s/cpuset.effective_cpus", strstr(line, ":cpuset:") + 8);
+      found = readCpus(path, set);
+    }
+    if (found == 0 && CPU_COUNT(set) == 0) {
+      found = -1; // controller not enabled for this cgroup
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  if (found != 0 && readCpus("/sys/devices/system/cpu/online", set) != 0) {
+    *set = start_mask;
+  }
+}
+
+// NUMA node of a CPU, 0 on hosts without NUMA information
+static int cpuNode(int cpu)
+{
+  char path[64];
+  int node = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return 0;
+  }
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (sscanf(e->d_name, "node%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+static int countNodes()
+{
+  int n = 0, node;
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == NULL) {
+    return 1;
+  }
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    n += sscanf(e->d_name, "node%d", &node) == 1;
+  }
+  closedir(dir);
+  return n > 0 ? n : 1;
+}
+
+// "0-3 6": a CPU list without commas, for the CSV reports
+static void formatCpus(const cpu_set_t *set, char *buf, size_t size)
+{
+  size_t len = 0;
+
+  buf[0] = '\0';
+  for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+    if (!CPU_ISSET(c, set)) {
+      continue;
+    }
+    int hi = c;
+    while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) {
+      hi++;
+    }
+    if (hi > c) {
+      len += snprintf(buf + len, size - len, "%s%d-%d", len ? " " : "", c, hi);
+    } else {
+      len += snprintf(buf + len, size - len, "%s%d", len ? " " : "", c);
+    }
+    c = hi;
+  }
+}
+
+static void checkAllowed(int cpu, const char *what)
+{
+  if (cpu >= 0 && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))) {
+    char list[256];
+    formatCpus(&allowed, list, sizeof(list));
+    errx(1, "%s CPU %d is not in this process's cpuset (%s)", what, cpu, list);
+  }
+}
+
+/*******************************************
+ * Model: affinity_init
+ * Input: None (reads opts)
+ * Output: None
+ * Desc: Records the starting mask, the cpuset and the isolated CPUs, and
+ *  resolves --cpus into the list compute workers are dealt from. 'auto'
+ *  means the isolated CPUs of the cpuset if there are any, otherwise the
+ *  starting mask.
+ ********************************************/
+void affinity_init()
+{
+  if (opts.cpus == NULL && opts.captureCpu < 0 && opts.outputCpu < 0 && opts.rtPrio == 0) {
+    return;
+  }
+  enabled = 1;
+
+  if (sched_getaffinity(0, sizeof(start_mask), &start_mask) != 0) {
+    err(1, "sched_getaffinity");
+  }
+  cpusetCpus(&allowed);
+  if (readCpus("/sys/devices/system/cpu/isolated", &isolated) != 0) {
+    CPU_ZERO(&isolated);
+  }
+  CPU_AND(&isolated, &isolated, &allowed);
+  num_nodes = countNodes();
+
+  if (opts.cpus != NULL) {
+    cpu_set_t set;
+    if (strcmp(opts.cpus, "auto") == 0) {
+      set = CPU_COUNT(&isolated) > 0 ? isolated : start_mask;
+      for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &set)) {
+          compute[ncompute++] = c;
+        }
+      }
+    } else {
+      // Keep the order given, it is the order workers are dealt out in
+      const char *p = opts.cpus;
+      while (*p != '\0') {
+        size_t n = strcspn(p, ",");
+        char item[32];
+        snprintf(item, sizeof(item), "%.*s", (int)n, p);
+        if (n >= sizeof(item) || parseCpus(item, &set) != 0 || CPU_COUNT(&set) == 0) {
+          errx(1, "Invalid CPU list: %s (expected e.g. 2-5,8 or auto)", opts.cpus);
+        }
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+          if (CPU_ISSET(c, &set) && ncompute < CPU_SETSIZE) {
+            checkAllowed(c, "Compute");
+            compute[ncompute++] = c;
+          }
+        }
+        p += n + (p[n] == ',');
+      }
+    }
+  }
+  checkAllowed(opts.captureCpu, "Capture");
+  checkAllowed(opts.outputCpu, "Output");
+}
+
+// Give thread `tid` (0: the caller) CPU `cpu`, or the starting mask for -1
+static void pin(pid_t tid, int cpu)
+{
+  cpu_set_t set = start_mask;
+
+  if (cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(tid, sizeof(set), &set) != 0) {
+    warn("Cannot pin thread %d to CPU %d", (int)tid, cpu);
+  }
+  if (opts.rtPrio > 0) {
+    struct sched_param param;
+    param.sched_priority = opts.rtPrio;
+    if (sched_setscheduler(tid, SCHED_FIFO, &param) != 0 &&
+        __atomic_exchange_n(&rt_failed, 1, __ATOMIC_RELAXED) == 0) {
+      warn("Cannot use SCHED_FIFO, running with normal priority");
+    }
+  }
+}
+
+static int nextCompute()
+{
+  if (ncompute == 0) {
+    return -1;
+  }
+  return compute[__atomic_fetch_add(&next_compute, 1, __ATOMIC_RELAXED) % ncompute];
+}
+
+void affinity_pin_self(int role)
+{
+  int cpu;
+
+  if (!enabled || (role == AFF_COMPUTE && self_cpu >= 0)) {
+    return;
+  }
+  cpu = role == AFF_CAPTURE ? opts.captureCpu : role == AFF_OUTPUT ? opts.outputCpu : nextCompute();
+  pin(0, cpu);
+  self_cpu = cpu;
+}
+
+void affinity_pool(thread_pool_t *pool)
+{
+  if (!enabled) {
+    return;
+  }
+  for (int w = 0; w < pool->nthreads; w++) {
+    int cpu;
+    if (w == 0) {
+      affinity_pin_self(AFF_COMPUTE);
+      cpu = self_cpu;
+    } else {
+      cpu = nextCompute();
+      pin(pool->tids[w], cpu);
+    }
+    pool->nodes[w] = cpu >= 0 ? cpuNode(cpu) : -1;
+  }
+}
+
+void affinity_place(thread_pool_t *pool, unsigned char *const *bufs)
+{
+  if (num_nodes <= 1) {
+    return;
+  }
+  for (int w = 0; w < pool->nthreads; w++) {
+    if (bufs[w] != NULL && pool->nodes[w] >= 0) {
+      fpool_place(bufs[w], pool->nodes[w]);
+    }
+  }
+}
+
+// A dedicated CPU, or "any" for the starting mask
+static void reportCpu(std::ostream &out, const char *what, int cpu)
+{
+  out << what << ", ";
+  if (cpu >= 0) {
+    out << cpu << std::endl;
+  } else {
+    out << "any" << std::endl;
+  }
+}
+
+void affinity_report(std::ostream &out)
+{
+  char list[256];
+
+  if (!enabled) {
+    return;
+  }
+  reportCpu(out, "Capture CPU", opts.captureCpu);
+  out << "Compute CPUs, ";
+  for (int k = 0; k < ncompute; k++) {
+    out << (k ? " " : "") << compute[k];
+  }
+  out << (ncompute ? "" : "any") << std::endl;
+  reportCpu(out, "Output CPU", opts.outputCpu);
+  formatCpus(&isolated, list, sizeof(list));
+  out << "Isolated CPUs, " << (list[0] ? list : "none") << std::endl;
+  if (opts.rtPrio == 0) {
+    out << "Scheduling, SCHED_OTHER" << std::endl;
+  } else if (rt_failed) {
+    out << "Scheduling, SCHED_OTHER (SCHED_FIFO not permitted)" << std::endl;
+  } else {
+    out << "Scheduling, SCHED_FIFO " << opts.rtPrio << std::endl;
+  }
+  out << "NUMA nodes, " << num_nodes << std::endl;
+}
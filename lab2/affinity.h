@@ -0,0 +1,44 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <ostream>
+#include "thread_pool.h"
+
+// Thread placement (--cpus, --capture-cpu, --output-cpu, --rt). Left alone,
+// the kernel migrates the capture, compute and output threads between CPUs
+// and shares those CPUs with everything else on the host, which shows up as
+// frame time jitter. With any of these options set every thread the drivers
+// create is given an explicit CPU mask: capture and output threads their own
+// CPU when one is given, compute workers one CPU each, round robin over the
+// --cpus list, and everything else the mask the process started with.
+// Requested CPUs are checked against the cpuset the process may run on;
+// CPUs listed in /sys/devices/system/cpu/isolated (isolcpus) are outside the
+// default mask but inside the cpuset, so they can be used, and are what
+// --cpus auto picks when the host has any. --rt additionally runs every
+// placed thread under SCHED_FIFO.
+//
+// On hosts with several NUMA nodes, affinity_place then moves each pinned
+// worker's pooled buffers to the worker's node (see fpool_place).
+
+enum aff_role_t { AFF_CAPTURE, AFF_COMPUTE, AFF_OUTPUT };
+
+// Validates opts' CPU options against the host and sets up the placement.
+// Exits with a message on a bad CPU list. No-op unless an option is set.
+void affinity_init();
+
+// Place the calling thread for `role`. A thread already pinned to a capture
+// or output CPU keeps it when asked for AFF_COMPUTE, so a driver whose
+// capture thread also computes stays on the capture CPU.
+void affinity_pin_self(int role);
+
+// Pin every worker of a pool (worker 0 through affinity_pin_self) and record
+// each one's NUMA node in pool->nodes
+void affinity_pool(thread_pool_t *pool);
+
+// Move bufs[w], a pooled buffer per worker, to worker w's NUMA node
+void affinity_place(thread_pool_t *pool, unsigned char *const *bufs);
+
+// Report lines describing the placement, if any
+void affinity_report(std::ostream &out);
+
+#endif
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "thread_pool.h"
+#include "autotune.h"
+#include "frame_source.h"
+
+// Each candidate runs for at least TUNE_MIN_RUNS frames and TUNE_MS
+// milliseconds; its median frame time is what counts. With three backends,
+// three modes and a few thread counts that keeps tuning around a second.
+#define TUNE_MIN_RUNS 5
+#define TUNE_MS 30
+
+#define PROFILE_MAGIC "# sobel autotune profile v1"
+
+static const char *mode_names[TUNE_NUM_MODES] = { "two-pass", "fused", "tiled" };
+
+const char *tune_mode_name(int mode)
+{
+  return mode >= 0 && mode < TUNE_NUM_MODES ? mode_names[mode] : "?";
+}
+
+static void hostName(char *buf, size_t len)
+{
+  if (gethostname(buf, len) != 0) {
+    snprintf(buf, len, "unknown");
+  }
+  buf[len - 1] = '\0';
+}
+
+const char *profile_default_path()
+{
+  static char path[128];
+  char host[64];
+  hostName(host, sizeof(host));
+  snprintf(path, sizeof(path), "sobel-%s.profile", host);
+  return path;
+}
+
+/*******************************************
+ * Model: profile_load
+ * Input: profile path
+ * Output: 0 and p filled in, or -1
+ * Desc: The profile is one key=value per line after a magic line. A
+ *  profile from another host (copied along with a checkout, say) is
+ *  refused rather than silently applied.
+ ********************************************/
+int profile_load(const char *path, tune_profile_t *p)
+{
+  char line[256], host[64];
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  memset(p, 0, sizeof(*p));
+  p->mode = -1;
+  if (fgets(line, sizeof(line), f) == NULL || strncmp(line, PROFILE_MAGIC, strlen(PROFILE_MAGIC)) != 0) {
+    fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char mode[16];
+    if (sscanf(line, "host=%63s", p->host) == 1 ||
+        sscanf(line, "frame=%dx%d", &p->width, &p->height) == 2 ||
+        sscanf(line, "kernel=%15s", p->kernel) == 1 ||
+        sscanf(line, "threads=%d", &p->threads) == 1 ||
+        sscanf(line, "band_rows=%d", &p->band_rows) == 1 ||
+        sscanf(line, "tile=%dx%d", &p->tile_w, &p->tile_h) == 2 ||
+        sscanf(line, "ns_per_frame=%lf", &p->ns_per_frame) == 1) {
+      continue;
+    }
+    if (sscanf(line, "mode=%15s", mode) == 1) {
+      for (int m = 0; m < TUNE_NUM_MODES; m++) {
+        if (strcmp(mode, mode_names[m]) == 0) {
+          p->mode = m;
+        }
+      }
+    }
+  }
+  fclose(f);
+
+  hostName(host, sizeof(host));
+  if (strcmp(p->host, host) != 0 || p->mode < 0 || p->kernel[0] == '\0' ||
+      p->threads < 0 || p->threads > POOL_MAX_THREADS) {
+    return -1;
+  }
+  return 0;
+}
+
+int profile_save(const char *path, const tune_profile_t *p)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  fprintf(f, "%s\n", PROFILE_MAGIC);
+  fprintf(f, "host=%s\n", p->host);
+  fprintf(f, "frame=%dx%d\n", p->width, p->height);
+  fprintf(f, "kernel=%s\n", p->kernel);
+  fprintf(f, "mode=%s\n", mode_names[p->mode]);
+  fprintf(f, "threads=%d\n", p->threads);
+  fprintf(f, "band_rows=%d\n", p->band_rows);
+  fprintf(f, "tile=%dx%d\n", p->tile_w, p->tile_h);
+  fprintf(f, "ns_per_frame=%.0f\n", p->ns_per_frame);
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+// Modes the rest of opts allows, so that neither the tuner nor a saved
+// profile picks one the checks in main.cpp would refuse: -F only fuses
+// plain Sobel, --incremental/--pyramid are modes of their own that run in
+// two passes, gray (luma) and 16-bit input only run two passes, and -p and
+// multi-stream runs have no tiled path
+static int modeAllowed(int mode)
+{
+  int luma = 0, deep = 0;
+  for (int n = 0; n < opts.numInputs; n++) {
+    luma |= source_is_luma(opts.inputs[n]);
+    deep |= source_bits(opts.inputs[n]) > 8;
+  }
+  if (opts.incremental || opts.pyramid || luma || deep) {
+    return mode == TUNE_TWO_PASS;
+  }
+  if (mode == TUNE_FUSED) {
+    return opts.filter == FILTER_SOBEL && !opts.gradient;
+  }
+  if (mode == TUNE_TILED) {
+    return !opts.pipelined && opts.numInputs <= 1;
+  }
+  return 1;
+}
+
+void profile_apply(const tune_profile_t *p, int fixed)
+{
+  if (!(fixed & TUNE_KERNEL)) {
+    opts.kernel = strdup(p->kernel);
+  }
+  if (!(fixed & TUNE_THREADS)) {
+    opts.numThreads = p->threads;
+    opts.multiThreaded = 1;
+  }
+  // A saved profile's tiles were sized for one byte output pixels, not
+  // --gradient's three
+  if (!(fixed & TUNE_MODE) && modeAllowed(p->mode) && !(p->mode == TUNE_TILED && opts.gradient)) {
+    opts.fused = p->mode == TUNE_FUSED;
+    opts.tiled = p->mode == TUNE_TILED;
+  }
+  if (!(fixed & TUNE_BANDS)) {
+    opts.bandRows = p->band_rows;
+  }
+  if (!(fixed & TUNE_TILE) && !opts.incremental) {
+    opts.tileWidth = p->tile_w;
+    opts.tileHeight = p->tile_h;
+  }
+}
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*******************************************
+ * Model: timeCandidate
+ * Input: sample frame, gray and output images, pool, candidate settings
+ * Output: median ns per frame
+ * Desc: Runs the frame through the same band/tile entry points -m uses,
+ *  with the candidate's settings in opts
+ ********************************************/
+static double timeCandidate(Mat& src, Mat& gray, Mat& out, thread_pool_t *pool,
+                            int mode, int band_rows, int tile_w, int tile_h)
+{
+  band_job_t job;
+  tiled_job_t tiled;
+  std::vector<double> runs;
+
+  opts.fused = mode == TUNE_FUSED;
+  opts.tiled = mode == TUNE_TILED;
+  opts.bandRows = band_rows;
+  opts.tileWidth = tile_w;
+  opts.tileHeight = tile_h;
+
+  memset(&job, 0, sizeof(job));
+  job.src = &src;
+  job.gray = &gray;
+  job.sobel = &out;
+  planBands(&job, src.rows, src.cols, pool->nthreads);
+  memset(&tiled, 0, sizeof(tiled));
+  tiled.src = &src;
+  tiled.sobel = &out;
+  if (mode == TUNE_TILED) {
+    tiledPlan(&tiled, pool->nthreads);
+  }
+
+  // The first run warms caches and workers and is not counted
+  double t_end = now_ns() + TUNE_MS * 1e6;
+  for (int run = 0; run <= TUNE_MIN_RUNS || now_ns() < t_end; run++) {
+    double t0 = now_ns();
+    if (mode == TUNE_FUSED) {
+      pool_run(pool, fusedBand, &job, job.num_bands);
+    } else if (mode == TUNE_TILED) {
+      pool_run(pool, tiledBand, &tiled, tiled.tiles_x * tiled.tiles_y);
+    } else {
+      pool_run(pool, grayBand, &job, job.num_bands);
+      pool_run(pool, sobelBand, &job, job.num_bands);
+    }
+    if (run > 0) {
+      runs.push_back(now_ns() - t0);
+    }
+  }
+
+  freeBands(&job);
+  tiledFree(&tiled);
+  std::sort(runs.begin(), runs.end());
+  return runs[runs.size() / 2];
+}
+
+// Keeps the candidate if it beats the best so far
+static void consider(tune_profile_t *best, double ns, int mode, int threads,
+                     int band_rows, int tile_w, int tile_h)
+{
+  printf("autotune: %-7s %-8s %2d threads  bands %3d  tile %4dx%-3d %10.3f ms\n",
+         kernels->name, mode_names[mode], threads, band_rows, tile_w, tile_h, ns / 1e6);
+  if (best->ns_per_frame == 0 || ns < best->ns_per_frame) {
+    snprintf(best->kernel, sizeof(best->kernel), "%s", kernels->name);
+    best->mode = mode;
+    best->threads = threads;
+    best->band_rows = band_rows;
+    best->tile_w = tile_w;
+    best->tile_h = tile_h;
+    best->ns_per_frame = ns;
+  }
+}
+
+/*******************************************
+ * Model: autotune
+ * Input: profile to fill, mask of settings fixed by the command line
+ * Output: None directly. Fills p with the fastest configuration
+ * Desc: Two rounds on the first frame of the input. The first tries every
+ *  backend, thread count (1, powers of two and every online CPU) and mode
+ *  with the default band and tile sizes; the second varies the band rows
+ *  or tile size of the winner. Leaves opts as it found it.
+ ********************************************/
+void autotune(tune_profile_t *p, int fixed)
+{
+  struct opts saved = opts;
+  static const int band_sizes[] = { 8, 16, 32, 64, 128 };
+  static const int tile_sizes[][2] = { { 256, 16 }, { 256, 64 }, { 1024, 16 }, { 1024, 64 } };
+
+  // Sample frame: the input's first frame, copied out of the capture
+  frame_source_t source;
+  Mat frame, src;
+  source_open(&source);
+  source_read(&source, frame);
+  if (frame.empty()) {
+    errx(1, "--autotune: no frame to tune on in %s", opts.webcam ? "webcam" : opts.videoFile);
+  }
+  frame.copyTo(src);
+  source_close(&source);
+  Mat gray(src.rows, src.cols, CV_8UC1);
+  Mat out(src.rows, opts.gradient ? 3 * src.cols : pyramidCols(src.cols), CV_8UC1);
+
+  memset(p, 0, sizeof(*p));
+  hostName(p->host, sizeof(p->host));
+  p->width = src.cols;
+  p->height = src.rows;
+
+  std::vector<int> threads;
+  if (fixed & TUNE_THREADS) {
+    threads.push_back(opts.numThreads);
+  } else {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpus = cpus < 1 ? 1 : (cpus > POOL_MAX_THREADS ? POOL_MAX_THREADS : cpus);
+    for (int t = 1; t < cpus; t *= 2) {
+      threads.push_back(t);
+    }
+    threads.push_back(cpus);
+  }
+
+  char list[64];
+  snprintf(list, sizeof(list), "%s", (fixed & TUNE_KERNEL) ? opts.kernel : kernels_available());
+  char *save = NULL;
+  for (char *k = strtok_r(list, ",", &save); k != NULL; k = strtok_r(NULL, ",", &save)) {
+    if (kernels_select(k) == NULL) {
+      continue;
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      thread_pool_t *pool = pool_create(threads[t]);
+      for (int mode = 0; mode < TUNE_NUM_MODES; mode++) {
+        if ((fixed & TUNE_MODE) ? mode != (saved.fused ? TUNE_FUSED : saved.tiled ? TUNE_TILED : TUNE_TWO_PASS)
+                                : !modeAllowed(mode)) {
+          continue;
+        }
+        int bands = (fixed & TUNE_BANDS) ? saved.bandRows : 0;
+        int tw = (fixed & TUNE_TILE) ? saved.tileWidth : 0;
+        int th = (fixed & TUNE_TILE) ? saved.tileHeight : 0;
+        consider(p, timeCandidate(src, gray, out, pool, mode, bands, tw, th),
+                 mode, threads[t], bands, tw, th);
+      }
+      pool_destroy(pool);
+    }
+  }
+  if (p->ns_per_frame == 0) {
+    errx(1, "--autotune: no kernel backend to tune");
+  }
+
+  // Second round: band rows or tile size of the winner
+  kernels_select(p->kernel);
+  thread_pool_t *pool = pool_create(p->threads);
+  tune_profile_t first = *p;
+  if (first.mode == TUNE_TILED && !(fixed & TUNE_TILE)) {
+    for (size_t s = 0; s < sizeof(tile_sizes) / sizeof(tile_sizes[0]); s++) {
+      consider(p, timeCandidate(src, gray, out, pool, first.mode, first.band_rows,
+                                tile_sizes[s][0], tile_sizes[s][1]),
+               first.mode, first.threads, first.band_rows, tile_sizes[s][0], tile_sizes[s][1]);
+    }
+  } else if (first.mode != TUNE_TILED && !(fixed & TUNE_BANDS)) {
+    for (size_t s = 0; s < sizeof(band_sizes) / sizeof(band_sizes[0]); s++) {
+      consider(p, timeCandidate(src, gray, out, pool, first.mode, band_sizes[s], first.tile_w, first.tile_h),
+               first.mode, first.threads, band_sizes[s], first.tile_w, first.tile_h);
+    }
+  }
+  pool_destroy(pool);
+
+  opts = saved;
+  printf("autotune: picked %s %s, %d threads, bands %d, tile %dx%d: %.3f ms per frame\n",
+         p->kernel, mode_names[p->mode], p->threads, p->band_rows, p->tile_w, p->tile_h,
+         p->ns_per_frame / 1e6);
+}
@@ -0,0 +1,48 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+// Per host tuning (--autotune). The fastest kernel backend, execution mode,
+// thread count and band/tile size depend on the machine, so they are
+// measured once on a sample frame and saved to a profile file, which later
+// runs load at startup instead of measuring again. Settings given on the
+// command line always win over the profile, and are not varied when tuning.
+
+// Execution modes the tuner picks between
+enum tune_mode_t { TUNE_TWO_PASS, TUNE_FUSED, TUNE_TILED, TUNE_NUM_MODES };
+
+// Settings fixed by the command line (tune_fixed mask)
+#define TUNE_KERNEL  1
+#define TUNE_THREADS 2
+#define TUNE_MODE    4
+#define TUNE_BANDS   8
+#define TUNE_TILE    16
+
+struct tune_profile_t {
+  char host[64];
+  int width, height;    // sample frame it was measured on
+  char kernel[16];
+  int mode;             // tune_mode_t
+  int threads;
+  int band_rows;        // 0: planBands picks
+  int tile_w, tile_h;   // 0x0: tiledPlan picks
+  double ns_per_frame;  // of the winner, for reference
+};
+
+// Default profile path: sobel-<hostname>.profile in the working directory
+const char *profile_default_path();
+
+// 0 on success; fails if the file is missing, malformed or from another host
+int profile_load(const char *path, tune_profile_t *p);
+int profile_save(const char *path, const tune_profile_t *p);
+
+// Measures the candidates on the first frame of opts' input and fills p
+// with the fastest. `fixed` is a mask of the settings not to vary.
+void autotune(tune_profile_t *p, int fixed);
+
+// Copies the profile's settings into opts, skipping the fixed ones and any
+// mode the rest of opts rules out
+void profile_apply(const tune_profile_t *p, int fixed);
+
+const char *tune_mode_name(int mode);
+
+#endif
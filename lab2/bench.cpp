@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <algorithm>
+#include <vector>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <iostream>
+#include <fstream>
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "thread_pool.h"
+#include "frame_pool.h"
+#include "pc.h"
+
+// Kernel microbenchmark (make bench). Times the grayscale, Sobel, fused and
+// tiled passes, split over the thread pool exactly as -m runs them, for
+// every combination of kernel backend, frame size and thread count, on
+// synthetic frames and optionally on a frame from a recording. Reports the
+// median time per frame as ns/pixel and the bytes each pass moves per cycle.
+// With -s it measures the pool's own dispatch/completion cost instead.
+
+using namespace cv;
+
+#define EPRINTF(...) fprintf(stderr, __VA_ARGS__)
+
+struct opts opts;
+
+static ofstream results_file;
+
+enum { STAGE_GRAY, STAGE_SOBEL, STAGE_FUSED, STAGE_TILED, NUM_STAGES };
+static const char *stage_names[NUM_STAGES] = { "gray", "sobel", "fused", "tiled" };
+// Bytes read + written per pixel: BGR in and gray out, gray in and Sobel out
+// (neighbour rows come from cache), BGR in and Sobel out (twice)
+static const int stage_bytes[NUM_STAGES] = { 4, 2, 4, 4 };
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void runStage(thread_pool_t *pool, band_job_t *job, tiled_job_t *tiled, int stage)
+{
+  switch (stage) {
+    case STAGE_TILED:
+      pool_run(pool, tiledBand, tiled, tiled->tiles_x * tiled->tiles_y);
+      break;
+    case STAGE_GRAY:
+      pool_run(pool, grayBand, job, job->num_bands);
+      break;
+    case STAGE_SOBEL:
+      pool_run(pool, sobelBand, job, job->num_bands);
+      break;
+    default:
+      pool_run(pool, fusedBand, job, job->num_bands);
+      break;
+  }
+}
+
+/*******************************************
+ * Model: benchFrame
+ * Input: BGR frame, its label, pool and its counters, minimum time per pass
+ * Output: None
+ * Desc: Runs every pass on the frame with the selected backend. Each pass
+ *  is warmed up, then repeated for at least min_ms (and 5 runs); the median
+ *  run is reported so stray interrupts and page faults do not skew it.
+ ********************************************/
+static void benchFrame(Mat& src, const char *source, thread_pool_t *pool,
+                       counters_t *counters, double min_ms)
+{
+  static Mat gray, sobel;
+  band_job_t job;
+  tiled_job_t tiled;
+
+  poolMat(gray, src.rows, src.cols, CV_8UC1);
+  poolMat(sobel, src.rows, src.cols, CV_8UC1);
+  memset(&job, 0, sizeof(job));
+  job.src = &src;
+  job.gray = &gray;
+  job.sobel = &sobel;
+  planBands(&job, src.rows, src.cols, pool->nthreads);
+  memset(&tiled, 0, sizeof(tiled));
+  tiled.src = &src;
+  tiled.sobel = &sobel;
+  tiledPlan(&tiled, pool->nthreads);
+
+  double pixels = (double)src.rows * src.cols;
+  int counted = pc_available(counters, PC_CYCLES);
+
+  for (int stage = 0; stage < NUM_STAGES; stage++) {
+    std::vector<double> runs;
+
+    // Warm up caches, TLBs and the workers; also produces the gray input of
+    // the Sobel pass
+    runStage(pool, &job, &tiled, STAGE_GRAY);
+    runStage(pool, &job, &tiled, stage);
+
+    pc_start(counters);
+    double t_end = now_ns() + min_ms * 1e6;
+    while (runs.size() < 5 || now_ns() < t_end) {
+      double t0 = now_ns();
+      runStage(pool, &job, &tiled, stage);
+      runs.push_back(now_ns() - t0);
+    }
+    pc_stop(counters);
+
+    std::sort(runs.begin(), runs.end());
+    double ns = runs[runs.size() / 2];
+    // Counted cycles are summed over the workers; without a cycle counter
+    // fall back to wall time at the nominal clock
+    double cycles = counted ? (double)counters->count[PC_CYCLES] / runs.size() : NS_TO_CYCLES(ns);
+    double ns_pixel = ns / pixels;
+    double bytes_cycle = stage_bytes[stage] * pixels / cycles;
+
+    printf("%-7s %-10s %5dx%-5d %3d  %-6s %9.3f %9.2f %10.1f\n", kernels->name, source,
+           src.cols, src.rows, pool->nthreads, stage_names[stage], ns_pixel,
+           bytes_cycle, pixels / ns * 1e3);
+    results_file << kernels->name << ", " << source << ", " << src.cols << ", " << src.rows
+                 << ", " << pool->nthreads << ", " << stage_names[stage] << ", " << ns_pixel
+                 << ", " << bytes_cycle << ", " << (counted ? "counted" : "nominal")
+                 << ", " << pixels / ns * 1e3 << ", " << runs.size() << endl;
+  }
+  freeBands(&job);
+  tiledFree(&tiled);
+}
+
+static void emptyTask(void *arg, int task, int worker)
+{
+}
+
+/*******************************************
+ * Model: benchSync
+ * Input: pool, minimum time per measurement
+ * Output: None
+ * Desc: Synchronization overhead per frame: a -m frame is two pool_run
+ *  rounds (gray, then Sobel), here with one empty task per worker, so all
+ *  that is timed is waking the workers, their claims on the task cursors
+ *  and waiting for the last one. Median of batches of 100 frames.
+ ********************************************/
+static void benchSync(thread_pool_t *pool, double min_ms)
+{
+  std::vector<double> runs;
+  int n = pool->nthreads;
+
+  for (int f = 0; f < 100; f++) {
+    pool_run(pool, emptyTask, NULL, n);
+  }
+  double t_end = now_ns() + min_ms * 1e6;
+  while (runs.size() < 5 || now_ns() < t_end) {
+    double t0 = now_ns();
+    for (int f = 0; f < 100; f++) {
+      pool_run(pool, emptyTask, NULL, n);
+      pool_run(pool, emptyTask, NULL, n);
+    }
+    runs.push_back((now_ns() - t0) / 100);
+  }
+  std::sort(runs.begin(), runs.end());
+
+  double ns = runs[runs.size() / 2];
+  printf("%3d %12.0f %12.0f %12.0f\n", n, ns, runs[0], runs[runs.size() - 1]);
+  results_file << n << ", " << ns << ", " << runs[0] << ", " << runs[runs.size() - 1]
+               << ", " << runs.size() * 100 << endl;
+}
+
+static void printHelp(char **argv)
+{
+  EPRINTF("Usage: %s OPTS\n", argv[0]);
+  EPRINTF("-r <list> :  Synthetic frame sizes, e.g. 640x480,1920x1080 (default 320x240,640x480,1280x720,1920x1080,3840x2160)\n");
+  EPRINTF("-f <file> :  Also benchmark the first frame of this recording, at its own size\n");
+  EPRINTF("-t <list> :  Thread counts, e.g. 1,2,4 (default 1,2,4)\n");
+  EPRINTF("-k <list> :  Kernel backends (default every one this CPU supports: %s)\n", kernels_available());
+  EPRINTF("-i <ms>   :  Minimum time per measurement (default 200)\n");
+  EPRINTF("-s        :  Only measure the thread pool's synchronization overhead per frame (default threads 2,4,8,16,32,64)\n");
+  EPRINTF("Results also go to bench.csv (bench_sync.csv with -s)\n");
+}
+
+int main(int argc, char **argv)
+{
+  char sizes[256] = "320x240,640x480,1280x720,1920x1080,3840x2160";
+  char threads[64] = "1,2,4";
+  char backends[64];
+  const char *videoFile = NULL;
+  double min_ms = 200;
+  int sync = 0;
+  int c;
+
+  strcpy(backends, kernels_available());
+  while ((c = getopt(argc, argv, "r:f:t:k:i:sh")) != -1) {
+    switch (c) {
+      case 'r': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+      case 'f': videoFile = optarg; break;
+      case 't': snprintf(threads, sizeof(threads), "%s", optarg); break;
+      case 'k': snprintf(backends, sizeof(backends), "%s", optarg); break;
+      case 'i': min_ms = atof(optarg); break;
+      case 's': sync = 1; break;
+      default:
+        printHelp(argv);
+        exit(-1);
+    }
+  }
+
+  memset(&opts, 0, sizeof(opts));
+  if (sync) {
+    char *save = NULL;
+    if (strcmp(threads, "1,2,4") == 0) {
+      strcpy(threads, "2,4,8,16,32,64"); // -t not given
+    }
+    results_file.open("bench_sync.csv", ios::out);
+    results_file << "Threads, ns/frame, Min ns/frame, Max ns/frame, Frames" << endl;
+    printf("%3s %12s %12s %12s\n", "thr", "ns/frame", "min", "max");
+    for (char *t = strtok_r(threads, ",", &save); t != NULL; t = strtok_r(NULL, ",", &save)) {
+      thread_pool_t *pool = pool_create(atoi(t));
+      benchSync(pool, min_ms);
+      pool_destroy(pool);
+    }
+    results_file.close();
+    return 0;
+  }
+  opts.fused = 1; // planBands then sets up the fused line buffers too
+  pc_configure("cycles");
+
+  // Synthetic frames: noise over a gradient, so every vector lane and both
+  // saturation limits are exercised
+  std::vector<Mat> frames;
+  std::vector<const char *> sources;
+  char *save = NULL;
+  for (char *s = strtok_r(sizes, ",", &save); s != NULL; s = strtok_r(NULL, ",", &save)) {
+    int w, h;
+    if (sscanf(s, "%dx%d", &w, &h) != 2 || w < 3 || h < 3) {
+      EPRINTF("Invalid frame size: %s\n", s);
+      exit(-1);
+    }
+    Mat m;
+    poolMat(m, h, w, CV_8UC3);
+    srand(180);
+    for (int i = 0; i < h; i++) {
+      uint8_t *row = m.ptr(i);
+      for (int j = 0; j < w * 3; j++) {
+        row[j] = (uint8_t)(j / 3 + i + (rand() & 63));
+      }
+    }
+    frames.push_back(m);
+    sources.push_back("synthetic");
+  }
+  if (videoFile != NULL) {
+    CvCapture *cap = cvCreateFileCapture(videoFile);
+    if (cap == NULL) {
+      errx(1, "Cannot open %s", videoFile);
+    }
+    Mat frame = cvQueryFrame(cap);
+    if (frame.empty()) {
+      errx(1, "No frame in %s", videoFile);
+    }
+    Mat m;
+    poolMat(m, frame.rows, frame.cols, frame.type());
+    frame.copyTo(m);
+    frames.push_back(m);
+    sources.push_back("recorded");
+    cvReleaseCapture(&cap);
+  }
+
+  results_file.open("bench.csv", ios::out);
+  results_file << "Kernel, Source, Width, Height, Threads, Pass, ns/pixel, Bytes/cycle, Cycle source, Mpixel/s, Runs" << endl;
+  printf("%-7s %-10s %11s %3s  %-6s %9s %9s %10s\n", "kernel", "source", "size", "thr",
+         "pass", "ns/pixel", "bytes/cyc", "Mpixel/s");
+
+  save = NULL;
+  for (char *t = strtok_r(threads, ",", &save); t != NULL; t = strtok_r(NULL, ",", &save)) {
+    thread_pool_t *pool = pool_create(atoi(t));
+    counters_t counters;
+    pc_init(&counters, 0);
+    for (int w = 1; w < pool->nthreads; w++) {
+      pc_attach(&counters, pool->tids[w]);
+    }
+
+    char list[64];
+    char *ksave = NULL;
+    strcpy(list, backends);
+    for (char *k = strtok_r(list, ",", &ksave); k != NULL; k = strtok_r(NULL, ",", &ksave)) {
+      if (kernels_select(k) == NULL) {
+        EPRINTF("Skipping kernel backend '%s': unknown or not supported by this CPU\n", k);
+        continue;
+      }
+      for (size_t f = 0; f < frames.size(); f++) {
+        benchFrame(frames[f], sources[f], pool, &counters, min_ms);
+      }
+    }
+
+    pc_close(&counters);
+    pool_destroy(pool);
+  }
+
+  results_file.close();
+  return 0;
+}
@@ -0,0 +1,1404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "thread_pool.h"
+#include "frame_pool.h"
+#include "edge_map.h"
+#include "libsobel.h"
+
+// Golden correctness check (make check). Every kernel backend this CPU can
+// run is compared bit for bit against the straightforward reference below,
+// row by row and through the frame level entry points the drivers use:
+// grayScale, sobelCalc, sobelFused, the pool's bands and --tiled tiles.
+// Every --filter operator is checked the same way against a direct 2D
+// convolution, and the --gradient planes against sqrt/bin computed from the
+// definition, --incremental against a full recompute and every --pyramid
+// level against its own golden image. The 16-bit kernels are checked on
+// rows and frames the same way, and libsobel's C API on every input format
+// it takes. The thread pool's dispatch/completion handshake is checked
+// first, spinning and sleeping, then the frame pool's table and several
+// libsobel pools at once, and the multi-stream driver and the edges:<path>
+// sink's RLE codec and file index last. Exits non-zero if any backend
+// differs.
+
+using namespace cv;
+
+struct opts opts;
+
+static int failures;
+
+// Reference grayscale, kept independent of kernels_scalar on purpose
+template <class T>
+static T goldenGray(const T *p)
+{
+  return (7 * p[0] + 38 * p[1] + 19 * p[2]) >> 6;
+}
+
+// Golden filters as full 2D kernels, combined the way the filter does:
+// (|Kx| + |Ky|) >> shift, rounded (K + 2^(shift-1)) >> shift, or |K|
+enum { GOLDEN_GRADIENT, GOLDEN_SMOOTH, GOLDEN_ABS };
+struct golden_filter_t {
+  int kind, shift;
+  int kx[5][5], ky[5][5];
+};
+static golden_filter_t golden[FILTER_COUNT];
+
+// k[i][j] = v[i] * h[j]; taps are centred in the 5x5 grid
+static void outer(int k[5][5], const int *v, const int *h)
+{
+  for (int i = 0; i < 5; i++) {
+    for (int j = 0; j < 5; j++) {
+      k[i][j] = v[i] * h[j];
+    }
+  }
+}
+
+static void goldenInit()
+{
+  static const int smooth3[5] = { 0, 1, 2, 1, 0 }, diff3[5] = { 0, -1, 0, 1, 0 };
+  static const int scharr3[5] = { 0, 3, 10, 3, 0 }, box3[5] = { 0, 1, 1, 1, 0 };
+  static const int smooth5[5] = { 1, 4, 6, 4, 1 }, diff5[5] = { -1, -2, 0, 2, 1 };
+  static const int laplacian[5][5] = {
+    { 0, 0, 0, 0, 0 }, { 0, 0, 1, 0, 0 }, { 0, 1, -4, 1, 0 }, { 0, 0, 1, 0, 0 }, { 0, 0, 0, 0, 0 },
+  };
+  const int *grad[][3] = {
+    { smooth3, diff3, NULL }, // FILTER_SOBEL: smoothing down the column, difference along the row
+    { scharr3, diff3, NULL },
+    { box3, diff3, NULL },
+    { smooth5, diff5, NULL },
+  };
+  static const int shifts[] = { 0, 2, 0, 3 };
+  int f[] = { FILTER_SOBEL, FILTER_SCHARR, FILTER_PREWITT, FILTER_SOBEL5 };
+
+  memset(golden, 0, sizeof(golden));
+  for (int k = 0; k < 4; k++) {
+    golden[f[k]].kind = GOLDEN_GRADIENT;
+    golden[f[k]].shift = shifts[k];
+    outer(golden[f[k]].kx, grad[k][0], grad[k][1]);
+    outer(golden[f[k]].ky, grad[k][1], grad[k][0]);
+  }
+  golden[FILTER_GAUSS3].kind = GOLDEN_SMOOTH;
+  golden[FILTER_GAUSS3].shift = 4;
+  outer(golden[FILTER_GAUSS3].kx, smooth3, smooth3);
+  golden[FILTER_GAUSS5].kind = GOLDEN_SMOOTH;
+  golden[FILTER_GAUSS5].shift = 8;
+  outer(golden[FILTER_GAUSS5].kx, smooth5, smooth5);
+  golden[FILTER_LAPLACIAN].kind = GOLDEN_ABS;
+  memcpy(golden[FILTER_LAPLACIAN].kx, laplacian, sizeof(laplacian));
+}
+
+// Filter f at (i, j); rows[k] is image row i - 2 + k
+static uint8_t goldenFilter(int f, const uint8_t *const *rows, int j)
+{
+  const golden_filter_t *g = &golden[f];
+  int x = 0, y = 0, v;
+  for (int a = 0; a < 5; a++) {
+    for (int b = 0; b < 5; b++) {
+      if (g->kx[a][b] != 0 || g->ky[a][b] != 0) {
+        x += g->kx[a][b] * rows[a][j - 2 + b];
+        y += g->ky[a][b] * rows[a][j - 2 + b];
+      }
+    }
+  }
+  switch (g->kind) {
+    case GOLDEN_GRADIENT: v = (abs(x) + abs(y)) >> g->shift; break;
+    case GOLDEN_SMOOTH:   v = (x + (1 << g->shift >> 1)) >> g->shift; break;
+    default:              v = abs(x); break;
+  }
+  return v > 255 ? 255 : v;
+}
+
+static uint8_t goldenAt(int f, Mat& g, int i, int j)
+{
+  const uint8_t *rows[5];
+  for (int k = 0; k < 5; k++) {
+    // rows beyond the radius have zero taps; keep the pointers valid
+    int r = i - 2 + k;
+    rows[k] = g.ptr(r < 0 ? 0 : (r >= g.rows ? g.rows - 1 : r));
+  }
+  return goldenFilter(f, rows, j);
+}
+
+// Reference L2 magnitude and orientation bin for one Sobel gradient,
+// written from the definition in sobel_kernels.h rather than the kernels'
+// tricks
+static void goldenGrad(int gx, int gy, uint16_t *mag, uint8_t *ori)
+{
+  *mag = (uint16_t)floor(sqrt((double)(gx * gx + gy * gy)) + 0.5);
+
+  int a = abs(gx), b = abs(gy), dir;
+  if (b * 32768 <= a * GRAD_TAN22) {
+    dir = gx < 0 ? 4 : 0;                 // along x
+  } else if (a * 32768 < b * GRAD_TAN22) {
+    dir = gy < 0 ? 6 : 2;                 // along y
+  } else if (gx > 0) {
+    dir = gy > 0 ? 1 : 7;                 // diagonals
+  } else {
+    dir = gy > 0 ? 3 : 5;
+  }
+  *ori = dir;
+}
+
+template <class T>
+static void sobelAt(const T *a, const T *r, const T *b, int j, int *gx, int *gy)
+{
+  *gx = (a[j + 1] + 2 * r[j + 1] + b[j + 1]) - (a[j - 1] + 2 * r[j - 1] + b[j - 1]);
+  *gy = (b[j - 1] + 2 * b[j] + b[j + 1]) - (a[j - 1] + 2 * a[j] + a[j + 1]);
+}
+
+// Test pattern k: random, saturated, a checkerboard (largest gradients) or flat
+static uint8_t pattern(int k, int i)
+{
+  switch (k) {
+    case 0:  return rand();
+    case 1:  return 255;
+    case 2:  return (i & 1) ? 255 : 0;
+    default: return 0;
+  }
+}
+
+static void fail(const char *what, int width, int height, int pos)
+{
+  printf("  FAIL %s %s %s %dx%d at %d\n", kernels->name, filters[opts.filter].name, what,
+         width, height, pos);
+  failures++;
+}
+
+// Pad bytes written around every row buffer to catch out of bounds stores
+#define CANARY 0xA5
+#define PAD 64
+
+/*******************************************
+ * Model: checkRows
+ * Input: None (uses the selected backend)
+ * Output: None
+ * Desc: Row kernels on every width from 1 to 300, which covers every vector
+ *  body/tail split. Also checks that sobel_row and grad_row leave columns
+ *  0 and width-1 alone and that no kernel writes past the row.
+ ********************************************/
+static void checkRows()
+{
+  static uint8_t bgr[300 * 3], rows[3][300], gray[300 + 2 * PAD], out[300 + 2 * PAD];
+  static uint16_t mag[300 + 2 * PAD];
+  static uint8_t ori[300 + 2 * PAD];
+
+  for (int width = 1; width <= 300; width++) {
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < width * 3; i++) {
+        bgr[i] = pattern(k, i);
+      }
+      for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < width; i++) {
+          rows[r][i] = pattern(k, i + r);
+        }
+      }
+
+      memset(gray, CANARY, sizeof(gray));
+      kernels->gray_row(bgr, gray + PAD, width);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint8_t want = (j >= 0 && j < width) ? goldenGray(&bgr[j * 3]) : CANARY;
+        if (gray[i] != want) {
+          fail("gray_row", width, 1, j);
+          break;
+        }
+      }
+
+      memset(out, CANARY, sizeof(out));
+      kernels->sobel_row(rows[0], rows[1], rows[2], out + PAD, width);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint8_t want = CANARY;
+        if (j >= 1 && j < width - 1) {
+          int gx = (rows[0][j + 1] + 2 * rows[1][j + 1] + rows[2][j + 1]) -
+                   (rows[0][j - 1] + 2 * rows[1][j - 1] + rows[2][j - 1]);
+          int gy = (rows[2][j - 1] + 2 * rows[2][j] + rows[2][j + 1]) -
+                   (rows[0][j - 1] + 2 * rows[0][j] + rows[0][j + 1]);
+          int m = abs(gx) + abs(gy);
+          want = m > 255 ? 255 : m;
+        }
+        if (out[i] != want) {
+          fail("sobel_row", width, 1, j);
+          break;
+        }
+      }
+
+      memset(mag, CANARY, sizeof(mag));
+      memset(ori, CANARY, sizeof(ori));
+      kernels->grad_row(rows[0], rows[1], rows[2], mag + PAD, ori + PAD, width);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint16_t want_mag = CANARY * 0x101;
+        uint8_t want_ori = CANARY;
+        if (j >= 1 && j < width - 1) {
+          int gx, gy;
+          sobelAt(rows[0], rows[1], rows[2], j, &gx, &gy);
+          goldenGrad(gx, gy, &want_mag, &want_ori);
+        }
+        if (mag[i] != want_mag || ori[i] != want_ori) {
+          fail("grad_row", width, 1, j);
+          break;
+        }
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: checkSad
+ * Input: None (uses the selected backend)
+ * Output: None
+ * Desc: sad_row on lengths 0 to 300 from an odd start, every pattern
+ *  against random bytes and against itself (SAD 0)
+ ********************************************/
+static void checkSad()
+{
+  static uint8_t a[301], b[301];
+
+  for (int n = 0; n <= 300; n++) {
+    for (int k = 0; k < 4; k++) {
+      uint32_t want = 0;
+      for (int i = 0; i < n; i++) {
+        a[i + 1] = pattern(k, i);
+        b[i + 1] = rand();
+        want += abs(a[i + 1] - b[i + 1]);
+      }
+      if (kernels->sad_row(a + 1, b + 1, n) != want || kernels->sad_row(a + 1, a + 1, n) != 0) {
+        fail("sad_row", n, 1, 0);
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: checkDown
+ * Input: None (uses the selected backend)
+ * Output: None
+ * Desc: down_row on output widths 0 to 300 against the rounded 2x2 mean;
+ *  nothing may be written past the row
+ ********************************************/
+/*******************************************
+ * Model: checkLuma
+ * Input: None (uses the selected backend)
+ * Output: None
+ * Desc: luma_row on widths 0 to 300 against the even bytes of the YUYV row;
+ *  nothing may be written past the row
+ ********************************************/
+static void checkLuma()
+{
+  static uint8_t yuyv[600], out[300 + 2 * PAD];
+
+  for (int width = 0; width <= 300; width++) {
+    for (int i = 0; i < 2 * width; i++) {
+      yuyv[i] = pattern(i & 3, i);
+    }
+    memset(out, CANARY, sizeof(out));
+    kernels->luma_row(yuyv, out + PAD, width);
+    for (int i = 0; i < width + 2 * PAD; i++) {
+      int j = i - PAD;
+      if (out[i] != (j >= 0 && j < width ? yuyv[2 * j] : CANARY)) {
+        fail("luma_row", width, 1, j);
+        break;
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: checkEdgeRows
+ * Input: None (uses the selected backend)
+ * Output: None
+ * Desc: edge_row on widths 0 to 300 and thresholds at both ends of the
+ *  range against the definition; unused bits of the last byte must be
+ *  zero and nothing may be written past it
+ ********************************************/
+static void checkEdgeRows()
+{
+  static const int thresholds[] = { 0, 1, 127, 128, 253, 254 };
+  static uint8_t mag[300], bits[EDGE_ROW_BYTES(300) + 2 * PAD];
+
+  for (int width = 0; width <= 300; width++) {
+    for (int t = 0; t < 7; t++) {
+      int threshold = t < 6 ? thresholds[t] : rand() & 0xFF;
+      for (int i = 0; i < width; i++) {
+        mag[i] = pattern(t & 3, i);
+      }
+      memset(bits, CANARY, sizeof(bits));
+      kernels->edge_row(mag, bits + PAD, width, threshold);
+      for (int i = 0; i < EDGE_ROW_BYTES(width) + 2 * PAD; i++) {
+        int b = i - PAD, expect = 0;
+        for (int k = 0; b >= 0 && k < 8 && 8 * b + k < width; k++) {
+          expect |= (mag[8 * b + k] > threshold) << k;
+        }
+        if (bits[i] != (b >= 0 && b < EDGE_ROW_BYTES(width) ? expect : CANARY)) {
+          fail("edge_row", width, 1, b);
+          break;
+        }
+      }
+    }
+  }
+}
+
+// 16-bit test pattern k: random, saturated, a checkerboard or 12-bit random
+static uint16_t pattern16(int k, int i)
+{
+  switch (k) {
+    case 0:  return rand();
+    case 1:  return 0xFFFF;
+    case 2:  return (i & 1) ? 0xFFFF : 0;
+    default: return rand() & 0xFFF;
+  }
+}
+
+/*******************************************
+ * Model: checkRows16
+ * Input: None (uses the selected backend)
+ * Output: None
+ * Desc: gray16_row and sobel16_row as checkRows does the 8-bit kernels;
+ *  the magnitude must only saturate at 65535
+ ********************************************/
+static void checkRows16()
+{
+  static uint16_t bgr[300 * 3], rows[3][300], gray[300 + 2 * PAD], out[300 + 2 * PAD];
+
+  for (int width = 1; width <= 300; width++) {
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < width * 3; i++) {
+        bgr[i] = pattern16(k, i);
+      }
+      for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < width; i++) {
+          rows[r][i] = pattern16(k, i + r);
+        }
+      }
+
+      memset(gray, CANARY, sizeof(gray));
+      kernels->gray16_row(bgr, gray + PAD, width);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint16_t want = (j >= 0 && j < width) ? goldenGray(&bgr[j * 3]) : CANARY * 0x101;
+        if (gray[i] != want) {
+          fail("gray16_row", width, 1, j);
+          break;
+        }
+      }
+
+      memset(out, CANARY, sizeof(out));
+      kernels->sobel16_row(rows[0], rows[1], rows[2], out + PAD, width);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint16_t want = CANARY * 0x101;
+        if (j >= 1 && j < width - 1) {
+          int gx, gy;
+          sobelAt(rows[0], rows[1], rows[2], j, &gx, &gy);
+          want = abs(gx) + abs(gy) > 0xFFFF ? 0xFFFF : abs(gx) + abs(gy);
+        }
+        if (out[i] != want) {
+          fail("sobel16_row", width, 1, j);
+          break;
+        }
+      }
+    }
+  }
+}
+
+static void checkDown()
+{
+  static uint8_t r0[600], r1[600], out[300 + 2 * PAD];
+
+  for (int width = 0; width <= 300; width++) {
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < 2 * width; i++) {
+        r0[i] = pattern(k, i);
+        r1[i] = pattern(k, i + 1);
+      }
+      memset(out, CANARY, sizeof(out));
+      kernels->down_row(r0, r1, out + PAD, width);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint8_t want = CANARY;
+        if (j >= 0 && j < width) {
+          want = (r0[2 * j] + r0[2 * j + 1] + r1[2 * j] + r1[2 * j + 1] + 2) / 4;
+        }
+        if (out[i] != want) {
+          fail("down_row", width, 1, j);
+          break;
+        }
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: checkFilterRows
+ * Input: filter (filter_t)
+ * Output: None
+ * Desc: The filter's row on widths 1 to 300: columns radius ..
+ *  width-radius-1 against the 2D golden, the rest of the row and the pad
+ *  around it untouched
+ ********************************************/
+#define POOL_CHECK_TASKS 32
+static int task_runs[POOL_CHECK_TASKS];
+static int task_worker[POOL_CHECK_TASKS];
+
+static void countTask(void *arg, int task, int worker)
+{
+  __atomic_add_fetch(&task_runs[task], 1, __ATOMIC_RELAXED);
+  task_worker[task] = worker;
+}
+
+/*******************************************
+ * Model: checkPool
+ * Input: None
+ * Output: None
+ * Desc: Many back to back jobs of random size (0 tasks included) on pools
+ *  of a few sizes, with the spin phase on and off, so both the spinning
+ *  and the futex paths of pool_run and the workers are taken. Every task
+ *  must run exactly once per job, and be done when pool_run returns. The
+ *  active worker count is changed at random in between, often twice in a
+ *  row, and tasks must only run on active workers.
+ ********************************************/
+static void checkPool()
+{
+  int before = failures;
+  int sizes[] = { 1, 2, 5 };
+
+  for (int s = 0; s < 3; s++) {
+    for (int spin = 0; spin < 2; spin++) {
+      thread_pool_t *pool = pool_create(sizes[s]);
+      pool->spin = spin ? POOL_SPIN : 0;
+      for (int job = 0; job < 2000; job++) {
+        int ntasks = rand() % (POOL_CHECK_TASKS + 1);
+        while (rand() % 8 == 0) {
+          pool_set_active(pool, 1 + rand() % sizes[s]);
+        }
+        memset(task_runs, 0, sizeof(task_runs));
+        pool_run(pool, countTask, NULL, ntasks);
+        for (int t = 0; t < POOL_CHECK_TASKS; t++) {
+          if (task_runs[t] != (t < ntasks) || (t < ntasks && task_worker[t] >= pool->active)) {
+            printf("  FAIL pool of %d (spin %d, %d active) job %d: task %d ran %d times, last on %d\n",
+                   sizes[s], pool->spin, pool->active, job, t, task_runs[t], task_worker[t]);
+            failures++;
+            break;
+          }
+        }
+      }
+      pool_destroy(pool);
+    }
+  }
+  printf("%-8s %s\n", "pool", failures == before ? "ok" : "FAILED");
+}
+
+#define FPOOL_CHECK_BUFFERS (5 * FPOOL_CHUNK + 7)
+
+/*******************************************
+ * Model: checkFramePool
+ * Input: None
+ * Output: None directly. Counts failures
+ * Desc: Holds more buffers than several chunks of the frame pool's table
+ *  at once, as a -t 256 run's per worker buffers do. Each must be owned
+ *  while held and not after release, and taking them again must reuse
+ *  them rather than allocate.
+ ********************************************/
+static void checkFramePool()
+{
+  static void *bufs[FPOOL_CHECK_BUFFERS];
+  int before = failures;
+
+  for (int b = 0; b < FPOOL_CHECK_BUFFERS; b++) {
+    bufs[b] = fpool_acquire(64 + b % 3 * 64);
+  }
+  for (int b = 0; b < FPOOL_CHECK_BUFFERS; b += 2) {
+    fpool_release(bufs[b]);
+  }
+  for (int b = 0; b < FPOOL_CHECK_BUFFERS; b++) {
+    if (fpool_owns(bufs[b]) != (b % 2)) {
+      printf("  FAIL frame pool: buffer %d of %d owned %d\n", b, FPOOL_CHECK_BUFFERS, fpool_owns(bufs[b]));
+      failures++;
+      break;
+    }
+  }
+  unsigned long allocs = fpool_stats().allocs;
+  for (int b = 0; b < FPOOL_CHECK_BUFFERS; b += 2) {
+    bufs[b] = fpool_acquire(64 + b % 3 * 64);
+  }
+  if (fpool_stats().allocs != allocs) {
+    printf("  FAIL frame pool: %lu fresh allocations for released buffers\n", fpool_stats().allocs - allocs);
+    failures++;
+  }
+  for (int b = 0; b < FPOOL_CHECK_BUFFERS; b++) {
+    fpool_release(bufs[b]);
+  }
+  printf("%-8s %s\n", "fpool", failures == before ? "ok" : "FAILED");
+}
+
+static void checkFilterRows(int f)
+{
+  static uint8_t rows[5][300 + 2 * PAD], out[300 + 2 * PAD];
+  static int scratch[FILTER_SCRATCH_ROWS * 300];
+  int radius = filters[f].radius;
+  const uint8_t *in[5];
+
+  // Golden rows start two above the output row whatever the radius
+  for (int r = 0; r < 5; r++) {
+    in[r] = rows[r] + PAD;
+  }
+  for (int width = 1; width <= 300; width++) {
+    for (int k = 0; k < 4; k++) {
+      for (int r = 0; r < 5; r++) {
+        for (int i = 0; i < width; i++) {
+          rows[r][PAD + i] = pattern(k, i + r);
+        }
+      }
+
+      memset(out, CANARY, sizeof(out));
+      kernels->filter_row[f](in + 2 - radius, out + PAD, width, scratch);
+      for (int i = 0; i < width + 2 * PAD; i++) {
+        int j = i - PAD;
+        uint8_t want = (j >= radius && j < width - radius) ? goldenFilter(f, in, j) : CANARY;
+        if (out[i] != want) {
+          fail("filter_row", width, 1, j);
+          break;
+        }
+      }
+    }
+  }
+}
+
+static void goldenGrayFrame(Mat& src, Mat& golden)
+{
+  for (int i = 0; i < src.rows; i++) {
+    for (int j = 0; j < src.cols; j++) {
+      golden.ptr(i)[j] = goldenGray(src.ptr(i) + j * 3);
+    }
+  }
+}
+
+static void fill(Mat& m, uint8_t value)
+{
+  for (int i = 0; i < m.rows; i++) {
+    memset(m.ptr(i), value, m.cols * m.elemSize());
+  }
+}
+
+static void compareGray(const char *what, Mat& golden, Mat& gray)
+{
+  for (int i = 0; i < gray.rows; i++) {
+    if (memcmp(gray.ptr(i), golden.ptr(i), gray.cols * gray.elemSize()) != 0) {
+      fail(what, gray.cols, gray.rows, i);
+      return;
+    }
+  }
+}
+
+// Compare the interior of a filtered frame against the golden one; the
+// border the filter's radius leaves must still hold the fill value
+static void compareFilter(const char *what, Mat& gray, Mat& out, int f, uint8_t border)
+{
+  int r = filters[f].radius;
+  for (int i = 0; i < out.rows; i++) {
+    for (int j = 0; j < out.cols; j++) {
+      int inside = i >= r && i < out.rows - r && j >= r && j < out.cols - r;
+      uint8_t want = inside ? goldenAt(f, gray, i, j) : border;
+      if (out.ptr(i)[j] != want) {
+        fail(what, out.cols, out.rows, i * out.cols + j);
+        return;
+      }
+    }
+  }
+}
+
+static void compareSobel(const char *what, Mat& gray, Mat& out, uint8_t border)
+{
+  compareFilter(what, gray, out, FILTER_SOBEL, border);
+}
+
+// Compare a gradient frame (see gradientCalc) against the golden L2
+// magnitude and orientation; the one pixel border must hold the fill value
+static void compareGradient(const char *what, Mat& gray, Mat& out)
+{
+  Mat mag, ori;
+  gradientPlanes(out, mag, ori);
+  for (int i = 0; i < gray.rows; i++) {
+    for (int j = 0; j < gray.cols; j++) {
+      uint16_t want_mag = CANARY * 0x101;
+      uint8_t want_ori = CANARY;
+      if (i > 0 && i < gray.rows - 1 && j > 0 && j < gray.cols - 1) {
+        int gx, gy;
+        sobelAt(gray.ptr(i - 1), gray.ptr(i), gray.ptr(i + 1), j, &gx, &gy);
+        goldenGrad(gx, gy, &want_mag, &want_ori);
+      }
+      if (((uint16_t *)mag.ptr(i))[j] != want_mag || ori.ptr(i)[j] != want_ori) {
+        fail(what, gray.cols, gray.rows, i * gray.cols + j);
+        return;
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: checkFrame
+ * Input: frame size, whether rows are padded, pool to run bands on
+ * Output: None
+ * Desc: Full frames through the same entry points the drivers call, with
+ *  packed and padded (non-continuous) rows
+ ********************************************/
+static void checkFrame(int width, int height, int padded, thread_pool_t *pool)
+{
+  // A padded frame has a row stride wider than its pixels, like a view
+  // into a larger image
+  size_t stride = width * 3 + (padded ? 13 : 0);
+  uint8_t *pixels = (uint8_t *)malloc(stride * height);
+  Mat src(height, width, CV_8UC3, pixels, stride);
+  for (size_t k = 0; k < stride * height; k++) {
+    pixels[k] = rand();
+  }
+
+  Mat golden(height, width, CV_8UC1);
+  goldenGrayFrame(src, golden);
+
+  Mat gray(height, width, CV_8UC1), out(height, width, CV_8UC1);
+  fill(gray, CANARY);
+  grayScale(src, gray);
+  compareGray(padded ? "grayScale (padded)" : "grayScale", golden, gray);
+
+  fill(out, CANARY);
+  sobelCalc(golden, out);
+  compareSobel("sobelCalc", golden, out, CANARY);
+
+  fill(out, CANARY);
+  sobelFused(src, out);
+  compareSobel(padded ? "sobelFused (padded)" : "sobelFused", golden, out, CANARY);
+
+  // Bands over the pool, as in -m
+  band_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.src = &src;
+  job.gray = &gray;
+  job.sobel = &out;
+  planBands(&job, height, width, pool->nthreads);
+
+  fill(gray, CANARY);
+  fill(out, CANARY);
+  pool_run(pool, grayBand, &job, job.num_bands);
+  pool_run(pool, sobelBand, &job, job.num_bands);
+  compareGray("grayBand", golden, gray);
+  compareSobel("sobelBand", golden, out, CANARY);
+
+  fill(out, CANARY);
+  pool_run(pool, fusedBand, &job, job.num_bands);
+  compareSobel("fusedBand", golden, out, CANARY);
+
+  // The other filters through sobelCalc's --filter dispatch, whole frame and
+  // in bands over the gray frame
+  for (int f = FILTER_SOBEL + 1; f < FILTER_COUNT; f++) {
+    opts.filter = f;
+    fill(out, CANARY);
+    sobelCalc(golden, out);
+    compareFilter("sobelCalc", golden, out, f, CANARY);
+
+    job.gray = &golden;
+    fill(out, CANARY);
+    pool_run(pool, sobelBand, &job, job.num_bands);
+    compareFilter("sobelBand", golden, out, f, CANARY);
+    job.gray = &gray;
+  }
+  opts.filter = FILTER_SOBEL;
+
+  // --gradient output, whole frame and in bands
+  Mat grad(height, 3 * width, CV_8UC1);
+  opts.gradient = 1;
+  fill(grad, CANARY);
+  sobelCalc(golden, grad);
+  compareGradient("gradientCalc", golden, grad);
+
+  job.gray = &golden;
+  job.sobel = &grad;
+  fill(grad, CANARY);
+  pool_run(pool, sobelBand, &job, job.num_bands);
+  compareGradient("gradient sobelBand", golden, grad);
+  opts.gradient = 0;
+
+  freeBands(&job);
+  free(pixels);
+}
+
+// 16-bit Sobel frame against sobelAt; the border must hold the fill value
+/*******************************************
+ * Model: checkReplan
+ * Input: pool to run bands on
+ * Output: None
+ * Desc: One band job over frames of the same height that get wider, as a
+ *  capture changing size does. The drivers re-plan on either dimension;
+ *  the line buffers must grow with the width, and fusedBand and a --filter
+ *  operator must still match the golden output on the wider frame.
+ ********************************************/
+static void checkReplan(thread_pool_t *pool)
+{
+  static const int widths[] = { 64, 1280 };
+  int height = 48;
+  band_job_t job;
+  memset(&job, 0, sizeof(job));
+
+  for (int w = 0; w < 2; w++) {
+    int width = widths[w];
+    Mat src(height, width, CV_8UC3), golden(height, width, CV_8UC1), out(height, width, CV_8UC1);
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width * 3; j++) {
+        src.ptr(i)[j] = rand();
+      }
+    }
+    goldenGrayFrame(src, golden);
+
+    job.src = &src;
+    job.gray = &golden;
+    job.sobel = &out;
+    planBands(&job, height, width, pool->nthreads);
+    if (job.line_width < width) {
+      fail("planBands line buffers", width, height, job.line_width);
+    }
+
+    fill(out, CANARY);
+    pool_run(pool, fusedBand, &job, job.num_bands);
+    compareSobel("fusedBand after re-plan", golden, out, CANARY);
+
+    opts.filter = FILTER_SCHARR;
+    fill(out, CANARY);
+    pool_run(pool, sobelBand, &job, job.num_bands);
+    compareFilter("sobelBand after re-plan", golden, out, FILTER_SCHARR, CANARY);
+    opts.filter = FILTER_SOBEL;
+  }
+  freeBands(&job);
+}
+
+static void compareSobel16(const char *what, Mat& gray, Mat& out, int border = CANARY * 0x101)
+{
+  for (int i = 0; i < out.rows; i++) {
+    for (int j = 0; j < out.cols; j++) {
+      int want = border;
+      if (i > 0 && i < out.rows - 1 && j > 0 && j < out.cols - 1) {
+        int gx, gy;
+        sobelAt((const uint16_t *)gray.ptr(i - 1), (const uint16_t *)gray.ptr(i),
+                (const uint16_t *)gray.ptr(i + 1), j, &gx, &gy);
+        want = abs(gx) + abs(gy) > 0xFFFF ? 0xFFFF : abs(gx) + abs(gy);
+      }
+      if (((uint16_t *)out.ptr(i))[j] != want) {
+        fail(what, out.cols, out.rows, i * out.cols + j);
+        return;
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: checkFrame16
+ * Input: frame size, whether rows are padded, pool to run bands on
+ * Output: None
+ * Desc: 16-bit frames (12-bit samples) through grayScale and sobelCalc,
+ *  whole and in bands, which dispatch on the Mat depth
+ ********************************************/
+static void checkFrame16(int width, int height, int padded, thread_pool_t *pool)
+{
+  size_t stride = width * 6 + (padded ? 14 : 0);
+  uint8_t *pixels = (uint8_t *)malloc(stride * height);
+  Mat src(height, width, CV_16UC3, pixels, stride);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < 3 * width; j++) {
+      ((uint16_t *)src.ptr(i))[j] = rand() & 0xFFF;
+    }
+  }
+
+  Mat golden(height, width, CV_16UC1);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      ((uint16_t *)golden.ptr(i))[j] = goldenGray((const uint16_t *)src.ptr(i) + 3 * j);
+    }
+  }
+
+  Mat gray(height, width, CV_16UC1), out(height, width, CV_16UC1);
+  fill(gray, CANARY);
+  grayScale(src, gray);
+  compareGray(padded ? "grayScale 16-bit (padded)" : "grayScale 16-bit", golden, gray);
+
+  fill(out, CANARY);
+  sobelCalc(golden, out);
+  compareSobel16("sobelCalc 16-bit", golden, out);
+
+  band_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.src = &src;
+  job.gray = &gray;
+  job.sobel = &out;
+  planBands(&job, height, width, pool->nthreads);
+
+  fill(gray, CANARY);
+  fill(out, CANARY);
+  pool_run(pool, grayBand, &job, job.num_bands);
+  pool_run(pool, sobelBand, &job, job.num_bands);
+  compareGray("grayBand 16-bit", golden, gray);
+  compareSobel16("sobelBand 16-bit", golden, out);
+
+  freeBands(&job);
+  free(pixels);
+}
+
+/*******************************************
+ * Model: checkLibrary
+ * Input: frame size, libsobel pool
+ * Output: None
+ * Desc: libsobel's C API on padded caller buffers in every format: gray
+ *  conversion, single threaded Sobel and sobel_frame two-pass and fused,
+ *  against the golden gray and Sobel images. The output border must be 0.
+ ********************************************/
+static void checkLibrary(int width, int height, sobel_pool_t *lib)
+{
+  static const int bytes[] = { 3, 1, 2, 6, 2 };
+  static const char *names[] = { "bgr", "gray", "yuyv", "bgr16", "gray16" };
+
+  for (int format = SOBEL_BGR; format <= SOBEL_GRAY16; format++) {
+    int deep = format == SOBEL_BGR16 || format == SOBEL_GRAY16;
+    int type = deep ? CV_16UC1 : CV_8UC1;
+    size_t stride = width * bytes[format] + 6;
+    uint8_t *pixels = (uint8_t *)malloc(stride * height);
+    Mat golden(height, width, type), gray(height, width, type), out(height, width, type);
+    char what[64];
+
+    for (int i = 0; i < height; i++) {
+      uint8_t *row = pixels + i * stride;
+      uint16_t *row16 = (uint16_t *)row;
+      for (int j = 0; j < width * bytes[format] / (deep ? 2 : 1); j++) {
+        if (deep) {
+          row16[j] = rand() & 0xFFF;
+        } else {
+          row[j] = rand();
+        }
+      }
+      for (int j = 0; j < width; j++) {
+        switch (format) {
+          case SOBEL_BGR:    golden.ptr(i)[j] = goldenGray(row + 3 * j); break;
+          case SOBEL_GRAY:   golden.ptr(i)[j] = row[j]; break;
+          case SOBEL_YUYV:   golden.ptr(i)[j] = row[2 * j]; break;
+          case SOBEL_BGR16:  ((uint16_t *)golden.ptr(i))[j] = goldenGray(row16 + 3 * j); break;
+          default:           ((uint16_t *)golden.ptr(i))[j] = row16[j]; break;
+        }
+      }
+    }
+
+    fill(gray, CANARY);
+    snprintf(what, sizeof(what), "sobel_gray %s", names[format]);
+    if (sobel_gray((sobel_format_t)format, pixels, stride, gray.data, gray.step,
+                   width, height) != 0) {
+      fail(what, width, height, -1);
+    }
+    compareGray(what, golden, gray);
+
+    for (int pass = 0; pass < 3; pass++) {
+      fill(out, CANARY);
+      int ret;
+      if (pass == 0) {
+        snprintf(what, sizeof(what), "sobel_magnitude %s", names[format]);
+        ret = sobel_magnitude(deep ? SOBEL_GRAY16 : SOBEL_GRAY, golden.data, golden.step,
+                              out.data, out.step, width, height);
+      } else {
+        snprintf(what, sizeof(what), "sobel_frame %s%s", names[format], pass == 2 ? " fused" : "");
+        ret = sobel_frame(lib, (sobel_format_t)format, pixels, stride, out.data, out.step,
+                          width, height, pass == 2 ? SOBEL_FUSED : 0);
+      }
+      if (ret != 0) {
+        fail(what, width, height, -1);
+      } else if (deep) {
+        compareSobel16(what, golden, out, 0);
+      } else {
+        compareSobel(what, golden, out, 0);
+      }
+    }
+    free(pixels);
+  }
+
+  // Bad arguments are refused without touching the output
+  uint8_t small[9];
+  errno = 0;
+  if (sobel_frame(lib, SOBEL_GRAY, small, 2, small, 3, 3, 3, 0) != -1 || errno != EINVAL ||
+      sobel_frame(lib, SOBEL_GRAY, small, 3, small, 3, 2, 3, 0) != -1 ||
+      sobel_gray((sobel_format_t)-1, small, 3, small, 3, 3, 3) != -1 ||
+      sobel_magnitude(SOBEL_BGR, small, 3, small, 3, 3, 3) != -1) {
+    fail("libsobel argument checks", 3, 3, -1);
+  }
+}
+
+/*******************************************
+ * Model: checkIncremental
+ * Input: frame size, pool to run the tile rows on
+ * Output: None
+ * Desc: --incremental over a sequence of frames: a first frame (every tile
+ *  dirty), the same frame again (no tile dirty, nothing may change), then
+ *  frames with a few pixels changed, including frame corners and tile
+ *  edges. With a zero threshold every output must equal a full recompute.
+ *  Runs Sobel, a radius 2 filter and --gradient with 5x4 tiles, so halos
+ *  cross tile corners and tiles are smaller than the radius-2 halo.
+ ********************************************/
+#define LIB_CHECK_POOLS 6
+#define LIB_CHECK_THREADS 24
+
+/*******************************************
+ * Model: checkLibraryPools
+ * Input: None
+ * Output: None directly. Counts failures
+ * Desc: Several libsobel pools of many threads alive at once, as in a host
+ *  with one pool per ingest thread. Each takes its own scratch memory for
+ *  a fused and a two-pass frame, which must both succeed and match the
+ *  golden Sobel image.
+ ********************************************/
+static void checkLibraryPools()
+{
+  const int width = 320, height = 240;
+  sobel_pool_t *pools[LIB_CHECK_POOLS];
+  Mat src(height, width, CV_8UC3), golden(height, width, CV_8UC1), out(height, width, CV_8UC1);
+  int before = failures;
+
+  for (size_t k = 0; k < (size_t)width * height * 3; k++) {
+    src.data[k] = rand();
+  }
+  goldenGrayFrame(src, golden);
+  for (int p = 0; p < LIB_CHECK_POOLS; p++) {
+    pools[p] = sobel_pool_create(LIB_CHECK_THREADS);
+    if (pools[p] == NULL) {
+      printf("  FAIL libsobel pool %d of %d threads: %s\n", p, LIB_CHECK_THREADS, strerror(errno));
+      failures++;
+      continue;
+    }
+    for (int fused = 0; fused < 2; fused++) {
+      fill(out, CANARY);
+      if (sobel_frame(pools[p], SOBEL_BGR, src.data, src.step, out.data, out.step, width, height,
+                      fused ? SOBEL_FUSED : 0) != 0) {
+        fail(fused ? "sobel_frame fused, many pools" : "sobel_frame, many pools", width, height, -1);
+      } else {
+        compareSobel(fused ? "sobel_frame fused, many pools" : "sobel_frame, many pools", golden, out, 0);
+      }
+    }
+  }
+  for (int p = 0; p < LIB_CHECK_POOLS; p++) {
+    sobel_pool_destroy(pools[p]);
+  }
+  printf("%-8s %s\n", "libpools", failures == before ? "ok" : "FAILED");
+}
+
+static void checkIncremental(int width, int height, thread_pool_t *pool)
+{
+  static const int modes[][2] = { { FILTER_SOBEL, 0 }, { FILTER_GAUSS5, 0 }, { FILTER_SOBEL, 1 } };
+
+  Mat src(height, width, CV_8UC3), golden(height, width, CV_8UC1);
+  Mat gray(height, width, CV_8UC1);
+  opts.incrSad = 0;
+  opts.tileWidth = 5;
+  opts.tileHeight = 4;
+
+  for (int m = 0; m < 3; m++) {
+    opts.filter = modes[m][0];
+    opts.gradient = modes[m][1];
+    Mat out(height, opts.gradient ? 3 * width : width, CV_8UC1);
+    incr_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.src = &src;
+    job.gray = &gray;
+    job.sobel = &out;
+
+    for (int i = 0; i < height; i++) {
+      for (int j = 0; j < width * 3; j++) {
+        src.ptr(i)[j] = rand();
+      }
+    }
+    fill(gray, CANARY);
+    fill(out, CANARY);
+
+    for (int frame = 0; frame < 5; frame++) {
+      // Frame 1 repeats frame 0; later frames touch a corner, a tile edge
+      // and a random pixel
+      if (frame >= 2) {
+        int y[3] = { frame == 2 ? 0 : height - 1, rand() % height, rand() % height };
+        int x[3] = { frame == 2 ? 0 : width - 1, (rand() % width) / 5 * 5, rand() % width };
+        for (int k = 0; k < 3; k++) {
+          src.ptr(y[k])[x[k] * 3 + rand() % 3] ^= 1 + rand() % 255;
+        }
+      }
+      goldenGrayFrame(src, golden);
+
+      incrPlan(&job, pool->nthreads);
+      pool_run(pool, incrGrayBand, &job, job.tiles_y);
+      pool_run(pool, incrSobelBand, &job, job.tiles_y);
+      if (incrEndFrame(&job) != 0 && frame == 1) {
+        fail("incremental (unchanged frame)", width, height, 0);
+      }
+
+      compareGray("incrGrayBand", golden, gray);
+      if (opts.gradient) {
+        compareGradient("incremental gradient", golden, out);
+      } else {
+        compareFilter("incrSobelBand", golden, out, opts.filter, CANARY);
+      }
+    }
+    incrFree(&job);
+  }
+  opts.filter = FILTER_SOBEL;
+  opts.gradient = 0;
+  opts.tileWidth = opts.tileHeight = 0;
+}
+
+/*******************************************
+ * Model: checkTiled
+ * Input: frame size, pool to run the tiles on
+ * Output: None
+ * Desc: --tiled for Sobel, a radius 2 filter and --gradient, with tiles
+ *  sized from the caches and with 7x5 tiles, whose halos overlap their
+ *  neighbours' and the frame border on every side
+ ********************************************/
+static void checkTiled(int width, int height, thread_pool_t *pool)
+{
+  static const int modes[][2] = { { FILTER_SOBEL, 0 }, { FILTER_GAUSS5, 0 }, { FILTER_SOBEL, 1 } };
+
+  Mat src(height, width, CV_8UC3), golden(height, width, CV_8UC1);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width * 3; j++) {
+      src.ptr(i)[j] = rand();
+    }
+  }
+  goldenGrayFrame(src, golden);
+
+  for (int m = 0; m < 3; m++) {
+    opts.filter = modes[m][0];
+    opts.gradient = modes[m][1];
+    Mat out(height, opts.gradient ? 3 * width : width, CV_8UC1);
+    for (int sized = 0; sized < 2; sized++) {
+      opts.tileWidth = sized ? 7 : 0;
+      opts.tileHeight = sized ? 5 : 0;
+      tiled_job_t job;
+      memset(&job, 0, sizeof(job));
+      job.src = &src;
+      job.sobel = &out;
+      tiledPlan(&job, pool->nthreads);
+
+      fill(out, CANARY);
+      pool_run(pool, tiledBand, &job, job.tiles_x * job.tiles_y);
+      if (opts.gradient) {
+        compareGradient("tiled gradient", golden, out);
+      } else {
+        compareFilter(sized ? "tiledBand (7x5)" : "tiledBand", golden, out, opts.filter, CANARY);
+      }
+      tiledFree(&job);
+    }
+  }
+  opts.filter = FILTER_SOBEL;
+  opts.gradient = 0;
+  opts.tileWidth = opts.tileHeight = 0;
+}
+
+/*******************************************
+ * Model: checkPyramid
+ * Input: frame size, pool to run bands on
+ * Output: None
+ * Desc: --pyramid, whole frame and in bands with an odd -b: every level's
+ *  gray image against the 2x2 means of the golden level above it, and its
+ *  part of the composite output against the golden filter of that level
+ ********************************************/
+static void checkPyramid(int width, int height, thread_pool_t *pool)
+{
+  Mat src(height, width, CV_8UC3);
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width * 3; j++) {
+      src.ptr(i)[j] = rand();
+    }
+  }
+
+  Mat golden[PYR_MAX_LEVELS];
+  golden[0] = Mat(height, width, CV_8UC1);
+  goldenGrayFrame(src, golden[0]);
+  for (int l = 1; l < PYR_MAX_LEVELS; l++) {
+    Mat& up = golden[l - 1];
+    golden[l] = Mat(height >> l, width >> l, CV_8UC1);
+    for (int i = 0; i < golden[l].rows; i++) {
+      for (int j = 0; j < golden[l].cols; j++) {
+        golden[l].ptr(i)[j] = (up.ptr(2 * i)[2 * j] + up.ptr(2 * i)[2 * j + 1] +
+                               up.ptr(2 * i + 1)[2 * j] + up.ptr(2 * i + 1)[2 * j + 1] + 2) / 4;
+      }
+    }
+  }
+
+  opts.pyramid = PYR_MAX_LEVELS;
+  opts.bandRows = 5;
+  Mat gray(height, width, CV_8UC1), out(height, pyramidCols(width), CV_8UC1);
+  pyramid_t pyr;
+  pyr.levels = 0;
+  band_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.src = &src;
+  job.gray = &gray;
+  job.sobel = &out;
+  job.pyr = &pyr;
+  planBands(&job, height, width, pool->nthreads);
+
+  static const int pyr_filters[] = { FILTER_SOBEL, FILTER_GAUSS5 };
+  for (int k = 0; k < 2; k++) {
+    int f = pyr_filters[k];
+    opts.filter = f;
+    for (int banded = 0; banded < 2; banded++) {
+      const char *what = banded ? "pyramid bands" : "pyramid";
+      fill(gray, CANARY);
+      fill(out, CANARY);
+      pyramidPlan(&pyr, gray, out);
+      for (int l = 1; l < pyr.levels; l++) {
+        fill(pyr.gray[l], CANARY);
+      }
+      if (banded) {
+        pool_run(pool, pyramidGrayBand, &job, job.num_bands);
+        pool_run(pool, pyramidSobelBand, &job, job.num_bands);
+      } else {
+        pyramidGray(src, &pyr);
+        pyramidSobel(&pyr);
+      }
+      for (int l = 0; l < pyr.levels; l++) {
+        compareGray(what, golden[l], pyr.gray[l]);
+        compareFilter(what, golden[l], pyr.sobel[l], f, CANARY);
+      }
+    }
+  }
+
+  freeBands(&job);
+  pyramidFree(&pyr);
+  opts.filter = FILTER_SOBEL;
+  opts.bandRows = 0;
+  opts.pyramid = 0;
+}
+
+/*******************************************
+ * Model: checkEdgeFile
+ * Input: None
+ * Output: None
+ * Desc: Builds an edge map file in memory the way the edges sink writes
+ *  it, from maps of every density (so both encodings occur) and widths
+ *  that are not a multiple of 8, then reads every frame back through the
+ *  index and, with the trailer cut off, by walking the records.
+ ********************************************/
+#define EDGE_CHECK_FRAMES 24
+#define MULTI_CHECK_STREAMS 40
+#define MULTI_CHECK_FRAMES 3
+
+/*******************************************
+ * Model: checkMulti
+ * Input: pool to run the streams on
+ * Output: None directly. Counts failures
+ * Desc: Runs the multi-stream driver on MULTI_CHECK_STREAMS copies of a
+ *  raw recording with a raw sink, in a scratch directory, so every stream
+ *  holds its own pooled frames and output file as a wall of camera
+ *  recordings does. Every stream's output must be the golden Sobel of
+ *  every frame, with the zeroed border pooled outputs give.
+ ********************************************/
+static void checkMulti(thread_pool_t *pool)
+{
+  const int width = 64, height = 48;
+  size_t frame_bytes = width * 3 * height;
+  char dir[] = "/tmp/sobel_check.XXXXXX", cwd[4096], path[64];
+  static char spec[64], sink[64];
+  static char *inputs[MULTI_CHECK_STREAMS];
+  int before = failures;
+
+  if (mkdtemp(dir) == NULL || getcwd(cwd, sizeof(cwd)) == NULL || chdir(dir) != 0) {
+    printf("  FAIL multi-stream: no scratch directory: %s\n", strerror(errno));
+    failures++;
+    return;
+  }
+
+  uint8_t *pixels = (uint8_t *)malloc(MULTI_CHECK_FRAMES * frame_bytes);
+  for (size_t k = 0; k < MULTI_CHECK_FRAMES * frame_bytes; k++) {
+    pixels[k] = rand();
+  }
+  FILE *f = fopen("in.bgr", "wb");
+  fwrite(pixels, frame_bytes, MULTI_CHECK_FRAMES, f);
+  fclose(f);
+
+  struct opts saved = opts;
+  snprintf(spec, sizeof(spec), "raw:%dx%d:in.bgr", width, height);
+  snprintf(sink, sizeof(sink), "raw:out.raw");
+  for (int n = 0; n < MULTI_CHECK_STREAMS; n++) {
+    inputs[n] = spec;
+  }
+  opts.inputs = inputs;
+  opts.numInputs = MULTI_CHECK_STREAMS;
+  opts.numFrames = MULTI_CHECK_FRAMES;
+  opts.sink = sink;
+  opts.fused = 0;
+  opts.headless = 1;
+  opts.captureCpu = opts.outputCpu = -1;
+  runSobelMulti(pool);
+  opts = saved;
+
+  Mat golden(height, width, CV_8UC1), out(height, width, CV_8UC1);
+  for (int n = 0; n < MULTI_CHECK_STREAMS && failures == before; n++) {
+    snprintf(path, sizeof(path), "out.%d.raw", n);
+    f = fopen(path, "rb");
+    for (int k = 0; k < MULTI_CHECK_FRAMES && failures == before; k++) {
+      Mat src(height, width, CV_8UC3, pixels + k * frame_bytes);
+      goldenGrayFrame(src, golden);
+      if (f == NULL || fread(out.data, width * height, 1, f) != 1) {
+        printf("  FAIL multi-stream: stream %d frame %d missing\n", n, k);
+        failures++;
+        break;
+      }
+      compareSobel("multi-stream", golden, out, 0);
+    }
+    if (f != NULL) {
+      fclose(f);
+    }
+    unlink(path);
+  }
+  for (int n = 0; n < MULTI_CHECK_STREAMS; n++) {
+    snprintf(path, sizeof(path), "out.%d.raw", n);
+    unlink(path);
+  }
+  unlink("in.bgr");
+  unlink("multi_perf.csv");
+  if (chdir(cwd) != 0 || rmdir(dir) != 0) {
+    printf("  FAIL multi-stream: cannot remove %s: %s\n", dir, strerror(errno));
+    failures++;
+  }
+  free(pixels);
+  printf("%-8s %s\n", "multi", failures == before ? "ok" : "FAILED");
+}
+
+static void checkEdgeFile()
+{
+  static const int sizes[][2] = { { 1, 1 }, { 13, 7 }, { 64, 3 }, { 321, 17 } };
+  int before = failures;
+
+  for (int s = 0; s < 4; s++) {
+    int width = sizes[s][0], height = sizes[s][1];
+    size_t row = EDGE_ROW_BYTES(width), bitmap = row * height;
+    uint8_t *maps = (uint8_t *)malloc(EDGE_CHECK_FRAMES * bitmap);
+    uint8_t *file = (uint8_t *)malloc(EDGE_HEADER_BYTES + EDGE_CHECK_FRAMES * (EDGE_RECORD_BYTES + bitmap + 8) +
+                                      EDGE_TRAILER_BYTES);
+    uint8_t *out = (uint8_t *)malloc(bitmap);
+    uint64_t offsets[EDGE_CHECK_FRAMES];
+    size_t size = EDGE_HEADER_BYTES;
+
+    edge_put_header(file, width, height, 42);
+    for (int n = 0; n < EDGE_CHECK_FRAMES; n++) {
+      uint8_t *map = maps + n * bitmap;
+      int density = n % 6 == 5 ? 100 : n * 4; // percent of edge pixels
+      memset(map, 0, bitmap);
+      for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+          if (rand() % 100 < density) {
+            map[i * row + j / 8] |= 1 << (j % 8);
+          }
+        }
+      }
+      offsets[n] = size;
+      long rle = edge_rle_encode(map, row, width, height, file + size + EDGE_RECORD_BYTES, bitmap - 1);
+      if (rle >= 0) {
+        edge_put_record(file + size, EDGE_RLE, rle);
+        size += EDGE_RECORD_BYTES + rle;
+      } else {
+        edge_put_record(file + size, EDGE_BITMAP, bitmap);
+        memcpy(file + size + EDGE_RECORD_BYTES, map, bitmap);
+        size += EDGE_RECORD_BYTES + bitmap;
+      }
+    }
+    size_t records = size;
+    for (int n = 0; n < EDGE_CHECK_FRAMES; n++) {
+      for (int i = 0; i < 8; i++) {
+        file[size++] = offsets[n] >> (8 * i);
+      }
+    }
+    edge_put_trailer(file + size, EDGE_CHECK_FRAMES, records);
+    size += EDGE_TRAILER_BYTES;
+
+    for (int cut = 0; cut < 2; cut++) {
+      edge_file_t f;
+      if (edge_file_open(&f, file, cut ? records : size) != 0 || f.width != width || f.height != height ||
+          f.threshold != 42 || f.frames != EDGE_CHECK_FRAMES || (f.index == NULL) != cut) {
+        printf("  FAIL edge file %dx%d%s: bad header or index\n", width, height, cut ? " without trailer" : "");
+        failures++;
+        continue;
+      }
+      for (int n = 0; n < EDGE_CHECK_FRAMES; n++) {
+        memset(out, CANARY, bitmap);
+        if (edge_file_frame(&f, n, out, row) != 0 || memcmp(out, maps + n * bitmap, bitmap) != 0) {
+          printf("  FAIL edge file %dx%d%s: frame %d\n", width, height, cut ? " without trailer" : "", n);
+          failures++;
+          break;
+        }
+      }
+    }
+    free(maps);
+    free(file);
+    free(out);
+  }
+  printf("%-8s %s\n", "edges", failures == before ? "ok" : "FAILED");
+}
+
+int main(int argc, char **argv)
+{
+  static const int sizes[][2] = {
+    { 3, 3 }, { 4, 3 }, { 17, 5 }, { 31, 9 }, { 64, 48 }, { 65, 33 },
+    { 320, 240 }, { 641, 479 }, { 1920, 1080 },
+  };
+  int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  char list[64];
+
+  memset(&opts, 0, sizeof(opts));
+  opts.fused = 1; // planBands then sets up the fused line buffers too
+  thread_pool_t *pool = pool_create(3);
+  // Let libsobel pick its default backend now, not in the middle of the
+  // loop below
+  sobel_select_backend(NULL);
+  sobel_pool_t *lib = sobel_pool_create(3);
+  srand(180);
+  goldenInit();
+  checkPool();
+  checkFramePool();
+  checkLibraryPools();
+
+  strcpy(list, kernels_available());
+  for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    if (kernels_select(name) == NULL) {
+      printf("%-8s skipped (not supported by this CPU)\n", name);
+      continue;
+    }
+    int before = failures;
+    checkRows();
+    checkSad();
+    checkDown();
+    checkLuma();
+    checkEdgeRows();
+    checkRows16();
+    for (int f = 0; f < FILTER_COUNT; f++) {
+      opts.filter = f;
+      checkFilterRows(f);
+    }
+    opts.filter = FILTER_SOBEL;
+    checkReplan(pool);
+    for (int s = 0; s < nsizes; s++) {
+      checkFrame(sizes[s][0], sizes[s][1], 0, pool);
+      checkFrame(sizes[s][0], sizes[s][1], 1, pool);
+      checkFrame16(sizes[s][0], sizes[s][1], 0, pool);
+      checkFrame16(sizes[s][0], sizes[s][1], 1, pool);
+      checkLibrary(sizes[s][0], sizes[s][1], lib);
+      checkIncremental(sizes[s][0], sizes[s][1], pool);
+      checkPyramid(sizes[s][0], sizes[s][1], pool);
+      checkTiled(sizes[s][0], sizes[s][1], pool);
+    }
+    printf("%-8s %s\n", name, failures == before ? "ok" : "FAILED");
+  }
+
+  checkMulti(pool);
+  checkEdgeFile();
+
+  sobel_pool_destroy(lib);
+  pool_destroy(pool);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+#ifndef CONV_ENGINE_H
+#define CONV_ENGINE_H
+
+#include <stdint.h>
+#include "sobel_kernels.h"
+
+// Compile-time specialized 3x3 / 5x5 filter engine. A filter is a type whose
+// taps are template arguments, so every instance is compiled into its own
+// loops with the coefficients folded in as constants, and those loops are
+// plain enough for the compiler to vectorize with whatever -m flags the
+// including file is built with. Each backend (kernels_*.cpp) includes this
+// header and gets its own SIMD build of every filter through
+// CONV_FILTER_TABLE, so a new operator is one typedef plus a table entry.
+//
+// Separable kernels run as two passes: a vertical pass over the input rows
+// into int scratch rows, then a horizontal pass over the scratch. Kernels
+// that are not separable are written as a sum of separable ones.
+//
+// Everything is in an anonymous namespace: the same instance is built with
+// different instruction sets in different files, and must not be merged by
+// the linker.
+
+namespace {
+
+// One dimensional taps of odd length N (3 or 5), T0 first
+template <int N, int T0, int T1, int T2, int T3 = 0, int T4 = 0>
+struct taps {
+  enum { size = N, radius = N / 2 };
+
+  // Vertical pass: taps over the rows around `center` (center[0] is the
+  // middle row)
+  static inline void column(const uint8_t *const *center, int *out, int width)
+  {
+    const uint8_t *r0 = center[-radius], *r1 = center[1 - radius], *r2 = center[2 - radius];
+    const uint8_t *r3 = N == 5 ? center[3 - radius] : r2;
+    const uint8_t *r4 = N == 5 ? center[4 - radius] : r2;
+    for (int j = 0; j < width; j++) {
+      int v = T0 * r0[j] + T1 * r1[j] + T2 * r2[j];
+      if (N == 5) {
+        v += T3 * r3[j] + T4 * r4[j];
+      }
+      out[j] = v;
+    }
+  }
+
+  // Horizontal pass at column j of an int row
+  static inline int row(const int *in, int j)
+  {
+    int v = T0 * in[j - radius] + T1 * in[j + 1 - radius] + T2 * in[j + 2 - radius];
+    if (N == 5) {
+      v += T3 * in[j + 3 - radius] + T4 * in[j + 4 - radius];
+    }
+    return v;
+  }
+};
+
+// V (over rows) applied first, then H (along the row)
+template <class V, class H>
+struct separable {
+  enum { radius = (int)V::radius > (int)H::radius ? (int)V::radius : (int)H::radius };
+
+  static inline void column(const uint8_t *const *center, int *out, int width)
+  {
+    V::column(center, out, width);
+  }
+  static inline int row(const int *in, int j)
+  {
+    return H::row(in, j);
+  }
+};
+
+static inline uint8_t sat8(int v)
+{
+  return v > 255 ? 255 : v;
+}
+
+// Operators. Each has a radius, a number of int scratch rows and two steps:
+// columns() runs every vertical pass for one output row, value() finishes
+// one pixel from the scratch rows.
+
+// (|GX| + |GY|) >> SHIFT, saturated: Sobel, Scharr, Prewitt
+template <class GX, class GY, int SHIFT>
+struct gradient {
+  enum { radius = (int)GX::radius > (int)GY::radius ? (int)GX::radius : (int)GY::radius, scratch_rows = 2 };
+
+  static inline void columns(const uint8_t *const *center, int *tmp, int width)
+  {
+    GX::column(center, tmp, width);
+    GY::column(center, tmp + width, width);
+  }
+  static inline uint8_t value(const int *tmp, int width, int j)
+  {
+    int gx = GX::row(tmp, j);
+    int gy = GY::row(tmp + width, j);
+    return sat8(((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy)) >> SHIFT);
+  }
+};
+
+// Non-negative kernel normalised by 2^SHIFT, rounded: Gaussian
+template <class K, int SHIFT>
+struct smooth {
+  enum { radius = K::radius, scratch_rows = 1 };
+
+  static inline void columns(const uint8_t *const *center, int *tmp, int width)
+  {
+    K::column(center, tmp, width);
+  }
+  static inline uint8_t value(const int *tmp, int width, int j)
+  {
+    return sat8((K::row(tmp, j) + ((1 << SHIFT) >> 1)) >> SHIFT);
+  }
+};
+
+// |A + B|, saturated: a non-separable kernel split into two separable ones
+// (Laplacian)
+template <class A, class B>
+struct sum2 {
+  enum { radius = (int)A::radius > (int)B::radius ? (int)A::radius : (int)B::radius, scratch_rows = 2 };
+
+  static inline void columns(const uint8_t *const *center, int *tmp, int width)
+  {
+    A::column(center, tmp, width);
+    B::column(center, tmp + width, width);
+  }
+  static inline uint8_t value(const int *tmp, int width, int j)
+  {
+    int v = A::row(tmp, j) + B::row(tmp + width, j);
+    return sat8(v < 0 ? -v : v);
+  }
+};
+
+typedef taps<3, 1, 2, 1> smooth3;
+typedef taps<3, -1, 0, 1> diff3;
+typedef taps<3, 3, 10, 3> scharr3;
+typedef taps<3, 1, 1, 1> box3;
+typedef taps<3, 1, -2, 1> second3;
+typedef taps<3, 0, 1, 0> ident3;
+typedef taps<5, 1, 4, 6, 4, 1> smooth5;
+typedef taps<5, -1, -2, 0, 2, 1> diff5;
+
+typedef gradient<separable<smooth3, diff3>, separable<diff3, smooth3>, 0> sobel_op;
+typedef gradient<separable<scharr3, diff3>, separable<diff3, scharr3>, 2> scharr_op;
+typedef gradient<separable<box3, diff3>, separable<diff3, box3>, 0> prewitt_op;
+typedef gradient<separable<smooth5, diff5>, separable<diff5, smooth5>, 3> sobel5_op;
+typedef smooth<separable<smooth3, smooth3>, 4> gauss3_op;
+typedef smooth<separable<smooth5, smooth5>, 8> gauss5_op;
+typedef sum2<separable<second3, ident3>, separable<ident3, second3> > laplacian_op;
+
+/*******************************************
+ * Model: conv_row
+ * Input: the 2*radius+1 input rows (rows[radius] is the output row's own),
+ *  output row, width, scratch of scratch_rows * width ints
+ * Output: None directly. Writes out[radius .. width-radius-1]
+ * Desc: The engine. All the work is in the two passes of Op, which are
+ *  inlined here with their taps as constants.
+ ********************************************/
+template <class Op>
+void conv_row(const uint8_t *const *rows, uint8_t *out, int width, int *scratch)
+{
+  if (width <= 2 * Op::radius) {
+    return;
+  }
+  Op::columns(rows + Op::radius, scratch, width);
+  for (int j = Op::radius; j < width - Op::radius; j++) {
+    out[j] = Op::value(scratch, width, j);
+  }
+}
+
+} // namespace
+
+// filter_row table of a backend, in filter_t order. `sobel` lets a backend
+// plug in its hand written Sobel row in place of the generic instance.
+#define CONV_FILTER_TABLE(sobel) {  \
+    sobel,                          \
+    conv_row<scharr_op>,            \
+    conv_row<prewitt_op>,           \
+    conv_row<sobel5_op>,            \
+    conv_row<gauss3_op>,            \
+    conv_row<gauss5_op>,            \
+    conv_row<laplacian_op>,         \
+  }
+
+#endif
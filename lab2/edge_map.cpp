@@ -0,0 +1,211 @@
+#include <string.h>
+#include "edge_map.h"
+
+static void putLE(uint8_t *out, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; i++) {
+    out[i] = v >> (8 * i);
+  }
+}
+
+static uint64_t getLE(const uint8_t *in, int bytes)
+{
+  uint64_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | in[i];
+  }
+  return v;
+}
+
+static int putVarint(uint8_t *out, size_t cap, size_t *pos, uint32_t v)
+{
+  do {
+    if (*pos >= cap) {
+      return -1;
+    }
+    out[(*pos)++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+    v >>= 7;
+  } while (v != 0);
+  return 0;
+}
+
+static int getVarint(const uint8_t *in, size_t len, size_t *pos, uint32_t *v)
+{
+  *v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*pos >= len) {
+      return -1;
+    }
+    uint8_t byte = in[(*pos)++];
+    *v |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*******************************************
+ * Model: edge_rle_encode
+ * Input: packed map, its row stride and size, output buffer and its size
+ * Output: bytes written, -1 if they would not fit
+ * Desc: Encodes each row as alternating non-edge/edge run lengths. Whole
+ *  bytes of a run (0x00 or 0xFF) are skipped at once, so the sparse maps
+ *  Sobel thresholds produce cost about a byte compare per 8 pixels.
+ ********************************************/
+long edge_rle_encode(const uint8_t *bits, size_t stride, int width, int height,
+                     uint8_t *out, size_t cap)
+{
+  size_t pos = 0;
+
+  for (int i = 0; i < height; i++) {
+    const uint8_t *row = bits + i * stride;
+    int j = 0, value = 0;
+    while (j < width) {
+      uint32_t run = 0;
+      while (j < width) {
+        if ((j & 7) == 0 && j + 8 <= width && row[j >> 3] == (value ? 0xFF : 0x00)) {
+          run += 8;
+          j += 8;
+        } else if (((row[j >> 3] >> (j & 7)) & 1) == value) {
+          run++;
+          j++;
+        } else {
+          break;
+        }
+      }
+      if (putVarint(out, cap, &pos, run) != 0) {
+        return -1;
+      }
+      value ^= 1;
+    }
+  }
+  return pos;
+}
+
+int edge_rle_decode(const uint8_t *in, size_t len, int width, int height,
+                    uint8_t *bits, size_t stride)
+{
+  size_t pos = 0;
+
+  for (int i = 0; i < height; i++) {
+    uint8_t *row = bits + i * stride;
+    int j = 0, value = 0;
+    memset(row, 0, EDGE_ROW_BYTES(width));
+    while (j < width) {
+      uint32_t run;
+      if (getVarint(in, len, &pos, &run) != 0 || run > (uint32_t)(width - j)) {
+        return -1;
+      }
+      for (uint32_t k = 0; value && k < run; k++) {
+        row[(j + k) >> 3] |= 1 << ((j + k) & 7);
+      }
+      j += run;
+      value ^= 1;
+    }
+  }
+  return pos == len ? 0 : -1;
+}
+
+void edge_put_header(uint8_t *out, int width, int height, int threshold)
+{
+  memcpy(out, EDGE_MAGIC, 8);
+  putLE(out + 8, EDGE_VERSION, 4);
+  putLE(out + 12, width, 4);
+  putLE(out + 16, height, 4);
+  putLE(out + 20, threshold, 4);
+}
+
+void edge_put_record(uint8_t *out, edge_encoding_t encoding, uint32_t bytes)
+{
+  putLE(out, encoding, 4);
+  putLE(out + 4, bytes, 4);
+}
+
+void edge_put_trailer(uint8_t *out, uint64_t frames, uint64_t index_offset)
+{
+  putLE(out, frames, 8);
+  putLE(out + 8, index_offset, 8);
+  memcpy(out + 16, EDGE_INDEX_MAGIC, 8);
+}
+
+// Offset of the record after the one at `offset`, 0 if that one is incomplete
+static size_t nextRecord(const edge_file_t *f, size_t offset)
+{
+  if (f->size - offset < EDGE_RECORD_BYTES) {
+    return 0;
+  }
+  size_t bytes = getLE(f->data + offset + 4, 4);
+  if (f->size - offset - EDGE_RECORD_BYTES < bytes) {
+    return 0;
+  }
+  return offset + EDGE_RECORD_BYTES + bytes;
+}
+
+int edge_file_open(edge_file_t *f, const uint8_t *data, size_t size)
+{
+  memset(f, 0, sizeof(*f));
+  if (size < EDGE_HEADER_BYTES || memcmp(data, EDGE_MAGIC, 8) != 0 || getLE(data + 8, 4) != EDGE_VERSION) {
+    return -1;
+  }
+  f->data = data;
+  f->size = size;
+  f->width = getLE(data + 12, 4);
+  f->height = getLE(data + 16, 4);
+  f->threshold = getLE(data + 20, 4);
+
+  if (size >= EDGE_HEADER_BYTES + EDGE_TRAILER_BYTES &&
+      memcmp(data + size - 8, EDGE_INDEX_MAGIC, 8) == 0) {
+    const uint8_t *trailer = data + size - EDGE_TRAILER_BYTES;
+    uint64_t frames = getLE(trailer, 8), index = getLE(trailer + 8, 8);
+    if (index >= EDGE_HEADER_BYTES && index <= size - EDGE_TRAILER_BYTES &&
+        (size - EDGE_TRAILER_BYTES - index) / 8 == frames) {
+      f->frames = frames;
+      f->index = data + index;
+      return 0;
+    }
+  }
+
+  // No trailer: count the complete records
+  for (size_t offset = EDGE_HEADER_BYTES; (offset = nextRecord(f, offset)) != 0; ) {
+    f->frames++;
+  }
+  return 0;
+}
+
+int edge_file_frame(const edge_file_t *f, unsigned long n, uint8_t *bits, size_t stride)
+{
+  size_t offset = EDGE_HEADER_BYTES;
+
+  if (n >= f->frames) {
+    return -1;
+  }
+  if (f->index != NULL) {
+    offset = getLE(f->index + 8 * n, 8);
+  } else {
+    for (unsigned long k = 0; k < n; k++) {
+      offset = nextRecord(f, offset);
+    }
+  }
+  if (offset < EDGE_HEADER_BYTES || nextRecord(f, offset) == 0) {
+    return -1;
+  }
+
+  const uint8_t *payload = f->data + offset + EDGE_RECORD_BYTES;
+  size_t bytes = getLE(f->data + offset + 4, 4);
+  size_t row = EDGE_ROW_BYTES(f->width);
+  switch (getLE(f->data + offset, 4)) {
+    case EDGE_BITMAP:
+      if (bytes != row * f->height) {
+        return -1;
+      }
+      for (int i = 0; i < f->height; i++) {
+        memcpy(bits + i * stride, payload + i * row, row);
+      }
+      return 0;
+    case EDGE_RLE:
+      return edge_rle_decode(payload, bytes, f->width, f->height, bits, stride);
+    default:
+      return -1;
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef EDGE_MAP_H
+#define EDGE_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact edge map archive, written by the edges:<path> sink. Each output
+// frame is thresholded (pixel > --edge-threshold) and bit packed by the
+// backend's edge_row kernel, then stored as that bitmap or run length
+// encoded, whichever is smaller. All integers are little endian:
+//   header   "SOBELEDG", u32 version, u32 width, u32 height, u32 threshold
+//   frames   u32 encoding (edge_encoding_t), u32 payload bytes, payload
+//   index    u64 file offset of each frame record
+//   trailer  u64 frame count, u64 index offset, "SOBELIDX"
+// Frames are appended as they arrive and the index is written on close. A
+// file cut short (no trailer) still holds every complete frame before the
+// cut; they are found by walking the records from the header.
+//
+// Bitmap payload: rows of EDGE_ROW_BYTES(width) bytes, bit j % 8 of byte
+// j / 8 is pixel j. RLE payload: per row, the lengths of alternating runs
+// of non-edge and edge pixels, starting with non-edge (possibly 0), as
+// LEB128 varints adding up to the width.
+
+#define EDGE_MAGIC "SOBELEDG"
+#define EDGE_INDEX_MAGIC "SOBELIDX"
+#define EDGE_VERSION 1
+#define EDGE_HEADER_BYTES 24
+#define EDGE_RECORD_BYTES 8
+#define EDGE_TRAILER_BYTES 24
+#define EDGE_DEFAULT_THRESHOLD 64
+#define EDGE_ROW_BYTES(width) (((width) + 7) / 8)
+
+enum edge_encoding_t { EDGE_BITMAP, EDGE_RLE };
+
+// Run length encodes a packed map (rows `stride` bytes apart) into out.
+// Returns the bytes used, or -1 if the encoding does not fit in cap.
+long edge_rle_encode(const uint8_t *bits, size_t stride, int width, int height,
+                     uint8_t *out, size_t cap);
+
+// Unpacks an RLE payload into a packed map. Returns 0, or -1 if malformed.
+int edge_rle_decode(const uint8_t *in, size_t len, int width, int height,
+                    uint8_t *bits, size_t stride);
+
+void edge_put_header(uint8_t *out, int width, int height, int threshold);
+void edge_put_record(uint8_t *out, edge_encoding_t encoding, uint32_t bytes);
+void edge_put_trailer(uint8_t *out, uint64_t frames, uint64_t index_offset);
+
+// Reading an archive held in memory (e.g. mapped)
+struct edge_file_t {
+  const uint8_t *data;
+  size_t size;
+  int width, height, threshold;
+  unsigned long frames;
+  const uint8_t *index;   // NULL for a file without its trailer
+};
+
+// Parses the header and trailer. Returns 0, or -1 if not an edge map file.
+int edge_file_open(edge_file_t *f, const uint8_t *data, size_t size);
+
+// Decodes frame n into a packed map. Returns 0, or -1 if n is out of range
+// or the record is damaged.
+int edge_file_frame(const edge_file_t *f, unsigned long n, uint8_t *bits, size_t stride);
+
+#endif
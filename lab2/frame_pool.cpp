@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "frame_pool.h"
+
+struct fpool_buffer_t {
+  void *ptr;
+  size_t size;
+  int in_use;
+  int node;     // NUMA node fpool_place moved it to, -1 if never placed
+};
+
+// The buffer table grows by linked chunks, so the number of buffers is only
+// bounded by memory. Buffer b is entry b % FPOOL_CHUNK of chunk
+// b / FPOOL_CHUNK.
+struct fpool_chunk_t {
+  fpool_buffer_t buffers[FPOOL_CHUNK];
+  fpool_chunk_t *next;
+};
+
+// Writers hold fpool_lock. fpool_owns reads without it: an entry (and the
+// chunk holding it) is filled in before num_buffers is raised past it
+// (release), entries and chunks are never removed, and in_use is read and
+// written atomically.
+static pthread_mutex_t fpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static fpool_chunk_t first_chunk;
+static fpool_chunk_t *last_chunk = &first_chunk;
+static int num_buffers;
+static fpool_stats_t stats;
+static int steady;
+
+// Entry b of the table, for loops that visit b = 0, 1, 2, ... in order:
+// *chunk starts at &first_chunk and moves to the next chunk as b crosses
+// into it
+static fpool_buffer_t *fpool_entry(fpool_chunk_t **chunk, int b)
+{
+  if (b > 0 && b % FPOOL_CHUNK == 0) {
+    *chunk = __atomic_load_n(&(*chunk)->next, __ATOMIC_ACQUIRE);
+  }
+  return &(*chunk)->buffers[b % FPOOL_CHUNK];
+}
+
+/*******************************************
+ * Model: fpool_acquire
+ * Input: size in bytes
+ * Output: pointer to a pooled buffer
+ * Desc: Best fit search of the free list; only allocates if nothing free is
+ *  big enough. Fresh buffers are zero filled here so their page faults are
+ *  taken now and not in the middle of a frame.
+ ********************************************/
+void *fpool_acquire(size_t bytes)
+{
+  fpool_chunk_t *chunk = &first_chunk;
+  fpool_buffer_t *best = NULL;
+
+  pthread_mutex_lock(&fpool_lock);
+  for (int b = 0; b < num_buffers; b++) {
+    fpool_buffer_t *buf = fpool_entry(&chunk, b);
+    if (!buf->in_use && buf->size >= bytes && (best == NULL || buf->size < best->size)) {
+      best = buf;
+    }
+  }
+
+  if (best != NULL) {
+    stats.reuses++;
+  } else {
+    size_t align = bytes >= FPOOL_HUGE_PAGE ? FPOOL_HUGE_PAGE : FPOOL_ALIGN;
+    size_t size = (bytes + align - 1) & ~(align - 1);
+    void *ptr;
+
+    if (posix_memalign(&ptr, align, size) != 0) {
+      err(1, "fpool_acquire: cannot allocate %lu bytes", (unsigned long)size);
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == FPOOL_HUGE_PAGE) {
+      madvise(ptr, size, MADV_HUGEPAGE); // best effort, THP may be disabled
+    }
+#endif
+    memset(ptr, 0, size);
+
+    // The last chunk is full: link a new one before the entry is published
+    if (num_buffers > 0 && num_buffers % FPOOL_CHUNK == 0) {
+      fpool_chunk_t *c = (fpool_chunk_t *)calloc(1, sizeof(fpool_chunk_t));
+      if (c == NULL) {
+        err(1, "fpool_acquire: cannot grow the buffer table");
+      }
+      __atomic_store_n(&last_chunk->next, c, __ATOMIC_RELEASE);
+      last_chunk = c;
+    }
+    best = &last_chunk->buffers[num_buffers % FPOOL_CHUNK];
+    best->ptr = ptr;
+    best->size = size;
+    best->node = -1;
+    __atomic_store_n(&num_buffers, num_buffers + 1, __ATOMIC_RELEASE);
+    stats.allocs++;
+    stats.bytes += size;
+    if (steady) {
+      stats.steady_allocs++;
+    }
+  }
+
+  __atomic_store_n(&best->in_use, 1, __ATOMIC_RELAXED);
+  stats.live++;
+  pthread_mutex_unlock(&fpool_lock);
+  return best->ptr;
+}
+
+void fpool_release(void *ptr)
+{
+  fpool_chunk_t *chunk = &first_chunk;
+
+  pthread_mutex_lock(&fpool_lock);
+  for (int b = 0; b < num_buffers; b++) {
+    fpool_buffer_t *buf = fpool_entry(&chunk, b);
+    if (buf->ptr == ptr && buf->in_use) {
+      __atomic_store_n(&buf->in_use, 0, __ATOMIC_RELAXED);
+      stats.live--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fpool_lock);
+}
+
+// No lock: poolMat/outputMat ask on every frame from every worker of a
+// multi-stream run. A buffer the caller holds cannot be released or handed
+// out by anyone else meanwhile, so the answer for it is exact.
+int fpool_owns(void *ptr)
+{
+  fpool_chunk_t *chunk = &first_chunk;
+  int n = __atomic_load_n(&num_buffers, __ATOMIC_ACQUIRE);
+
+  for (int b = 0; b < n; b++) {
+    fpool_buffer_t *buf = fpool_entry(&chunk, b);
+    if (buf->ptr == ptr) {
+      return __atomic_load_n(&buf->in_use, __ATOMIC_RELAXED);
+    }
+  }
+  return 0;
+}
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+/*******************************************
+ * Model: fpool_place
+ * Input: pooled buffer, NUMA node
+ * Output: None
+ * Desc: move_pages(2) on every page of the buffer. The buffer was first
+ *  touched by whichever thread acquired it, usually the controller, so
+ *  without this a worker on another socket reads all of it remotely.
+ ********************************************/
+void fpool_place(void *ptr, int node)
+{
+#ifdef SYS_move_pages
+  fpool_chunk_t *chunk = &first_chunk;
+  size_t size = 0;
+
+  pthread_mutex_lock(&fpool_lock);
+  for (int b = 0; b < num_buffers; b++) {
+    fpool_buffer_t *buf = fpool_entry(&chunk, b);
+    if (buf->ptr == ptr && buf->in_use && buf->node != node) {
+      buf->node = node;
+      size = buf->size;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fpool_lock);
+  if (size == 0) {
+    return;
+  }
+
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned long count = (size + page - 1) / page;
+  void **pages = (void **)malloc(count * sizeof(void *));
+  int *nodes = (int *)malloc(count * sizeof(int));
+  int *status = (int *)malloc(count * sizeof(int));
+  if (pages == NULL || nodes == NULL || status == NULL) {
+    err(1, "fpool_place: cannot allocate %lu page entries", count);
+  }
+  for (unsigned long p = 0; p < count; p++) {
+    pages[p] = (char *)ptr + p * page;
+    nodes[p] = node;
+  }
+  syscall(SYS_move_pages, 0, count, pages, nodes, status, MPOL_MF_MOVE);
+  free(pages);
+  free(nodes);
+  free(status);
+#endif
+}
+
+void fpool_mark_steady()
+{
+  pthread_mutex_lock(&fpool_lock);
+  steady = 1;
+  pthread_mutex_unlock(&fpool_lock);
+}
+
+fpool_stats_t fpool_stats()
+{
+  pthread_mutex_lock(&fpool_lock);
+  fpool_stats_t s = stats;
+  pthread_mutex_unlock(&fpool_lock);
+  return s;
+}
@@ -0,0 +1,50 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stddef.h>
+
+// Process wide pool of frame buffers. Buffers are cache-line aligned (huge
+// page aligned and advised above FPOOL_HUGE_PAGE), zero filled and touched
+// once when first allocated, then recycled: a released buffer goes back on
+// the free list and the next request of the same or smaller size reuses it.
+// After the first frame every mode should be running entirely from recycled
+// buffers; fpool_mark_steady() starts counting allocations made after that
+// point so the reports can show it stays at zero.
+
+#define FPOOL_CHUNK 64  // buffer table entries added at a time
+#define FPOOL_ALIGN 64
+#define FPOOL_HUGE_PAGE (2 * 1024 * 1024)
+
+struct fpool_stats_t {
+  unsigned long allocs;        // fresh buffers obtained from the OS
+  unsigned long reuses;        // requests served from the free list
+  unsigned long steady_allocs; // allocs since fpool_mark_steady()
+  unsigned long live;          // buffers currently handed out
+  size_t bytes;                // total bytes owned by the pool
+};
+
+// Get a buffer of at least `bytes` bytes. Never returns NULL (exits on OOM).
+void *fpool_acquire(size_t bytes);
+
+// Give a buffer back. Ignores pointers the pool did not hand out.
+void fpool_release(void *ptr);
+
+// Nonzero if ptr was handed out by the pool and not released since. Takes
+// no lock, so it is cheap enough to call on every frame.
+int fpool_owns(void *ptr);
+
+// Move a pooled buffer's pages to NUMA node `node`, for buffers one pinned
+// worker uses (see affinity.h). Remembers the node, so asking again is
+// cheap. Best effort: ignored if the kernel cannot move them.
+void fpool_place(void *ptr, int node);
+
+void fpool_mark_steady();
+fpool_stats_t fpool_stats();
+
+// Row stride used for pooled images: rows start on cache line boundaries
+static inline size_t fpool_stride(size_t row_bytes)
+{
+  return (row_bytes + FPOOL_ALIGN - 1) & ~(size_t)(FPOOL_ALIGN - 1);
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "frame_sink.h"
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "frame_pool.h"
+#include "edge_map.h"
+#include "affinity.h"
+
+using namespace cv;
+
+static void sinkWriteFile(frame_sink_t *sink, const void *data, size_t bytes)
+{
+  if (bytes > 0 && fwrite(data, bytes, 1, sink->raw) != 1) {
+    err(1, "Cannot write %s", sink->path);
+  }
+  sink->offset += bytes;
+}
+
+/*******************************************
+ * Model: sinkEdges
+ * Input: the sink, a packed edge map from sink_write
+ * Output: None directly. Appends the frame record to the file
+ * Desc: Stores the map run length encoded when that is smaller than the
+ *  bitmap (the encoder gives up as soon as it is not), else as the bitmap,
+ *  and records the frame's offset for the index.
+ ********************************************/
+static void sinkEdges(frame_sink_t *sink, Mat& bits)
+{
+  size_t row = bits.cols;
+  size_t bitmap = row * bits.rows;
+  unsigned char record[EDGE_RECORD_BYTES];
+  long rle = edge_rle_encode(bits.data, bits.step, sink->edge_width, bits.rows, sink->rle, bitmap - 1);
+
+  if (sink->index_len == sink->index_cap) {
+    sink->index_cap = sink->index_cap ? 2 * sink->index_cap : 256;
+    sink->index = (uint64_t *)realloc(sink->index, sink->index_cap * sizeof(uint64_t));
+    if (sink->index == NULL) {
+      err(1, "Cannot grow the frame index");
+    }
+  }
+  sink->index[sink->index_len++] = sink->offset;
+
+  if (rle >= 0) {
+    edge_put_record(record, EDGE_RLE, rle);
+    sinkWriteFile(sink, record, sizeof(record));
+    sinkWriteFile(sink, sink->rle, rle);
+  } else {
+    edge_put_record(record, EDGE_BITMAP, bitmap);
+    sinkWriteFile(sink, record, sizeof(record));
+    for (int r = 0; r < bits.rows; r++) {
+      sinkWriteFile(sink, bits.ptr(r), row);
+    }
+  }
+}
+
+// Index and trailer, once every frame is in
+static void sinkEdgesClose(frame_sink_t *sink)
+{
+  unsigned char entry[8], trailer[EDGE_TRAILER_BYTES];
+  uint64_t index_offset = sink->offset;
+
+  for (unsigned long n = 0; n < sink->index_len; n++) {
+    for (int i = 0; i < 8; i++) {
+      entry[i] = sink->index[n] >> (8 * i);
+    }
+    sinkWriteFile(sink, entry, sizeof(entry));
+  }
+  edge_put_trailer(trailer, sink->index_len, index_offset);
+  sinkWriteFile(sink, trailer, sizeof(trailer));
+  free(sink->index);
+  sink->index = NULL;
+  fpool_release(sink->rle);
+  sink->rle = NULL;
+}
+
+/*******************************************
+ * Model: sinkWriter
+ * Input: the sink
+ * Output: None
+ * Desc: Background writer. Pops filled buffers, writes them out and hands
+ *  them back to sink_write, until the end of stream marker arrives.
+ ********************************************/
+static void *sinkWriter(void *ptr)
+{
+  frame_sink_t *sink = (frame_sink_t *)ptr;
+
+  affinity_pin_self(AFF_OUTPUT);
+  while (1) {
+    Mat *frame = (Mat *)spsc_pop_wait(&sink->to_writer);
+    if (frame == &sink->last) {
+      break;
+    }
+    if (sink->type == SINK_RAW) {
+      for (int r = 0; r < frame->rows; r++) {
+        if (fwrite(frame->ptr(r), frame->cols * frame->elemSize(), 1, sink->raw) != 1) {
+          err(1, "Cannot write %s", sink->path);
+        }
+      }
+    } else if (sink->type == SINK_EDGES) {
+      sinkEdges(sink, *frame);
+    } else {
+      sink->video->write(*frame);
+    }
+    spsc_push_wait(&sink->to_free, frame);
+  }
+  return NULL;
+}
+
+// Open the output on the first frame, once its size is known
+static void sinkStart(frame_sink_t *sink, Mat& frame)
+{
+  int ret;
+  int cols = frame.cols;
+
+  if (sink->type == SINK_EDGES) {
+    unsigned char header[EDGE_HEADER_BYTES];
+    sink->raw = fopen(sink->path, "wb");
+    if (sink->raw == NULL) {
+      err(1, "Cannot open %s", sink->path);
+    }
+    sink->edge_width = frame.cols;
+    sink->edge_height = frame.rows;
+    edge_put_header(header, frame.cols, frame.rows, sink->threshold);
+    sinkWriteFile(sink, header, sizeof(header));
+    cols = EDGE_ROW_BYTES(frame.cols);
+    sink->rle = (unsigned char *)fpool_acquire(cols * frame.rows);
+  } else if (sink->type == SINK_RAW) {
+    sink->raw = fopen(sink->path, "wb");
+    if (sink->raw == NULL) {
+      err(1, "Cannot open %s", sink->path);
+    }
+  } else {
+    sink->video = new VideoWriter(sink->path, CV_FOURCC('M', 'J', 'P', 'G'),
+                                  sink->fps, frame.size(), frame.channels() == 3);
+    if (!sink->video->isOpened()) {
+      errx(1, "Cannot open video writer for %s", sink->path);
+    }
+  }
+
+  spsc_init(&sink->to_writer, SINK_BUFFERS * 2);
+  spsc_init(&sink->to_free, SINK_BUFFERS * 2);
+  for (int b = 0; b < SINK_BUFFERS; b++) {
+    poolMat(sink->buffers[b], frame.rows, cols, frame.type());
+    spsc_push(&sink->to_free, &sink->buffers[b]);
+  }
+  if ( (ret = pthread_create(&sink->thread, NULL, sinkWriter, sink)) ) {
+    errx(1, "Thread creation failed: %d", ret);
+  }
+  sink->started = 1;
+}
+
+/*******************************************
+ * Model: sinkMap
+ * Input: the sink, the frame to write
+ * Output: None directly. Writes the frame's rows to the file
+ * Desc: Copies the frame into the mapped window, first moving the window
+ *  on (and growing the file by SINK_MAP_FRAMES frames) if the frame does
+ *  not fit. The kernel writes the dirty pages back in the background.
+ ********************************************/
+static void sinkMap(frame_sink_t *sink, Mat& frame)
+{
+  size_t row = frame.cols * frame.elemSize();
+  size_t bytes = row * frame.rows;
+
+  if (sink->fd < 0) {
+    sink->fd = open(sink->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sink->fd < 0) {
+      err(1, "Cannot open %s", sink->path);
+    }
+  }
+  if (sink->map == NULL || sink->written + bytes > sink->map_off + sink->map_len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (sink->map != NULL) {
+      munmap(sink->map, sink->map_len);
+    }
+    sink->map_off = sink->written & ~(page - 1);
+    sink->map_len = (sink->written - sink->map_off + bytes * SINK_MAP_FRAMES + page - 1) & ~(page - 1);
+    if (ftruncate(sink->fd, sink->map_off + sink->map_len) != 0) {
+      err(1, "Cannot extend %s", sink->path);
+    }
+    sink->map = (unsigned char *)mmap(NULL, sink->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      sink->fd, sink->map_off);
+    if (sink->map == MAP_FAILED) {
+      err(1, "Cannot map %s", sink->path);
+    }
+  }
+
+  unsigned char *out = sink->map + (sink->written - sink->map_off);
+  for (int r = 0; r < frame.rows; r++) {
+    memcpy(out + r * row, frame.ptr(r), row);
+  }
+  sink->written += bytes;
+}
+
+int sink_open(frame_sink_t *sink, const char *spec, double fps)
+{
+  sink->path = NULL;
+  sink->window = "Sobel Top";
+  sink->started = 0;
+  sink->raw = NULL;
+  sink->video = NULL;
+  sink->fd = -1;
+  sink->map = NULL;
+  sink->map_off = sink->map_len = sink->written = 0;
+  sink->threshold = opts.edgeThreshold;
+  sink->edge_width = sink->edge_height = 0;
+  sink->rle = NULL;
+  sink->index = NULL;
+  sink->index_len = sink->index_cap = 0;
+  sink->offset = 0;
+  sink->fps = fps > 0 ? fps : 30;
+  sink->frames = 0;
+
+  if (strcmp(spec, "window") == 0) {
+    sink->type = SINK_WINDOW;
+  } else if (strcmp(spec, "null") == 0) {
+    sink->type = SINK_NULL;
+  } else if (strncmp(spec, "raw:", 4) == 0 && spec[4] != '\0') {
+    sink->type = SINK_RAW;
+    sink->path = spec + 4;
+  } else if (strncmp(spec, "mmap:", 5) == 0 && spec[5] != '\0') {
+    sink->type = SINK_MMAP;
+    sink->path = spec + 5;
+  } else if (strncmp(spec, "video:", 6) == 0 && spec[6] != '\0') {
+    sink->type = SINK_VIDEO;
+    sink->path = spec + 6;
+  } else if (strncmp(spec, "edges:", 6) == 0 && spec[6] != '\0') {
+    sink->type = SINK_EDGES;
+    sink->path = spec + 6;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/*******************************************
+ * Model: sink_write
+ * Input: the sink, the frame to output
+ * Output: None
+ * Desc: Shows, drops or queues one frame. Queued frames are copied (for
+ *  edges, thresholded and packed), so the caller may reuse its buffer right
+ *  away. If the writer falls SINK_BUFFERS frames behind, this blocks until
+ *  a buffer is free.
+ ********************************************/
+void sink_write(frame_sink_t *sink, Mat& frame)
+{
+  sink->frames++;
+
+  switch (sink->type) {
+    case SINK_WINDOW:
+      namedWindow(sink->window, CV_WINDOW_AUTOSIZE);
+      imshow(sink->window, frame);
+      return;
+    case SINK_NULL:
+      return;
+    case SINK_MMAP:
+      sinkMap(sink, frame);
+      return;
+    default:
+      break;
+  }
+
+  if (!sink->started) {
+    sinkStart(sink, frame);
+  }
+  Mat *buffer = (Mat *)spsc_pop_wait(&sink->to_free);
+  if (sink->type == SINK_EDGES) {
+    if (frame.cols != sink->edge_width || frame.rows != sink->edge_height) {
+      errx(1, "%s: frame size changed from %dx%d to %dx%d; an edge map file holds one size",
+           sink->path, sink->edge_width, sink->edge_height, frame.cols, frame.rows);
+    }
+    for (int r = 0; r < frame.rows; r++) {
+      kernels->edge_row(frame.ptr(r), buffer->ptr(r), frame.cols, sink->threshold);
+    }
+    spsc_push_wait(&sink->to_writer, buffer);
+    return;
+  }
+  poolMat(*buffer, frame.rows, frame.cols, frame.type()); // no-op unless the size changed
+  frame.copyTo(*buffer);
+  spsc_push_wait(&sink->to_writer, buffer);
+}
+
+int sink_poll_key(frame_sink_t *sink)
+{
+  if (sink->type != SINK_WINDOW) {
+    return -1;
+  }
+  return cvWaitKey(10);
+}
+
+void sink_close(frame_sink_t *sink)
+{
+  if (sink->fd >= 0) {
+    // Drop the unused tail of the last window
+    if (sink->map != NULL) {
+      munmap(sink->map, sink->map_len);
+      sink->map = NULL;
+    }
+    if (ftruncate(sink->fd, sink->written) != 0) {
+      warn("Cannot truncate %s", sink->path);
+    }
+    close(sink->fd);
+    sink->fd = -1;
+  }
+  if (!sink->started) {
+    return;
+  }
+  spsc_push_wait(&sink->to_writer, &sink->last);
+  pthread_join(sink->thread, NULL);
+  if (sink->type == SINK_EDGES) {
+    sinkEdgesClose(sink);
+  }
+
+  if (sink->raw != NULL) {
+    fclose(sink->raw);
+  }
+  if (sink->video != NULL) {
+    sink->video->release();
+    delete sink->video;
+  }
+  for (int b = 0; b < SINK_BUFFERS; b++) {
+    poolRelease(sink->buffers[b]);
+  }
+  sink->started = 0;
+}
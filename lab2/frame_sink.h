@@ -0,0 +1,79 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "spsc_ring.h"
+
+// Where processed frames go. The window sink is the original imshow +
+// cvWaitKey(10) path and needs an X display. The others need no GUI:
+//   null         frames are dropped (pure compute throughput)
+//   raw:<path>   frames are appended to <path> as packed 8-bit rows
+//   mmap:<path>  the same file, written through a shared mapping of it on
+//                the calling thread: no writer thread, no write(2) per frame
+//   video:<path> frames are encoded to <path> (MJPG) with cv::VideoWriter
+//   edges:<path> frames are thresholded at --edge-threshold and appended to
+//                <path> as bit packed or run length encoded edge maps, with
+//                a frame index (see edge_map.h)
+// raw, video and edges writes happen on a background writer thread;
+// sink_write only copies the frame into one of SINK_BUFFERS buffers taken
+// from the frame pool when the first frame arrives. For edges that copy is
+// the edge_row kernel, so only the packed map (an eighth of the frame) is
+// handed over.
+enum sink_type_t { SINK_WINDOW, SINK_NULL, SINK_RAW, SINK_VIDEO, SINK_MMAP, SINK_EDGES };
+
+#define SINK_BUFFERS 4
+// Frames mapped at a time by the mmap sink; the file grows by this much
+#define SINK_MAP_FRAMES 8
+
+struct frame_sink_t {
+  sink_type_t type;
+  const char *path;
+  const char *window;
+
+  // background writer (raw, video and edges)
+  int started;
+  pthread_t thread;
+  FILE *raw;                       // also the edges file
+  cv::VideoWriter *video;
+  double fps;
+  cv::Mat buffers[SINK_BUFFERS];
+  cv::Mat last;                    // end of stream marker
+  spsc_ring_t to_writer, to_free;
+
+  // mmap sink: the mapped window [map_off, map_off + map_len) of the file
+  int fd;
+  unsigned char *map;
+  size_t map_off, map_len;
+  size_t written;                  // bytes of frames in the file
+
+  // edges sink
+  int threshold;
+  int edge_width, edge_height;     // frame size in the file header
+  unsigned char *rle;              // writer's RLE scratch, one bitmap in size
+  uint64_t *index;                 // file offset of each frame record
+  unsigned long index_len, index_cap;
+  uint64_t offset;                 // bytes written to the file
+
+  unsigned long frames;
+};
+
+// Parse a sink spec ("window", "null", "raw:<path>", "mmap:<path>", "video:<path>",
+// "edges:<path>").
+// Returns 0 on success, -1 if the spec is invalid.
+int sink_open(frame_sink_t *sink, const char *spec, double fps);
+
+// Hand one frame to the sink
+void sink_write(frame_sink_t *sink, cv::Mat& frame);
+
+// Key pressed in the window (cvWaitKey(10)) for the window sink. The other
+// sinks return -1 right away instead of sleeping.
+int sink_poll_key(frame_sink_t *sink);
+
+// Flush queued frames, stop the writer and close files
+void sink_close(frame_sink_t *sink);
+
+#endif
@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "frame_pool.h"
+#include "frame_source.h"
+
+using namespace cv;
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME"
+
+// Path of a y4m spec, or NULL if the spec is not one
+static const char *y4mPath(const char *spec)
+{
+  size_t len = strlen(spec);
+
+  if (strncmp(spec, "y4m:", 4) == 0) {
+    return spec + 4;
+  }
+  if (len > 4 && strcmp(spec + len - 4, ".y4m") == 0) {
+    return spec;
+  }
+  return NULL;
+}
+
+int source_is_luma(const char *spec)
+{
+  return spec != NULL && (y4mPath(spec) != NULL || strncmp(spec, "yuv:", 4) == 0 ||
+                          strncmp(spec, "v4l2:", 5) == 0);
+}
+
+int source_bits(const char *spec)
+{
+  frame_source_t s;
+
+  if (spec == NULL) {
+    return 8;
+  }
+  if (strncmp(spec, "raw16:", 6) == 0) {
+    return 16;
+  }
+  if (y4mPath(spec) == NULL) {
+    return 8;
+  }
+  source_open(&s, spec);
+  source_close(&s);
+  return s.bits;
+}
+
+static void mapFile(frame_source_t *s)
+{
+  struct stat st;
+  int fd = open(s->path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    err(1, "Cannot open %s", s->path);
+  }
+  s->size = st.st_size;
+  if (s->size > 0) {
+    s->map = (unsigned char *)mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s->map == MAP_FAILED) {
+      err(1, "Cannot map %s", s->path);
+    }
+    madvise(s->map, s->size, MADV_SEQUENTIAL); // read ahead of the frame being processed
+  }
+  close(fd);
+}
+
+/*******************************************
+ * Model: y4mHeader
+ * Input: source with the file mapped
+ * Output: None directly. Sets the frame geometry and rate
+ * Desc: Parses the stream header line. Only the tags that matter to
+ *  finding the planes are used; interlacing, aspect and X tags are
+ *  skipped. Layouts above 8 bits (C420p10, Cmono12, ...) store every
+ *  sample in 16 bits, little endian. Alpha layouts are refused.
+ ********************************************/
+static void y4mHeader(frame_source_t *s)
+{
+  const char *end = s->map ? (const char *)memchr(s->map, '\n', s->size) : NULL;
+  char header[1024], chroma[32] = "420";
+  int num = 0, den = 1;
+
+  if (end == NULL || s->size < strlen(Y4M_MAGIC) || memcmp(s->map, Y4M_MAGIC, strlen(Y4M_MAGIC)) != 0) {
+    errx(1, "%s is not a YUV4MPEG2 file", s->path);
+  }
+  snprintf(header, sizeof(header), "%.*s", (int)(end - (const char *)s->map), (const char *)s->map);
+  s->pos = end + 1 - (const char *)s->map;
+
+  char *save = NULL;
+  for (char *tag = strtok_r(header, " ", &save); tag != NULL; tag = strtok_r(NULL, " ", &save)) {
+    switch (tag[0]) {
+      case 'W': s->width = atoi(tag + 1); break;
+      case 'H': s->height = atoi(tag + 1); break;
+      case 'F': sscanf(tag + 1, "%d:%d", &num, &den); break;
+      case 'C': snprintf(chroma, sizeof(chroma), "%s", tag + 1); break;
+    }
+  }
+  if (s->width <= 0 || s->height <= 0) {
+    errx(1, "%s: missing or invalid frame size", s->path);
+  }
+  s->fps = num > 0 && den > 0 ? (double)num / den : 0;
+
+  // Depth suffix: 420p10, 444p16, mono12, ... (not the p of 420jpeg)
+  char *suffix = strncmp(chroma, "mono", 4) == 0 ? chroma + 4 : strchr(chroma, 'p');
+  s->bits = 8;
+  if (suffix != NULL && isdigit(suffix[*suffix == 'p'])) {
+    s->bits = atoi(suffix + (*suffix == 'p'));
+    if (s->bits < 9 || s->bits > 16) {
+      errx(1, "%s: unsupported sample depth in C%s (8 to 16 bits only)", s->path, chroma);
+    }
+    *suffix = '\0';
+  }
+
+  size_t luma = (size_t)s->width * s->height;
+  size_t cw = (s->width + 1) / 2, ch = (s->height + 1) / 2;
+  if (strcmp(chroma, "420") == 0 || strcmp(chroma, "420jpeg") == 0 ||
+      strcmp(chroma, "420paldv") == 0 || strcmp(chroma, "420mpeg2") == 0) {
+    s->frame_bytes = luma + 2 * cw * ch;
+  } else if (strcmp(chroma, "422") == 0) {
+    s->frame_bytes = luma + 2 * cw * s->height;
+  } else if (strcmp(chroma, "444") == 0) {
+    s->frame_bytes = 3 * luma;
+  } else if (strcmp(chroma, "mono") == 0) {
+    s->frame_bytes = luma;
+  } else {
+    errx(1, "%s: unsupported colour space C%s (420, 422, 444 or mono only)", s->path, chroma);
+  }
+  if (s->bits > 8) {
+    s->frame_bytes *= 2;
+  }
+}
+
+// Bytes per Y row, or per packed row for YUYV (two pixels in four bytes)
+static size_t yuvStride(yuv_layout_t layout, int width)
+{
+  return layout == YUV_YUYV ? 4 * (size_t)((width + 1) / 2) : width;
+}
+
+// Every plane of one frame
+static size_t yuvFrameBytes(yuv_layout_t layout, int width, int height)
+{
+  if (layout == YUV_YUYV) {
+    return yuvStride(layout, width) * height;
+  }
+  return (size_t)width * height + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+}
+
+static void yuvOpen(frame_source_t *s, const char *spec)
+{
+  char layout[8];
+  int n = 0;
+
+  if (sscanf(spec + 4, "%dx%d:%7[a-z0-9]:%n", &s->width, &s->height, layout, &n) != 3 || n == 0 ||
+      s->width <= 0 || s->height <= 0 || spec[4 + n] == '\0') {
+    errx(1, "Invalid YUV input: %s (expected yuv:<W>x<H>:<i420|nv12|yuyv>:<path>)", spec);
+  }
+  if (strcmp(layout, "i420") == 0) {
+    s->layout = YUV_I420;
+  } else if (strcmp(layout, "nv12") == 0) {
+    s->layout = YUV_NV12;
+  } else if (strcmp(layout, "yuyv") == 0) {
+    s->layout = YUV_YUYV;
+  } else {
+    errx(1, "Unknown YUV layout %s (i420, nv12 or yuyv)", layout);
+  }
+  s->path = spec + 4 + n;
+  s->stride = yuvStride(s->layout, s->width);
+  s->frame_bytes = yuvFrameBytes(s->layout, s->width, s->height);
+  mapFile(s);
+}
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+  int ret;
+
+  do {
+    ret = ioctl(fd, req, arg);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/*******************************************
+ * Model: v4l2Open
+ * Input: source, with path set to the device
+ * Output: None directly. The device is streaming into s->bufs
+ * Desc: Negotiates the first of NV12, YUV420 and YUYV the driver accepts,
+ *  at the -r size if one was given (the driver may round it), then queues
+ *  V4L2_BUFFERS mmap'd buffers and starts streaming. The driver's
+ *  bytesperline becomes the Y stride.
+ ********************************************/
+static void v4l2Open(frame_source_t *s)
+{
+  static const struct { __u32 fourcc; yuv_layout_t layout; } formats[] = {
+    { V4L2_PIX_FMT_NV12, YUV_NV12 },
+    { V4L2_PIX_FMT_YUV420, YUV_I420 },
+    { V4L2_PIX_FMT_YUYV, YUV_YUYV },
+  };
+  struct v4l2_capability cap;
+  struct v4l2_format fmt;
+  size_t f;
+
+  s->fd = open(s->path, O_RDWR);
+  if (s->fd < 0) {
+    err(1, "Cannot open %s", s->path);
+  }
+  memset(&cap, 0, sizeof(cap));
+  if (xioctl(s->fd, VIDIOC_QUERYCAP, &cap) != 0) {
+    err(1, "%s is not a V4L2 device", s->path);
+  }
+  __u32 caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+    errx(1, "%s cannot stream video capture", s->path);
+  }
+
+  for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(s->fd, VIDIOC_G_FMT, &fmt) != 0) {
+      err(1, "%s: VIDIOC_G_FMT", s->path);
+    }
+    if (opts.capWidth > 0) {
+      fmt.fmt.pix.width = opts.capWidth;
+      fmt.fmt.pix.height = opts.capHeight;
+    }
+    fmt.fmt.pix.pixelformat = formats[f].fourcc;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(s->fd, VIDIOC_S_FMT, &fmt) == 0 && fmt.fmt.pix.pixelformat == formats[f].fourcc) {
+      break;
+    }
+  }
+  if (f == sizeof(formats) / sizeof(formats[0])) {
+    errx(1, "%s offers none of NV12, YUV420 or YUYV", s->path);
+  }
+  s->layout = formats[f].layout;
+  s->width = fmt.fmt.pix.width;
+  s->height = fmt.fmt.pix.height;
+  s->stride = fmt.fmt.pix.bytesperline;
+  if (s->stride < yuvStride(s->layout, s->width)) {
+    s->stride = yuvStride(s->layout, s->width);
+  }
+
+  struct v4l2_streamparm parm;
+  memset(&parm, 0, sizeof(parm));
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(s->fd, VIDIOC_G_PARM, &parm) == 0 && parm.parm.capture.timeperframe.numerator > 0) {
+    s->fps = (double)parm.parm.capture.timeperframe.denominator / parm.parm.capture.timeperframe.numerator;
+  }
+
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof(req));
+  req.count = V4L2_BUFFERS;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(s->fd, VIDIOC_REQBUFS, &req) != 0 || req.count < 2) {
+    errx(1, "%s: cannot get capture buffers", s->path);
+  }
+  s->nbufs = req.count < V4L2_BUFFERS ? req.count : V4L2_BUFFERS;
+  for (int b = 0; b < s->nbufs; b++) {
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = b;
+    if (xioctl(s->fd, VIDIOC_QUERYBUF, &buf) != 0) {
+      err(1, "%s: VIDIOC_QUERYBUF", s->path);
+    }
+    if (buf.length < s->stride * s->height) {
+      errx(1, "%s: capture buffer too small for %dx%d frames", s->path, s->width, s->height);
+    }
+    s->buf_len[b] = buf.length;
+    s->bufs[b] = (unsigned char *)mmap(NULL, buf.length, PROT_READ, MAP_SHARED, s->fd, buf.m.offset);
+    if (s->bufs[b] == MAP_FAILED) {
+      err(1, "Cannot map %s buffer %d", s->path, b);
+    }
+    if (xioctl(s->fd, VIDIOC_QBUF, &buf) != 0) {
+      err(1, "%s: VIDIOC_QBUF", s->path);
+    }
+  }
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(s->fd, VIDIOC_STREAMON, &type) != 0) {
+    err(1, "%s: VIDIOC_STREAMON", s->path);
+  }
+}
+
+/*******************************************
+ * Model: openCapture
+ * Input: video file, or NULL for the input picked by opts
+ * Output: the opened capture
+ * Desc: Opens the webcam or video file. The frame size is whatever the
+ *  source delivers unless -r asked the device for a specific one.
+ ********************************************/
+CvCapture *openCapture(const char *videoFile)
+{
+  CvCapture* video_cap;
+
+  if (videoFile == NULL && opts.webcam) {
+    video_cap = cvCreateCameraCapture(-1);
+  } else {
+    if (videoFile == NULL) {
+      videoFile = opts.videoFile;
+    }
+    video_cap = cvCreateFileCapture(videoFile);
+  }
+  if (video_cap == NULL) {
+    errx(1, "Cannot open %s", videoFile == NULL ? "webcam" : videoFile);
+  }
+  if (opts.capWidth > 0) {
+    cvSetCaptureProperty(video_cap, CV_CAP_PROP_FRAME_WIDTH, opts.capWidth);
+    cvSetCaptureProperty(video_cap, CV_CAP_PROP_FRAME_HEIGHT, opts.capHeight);
+  }
+  return video_cap;
+}
+
+void source_open(frame_source_t *s, const char *spec)
+{
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  s->held = -1;
+  if (spec == NULL && !opts.webcam) {
+    spec = opts.videoFile;
+  }
+
+  s->bits = 8;
+  if (spec != NULL && (strncmp(spec, "raw:", 4) == 0 || strncmp(spec, "raw16:", 6) == 0)) {
+    int n = 0, prefix = spec[3] == ':' ? 4 : 6;
+    s->type = SOURCE_RAW;
+    s->bits = prefix == 4 ? 8 : 16;
+    if (sscanf(spec + prefix, "%dx%d:%n", &s->width, &s->height, &n) != 2 || n == 0 ||
+        s->width <= 0 || s->height <= 0 || spec[prefix + n] == '\0') {
+      errx(1, "Invalid raw input: %s (expected %.*s<W>x<H>:<path>)", spec, prefix, spec);
+    }
+    s->path = spec + prefix + n;
+    s->frame_bytes = (size_t)s->width * s->height * 3 * (s->bits > 8 ? 2 : 1);
+    mapFile(s);
+  } else if (spec != NULL && y4mPath(spec) != NULL) {
+    s->type = SOURCE_Y4M;
+    s->path = y4mPath(spec);
+    mapFile(s);
+    y4mHeader(s);
+  } else if (spec != NULL && strncmp(spec, "yuv:", 4) == 0) {
+    s->type = SOURCE_YUV;
+    yuvOpen(s, spec);
+  } else if (spec != NULL && strncmp(spec, "v4l2:", 5) == 0) {
+    s->type = SOURCE_V4L2;
+    s->path = spec + 5;
+    v4l2Open(s);
+  } else {
+    s->type = SOURCE_CAPTURE;
+    s->path = spec;
+    s->cap = openCapture(spec);
+    s->fps = cvGetCaptureProperty(s->cap, CV_CAP_PROP_FPS);
+  }
+}
+
+// Points frame at the Y plane of a YUV frame starting at `base`, or for
+// YUYV unpacks the Y samples into the source's gray buffer
+static void lumaFrame(frame_source_t *s, const unsigned char *base, Mat& frame)
+{
+  if (s->layout != YUV_YUYV) {
+    frame = Mat(s->height, s->width, CV_8UC1, (void *)base, s->stride);
+    return;
+  }
+  size_t stride = fpool_stride(s->width);
+  if (s->luma == NULL) {
+    s->luma = (unsigned char *)fpool_acquire(stride * s->height);
+  }
+  for (int i = 0; i < s->height; i++) {
+    kernels->luma_row(base + i * s->stride, s->luma + i * stride, s->width);
+  }
+  frame = Mat(s->height, s->width, CV_8UC1, s->luma, stride);
+}
+
+// Gives the previous frame's buffer back to the driver and waits for the next
+static void v4l2Read(frame_source_t *s, Mat& frame)
+{
+  struct v4l2_buffer buf;
+
+  memset(&buf, 0, sizeof(buf));
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = V4L2_MEMORY_MMAP;
+  if (s->held >= 0) {
+    buf.index = s->held;
+    s->held = -1;
+    if (xioctl(s->fd, VIDIOC_QBUF, &buf) != 0) {
+      warn("%s: VIDIOC_QBUF", s->path);
+      return;
+    }
+  }
+  if (xioctl(s->fd, VIDIOC_DQBUF, &buf) != 0) {
+    warn("%s: VIDIOC_DQBUF", s->path);
+    return;
+  }
+  s->held = buf.index;
+  lumaFrame(s, s->bufs[buf.index], frame);
+}
+
+/*******************************************
+ * Model: source_read
+ * Input: source, Mat to point at the frame
+ * Output: None directly. frame is the next frame or empty
+ * Desc: Decodes the next frame from a capture, or points frame at the next
+ *  one in the mapped file or driver buffer. A truncated last frame ends the
+ *  input, as does a V4L2 device that stops delivering.
+ ********************************************/
+void source_read(frame_source_t *s, Mat& frame)
+{
+  size_t start = s->pos;
+
+  if (s->type == SOURCE_CAPTURE) {
+    frame = cvQueryFrame(s->cap);
+    return;
+  }
+
+  frame = Mat();
+  if (s->type == SOURCE_V4L2) {
+    v4l2Read(s, frame);
+    return;
+  }
+  if (s->type == SOURCE_Y4M) {
+    // FRAME, optional per frame tags, newline
+    if (s->size - s->pos < strlen(Y4M_FRAME) || memcmp(s->map + s->pos, Y4M_FRAME, strlen(Y4M_FRAME)) != 0) {
+      return;
+    }
+    const unsigned char *nl = (const unsigned char *)memchr(s->map + s->pos, '\n', s->size - s->pos);
+    if (nl == NULL) {
+      return;
+    }
+    start = nl + 1 - s->map;
+  }
+  if (s->size - start < s->frame_bytes) {
+    return;
+  }
+
+  if (s->type == SOURCE_YUV) {
+    lumaFrame(s, s->map + start, frame);
+  } else {
+    int channels = s->type == SOURCE_Y4M ? 1 : 3;
+    frame = Mat(s->height, s->width, CV_MAKETYPE(s->bits > 8 ? CV_16U : CV_8U, channels), s->map + start);
+  }
+  s->pos = start + s->frame_bytes;
+}
+
+int source_frames_persist(const frame_source_t *s)
+{
+  switch (s->type) {
+    case SOURCE_RAW:
+    case SOURCE_Y4M:
+      return 1;
+    case SOURCE_YUV:
+      return s->layout != YUV_YUYV;
+    default:
+      return 0;
+  }
+}
+
+void source_close(frame_source_t *s)
+{
+  if (s->cap != NULL) {
+    cvReleaseCapture(&s->cap);
+  }
+  if (s->map != NULL) {
+    munmap(s->map, s->size);
+    s->map = NULL;
+  }
+  if (s->fd >= 0) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(s->fd, VIDIOC_STREAMOFF, &type);
+    for (int b = 0; b < s->nbufs; b++) {
+      munmap(s->bufs[b], s->buf_len[b]);
+    }
+    close(s->fd);
+    s->fd = -1;
+  }
+  if (s->luma != NULL) {
+    fpool_release(s->luma);
+    s->luma = NULL;
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stddef.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+// Where input frames come from. By default an input is opened with
+// cvCreateFileCapture (or the webcam) and every frame is decoded. For
+// benchmarking and replaying archives two uncompressed formats are read
+// through mmap instead, with no decode and no copy: the frame handed out is
+// a view straight into the mapped file.
+//   raw:<W>x<H>:<path>  packed 8-bit BGR frames of W x H, back to back
+//   raw16:<W>x<H>:<path> the same with 16-bit little endian samples
+//                       (CV_16UC3), e.g. 10 or 12-bit camera data
+//   <path>.y4m          YUV4MPEG2 (C420*, C422, C444 or Cmono, or their
+//   y4m:<path>          10 to 16-bit forms such as C420p12 and Cmono16).
+//                       The frame handed out is the Y plane (CV_8UC1, or
+//                       CV_16UC1 above 8 bits), which is used as the gray
+//                       frame, so the grayscale pass is skipped.
+// 16-bit frames go through the gray16_row/sobel16_row kernels and give
+// 16-bit output frames.
+//   yuv:<W>x<H>:<layout>:<path>
+//                       headerless YUV frames of W x H as decoders and
+//                       cameras produce them: i420 (planar 4:2:0), nv12 (Y
+//                       plane, interleaved UV plane) or yuyv (packed 4:2:2)
+// Cameras can be read the same way, skipping OpenCV's conversion to BGR:
+//   v4l2:<device>       V4L2 capture (e.g. v4l2:/dev/video0) streaming into
+//                       mmap'd driver buffers, in NV12, YUV420 or YUYV,
+//                       whichever the device offers first. -r sets the size.
+// Every YUV source hands out the Y plane as the gray frame, with the plane's
+// own row stride, so neither colour conversion is done. For the planar
+// layouts that is a view into the file or driver buffer; YUYV rows are
+// de-interleaved into a pooled buffer with the backend's luma_row kernel.
+// Mapped file frames are read only and stay valid until source_close. A
+// V4L2 frame stays valid until the next source_read, which gives its buffer
+// back to the driver, the same contract as cvQueryFrame.
+enum source_type_t { SOURCE_CAPTURE, SOURCE_RAW, SOURCE_Y4M, SOURCE_YUV, SOURCE_V4L2 };
+enum yuv_layout_t { YUV_I420, YUV_NV12, YUV_YUYV };
+
+#define V4L2_BUFFERS 4
+
+struct frame_source_t {
+  source_type_t type;
+  const char *path;
+  CvCapture *cap;
+  double fps;           // 0 if the input does not say
+
+  // mmap sources
+  unsigned char *map;
+  size_t size;
+  size_t pos;           // offset of the next frame (its FRAME line for Y4M)
+  int width, height;
+  int bits;             // significant bits per sample, 8 to 16
+  size_t frame_bytes;   // every plane of one frame
+
+  // YUV sources
+  yuv_layout_t layout;
+  size_t stride;        // bytes per Y row (per YUYV row for yuyv)
+  unsigned char *luma;  // pooled gray frame YUYV is unpacked into
+
+  // V4L2
+  int fd;
+  unsigned char *bufs[V4L2_BUFFERS];
+  size_t buf_len[V4L2_BUFFERS];
+  int nbufs;
+  int held;             // buffer behind the last frame, -1 if none
+};
+
+// Open an input spec as above, or the input picked by opts for NULL.
+// Exits with a message if it cannot be opened.
+void source_open(frame_source_t *s, const char *spec = NULL);
+
+// Next frame, or an empty Mat at the end of the input
+void source_read(frame_source_t *s, cv::Mat& frame);
+
+// Whether every frame stays valid until source_close (views into a mapped
+// file), so several can be held at once without copying them. Not for
+// decoded or V4L2 frames, nor YUYV, whose buffers are reused.
+int source_frames_persist(const frame_source_t *s);
+
+void source_close(frame_source_t *s);
+
+// Whether the spec delivers gray (luma) frames rather than BGR
+int source_is_luma(const char *spec);
+
+// Bits per sample the spec delivers (8 for anything decoded by OpenCV). A
+// Y4M file is opened to read its header.
+int source_bits(const char *spec);
+
+#endif
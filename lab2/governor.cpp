@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "sobel_alg.h"
+#include "governor.h"
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// CPU a thread last ran on: field 39 of its stat line, counted after the
+// parenthesised command name, which may itself hold spaces. -1 if unknown.
+static int lastCpu(pid_t tid)
+{
+  char path[64], line[1024];
+  int cpu = -1;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fgets(line, sizeof(line), f) != NULL) {
+    char *p = strrchr(line, ')');
+    for (int field = 2; p != NULL && field < 39; field++) {
+      p = strchr(p + 1, ' ');
+    }
+    if (p != NULL) {
+      cpu = atoi(p + 1);
+    }
+  }
+  fclose(f);
+  return cpu;
+}
+
+// Current clock of a CPU in Hz from cpufreq, 0 if the host does not say
+static double cpuFreq(int cpu)
+{
+  char path[96];
+  long khz = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%ld", &khz) != 1) {
+    khz = 0;
+  }
+  fclose(f);
+  return khz * 1e3;
+}
+
+// Mean clock of the CPUs the active workers last ran on
+static void sampleFreq(governor_t *gov, thread_pool_t *pool)
+{
+  double sum = 0;
+  int n = 0;
+
+  for (int w = 0; w < gov->active; w++) {
+    int cpu = lastCpu(pool->tids[w]);
+    double hz = cpu >= 0 ? cpuFreq(cpu) : 0;
+    if (hz > 0) {
+      sum += hz;
+      n++;
+    }
+  }
+  gov->freq_sysfs = n > 0;
+  gov->freq_hz = n > 0 ? sum / n : PROC_FREQ;
+}
+
+void gov_init(governor_t *gov, thread_pool_t *pool, double target_fps)
+{
+  memset(gov, 0, sizeof(*gov));
+  gov->target_fps = target_fps;
+  gov->budget_ns = 1e9 / target_fps;
+  // Start wide so the first frames make the rate, then shed workers
+  gov->active = pool->active;
+  gov->hold = GOV_HOLD;
+  gov->start_ns = gov->next_ns = gov->end_ns = now_ns();
+  sampleFreq(gov, pool);
+}
+
+/*******************************************
+ * Model: gov_end_frame
+ * Input: governor, pool, time of the frame's serial and banded phases
+ * Output: None
+ * Desc: Charges the frame's energy, updates the moving averages, changes
+ *  the active worker count by at most one (see governor.h) and sleeps
+ *  until the next frame is due. A frame that finishes past its deadline is
+ *  counted late; one more than a whole frame late restarts the schedule
+ *  from now rather than running the following frames back to back to
+ *  catch up.
+ ********************************************/
+void gov_end_frame(governor_t *gov, thread_pool_t *pool, double serial_ns, double banded_ns)
+{
+  double busy_ns = serial_ns + banded_ns * gov->active;
+
+  gov->energy_j += PROC_EPC * (gov->freq_hz / PROC_FREQ) * busy_ns / 1e9;
+  gov->worker_frames += gov->active;
+  gov->freq_sum += gov->freq_hz;
+  if (gov->frames++ == 0) {
+    gov->serial_ns = serial_ns;
+    gov->work_ns = banded_ns * gov->active;
+  } else {
+    gov->serial_ns += GOV_ALPHA * (serial_ns - gov->serial_ns);
+    gov->work_ns += GOV_ALPHA * (banded_ns * gov->active - gov->work_ns);
+  }
+
+  if (gov->hold > 0) {
+    gov->hold--;
+  } else {
+    int n = gov->active;
+    double frame_ns = gov->serial_ns + gov->work_ns / n;
+    if (frame_ns > GOV_HIGH * gov->budget_ns && n < pool->nthreads) {
+      n++;
+    } else if (n > 1 && gov->serial_ns + gov->work_ns / (n - 1) < GOV_LOW * gov->budget_ns) {
+      n--;
+    }
+    if (n != gov->active) {
+      pool_set_active(pool, n);
+      gov->active = n;
+      gov->changes++;
+      gov->hold = GOV_HOLD;
+    }
+  }
+  if (gov->frames % GOV_HOLD == 0) {
+    sampleFreq(gov, pool);
+  }
+
+  // Pace to the target
+  double now = now_ns();
+  gov->next_ns += gov->budget_ns;
+  if (now > gov->next_ns) {
+    gov->late++;
+    if (now > gov->next_ns + gov->budget_ns) {
+      gov->next_ns = now;
+    }
+  } else {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(gov->next_ns / 1e9);
+    ts.tv_nsec = (long)(gov->next_ns - ts.tv_sec * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+    now = now_ns();
+  }
+  gov->end_ns = now;
+}
+
+double gov_fps(const governor_t *gov)
+{
+  double elapsed = gov->end_ns - gov->start_ns;
+  return elapsed > 0 ? gov->frames * 1e9 / elapsed : 0;
+}
+
+double gov_energy_per_frame(const governor_t *gov)
+{
+  return gov->frames ? gov->energy_j / gov->frames : 0;
+}
+
+void gov_report(const governor_t *gov, std::ostream &out)
+{
+  double frames = gov->frames ? gov->frames : 1;
+  out << "Target FPS, " << gov->target_fps << std::endl;
+  out << "Late frames, " << gov->late << std::endl;
+  out << "Active workers (mean), " << gov->worker_frames / frames << std::endl;
+  out << "Active workers (last), " << gov->active << std::endl;
+  out << "Worker count changes, " << gov->changes << std::endl;
+  out << "CPU clock (MHz), " << gov->freq_sum / frames / 1e6
+      << (gov->freq_sysfs ? "" : " (nominal, no cpufreq)") << std::endl;
+}
@@ -0,0 +1,66 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <ostream>
+#include "thread_pool.h"
+
+// Frame rate governor (--target-fps, -m only). Instead of running every
+// frame as fast as the pool allows, frames are paced to the target rate and
+// the number of active workers (pool_set_active) is kept at the fewest that
+// still meet it; parked workers and the paced gaps leave the cores idle.
+//
+// Each frame reports the time of its serial phases (capture, output, on the
+// calling thread only) and of its banded phases (gray, Sobel, on every
+// active worker). Their moving averages predict the frame time on k
+// workers as serial + banded * active / k. A worker is added when the
+// measured frame time exceeds GOV_HIGH of the frame budget and removed when
+// the prediction for one fewer is below GOV_LOW of it; after a change the
+// count is held for GOV_HOLD frames so the averages settle.
+//
+// Energy is estimated per frame from the same PROC_EPC per core figure the
+// reports use, but charged only for the core time actually busy (the
+// calling thread for the whole frame, the other active workers for the
+// banded phases) and scaled by the clock the active workers' CPUs run at,
+// read from cpufreq in sysfs (PROC_FREQ where that is not available). Idle
+// and parked cores are assumed to cost nothing.
+
+#define GOV_HIGH 0.95
+#define GOV_LOW 0.8
+#define GOV_HOLD 8
+#define GOV_ALPHA 0.25 // weight of the newest frame in the moving averages
+
+struct governor_t {
+  double target_fps;
+  double budget_ns;     // 1e9 / target_fps
+  int active;           // workers taking jobs
+  int hold;             // frames left before the next change
+  double serial_ns;     // moving averages per frame
+  double work_ns;       // banded phases in worker-ns (time * active workers)
+  double start_ns;      // first frame, and the deadline of the next one
+  double next_ns;
+  double freq_hz;       // clock of the active workers' CPUs
+  int freq_sysfs;       // freq_hz was read from cpufreq, not assumed
+
+  // Totals for the report
+  unsigned long frames, changes, late;
+  double worker_frames; // active workers summed over the frames
+  double freq_sum;      // freq_hz summed over the frames
+  double energy_j;
+  double end_ns;
+};
+
+void gov_init(governor_t *gov, thread_pool_t *pool, double target_fps);
+
+// Account a finished frame, adjust the active workers and sleep until the
+// next frame is due
+void gov_end_frame(governor_t *gov, thread_pool_t *pool, double serial_ns, double banded_ns);
+
+// Frames per second over the wall clock since the first frame
+double gov_fps(const governor_t *gov);
+
+// Estimated energy per frame in joules (see above)
+double gov_energy_per_frame(const governor_t *gov);
+
+void gov_report(const governor_t *gov, std::ostream &out);
+
+#endif
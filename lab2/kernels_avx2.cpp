@@ -0,0 +1,363 @@
+#include "sobel_kernels.h"
+#include "conv_engine.h"
+
+// Built with -mavx2 (see Makefile). Only reached when the CPU reports AVX2.
+#if defined(__x86_64__) || defined(__i386__)
+#include <string.h>
+#include <immintrin.h>
+
+static int avx2_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+// Two unaligned 16 byte loads, `lo` into the low lane and `hi` into the high one
+static inline __m256i load_lanes(const uint8_t *lo, const uint8_t *hi)
+{
+  return _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+      _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+/*******************************************
+ * Model: gray_row_avx2
+ * Input: BGR row of `width` pixels
+ * Output: None directly. Writes the gray row
+ * Desc: Same shuffle + multiply-add scheme as the SSE4 kernel, with each
+ *  128-bit lane handling its own 4 pixel group. A final cross-lane
+ *  permute puts the 32 results back in order.
+ ********************************************/
+static void gray_row_avx2(const uint8_t *bgr, uint8_t *gray, int width)
+{
+  const __m256i shuf = _mm256_setr_epi8(0, 1, 3, 4, 6, 7, 9, 10, 2, -1, 5, -1, 8, -1, 11, -1,
+                                        0, 1, 3, 4, 6, 7, 9, 10, 2, -1, 5, -1, 8, -1, 11, -1);
+  const __m256i coef = _mm256_setr_epi8(7, 38, 7, 38, 7, 38, 7, 38, 19, 0, 19, 0, 19, 0, 19, 0,
+                                        7, 38, 7, 38, 7, 38, 7, 38, 19, 0, 19, 0, 19, 0, 19, 0);
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int i = 0;
+
+  // The last load of an iteration reads bytes 84..99, so stop 34 pixels
+  // short of the end to stay inside the row
+  for (; i + 34 <= width; i += 32) {
+    const uint8_t *p = &bgr[i * 3];
+    // lane 0 gets pixels 0-3, 8-11, ... and lane 1 gets 4-7, 12-15, ...
+    __m256i ma = _mm256_maddubs_epi16(_mm256_shuffle_epi8(load_lanes(p, p + 12), shuf), coef);
+    __m256i mb = _mm256_maddubs_epi16(_mm256_shuffle_epi8(load_lanes(p + 24, p + 36), shuf), coef);
+    __m256i mc = _mm256_maddubs_epi16(_mm256_shuffle_epi8(load_lanes(p + 48, p + 60), shuf), coef);
+    __m256i md = _mm256_maddubs_epi16(_mm256_shuffle_epi8(load_lanes(p + 72, p + 84), shuf), coef);
+
+    __m256i yab = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(ma, mb),
+                                                     _mm256_unpackhi_epi64(ma, mb)), 6);
+    __m256i ycd = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(mc, md),
+                                                     _mm256_unpackhi_epi64(mc, md)), 6);
+
+    __m256i y = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(yab, ycd), order);
+    _mm256_storeu_si256((__m256i *)&gray[i], y);
+  }
+
+  gray_span_scalar(bgr, gray, i, width);
+}
+
+// |Gx| + |Gy| for 16 pixels given the eight neighbours widened to 16 bits
+static inline __m256i sobel_mag_avx2(__m256i p00, __m256i p01, __m256i p02,
+                                     __m256i p10, __m256i p12,
+                                     __m256i p20, __m256i p21, __m256i p22)
+{
+  __m256i gx = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(p02, p00), _mm256_sub_epi16(p22, p20)),
+                                _mm256_slli_epi16(_mm256_sub_epi16(p12, p10), 1));
+  __m256i gy = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(p20, p00), _mm256_sub_epi16(p22, p02)),
+                                _mm256_slli_epi16(_mm256_sub_epi16(p21, p01), 1));
+  return _mm256_add_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+}
+
+// 16 gray pixels widened to 16-bit lanes
+static inline __m256i widen16(const uint8_t *p)
+{
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+/*******************************************
+ * Model: sobel_row_avx2
+ * Input: gray rows above, at and below the output row
+ * Output: None directly. Writes out[1 .. width-2]
+ * Desc: Sobel magnitude 32 pixels at a time
+ ********************************************/
+static void sobel_row_avx2(const uint8_t *above, const uint8_t *row,
+                           const uint8_t *below, uint8_t *out, int width)
+{
+  int j;
+
+  // loads reach j+32, which must stay <= width-1
+  for (j = 1; j <= width - 33; j += 32) {
+    __m256i lo = sobel_mag_avx2(
+        widen16(&above[j - 1]), widen16(&above[j]), widen16(&above[j + 1]),
+        widen16(&row[j - 1]), widen16(&row[j + 1]),
+        widen16(&below[j - 1]), widen16(&below[j]), widen16(&below[j + 1]));
+    __m256i hi = sobel_mag_avx2(
+        widen16(&above[j + 15]), widen16(&above[j + 16]), widen16(&above[j + 17]),
+        widen16(&row[j + 15]), widen16(&row[j + 17]),
+        widen16(&below[j + 15]), widen16(&below[j + 16]), widen16(&below[j + 17]));
+
+    // packus interleaves the lanes; 0xD8 swaps the middle quarters back
+    __m256i mag = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+    _mm256_storeu_si256((__m256i *)&out[j], mag);
+  }
+
+  sobel_span_scalar(above, row, below, out, j, width - 1);
+}
+
+// Sobel Gx and Gy for 16 pixels at `j`, in signed 16-bit lanes
+static inline void sobel_gxgy_avx2(const uint8_t *above, const uint8_t *row,
+                                   const uint8_t *below, int j, __m256i *gx, __m256i *gy)
+{
+  __m256i p00 = widen16(&above[j - 1]), p01 = widen16(&above[j]), p02 = widen16(&above[j + 1]);
+  __m256i p10 = widen16(&row[j - 1]), p12 = widen16(&row[j + 1]);
+  __m256i p20 = widen16(&below[j - 1]), p21 = widen16(&below[j]), p22 = widen16(&below[j + 1]);
+
+  *gx = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(p02, p00), _mm256_sub_epi16(p22, p20)),
+                         _mm256_slli_epi16(_mm256_sub_epi16(p12, p10), 1));
+  *gy = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(p20, p00), _mm256_sub_epi16(p22, p02)),
+                         _mm256_slli_epi16(_mm256_sub_epi16(p21, p01), 1));
+}
+
+// round(sqrt(s)) for 8 lanes, as grad_mag_sse4
+static inline __m256i grad_mag_avx2(__m256i s)
+{
+  const __m256i one = _mm256_set1_epi32(1);
+  __m256 f = _mm256_cvtepi32_ps(s);
+  __m256 r = _mm256_rsqrt_ps(_mm256_max_ps(f, _mm256_set1_ps(1.0f)));
+  __m256i m = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(f, r), _mm256_set1_ps(0.5f)));
+
+  __m256i sq = _mm256_mullo_epi32(m, m);
+  m = _mm256_add_epi32(m, _mm256_cmpgt_epi32(_mm256_add_epi32(_mm256_sub_epi32(sq, m), one), s));
+  sq = _mm256_mullo_epi32(m, m);
+  m = _mm256_sub_epi32(m, _mm256_cmpgt_epi32(s, _mm256_add_epi32(sq, m)));
+  return _mm256_max_epi32(m, _mm256_setzero_si256());
+}
+
+// Sector for 8 lanes of (|gx|, |gy|) pairs, as grad_sector_sse4
+static inline __m256i grad_sector_avx2(__m256i ab)
+{
+  const __m256i axis = _mm256_set1_epi32((int)(((uint32_t)0x8000 << 16) | GRAD_TAN22));
+  const __m256i diag = _mm256_set1_epi32((int)(((uint32_t)GRAD_TAN22 << 16) | 0x8000));
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i past_axis = _mm256_cmpgt_epi32(zero, _mm256_madd_epi16(ab, axis));
+  __m256i past_diag = _mm256_cmpgt_epi32(_mm256_madd_epi16(ab, diag), zero);
+  return _mm256_sub_epi32(_mm256_sub_epi32(zero, past_axis), past_diag);
+}
+
+/*******************************************
+ * Model: grad_row_avx2
+ * Input: gray rows above, at and below the output row
+ * Output: None directly. Writes mag[1 .. width-2] and ori[1 .. width-2]
+ * Desc: L2 magnitude and orientation bin 16 pixels at a time, same scheme
+ *  as the SSE4 kernel. The unpacks and packs both work within 128-bit
+ *  lanes, so the results come out in pixel order without a permute.
+ ********************************************/
+static void grad_row_avx2(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                          uint16_t *mag, uint8_t *ori, int width)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  int j;
+
+  // loads reach j+16, which must stay <= width-1
+  for (j = 1; j <= width - 17; j += 16) {
+    __m256i gx, gy;
+    sobel_gxgy_avx2(above, row, below, j, &gx, &gy);
+
+    __m256i g_lo = _mm256_unpacklo_epi16(gx, gy), g_hi = _mm256_unpackhi_epi16(gx, gy);
+    __m256i m = _mm256_packus_epi32(grad_mag_avx2(_mm256_madd_epi16(g_lo, g_lo)),
+                                    grad_mag_avx2(_mm256_madd_epi16(g_hi, g_hi)));
+    _mm256_storeu_si256((__m256i *)&mag[j], m);
+
+    __m256i a = _mm256_abs_epi16(gx), b = _mm256_abs_epi16(gy);
+    __m256i k = _mm256_packs_epi32(grad_sector_avx2(_mm256_unpacklo_epi16(a, b)),
+                                   grad_sector_avx2(_mm256_unpackhi_epi16(a, b)));
+    __m256i nx = _mm256_cmpgt_epi16(zero, gx), ny = _mm256_cmpgt_epi16(zero, gy);
+    __m256i flip = _mm256_xor_si256(nx, ny);
+    __m256i base = _mm256_or_si256(_mm256_and_si256(nx, _mm256_set1_epi16(4)),
+                                   _mm256_andnot_si256(nx, _mm256_and_si256(ny, _mm256_set1_epi16(8))));
+    __m256i bin = _mm256_add_epi16(base, _mm256_sub_epi16(_mm256_xor_si256(k, flip), flip));
+    bin = _mm256_and_si256(bin, _mm256_set1_epi16(GRAD_BINS - 1));
+    _mm_storeu_si128((__m128i *)&ori[j], _mm_packus_epi16(_mm256_castsi256_si128(bin),
+                                                          _mm256_extracti128_si256(bin, 1)));
+  }
+
+  grad_span_scalar(above, row, below, mag, ori, j, width - 1);
+}
+
+// Sum of absolute differences, 32 bytes per vpsadbw
+static uint32_t sad_row_avx2(const uint8_t *a, const uint8_t *b, int n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  int i;
+
+  for (i = 0; i + 32 <= n; i += 32) {
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)&a[i]),
+                                                _mm256_loadu_si256((const __m256i *)&b[i])));
+  }
+  // One partial sum in each 64-bit quarter
+  __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  uint32_t sad = _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2);
+  return sad + sad_span_scalar(a, b, i, n);
+}
+
+// 2x2 mean, 32 output pixels per iteration; packus works per 128-bit lane,
+// so the quarters are put back in order with a permute
+static void down_row_avx2(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int width)
+{
+  const __m256i ones = _mm256_set1_epi8(1);
+  const __m256i two = _mm256_set1_epi16(2);
+  int j;
+
+  for (j = 0; j + 32 <= width; j += 32) {
+    __m256i lo = _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *)&r0[2 * j]), ones),
+                                  _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *)&r1[2 * j]), ones));
+    __m256i hi = _mm256_add_epi16(_mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *)&r0[2 * j + 32]), ones),
+                                  _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i *)&r1[2 * j + 32]), ones));
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+    _mm256_storeu_si256((__m256i *)&out[j], packed);
+  }
+  down_span_scalar(r0, r1, out, j, width);
+}
+
+// B, G and R of the 4 pixels (12 samples) at p, in 32-bit lanes; see
+// bgr16_quad_sse4
+static inline void bgr16_quad_avx2(const uint16_t *p, __m128i *b, __m128i *g, __m128i *r)
+{
+  const __m128i b0 = _mm_setr_epi8(0, 1, -1, -1, 6, 7, -1, -1, 12, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, -1, -1);
+  const __m128i g0 = _mm_setr_epi8(2, 3, -1, -1, 8, 9, -1, -1, 14, 15, -1, -1, -1, -1, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, -1, -1);
+  const __m128i r0 = _mm_setr_epi8(4, 5, -1, -1, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, -1, 6, 7, -1, -1);
+  __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+  __m128i v1 = _mm_loadl_epi64((const __m128i *)(p + 8));
+
+  *b = _mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1));
+  *g = _mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1));
+  *r = _mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1));
+}
+
+// Gray of the 8 16-bit pixels at p, in 32-bit lanes
+static inline __m256i gray16_oct_avx2(const uint16_t *p)
+{
+  __m128i b0, g0, r0, b1, g1, r1;
+
+  bgr16_quad_avx2(p, &b0, &g0, &r0);
+  bgr16_quad_avx2(p + 12, &b1, &g1, &r1);
+  __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+  __m256i g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+  __m256i r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+  __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(7)),
+                                                  _mm256_mullo_epi32(g, _mm256_set1_epi32(38))),
+                                 _mm256_mullo_epi32(r, _mm256_set1_epi32(19)));
+  return _mm256_srli_epi32(sum, 6);
+}
+
+// gray_row for 16-bit samples, 16 pixels per iteration. The lane wise pack
+// is put back in order with a permute.
+static void gray16_row_avx2(const uint16_t *bgr, uint16_t *gray, int width)
+{
+  int i = 0;
+
+  for (; i + 16 <= width; i += 16) {
+    __m256i y = _mm256_packus_epi32(gray16_oct_avx2(&bgr[3 * i]), gray16_oct_avx2(&bgr[3 * (i + 8)]));
+    _mm256_storeu_si256((__m256i *)&gray[i], _mm256_permute4x64_epi64(y, 0xD8));
+  }
+
+  gray_span_scalar(bgr, gray, i, width);
+}
+
+// |Gx| + |Gy| of 8 16-bit pixels at `j`, in 32-bit lanes
+static inline __m256i sobel16_mag_avx2(const uint16_t *above, const uint16_t *row,
+                                       const uint16_t *below, int j)
+{
+  __m256i p00 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&above[j - 1]));
+  __m256i p01 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&above[j]));
+  __m256i p02 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&above[j + 1]));
+  __m256i p10 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&row[j - 1]));
+  __m256i p12 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&row[j + 1]));
+  __m256i p20 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&below[j - 1]));
+  __m256i p21 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&below[j]));
+  __m256i p22 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&below[j + 1]));
+
+  __m256i gx = _mm256_add_epi32(_mm256_add_epi32(_mm256_sub_epi32(p02, p00), _mm256_sub_epi32(p22, p20)),
+                                _mm256_slli_epi32(_mm256_sub_epi32(p12, p10), 1));
+  __m256i gy = _mm256_add_epi32(_mm256_add_epi32(_mm256_sub_epi32(p20, p00), _mm256_sub_epi32(p22, p02)),
+                                _mm256_slli_epi32(_mm256_sub_epi32(p21, p01), 1));
+  return _mm256_add_epi32(_mm256_abs_epi32(gx), _mm256_abs_epi32(gy));
+}
+
+// sobel_row for 16-bit samples, 16 pixels per iteration
+static void sobel16_row_avx2(const uint16_t *above, const uint16_t *row,
+                             const uint16_t *below, uint16_t *out, int width)
+{
+  int j;
+
+  // loads reach j+16, which must stay <= width-1
+  for (j = 1; j <= width - 17; j += 16) {
+    __m256i packed = _mm256_packus_epi32(sobel16_mag_avx2(above, row, below, j),
+                                         sobel16_mag_avx2(above, row, below, j + 8));
+    _mm256_storeu_si256((__m256i *)&out[j], _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+
+  sobel_span_scalar(above, row, below, out, j, width - 1);
+}
+
+// YUYV to Y, 32 pixels per iteration; as down_row, the lane wise pack is
+// put back in order with a permute
+static void luma_row_avx2(const uint8_t *yuyv, uint8_t *gray, int width)
+{
+  const __m256i mask = _mm256_set1_epi16(0x00FF);
+  int j;
+
+  for (j = 0; j + 32 <= width; j += 32) {
+    __m256i lo = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&yuyv[2 * j]), mask);
+    __m256i hi = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&yuyv[2 * j + 32]), mask);
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+    _mm256_storeu_si256((__m256i *)&gray[j], packed);
+  }
+  luma_span_scalar(yuyv, gray, j, width);
+}
+
+// Threshold and pack, 32 pixels per iteration, as in the SSE4 backend
+static void edge_row_avx2(const uint8_t *mag, uint8_t *bits, int width, uint8_t threshold)
+{
+  const __m256i t = _mm256_set1_epi8((char)threshold);
+  const __m256i zero = _mm256_setzero_si256();
+  int j;
+
+  for (j = 0; j + 32 <= width; j += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)&mag[j]);
+    uint32_t mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(x, t), zero));
+    memcpy(&bits[j / 8], &mask, sizeof(mask));
+  }
+  edge_span_scalar(mag, bits, threshold, j, width);
+}
+
+// The hand written Sobel row stands in for the engine's Sobel instance
+static void sobel_filter_avx2(const uint8_t *const *rows, uint8_t *out, int width, int *scratch)
+{
+  sobel_row_avx2(rows[0], rows[1], rows[2], out, width);
+}
+
+const sobel_kernels_t kernels_avx2 = {
+  "avx2",
+  avx2_supported,
+  gray_row_avx2,
+  sobel_row_avx2,
+  grad_row_avx2,
+  sad_row_avx2,
+  down_row_avx2,
+  luma_row_avx2,
+  edge_row_avx2,
+  gray16_row_avx2,
+  sobel16_row_avx2,
+  CONV_FILTER_TABLE(sobel_filter_avx2),
+};
+
+#endif
@@ -0,0 +1,355 @@
+#include "sobel_kernels.h"
+#include "conv_engine.h"
+
+#if defined(__arm__) || defined(__aarch64__)
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+static int neon_supported(void)
+{
+#if defined(__aarch64__)
+  return 1; // Advanced SIMD is mandatory on ARMv8-A
+#else
+  return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+/*******************************************
+ * Model: gray_row_neon
+ * Input: BGR row of `width` pixels
+ * Output: None directly. Writes the gray row
+ * Desc: Converts 8 pixels at a time using fixed point arithmetic
+ ********************************************/
+static void gray_row_neon(const uint8_t *bgr, uint8_t *gray, int width)
+{
+  int i = 0;
+  for (; i <= width - 8; i += 8) {
+    // Load 8 BGR (blue green red interleaved) pixels into separate B, G, R channels
+    uint8x8x3_t rgb = vld3_u8(&bgr[i * 3]); //vector load three 8bit uints
+
+    // Widen to 16-bit to avoid overflow
+    uint16x8_t b = vmovl_u8(rgb.val[0]);
+    uint16x8_t g = vmovl_u8(rgb.val[1]);
+    uint16x8_t r = vmovl_u8(rgb.val[2]);
+
+    // Fixed point grayscalle approximation:
+    // gray = (7 Blue + 38 Green + 19 Red) / 64
+    // 0.114 ~ 7/64, 0.587 ~ 38/64, 0.299 ~ 19/64
+
+    // Multiply the B G R channels and accumulate into gray vector
+    uint16x8_t y = vmulq_n_u16(b, 7); // vector multiply qextended nconstant
+    y = vmlaq_n_u16(y, g, 38); // vector multiply accumulate
+    y = vmlaq_n_u16(y, r, 19);
+
+    // Divide by 64
+    y = vshrq_n_u16(y, 6); // vector shift right qextended nconstant
+
+    // Narrow back to 8-bit and store
+    vst1_u8(&gray[i], vmovn_u16(y)); // vector move narrow
+  }
+
+  // individually handling pixels in case the row doesn't split into 8
+  gray_span_scalar(bgr, gray, i, width);
+}
+
+/*******************************************
+ * Model: sobel_row_neon
+ * Input: gray rows above, at and below the output row
+ * Output: None directly. Writes out[1 .. width-2]
+ * Desc: Sobel magnitude 8 pixels at a time in signed 16-bit lanes
+ ********************************************/
+static void sobel_row_neon(const uint8_t *above, const uint8_t *row,
+                           const uint8_t *below, uint8_t *out, int width)
+{
+  int j;
+
+  // Process 8 pixels at a time using neon intrinsics. j runs over columns
+  // stops at width - 9 so that j+1 to j+8 are in bounds
+  for (j = 1; j <= width - 9; j += 8) {
+    // Load 8 pixels from each of the 8 positions since we don't need the middle
+    uint8x8_t top_l = vld1_u8(&above[j - 1]);
+    uint8x8_t top_m = vld1_u8(&above[j]);
+    uint8x8_t top_r = vld1_u8(&above[j + 1]);
+    uint8x8_t mid_l = vld1_u8(&row[j - 1]);
+    uint8x8_t mid_r = vld1_u8(&row[j + 1]);
+    uint8x8_t bot_l = vld1_u8(&below[j - 1]);
+    uint8x8_t bot_m = vld1_u8(&below[j]);
+    uint8x8_t bot_r = vld1_u8(&below[j + 1]);
+
+    // Widen to signed 16-bit for subtraction
+    int16x8_t p00 = vreinterpretq_s16_u16(vmovl_u8(top_l));
+    int16x8_t p01 = vreinterpretq_s16_u16(vmovl_u8(top_m));
+    int16x8_t p02 = vreinterpretq_s16_u16(vmovl_u8(top_r));
+    int16x8_t p10 = vreinterpretq_s16_u16(vmovl_u8(mid_l));
+    int16x8_t p12 = vreinterpretq_s16_u16(vmovl_u8(mid_r));
+    int16x8_t p20 = vreinterpretq_s16_u16(vmovl_u8(bot_l));
+    int16x8_t p21 = vreinterpretq_s16_u16(vmovl_u8(bot_m));
+    int16x8_t p22 = vreinterpretq_s16_u16(vmovl_u8(bot_r));
+
+    // Sobel Gx kernel:
+    //  [ -1  0 +1 ]
+    //  [ -2  0 +2 ]
+    //  [ -1  0 +1 ]
+    // Gx = (p02 + 2*p12 + p22) - (p00 + 2*p10 + p20)
+    int16x8_t gx = vsubq_s16(
+        vaddq_s16(vaddq_s16(p02, vshlq_n_s16(p12, 1)), p22),
+        vaddq_s16(vaddq_s16(p00, vshlq_n_s16(p10, 1)), p20));
+
+    // Sobel Gy kernel:
+    //  [ -1 -2 -1 ]
+    //  [  0  0  0 ]
+    //  [ +1 +2 +1 ]
+    // Gy = (p20 + 2*p21 + p22) - (p00 + 2*p01 + p02)
+    int16x8_t gy = vsubq_s16(
+        vaddq_s16(vaddq_s16(p20, vshlq_n_s16(p21, 1)), p22),
+        vaddq_s16(vaddq_s16(p00, vshlq_n_s16(p01, 1)), p02));
+
+    // |gx| + |gy| to approximate magnitudes
+    int16x8_t mag = vaddq_s16(vabsq_s16(gx), vabsq_s16(gy));
+
+    // Saturate/narrow signed 16-bit -> unsigned 8-bit.
+    // Negative becomes 0, >255 becomes 255.
+    vst1_u8(&out[j], vqmovun_s16(mag));
+  }
+
+  // individually handling pixels in case the row doesn't split into 8
+  sobel_span_scalar(above, row, below, out, j, width - 1);
+}
+
+// round(sqrt(s)) for 4 lanes: reciprocal square root estimate refined by
+// one Newton step, then the integer correction of grad_span_scalar
+static inline int32x4_t grad_mag_neon(int32x4_t s)
+{
+  float32x4_t f = vcvtq_f32_s32(s);
+  // Clamped so that s == 0 gives 0 * 1 rather than 0 * inf
+  float32x4_t fc = vmaxq_f32(f, vdupq_n_f32(1.0f));
+  float32x4_t r = vrsqrteq_f32(fc);
+  r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(fc, r), r));
+  int32x4_t m = vcvtq_s32_f32(vaddq_f32(vmulq_f32(f, r), vdupq_n_f32(0.5f)));
+
+  // The estimate is off by at most one either way; compare masks are -1
+  int32x4_t sq = vmulq_s32(m, m);
+  m = vaddq_s32(m, vreinterpretq_s32_u32(vcgtq_s32(vaddq_s32(vsubq_s32(sq, m), vdupq_n_s32(1)), s)));
+  sq = vmulq_s32(m, m);
+  m = vsubq_s32(m, vreinterpretq_s32_u32(vcgtq_s32(s, vaddq_s32(sq, m))));
+  return vmaxq_s32(m, vdupq_n_s32(0));
+}
+
+// Sector (0 x axis, 1 diagonal, 2 y axis) for 4 lanes:
+// [|gy| 2^15 > |gx| T] + [|gx| 2^15 < |gy| T]
+static inline int32x4_t grad_sector_neon(int16x4_t a, int16x4_t b)
+{
+  uint32x4_t past_axis = vcgtq_s32(vshll_n_s16(b, 15), vmull_n_s16(a, GRAD_TAN22));
+  uint32x4_t past_diag = vcltq_s32(vshll_n_s16(a, 15), vmull_n_s16(b, GRAD_TAN22));
+  return vnegq_s32(vaddq_s32(vreinterpretq_s32_u32(past_axis), vreinterpretq_s32_u32(past_diag)));
+}
+
+/*******************************************
+ * Model: grad_row_neon
+ * Input: gray rows above, at and below the output row
+ * Output: None directly. Writes mag[1 .. width-2] and ori[1 .. width-2]
+ * Desc: L2 magnitude and orientation bin 8 pixels at a time. Gx, Gy as in
+ *  sobel_row_neon; squares and sector tests in widening 32-bit multiplies.
+ ********************************************/
+static void grad_row_neon(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                          uint16_t *mag, uint8_t *ori, int width)
+{
+  int j;
+
+  for (j = 1; j <= width - 9; j += 8) {
+    int16x8_t p00 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&above[j - 1])));
+    int16x8_t p01 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&above[j])));
+    int16x8_t p02 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&above[j + 1])));
+    int16x8_t p10 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&row[j - 1])));
+    int16x8_t p12 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&row[j + 1])));
+    int16x8_t p20 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&below[j - 1])));
+    int16x8_t p21 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&below[j])));
+    int16x8_t p22 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(&below[j + 1])));
+
+    int16x8_t gx = vsubq_s16(
+        vaddq_s16(vaddq_s16(p02, vshlq_n_s16(p12, 1)), p22),
+        vaddq_s16(vaddq_s16(p00, vshlq_n_s16(p10, 1)), p20));
+    int16x8_t gy = vsubq_s16(
+        vaddq_s16(vaddq_s16(p20, vshlq_n_s16(p21, 1)), p22),
+        vaddq_s16(vaddq_s16(p00, vshlq_n_s16(p01, 1)), p02));
+
+    // Gx^2 + Gy^2 in 32 bits
+    int32x4_t s_lo = vmlal_s16(vmull_s16(vget_low_s16(gx), vget_low_s16(gx)),
+                               vget_low_s16(gy), vget_low_s16(gy));
+    int32x4_t s_hi = vmlal_s16(vmull_s16(vget_high_s16(gx), vget_high_s16(gx)),
+                               vget_high_s16(gy), vget_high_s16(gy));
+    vst1q_u16(&mag[j], vcombine_u16(vqmovun_s32(grad_mag_neon(s_lo)),
+                                    vqmovun_s32(grad_mag_neon(s_hi))));
+
+    int16x8_t a = vabsq_s16(gx), b = vabsq_s16(gy);
+    int16x8_t k = vcombine_s16(vmovn_s32(grad_sector_neon(vget_low_s16(a), vget_low_s16(b))),
+                               vmovn_s32(grad_sector_neon(vget_high_s16(a), vget_high_s16(b))));
+    // Mirror the sector into the quadrant: base 0, 4 or 8, +k or -k
+    int16x8_t nx = vreinterpretq_s16_u16(vcltq_s16(gx, vdupq_n_s16(0)));
+    int16x8_t ny = vreinterpretq_s16_u16(vcltq_s16(gy, vdupq_n_s16(0)));
+    int16x8_t flip = veorq_s16(nx, ny);
+    int16x8_t base = vorrq_s16(vandq_s16(nx, vdupq_n_s16(4)),
+                               vbicq_s16(vandq_s16(ny, vdupq_n_s16(8)), nx));
+    int16x8_t bin = vaddq_s16(base, vsubq_s16(veorq_s16(k, flip), flip));
+    bin = vandq_s16(bin, vdupq_n_s16(GRAD_BINS - 1));
+    vst1_u8(&ori[j], vmovn_u16(vreinterpretq_u16_s16(bin)));
+  }
+
+  grad_span_scalar(above, row, below, mag, ori, j, width - 1);
+}
+
+// Sum of absolute differences, 16 bytes at a time, widened pairwise into
+// 32-bit lanes so long rows cannot overflow
+static uint32_t sad_row_neon(const uint8_t *a, const uint8_t *b, int n)
+{
+  uint32x4_t acc = vdupq_n_u32(0);
+  int i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    acc = vpadalq_u16(acc, vpaddlq_u8(vabdq_u8(vld1q_u8(&a[i]), vld1q_u8(&b[i]))));
+  }
+  uint32_t sad = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+                 vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+  return sad + sad_span_scalar(a, b, i, n);
+}
+
+// 2x2 mean, 16 output pixels per iteration: pairwise widening adds of each
+// row, then a rounding narrowing shift
+static void down_row_neon(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int width)
+{
+  int j;
+
+  for (j = 0; j + 16 <= width; j += 16) {
+    uint8x16x2_t a = vld2q_u8(&r0[2 * j]);
+    uint8x16x2_t b = vld2q_u8(&r1[2 * j]);
+    uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[0]), vget_low_u8(a.val[1])),
+                              vaddl_u8(vget_low_u8(b.val[0]), vget_low_u8(b.val[1])));
+    uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[0]), vget_high_u8(a.val[1])),
+                              vaddl_u8(vget_high_u8(b.val[0]), vget_high_u8(b.val[1])));
+    vst1q_u8(&out[j], vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+  }
+  down_span_scalar(r0, r1, out, j, width);
+}
+
+// gray_row for 16-bit samples, 8 pixels per iteration. 7B + 38G + 19R
+// needs 22 bits, so the products are accumulated widening to 32 bits and
+// narrowed again by the divide.
+static void gray16_row_neon(const uint16_t *bgr, uint16_t *gray, int width)
+{
+  int i = 0;
+
+  for (; i + 8 <= width; i += 8) {
+    uint16x8x3_t p = vld3q_u16(&bgr[i * 3]);
+    uint32x4_t lo = vmull_n_u16(vget_low_u16(p.val[0]), 7);
+    uint32x4_t hi = vmull_n_u16(vget_high_u16(p.val[0]), 7);
+    lo = vmlal_n_u16(lo, vget_low_u16(p.val[1]), 38);
+    hi = vmlal_n_u16(hi, vget_high_u16(p.val[1]), 38);
+    lo = vmlal_n_u16(lo, vget_low_u16(p.val[2]), 19);
+    hi = vmlal_n_u16(hi, vget_high_u16(p.val[2]), 19);
+    vst1q_u16(&gray[i], vcombine_u16(vshrn_n_u32(lo, 6), vshrn_n_u32(hi, 6)));
+  }
+
+  gray_span_scalar(bgr, gray, i, width);
+}
+
+// |Gx| + |Gy| of 4 16-bit pixels given their neighbours; Gx and Gy reach
+// +-4 * 65535, so the arithmetic is in 32-bit lanes
+static inline uint32x4_t sobel16_mag_neon(uint16x4_t a0, uint16x4_t a1, uint16x4_t a2,
+                                          uint16x4_t m0, uint16x4_t m2,
+                                          uint16x4_t b0, uint16x4_t b1, uint16x4_t b2)
+{
+  int32x4_t p00 = vreinterpretq_s32_u32(vmovl_u16(a0)), p01 = vreinterpretq_s32_u32(vmovl_u16(a1));
+  int32x4_t p02 = vreinterpretq_s32_u32(vmovl_u16(a2)), p10 = vreinterpretq_s32_u32(vmovl_u16(m0));
+  int32x4_t p12 = vreinterpretq_s32_u32(vmovl_u16(m2)), p20 = vreinterpretq_s32_u32(vmovl_u16(b0));
+  int32x4_t p21 = vreinterpretq_s32_u32(vmovl_u16(b1)), p22 = vreinterpretq_s32_u32(vmovl_u16(b2));
+
+  int32x4_t gx = vaddq_s32(vaddq_s32(vsubq_s32(p02, p00), vsubq_s32(p22, p20)),
+                           vshlq_n_s32(vsubq_s32(p12, p10), 1));
+  int32x4_t gy = vaddq_s32(vaddq_s32(vsubq_s32(p20, p00), vsubq_s32(p22, p02)),
+                           vshlq_n_s32(vsubq_s32(p21, p01), 1));
+  return vaddq_u32(vreinterpretq_u32_s32(vabsq_s32(gx)), vreinterpretq_u32_s32(vabsq_s32(gy)));
+}
+
+// sobel_row for 16-bit samples, 8 pixels per iteration; the saturating
+// narrow clamps the magnitudes to 16 bits
+static void sobel16_row_neon(const uint16_t *above, const uint16_t *row,
+                             const uint16_t *below, uint16_t *out, int width)
+{
+  int j;
+
+  // loads reach j+8, which must stay <= width-1
+  for (j = 1; j <= width - 9; j += 8) {
+    uint16x8_t a0 = vld1q_u16(&above[j - 1]), a1 = vld1q_u16(&above[j]), a2 = vld1q_u16(&above[j + 1]);
+    uint16x8_t m0 = vld1q_u16(&row[j - 1]), m2 = vld1q_u16(&row[j + 1]);
+    uint16x8_t b0 = vld1q_u16(&below[j - 1]), b1 = vld1q_u16(&below[j]), b2 = vld1q_u16(&below[j + 1]);
+
+    uint32x4_t lo = sobel16_mag_neon(vget_low_u16(a0), vget_low_u16(a1), vget_low_u16(a2),
+                                     vget_low_u16(m0), vget_low_u16(m2),
+                                     vget_low_u16(b0), vget_low_u16(b1), vget_low_u16(b2));
+    uint32x4_t hi = sobel16_mag_neon(vget_high_u16(a0), vget_high_u16(a1), vget_high_u16(a2),
+                                     vget_high_u16(m0), vget_high_u16(m2),
+                                     vget_high_u16(b0), vget_high_u16(b1), vget_high_u16(b2));
+    vst1q_u16(&out[j], vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi)));
+  }
+
+  sobel_span_scalar(above, row, below, out, j, width - 1);
+}
+
+// YUYV to Y, 16 pixels per iteration: the de-interleaving load puts the
+// Y bytes in val[0]
+static void luma_row_neon(const uint8_t *yuyv, uint8_t *gray, int width)
+{
+  int j;
+
+  for (j = 0; j + 16 <= width; j += 16) {
+    vst1q_u8(&gray[j], vld2q_u8(&yuyv[2 * j]).val[0]);
+  }
+  luma_span_scalar(yuyv, gray, j, width);
+}
+
+// Threshold and pack, 16 pixels per iteration. NEON has no movemask: each
+// lane of the compare keeps only its own bit weight and the lanes of each
+// half are summed into one byte.
+static void edge_row_neon(const uint8_t *mag, uint8_t *bits, int width, uint8_t threshold)
+{
+  static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+  const uint8x16_t w = vld1q_u8(weights);
+  const uint8x16_t t = vdupq_n_u8(threshold);
+  int j;
+
+  for (j = 0; j + 16 <= width; j += 16) {
+    uint8x16_t m = vandq_u8(vcgtq_u8(vld1q_u8(&mag[j]), t), w);
+    uint8x8_t sum = vpadd_u8(vget_low_u8(m), vget_high_u8(m)); // 4 partial sums per half
+    sum = vpadd_u8(sum, sum);
+    sum = vpadd_u8(sum, sum);
+    bits[j / 8] = vget_lane_u8(sum, 0);
+    bits[j / 8 + 1] = vget_lane_u8(sum, 1);
+  }
+  edge_span_scalar(mag, bits, threshold, j, width);
+}
+
+// The hand written Sobel row stands in for the engine's Sobel instance
+static void sobel_filter_neon(const uint8_t *const *rows, uint8_t *out, int width, int *scratch)
+{
+  sobel_row_neon(rows[0], rows[1], rows[2], out, width);
+}
+
+const sobel_kernels_t kernels_neon = {
+  "neon",
+  neon_supported,
+  gray_row_neon,
+  sobel_row_neon,
+  grad_row_neon,
+  sad_row_neon,
+  down_row_neon,
+  luma_row_neon,
+  edge_row_neon,
+  gray16_row_neon,
+  sobel16_row_neon,
+  CONV_FILTER_TABLE(sobel_filter_neon),
+};
+
+#endif
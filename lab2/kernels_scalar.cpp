@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <math.h>
+#include "sobel_kernels.h"
+#include "conv_engine.h"
+
+/*******************************************
+ * Model: gray_span_scalar
+ * Input: BGR pixels, pixel range [start, end)
+ * Output: None directly. Writes gray[start .. end-1]
+ * Desc: Reference grayscale conversion. Every SIMD backend must match it
+ *  bit for bit: gray = (7 Blue + 38 Green + 19 Red) / 64. The sum fits an
+ *  int for 16-bit samples too.
+ ********************************************/
+template <class in_t, class out_t>
+void gray_span_scalar(const in_t *bgr, out_t *gray, int start, int end)
+{
+  for (int i = start; i < end; i++) {
+    int index = i * 3; // BGR index into color buffer is 3 bytes per pixel
+    gray[i] = (
+      7 * bgr[index] +
+      38 * bgr[index + 1] +
+      19 * bgr[index + 2]) >> 6;
+  }
+}
+
+/*******************************************
+ * Model: sobel_span_scalar
+ * Input: three gray rows, column range [start, end)
+ * Output: None directly. Writes out[start .. end-1]
+ * Desc: Reference Sobel magnitude |Gx| + |Gy| clamped to the largest
+ *  out_t (255 for 8-bit output). The caller guarantees 1 <= start and
+ *  end <= width - 1 so j-1 and j+1 are in bounds
+ ********************************************/
+template <class in_t, class out_t>
+void sobel_span_scalar(const in_t *above, const in_t *row,
+                       const in_t *below, out_t *out, int start, int end)
+{
+  for (int j = start; j < end; j++) {
+    // local 3x3 grid, the centre pixel is not needed
+    int p00 = above[j - 1];
+    int p01 = above[j];
+    int p02 = above[j + 1];
+    int p10 = row[j - 1];
+    int p12 = row[j + 1];
+    int p20 = below[j - 1];
+    int p21 = below[j];
+    int p22 = below[j + 1];
+
+    int gx = (p02 + (p12 << 1) + p22) - (p00 + (p10 << 1) + p20);
+    int gy = (p20 + (p21 << 1) + p22) - (p00 + (p01 << 1) + p02);
+
+    int magnitude = abs(gx) + abs(gy);
+    out[j] = (magnitude > pixel_traits<out_t>::max) ? pixel_traits<out_t>::max : magnitude;
+  }
+}
+
+template void gray_span_scalar(const uint8_t *bgr, uint8_t *gray, int start, int end);
+template void gray_span_scalar(const uint16_t *bgr, uint16_t *gray, int start, int end);
+template void sobel_span_scalar(const uint8_t *above, const uint8_t *row,
+                                const uint8_t *below, uint8_t *out, int start, int end);
+template void sobel_span_scalar(const uint16_t *above, const uint16_t *row,
+                                const uint16_t *below, uint16_t *out, int start, int end);
+
+/*******************************************
+ * Model: grad_span_scalar
+ * Input: three gray rows, column range [start, end)
+ * Output: None directly. Writes mag[] and ori[] over [start, end)
+ * Desc: Reference L2 magnitude and orientation bin (see grad_row in
+ *  sobel_kernels.h). The float square root only gives a first guess; it is
+ *  then corrected to the integer m with m*m - m < s <= m*m + m, which is
+ *  sqrt(s) rounded to nearest. The SIMD backends start from cheaper
+ *  reciprocal square root estimates and apply the same correction, so
+ *  every backend agrees bit for bit.
+ ********************************************/
+void grad_span_scalar(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                      uint16_t *mag, uint8_t *ori, int start, int end)
+{
+  for (int j = start; j < end; j++) {
+    int gx = (above[j + 1] + 2 * row[j + 1] + below[j + 1]) -
+             (above[j - 1] + 2 * row[j - 1] + below[j - 1]);
+    int gy = (below[j - 1] + 2 * below[j] + below[j + 1]) -
+             (above[j - 1] + 2 * above[j] + above[j + 1]);
+
+    int s = gx * gx + gy * gy;
+    int m = (int)(sqrtf((float)s) + 0.5f);
+    if (m > 0 && m * m - m >= s) {
+      m--;
+    } else if (m * m + m < s) {
+      m++;
+    }
+    mag[j] = m;
+
+    // Sector within the quadrant: 0 along the x axis, 1 diagonal, 2 along y
+    int a = abs(gx), b = abs(gy);
+    int k = (b * 32768 > a * GRAD_TAN22) + (a * 32768 < b * GRAD_TAN22);
+    // Mirror it into the quadrant the signs point to
+    int base = gx < 0 ? 4 : (gy < 0 ? 8 : 0);
+    ori[j] = (base + (((gx < 0) != (gy < 0)) ? -k : k)) & (GRAD_BINS - 1);
+  }
+}
+
+uint32_t sad_span_scalar(const uint8_t *a, const uint8_t *b, int start, int end)
+{
+  uint32_t sad = 0;
+  for (int i = start; i < end; i++) {
+    sad += abs(a[i] - b[i]);
+  }
+  return sad;
+}
+
+void down_span_scalar(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int start, int end)
+{
+  for (int j = start; j < end; j++) {
+    out[j] = (r0[2 * j] + r0[2 * j + 1] + r1[2 * j] + r1[2 * j + 1] + 2) >> 2;
+  }
+}
+
+void luma_span_scalar(const uint8_t *yuyv, uint8_t *gray, int start, int end)
+{
+  for (int j = start; j < end; j++) {
+    gray[j] = yuyv[2 * j];
+  }
+}
+
+void edge_span_scalar(const uint8_t *mag, uint8_t *bits, uint8_t threshold, int start, int end)
+{
+  for (int j = start; j < end; j += 8) {
+    uint8_t byte = 0;
+    for (int k = 0; k < 8 && j + k < end; k++) {
+      byte |= (mag[j + k] > threshold) << k;
+    }
+    bits[j / 8] = byte;
+  }
+}
+
+static int scalar_supported(void)
+{
+  return 1;
+}
+
+// One instance per pixel type for the table: gray_row/sobel_row (uint8_t)
+// and gray16_row/sobel16_row (uint16_t)
+template <class pixel_t>
+static void gray_row_scalar(const pixel_t *bgr, pixel_t *gray, int width)
+{
+  gray_span_scalar(bgr, gray, 0, width);
+}
+
+template <class pixel_t>
+static void sobel_row_scalar(const pixel_t *above, const pixel_t *row,
+                             const pixel_t *below, pixel_t *out, int width)
+{
+  sobel_span_scalar(above, row, below, out, 1, width - 1);
+}
+
+static void grad_row_scalar(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                            uint16_t *mag, uint8_t *ori, int width)
+{
+  grad_span_scalar(above, row, below, mag, ori, 1, width - 1);
+}
+
+static uint32_t sad_row_scalar(const uint8_t *a, const uint8_t *b, int n)
+{
+  return sad_span_scalar(a, b, 0, n);
+}
+
+static void down_row_scalar(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int width)
+{
+  down_span_scalar(r0, r1, out, 0, width);
+}
+
+static void luma_row_scalar(const uint8_t *yuyv, uint8_t *gray, int width)
+{
+  luma_span_scalar(yuyv, gray, 0, width);
+}
+
+static void edge_row_scalar(const uint8_t *mag, uint8_t *bits, int width, uint8_t threshold)
+{
+  edge_span_scalar(mag, bits, threshold, 0, width);
+}
+
+const sobel_kernels_t kernels_scalar = {
+  "scalar",
+  scalar_supported,
+  gray_row_scalar<uint8_t>,
+  sobel_row_scalar<uint8_t>,
+  grad_row_scalar,
+  sad_row_scalar,
+  down_row_scalar,
+  luma_row_scalar,
+  edge_row_scalar,
+  gray_row_scalar<uint16_t>,
+  sobel_row_scalar<uint16_t>,
+  // Sobel through the engine here, so the generic instance is what make
+  // check compares against the golden Sobel
+  CONV_FILTER_TABLE(conv_row<sobel_op>),
+};
@@ -0,0 +1,361 @@
+#include "sobel_kernels.h"
+#include "conv_engine.h"
+
+// Built with -msse4.1 (see Makefile). Only reached when the CPU reports SSE4.1.
+#if defined(__x86_64__) || defined(__i386__)
+#include <string.h>
+#include <smmintrin.h>
+
+static int sse4_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.1");
+}
+
+/*******************************************
+ * Model: gray_row_sse4
+ * Input: BGR row of `width` pixels
+ * Output: None directly. Writes the gray row
+ * Desc: Converts 16 pixels at a time. Each 16 byte load covers 4 pixels
+ *  that are shuffled into (B,G) and (R,0) byte pairs, so a single
+ *  multiply-add against (7,38) / (19,0) produces the fixed point sums.
+ ********************************************/
+static void gray_row_sse4(const uint8_t *bgr, uint8_t *gray, int width)
+{
+  const __m128i shuf = _mm_setr_epi8(0, 1, 3, 4, 6, 7, 9, 10,
+                                     2, -1, 5, -1, 8, -1, 11, -1);
+  const __m128i coef = _mm_setr_epi8(7, 38, 7, 38, 7, 38, 7, 38,
+                                     19, 0, 19, 0, 19, 0, 19, 0);
+  int i = 0;
+
+  // The last load of an iteration reads bytes 36..51, so stop 18 pixels
+  // short of the end to stay inside the row
+  for (; i + 18 <= width; i += 16) {
+    const uint8_t *p = &bgr[i * 3];
+    __m128i m0 = _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), shuf), coef);
+    __m128i m1 = _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 12)), shuf), coef);
+    __m128i m2 = _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 24)), shuf), coef);
+    __m128i m3 = _mm_maddubs_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 36)), shuf), coef);
+
+    // Low halves hold 7B+38G, high halves hold 19R; add and divide by 64
+    __m128i y0 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(m0, m1),
+                                              _mm_unpackhi_epi64(m0, m1)), 6);
+    __m128i y1 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(m2, m3),
+                                              _mm_unpackhi_epi64(m2, m3)), 6);
+
+    _mm_storeu_si128((__m128i *)&gray[i], _mm_packus_epi16(y0, y1));
+  }
+
+  gray_span_scalar(bgr, gray, i, width);
+}
+
+// B, G and R of the 4 pixels (12 samples) at p, in 32-bit lanes. The first
+// 8 samples come from one load and the last 4 from a second, half width
+// one, so nothing past the 4th pixel is read.
+static inline void bgr16_quad_sse4(const uint16_t *p, __m128i *b, __m128i *g, __m128i *r)
+{
+  const __m128i b0 = _mm_setr_epi8(0, 1, -1, -1, 6, 7, -1, -1, 12, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, -1, -1);
+  const __m128i g0 = _mm_setr_epi8(2, 3, -1, -1, 8, 9, -1, -1, 14, 15, -1, -1, -1, -1, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, -1, -1);
+  const __m128i r0 = _mm_setr_epi8(4, 5, -1, -1, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, -1, 6, 7, -1, -1);
+  __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+  __m128i v1 = _mm_loadl_epi64((const __m128i *)(p + 8));
+
+  *b = _mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1));
+  *g = _mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1));
+  *r = _mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1));
+}
+
+// gray_row for 16-bit samples, 8 pixels per iteration. 7B + 38G + 19R
+// needs 22 bits, so the sums are formed in 32-bit lanes.
+static void gray16_row_sse4(const uint16_t *bgr, uint16_t *gray, int width)
+{
+  const __m128i k7 = _mm_set1_epi32(7), k38 = _mm_set1_epi32(38), k19 = _mm_set1_epi32(19);
+  __m128i b, g, r, y[2];
+  int i = 0;
+
+  for (; i + 8 <= width; i += 8) {
+    for (int h = 0; h < 2; h++) {
+      bgr16_quad_sse4(&bgr[3 * (i + 4 * h)], &b, &g, &r);
+      y[h] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(b, k7), _mm_mullo_epi32(g, k38)),
+                                          _mm_mullo_epi32(r, k19)), 6);
+    }
+    _mm_storeu_si128((__m128i *)&gray[i], _mm_packus_epi32(y[0], y[1]));
+  }
+
+  gray_span_scalar(bgr, gray, i, width);
+}
+
+// |Gx| + |Gy| of 4 16-bit pixels at `j`. Gx and Gy reach +-4 * 65535, so
+// the neighbours are widened to 32 bits.
+static inline __m128i sobel16_mag_sse4(const uint16_t *above, const uint16_t *row,
+                                       const uint16_t *below, int j)
+{
+  __m128i p00 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&above[j - 1]));
+  __m128i p01 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&above[j]));
+  __m128i p02 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&above[j + 1]));
+  __m128i p10 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&row[j - 1]));
+  __m128i p12 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&row[j + 1]));
+  __m128i p20 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&below[j - 1]));
+  __m128i p21 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&below[j]));
+  __m128i p22 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&below[j + 1]));
+
+  __m128i gx = _mm_add_epi32(_mm_add_epi32(_mm_sub_epi32(p02, p00), _mm_sub_epi32(p22, p20)),
+                             _mm_slli_epi32(_mm_sub_epi32(p12, p10), 1));
+  __m128i gy = _mm_add_epi32(_mm_add_epi32(_mm_sub_epi32(p20, p00), _mm_sub_epi32(p22, p02)),
+                             _mm_slli_epi32(_mm_sub_epi32(p21, p01), 1));
+  return _mm_add_epi32(_mm_abs_epi32(gx), _mm_abs_epi32(gy));
+}
+
+// sobel_row for 16-bit samples, 8 pixels per iteration; packus saturates
+// the 32-bit magnitudes to 16 bits
+static void sobel16_row_sse4(const uint16_t *above, const uint16_t *row,
+                             const uint16_t *below, uint16_t *out, int width)
+{
+  int j;
+
+  // loads reach j+8, which must stay <= width-1
+  for (j = 1; j <= width - 9; j += 8) {
+    __m128i lo = sobel16_mag_sse4(above, row, below, j);
+    __m128i hi = sobel16_mag_sse4(above, row, below, j + 4);
+    _mm_storeu_si128((__m128i *)&out[j], _mm_packus_epi32(lo, hi));
+  }
+
+  sobel_span_scalar(above, row, below, out, j, width - 1);
+}
+
+// |Gx| + |Gy| for 8 pixels given the eight neighbours widened to 16 bits
+static inline __m128i sobel_mag_sse4(__m128i p00, __m128i p01, __m128i p02,
+                                     __m128i p10, __m128i p12,
+                                     __m128i p20, __m128i p21, __m128i p22)
+{
+  // Gx = (p02 - p00) + 2*(p12 - p10) + (p22 - p20)
+  __m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(p02, p00), _mm_sub_epi16(p22, p20)),
+                             _mm_slli_epi16(_mm_sub_epi16(p12, p10), 1));
+  // Gy = (p20 - p00) + 2*(p21 - p01) + (p22 - p02)
+  __m128i gy = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(p20, p00), _mm_sub_epi16(p22, p02)),
+                             _mm_slli_epi16(_mm_sub_epi16(p21, p01), 1));
+  return _mm_add_epi16(_mm_abs_epi16(gx), _mm_abs_epi16(gy));
+}
+
+/*******************************************
+ * Model: sobel_row_sse4
+ * Input: gray rows above, at and below the output row
+ * Output: None directly. Writes out[1 .. width-2]
+ * Desc: Sobel magnitude 16 pixels at a time in signed 16-bit lanes,
+ *  saturated back to 8 bits with packus
+ ********************************************/
+static void sobel_row_sse4(const uint8_t *above, const uint8_t *row,
+                           const uint8_t *below, uint8_t *out, int width)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int j;
+
+  // loads reach j+16, which must stay <= width-1
+  for (j = 1; j <= width - 17; j += 16) {
+    __m128i t0 = _mm_loadu_si128((const __m128i *)&above[j - 1]);
+    __m128i t1 = _mm_loadu_si128((const __m128i *)&above[j]);
+    __m128i t2 = _mm_loadu_si128((const __m128i *)&above[j + 1]);
+    __m128i m0 = _mm_loadu_si128((const __m128i *)&row[j - 1]);
+    __m128i m2 = _mm_loadu_si128((const __m128i *)&row[j + 1]);
+    __m128i b0 = _mm_loadu_si128((const __m128i *)&below[j - 1]);
+    __m128i b1 = _mm_loadu_si128((const __m128i *)&below[j]);
+    __m128i b2 = _mm_loadu_si128((const __m128i *)&below[j + 1]);
+
+    __m128i lo = sobel_mag_sse4(
+        _mm_cvtepu8_epi16(t0), _mm_cvtepu8_epi16(t1), _mm_cvtepu8_epi16(t2),
+        _mm_cvtepu8_epi16(m0), _mm_cvtepu8_epi16(m2),
+        _mm_cvtepu8_epi16(b0), _mm_cvtepu8_epi16(b1), _mm_cvtepu8_epi16(b2));
+    __m128i hi = sobel_mag_sse4(
+        _mm_unpackhi_epi8(t0, zero), _mm_unpackhi_epi8(t1, zero), _mm_unpackhi_epi8(t2, zero),
+        _mm_unpackhi_epi8(m0, zero), _mm_unpackhi_epi8(m2, zero),
+        _mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero), _mm_unpackhi_epi8(b2, zero));
+
+    _mm_storeu_si128((__m128i *)&out[j], _mm_packus_epi16(lo, hi));
+  }
+
+  sobel_span_scalar(above, row, below, out, j, width - 1);
+}
+
+// Sobel Gx and Gy for 8 pixels at `j`, in signed 16-bit lanes
+static inline void sobel_gxgy_sse4(const uint8_t *above, const uint8_t *row,
+                                   const uint8_t *below, int j, __m128i *gx, __m128i *gy)
+{
+  __m128i p00 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&above[j - 1]));
+  __m128i p01 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&above[j]));
+  __m128i p02 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&above[j + 1]));
+  __m128i p10 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&row[j - 1]));
+  __m128i p12 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&row[j + 1]));
+  __m128i p20 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&below[j - 1]));
+  __m128i p21 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&below[j]));
+  __m128i p22 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)&below[j + 1]));
+
+  *gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(p02, p00), _mm_sub_epi16(p22, p20)),
+                      _mm_slli_epi16(_mm_sub_epi16(p12, p10), 1));
+  *gy = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(p20, p00), _mm_sub_epi16(p22, p02)),
+                      _mm_slli_epi16(_mm_sub_epi16(p21, p01), 1));
+}
+
+// round(sqrt(s)) for 4 lanes: a ~12 bit reciprocal square root estimate,
+// then the integer correction of grad_span_scalar
+static inline __m128i grad_mag_sse4(__m128i s)
+{
+  const __m128i one = _mm_set1_epi32(1);
+  __m128 f = _mm_cvtepi32_ps(s);
+  // Clamped so that s == 0 gives 0 * 1 rather than 0 * inf
+  __m128 r = _mm_rsqrt_ps(_mm_max_ps(f, _mm_set1_ps(1.0f)));
+  __m128i m = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(f, r), _mm_set1_ps(0.5f)));
+
+  // The estimate is off by at most one either way; compare masks are -1
+  __m128i sq = _mm_mullo_epi32(m, m);
+  m = _mm_add_epi32(m, _mm_cmpgt_epi32(_mm_add_epi32(_mm_sub_epi32(sq, m), one), s));
+  sq = _mm_mullo_epi32(m, m);
+  m = _mm_sub_epi32(m, _mm_cmpgt_epi32(s, _mm_add_epi32(sq, m)));
+  return _mm_max_epi32(m, _mm_setzero_si128());
+}
+
+// Sector (0 x axis, 1 diagonal, 2 y axis) for 4 lanes of interleaved
+// (|gx|, |gy|) pairs: [|gy| 2^15 > |gx| T] + [|gx| 2^15 < |gy| T]
+static inline __m128i grad_sector_sse4(__m128i ab)
+{
+  const __m128i axis = _mm_setr_epi16(GRAD_TAN22, -32768, GRAD_TAN22, -32768,
+                                      GRAD_TAN22, -32768, GRAD_TAN22, -32768);
+  const __m128i diag = _mm_setr_epi16(-32768, GRAD_TAN22, -32768, GRAD_TAN22,
+                                      -32768, GRAD_TAN22, -32768, GRAD_TAN22);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i past_axis = _mm_cmpgt_epi32(zero, _mm_madd_epi16(ab, axis));
+  __m128i past_diag = _mm_cmpgt_epi32(_mm_madd_epi16(ab, diag), zero);
+  return _mm_sub_epi32(_mm_sub_epi32(zero, past_axis), past_diag);
+}
+
+/*******************************************
+ * Model: grad_row_sse4
+ * Input: gray rows above, at and below the output row
+ * Output: None directly. Writes mag[1 .. width-2] and ori[1 .. width-2]
+ * Desc: L2 magnitude and orientation bin 8 pixels at a time. Gx^2 + Gy^2
+ *  and both sector tests are single multiply-adds over interleaved
+ *  (gx, gy) / (|gx|, |gy|) pairs; the quadrant comes from the signs.
+ ********************************************/
+static void grad_row_sse4(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                          uint16_t *mag, uint8_t *ori, int width)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int j;
+
+  // loads reach j+8, which must stay <= width-1
+  for (j = 1; j <= width - 9; j += 8) {
+    __m128i gx, gy;
+    sobel_gxgy_sse4(above, row, below, j, &gx, &gy);
+
+    __m128i g_lo = _mm_unpacklo_epi16(gx, gy), g_hi = _mm_unpackhi_epi16(gx, gy);
+    __m128i m = _mm_packus_epi32(grad_mag_sse4(_mm_madd_epi16(g_lo, g_lo)),
+                                 grad_mag_sse4(_mm_madd_epi16(g_hi, g_hi)));
+    _mm_storeu_si128((__m128i *)&mag[j], m);
+
+    __m128i a = _mm_abs_epi16(gx), b = _mm_abs_epi16(gy);
+    __m128i k = _mm_packs_epi32(grad_sector_sse4(_mm_unpacklo_epi16(a, b)),
+                                grad_sector_sse4(_mm_unpackhi_epi16(a, b)));
+    // Mirror the sector into the quadrant: base 0, 4 or 8, +k or -k
+    __m128i nx = _mm_cmpgt_epi16(zero, gx), ny = _mm_cmpgt_epi16(zero, gy);
+    __m128i flip = _mm_xor_si128(nx, ny);
+    __m128i base = _mm_or_si128(_mm_and_si128(nx, _mm_set1_epi16(4)),
+                                _mm_andnot_si128(nx, _mm_and_si128(ny, _mm_set1_epi16(8))));
+    __m128i bin = _mm_add_epi16(base, _mm_sub_epi16(_mm_xor_si128(k, flip), flip));
+    bin = _mm_and_si128(bin, _mm_set1_epi16(GRAD_BINS - 1));
+    _mm_storel_epi64((__m128i *)&ori[j], _mm_packus_epi16(bin, bin));
+  }
+
+  grad_span_scalar(above, row, below, mag, ori, j, width - 1);
+}
+
+// Sum of absolute differences, 16 bytes per psadbw
+static uint32_t sad_row_sse4(const uint8_t *a, const uint8_t *b, int n)
+{
+  __m128i acc = _mm_setzero_si128();
+  int i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)&a[i]),
+                                          _mm_loadu_si128((const __m128i *)&b[i])));
+  }
+  // psadbw leaves one partial sum in each 64-bit half
+  uint32_t sad = _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+  return sad + sad_span_scalar(a, b, i, n);
+}
+
+// 2x2 mean, 16 output pixels per iteration: pmaddubsw with ones sums the
+// horizontal pairs of each row into 16 bits, then (sum + 2) >> 2
+static void down_row_sse4(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int width)
+{
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i two = _mm_set1_epi16(2);
+  int j;
+
+  for (j = 0; j + 16 <= width; j += 16) {
+    __m128i lo = _mm_add_epi16(_mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)&r0[2 * j]), ones),
+                               _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)&r1[2 * j]), ones));
+    __m128i hi = _mm_add_epi16(_mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)&r0[2 * j + 16]), ones),
+                               _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)&r1[2 * j + 16]), ones));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+    _mm_storeu_si128((__m128i *)&out[j], _mm_packus_epi16(lo, hi));
+  }
+  down_span_scalar(r0, r1, out, j, width);
+}
+
+// YUYV to Y, 16 pixels per iteration: mask off the chroma bytes and pack
+// the 16-bit lanes back down to bytes
+static void luma_row_sse4(const uint8_t *yuyv, uint8_t *gray, int width)
+{
+  const __m128i mask = _mm_set1_epi16(0x00FF);
+  int j;
+
+  for (j = 0; j + 16 <= width; j += 16) {
+    __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i *)&yuyv[2 * j]), mask);
+    __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i *)&yuyv[2 * j + 16]), mask);
+    _mm_storeu_si128((__m128i *)&gray[j], _mm_packus_epi16(lo, hi));
+  }
+  luma_span_scalar(yuyv, gray, j, width);
+}
+
+// Threshold and pack, 16 pixels per iteration. There is no unsigned byte
+// compare: mag > threshold exactly when mag - threshold, saturated, is not
+// zero. movemask then gives the 16 bits in pixel order.
+static void edge_row_sse4(const uint8_t *mag, uint8_t *bits, int width, uint8_t threshold)
+{
+  const __m128i t = _mm_set1_epi8((char)threshold);
+  const __m128i zero = _mm_setzero_si128();
+  int j;
+
+  for (j = 0; j + 16 <= width; j += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)&mag[j]);
+    uint16_t mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(x, t), zero));
+    memcpy(&bits[j / 8], &mask, sizeof(mask));
+  }
+  edge_span_scalar(mag, bits, threshold, j, width);
+}
+
+// The hand written Sobel row stands in for the engine's Sobel instance
+static void sobel_filter_sse4(const uint8_t *const *rows, uint8_t *out, int width, int *scratch)
+{
+  sobel_row_sse4(rows[0], rows[1], rows[2], out, width);
+}
+
+const sobel_kernels_t kernels_sse4 = {
+  "sse4",
+  sse4_supported,
+  gray_row_sse4,
+  sobel_row_sse4,
+  grad_row_sse4,
+  sad_row_sse4,
+  down_row_sse4,
+  luma_row_sse4,
+  edge_row_sse4,
+  gray16_row_sse4,
+  sobel16_row_sse4,
+  CONV_FILTER_TABLE(sobel_filter_sse4),
+};
+
+#endif
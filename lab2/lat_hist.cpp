@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <err.h>
+#include "lat_hist.h"
+
+using namespace std;
+
+#define LAT_SUB (1 << LAT_SUB_BITS)
+
+static int lat_bucket(uint64_t v)
+{
+  if (v < LAT_SUB) {
+    return (int)v;
+  }
+  int shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+  return ((shift + 1) << LAT_SUB_BITS) + (int)((v >> shift) & (LAT_SUB - 1));
+}
+
+// Middle of a bucket's value range
+static uint64_t lat_value(int b)
+{
+  if (b < LAT_SUB) {
+    return b;
+  }
+  int shift = (b >> LAT_SUB_BITS) - 1;
+  uint64_t low = (uint64_t)(LAT_SUB + (b & (LAT_SUB - 1))) << shift;
+  return low + ((1ull << shift) >> 1);
+}
+
+void lat_record(lat_hist_t *h, uint64_t value)
+{
+  if (h->count == 0 || value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+  h->count++;
+  h->sum += value;
+  h->buckets[lat_bucket(value)]++;
+}
+
+uint64_t lat_percentile(const lat_hist_t *h, double p)
+{
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p * h->count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank >= h->count) {
+    return h->max;
+  }
+
+  uint64_t seen = 0;
+  for (int b = 0; b < LAT_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank) {
+      uint64_t v = lat_value(b);
+      // A bucket's midpoint can lie outside what was actually recorded
+      return v < h->min ? h->min : (v > h->max ? h->max : v);
+    }
+  }
+  return h->max;
+}
+
+static const char *lat_keys[LAT_NUM_STAGES] = { "capture", "gray", "sobel", "display", "frame" };
+
+// Stats of one histogram, scaled (e.g. ns to ms)
+static void lat_stats(const lat_hist_t *h, double scale, double out[6])
+{
+  out[0] = h->count;
+  out[1] = h->count ? (double)h->sum / h->count * scale : 0;
+  out[2] = lat_percentile(h, 0.50) * scale;
+  out[3] = lat_percentile(h, 0.90) * scale;
+  out[4] = lat_percentile(h, 0.99) * scale;
+  out[5] = h->max * scale;
+}
+
+/*******************************************
+ * Model: lat_export
+ * Input: histograms of a run, file prefix, stage labels
+ * Output: None
+ * Desc: Writes the percentile table twice, as CSV for spreadsheets next to
+ *  the *_perf.csv reports and as JSON for dashboards and scripts. Wall
+ *  clock values are in ms, cycles are raw counts. Stages that never ran
+ *  (e.g. gray in fused mode) are left out.
+ ********************************************/
+void lat_export(const lat_report_t *r, const char *prefix, const char *const names[LAT_NUM_STAGES])
+{
+  static const char *units[2] = { "ms", "cycles" };
+  static const char *json_units[2] = { "wall_ms", "cycles" };
+  const lat_hist_t *hists[2] = { r->ns, r->cycles };
+  double scales[2] = { 1e-6, 1 };
+  int nunits = r->has_cycles ? 2 : 1;
+  char path[256];
+  ofstream csv, json;
+  double s[6];
+
+  snprintf(path, sizeof(path), "%s_latency.csv", prefix);
+  csv.open(path, ios::out);
+  if (!csv) {
+    err(1, "Cannot open %s", path);
+  }
+  csv << "Stage, Unit, Frames, Mean, p50, p90, p99, Max" << endl;
+  for (int u = 0; u < nunits; u++) {
+    for (int st = 0; st < LAT_NUM_STAGES; st++) {
+      if (hists[u][st].count == 0) {
+        continue;
+      }
+      lat_stats(&hists[u][st], scales[u], s);
+      csv << names[st] << ", " << units[u] << ", " << s[0];
+      for (int k = 1; k < 6; k++) {
+        csv << ", " << s[k];
+      }
+      csv << endl;
+    }
+  }
+  csv.close();
+
+  snprintf(path, sizeof(path), "%s_latency.json", prefix);
+  json.open(path, ios::out);
+  if (!json) {
+    err(1, "Cannot open %s", path);
+  }
+  json << "{\n  \"mode\": \"" << prefix << "\",\n  \"stages\": {";
+  const char *sep = "\n";
+  for (int st = 0; st < LAT_NUM_STAGES; st++) {
+    if (r->ns[st].count == 0) {
+      continue;
+    }
+    json << sep << "    \"" << lat_keys[st] << "\": {\n      \"label\": \"" << names[st] << "\"";
+    for (int u = 0; u < nunits; u++) {
+      lat_stats(&hists[u][st], scales[u], s);
+      json << ",\n      \"" << json_units[u] << "\": { \"count\": " << s[0]
+           << ", \"mean\": " << s[1] << ", \"p50\": " << s[2] << ", \"p90\": " << s[3]
+           << ", \"p99\": " << s[4] << ", \"max\": " << s[5] << " }";
+    }
+    json << "\n    }";
+    sep = ",\n";
+  }
+  json << "\n  }\n}" << endl;
+  json.close();
+}
@@ -0,0 +1,59 @@
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+#include <stdint.h>
+
+// Fixed size log-linear latency histogram. Values below 2^LAT_SUB_BITS are
+// counted exactly; above that every power of two is split into
+// 2^LAT_SUB_BITS buckets, so a reported percentile is within ~3% of the true
+// value whatever the range (ns to seconds, or cycles). Recording is a few
+// instructions and never allocates, so it can run on every frame.
+
+#define LAT_SUB_BITS 5
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+struct lat_hist_t {
+  uint64_t count, sum, min, max;
+  uint32_t buckets[LAT_BUCKETS];
+};
+
+void lat_record(lat_hist_t *h, uint64_t value);
+
+// Value at or below which a fraction p (0..1) of the samples lie
+uint64_t lat_percentile(const lat_hist_t *h, double p);
+
+// The stages every driver reports, plus the end-to-end frame latency
+enum lat_stage_t { LAT_CAPTURE, LAT_GRAY, LAT_SOBEL, LAT_DISPLAY, LAT_FRAME, LAT_NUM_STAGES };
+
+// Wall clock and cycle histograms for each stage of one run. cycles is only
+// exported when the host could count them (has_cycles, see pc.h).
+struct lat_report_t {
+  lat_hist_t ns[LAT_NUM_STAGES];
+  lat_hist_t cycles[LAT_NUM_STAGES];
+  int has_cycles;
+  uint64_t frame_ns, frame_cycles; // stages of the frame in progress
+};
+
+// Record one stage of the current frame. Drivers whose stages run back to
+// back close the frame with lat_end_frame, which records their sum as the
+// frame latency.
+static inline void lat_record_stage(lat_report_t *r, int stage, uint64_t ns, uint64_t cycles)
+{
+  lat_record(&r->ns[stage], ns);
+  lat_record(&r->cycles[stage], cycles);
+  r->frame_ns += ns;
+  r->frame_cycles += cycles;
+}
+
+static inline void lat_end_frame(lat_report_t *r)
+{
+  lat_record(&r->ns[LAT_FRAME], r->frame_ns);
+  lat_record(&r->cycles[LAT_FRAME], r->frame_cycles);
+  r->frame_ns = r->frame_cycles = 0;
+}
+
+// Writes <prefix>_latency.csv and <prefix>_latency.json with count, mean,
+// p50, p90, p99 and max of every stage. names labels the stages in the CSV.
+void lat_export(const lat_report_t *r, const char *prefix, const char *const names[LAT_NUM_STAGES]);
+
+#endif
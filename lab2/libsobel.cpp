@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "libsobel.h"
+#include "sobel_kernels.h"
+#include "thread_pool.h"
+#include "frame_pool.h"
+
+// C API over the row kernels and the worker pool (see libsobel.h). Nothing
+// here may depend on OpenCV or the driver's opts: the library is built
+// from this file, the kernel backends and thread_pool.cpp. Scratch memory
+// belongs to each sobel_pool_t rather than the driver's process wide frame
+// pool, so a host with many pools cannot run that out, and running out of
+// memory is an error return, never an exit.
+
+struct sobel_pool_t {
+  thread_pool_t *threads;
+  unsigned char *gray;                    // gray frame of two-pass frames
+  size_t gray_bytes;
+  unsigned char *lines[POOL_MAX_THREADS]; // SOBEL_FUSED line buffers, one per worker
+  size_t line_bytes;
+};
+
+// One frame split into row bands, as band_job_t in the driver
+struct frame_job_t {
+  sobel_format_t format;
+  const uint8_t *src;
+  size_t src_stride;
+  uint8_t *gray;        // the source itself for gray input
+  size_t gray_stride;
+  uint8_t *out;
+  size_t out_stride;
+  int width, height;
+  int band_rows, num_bands;
+  sobel_pool_t *pool;
+};
+
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+
+static void autoSelect()
+{
+  kernels_select(NULL);
+}
+
+static int invalid()
+{
+  errno = EINVAL;
+  return -1;
+}
+
+// Replace *buf with a zeroed, cache line aligned buffer of `bytes`. On
+// failure *buf is left NULL and -1 returned with errno ENOMEM.
+static int scratch(unsigned char **buf, size_t bytes)
+{
+  free(*buf);
+  *buf = NULL;
+  if (posix_memalign((void **)buf, FPOOL_ALIGN, bytes) != 0) {
+    *buf = NULL;
+    errno = ENOMEM;
+    return -1;
+  }
+  memset(*buf, 0, bytes);
+  return 0;
+}
+
+static int isDeep(sobel_format_t format)
+{
+  return format == SOBEL_BGR16 || format == SOBEL_GRAY16;
+}
+
+static int isGray(sobel_format_t format)
+{
+  return format == SOBEL_GRAY || format == SOBEL_GRAY16;
+}
+
+// Bytes per pixel of an input row
+static size_t pixelBytes(sobel_format_t format)
+{
+  switch (format) {
+    case SOBEL_BGR:
+      return 3;
+    case SOBEL_YUYV:
+    case SOBEL_GRAY16:
+      return 2;
+    case SOBEL_BGR16:
+      return 6;
+    default:
+      return 1;
+  }
+}
+
+// Bytes per pixel of the gray and output rows
+static size_t grayBytes(sobel_format_t format)
+{
+  return isDeep(format) ? 2 : 1;
+}
+
+static int validFormat(sobel_format_t format, int width, int height)
+{
+  return format >= SOBEL_BGR && format <= SOBEL_GRAY16 && width >= 3 && height >= 3;
+}
+
+// An image of `width` pixels of `bytes` each per row; 16-bit samples must
+// be aligned to 2 bytes
+static int validImage(const void *data, size_t stride, int width, size_t bytes, size_t align)
+{
+  return data != NULL && stride >= width * bytes && stride % align == 0 &&
+         (uintptr_t)data % align == 0;
+}
+
+static void grayRow(sobel_format_t format, const uint8_t *src, uint8_t *gray, int width)
+{
+  switch (format) {
+    case SOBEL_BGR:
+      kernels->gray_row(src, gray, width);
+      break;
+    case SOBEL_YUYV:
+      kernels->luma_row(src, gray, width);
+      break;
+    case SOBEL_BGR16:
+      kernels->gray16_row((const uint16_t *)src, (uint16_t *)gray, width);
+      break;
+    default:
+      memcpy(gray, src, width * grayBytes(format));
+      break;
+  }
+}
+
+// Output row from the gray rows around it, with its first and last pixel,
+// which the kernels leave untouched, cleared
+static void sobelRow(sobel_format_t format, const uint8_t *above, const uint8_t *row,
+                     const uint8_t *below, uint8_t *out, int width)
+{
+  if (isDeep(format)) {
+    uint16_t *out16 = (uint16_t *)out;
+    kernels->sobel16_row((const uint16_t *)above, (const uint16_t *)row,
+                         (const uint16_t *)below, out16, width);
+    out16[0] = out16[width - 1] = 0;
+  } else {
+    kernels->sobel_row(above, row, below, out, width);
+    out[0] = out[width - 1] = 0;
+  }
+}
+
+// Output rows [start, end) of a band; the bands holding the first and last
+// output row also clear the border rows next to them
+static void clearBorderRows(frame_job_t *job, int start, int end)
+{
+  size_t bytes = job->width * grayBytes(job->format);
+  if (start == 1) {
+    memset(job->out, 0, bytes);
+  }
+  if (end == job->height - 1) {
+    memset(job->out + (job->height - 1) * job->out_stride, 0, bytes);
+  }
+}
+
+static void bandRange(frame_job_t *job, int band, int *start, int *end)
+{
+  *start = 1 + band * job->band_rows;
+  *end = *start + job->band_rows;
+  if (*end > job->height - 1) {
+    *end = job->height - 1;
+  }
+}
+
+static void grayTask(void *arg, int band, int worker)
+{
+  frame_job_t *job = (frame_job_t *)arg;
+  int start = band * job->band_rows;
+  int end = (band == job->num_bands - 1) ? job->height : start + job->band_rows;
+  for (int i = start; i < end; i++) {
+    grayRow(job->format, job->src + i * job->src_stride, job->gray + i * job->gray_stride,
+            job->width);
+  }
+}
+
+static void sobelTask(void *arg, int band, int worker)
+{
+  frame_job_t *job = (frame_job_t *)arg;
+  int start, end;
+  bandRange(job, band, &start, &end);
+  for (int i = start; i < end; i++) {
+    const uint8_t *row = job->gray + i * job->gray_stride;
+    sobelRow(job->format, row - job->gray_stride, row, row + job->gray_stride,
+             job->out + i * job->out_stride, job->width);
+  }
+  clearBorderRows(job, start, end);
+}
+
+// Gray row r of the band lives in ring[r % 3], as in sobelFused
+static void fusedTask(void *arg, int band, int worker)
+{
+  frame_job_t *job = (frame_job_t *)arg;
+  size_t ring_stride = fpool_stride(job->width * grayBytes(job->format));
+  uint8_t *ring[3];
+  int start, end;
+
+  bandRange(job, band, &start, &end);
+  for (int k = 0; k < 3; k++) {
+    ring[k] = job->pool->lines[worker] + k * ring_stride;
+  }
+  grayRow(job->format, job->src + (start - 1) * job->src_stride, ring[(start - 1) % 3], job->width);
+  grayRow(job->format, job->src + start * job->src_stride, ring[start % 3], job->width);
+  for (int i = start; i < end; i++) {
+    grayRow(job->format, job->src + (i + 1) * job->src_stride, ring[(i + 1) % 3], job->width);
+    sobelRow(job->format, ring[(i - 1) % 3], ring[i % 3], ring[(i + 1) % 3],
+             job->out + i * job->out_stride, job->width);
+  }
+  clearBorderRows(job, start, end);
+}
+
+const char *sobel_select_backend(const char *name)
+{
+  pthread_once(&backend_once, autoSelect);
+  const sobel_kernels_t *k = kernels_select(name);
+  return k != NULL ? k->name : NULL;
+}
+
+const char *sobel_backends(void)
+{
+  return kernels_available();
+}
+
+int sobel_gray(sobel_format_t format, const void *src, size_t src_stride,
+               void *gray, size_t gray_stride, int width, int height)
+{
+  size_t gb = grayBytes(format);
+  if (!validFormat(format, width, height) ||
+      !validImage(src, src_stride, width, pixelBytes(format), gb) ||
+      !validImage(gray, gray_stride, width, gb, gb)) {
+    return invalid();
+  }
+  pthread_once(&backend_once, autoSelect);
+
+  for (int i = 0; i < height; i++) {
+    grayRow(format, (const uint8_t *)src + i * src_stride, (uint8_t *)gray + i * gray_stride, width);
+  }
+  return 0;
+}
+
+int sobel_magnitude(sobel_format_t format, const void *gray, size_t gray_stride,
+                    void *out, size_t out_stride, int width, int height)
+{
+  frame_job_t job;
+  size_t gb = grayBytes(format);
+  if (!isGray(format) || !validFormat(format, width, height) ||
+      !validImage(gray, gray_stride, width, gb, gb) || !validImage(out, out_stride, width, gb, gb)) {
+    return invalid();
+  }
+  pthread_once(&backend_once, autoSelect);
+
+  memset(&job, 0, sizeof(job));
+  job.format = format;
+  job.gray = (uint8_t *)gray;
+  job.gray_stride = gray_stride;
+  job.out = (uint8_t *)out;
+  job.out_stride = out_stride;
+  job.width = width;
+  job.height = height;
+  job.band_rows = height - 2;
+  job.num_bands = 1;
+  sobelTask(&job, 0, 0);
+  return 0;
+}
+
+sobel_pool_t *sobel_pool_create(int nthreads)
+{
+  pthread_once(&backend_once, autoSelect);
+  sobel_pool_t *pool = (sobel_pool_t *)calloc(1, sizeof(sobel_pool_t));
+  if (pool == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  pool->threads = pool_try_create(nthreads);
+  if (pool->threads == NULL) {
+    int e = errno;
+    free(pool);
+    errno = e;
+    return NULL;
+  }
+  return pool;
+}
+
+int sobel_pool_threads(const sobel_pool_t *pool)
+{
+  return pool->threads->nthreads;
+}
+
+void sobel_pool_destroy(sobel_pool_t *pool)
+{
+  if (pool == NULL) {
+    return;
+  }
+  pool_destroy(pool->threads);
+  free(pool->gray);
+  for (int w = 0; w < POOL_MAX_THREADS; w++) {
+    free(pool->lines[w]);
+  }
+  free(pool);
+}
+
+/*******************************************
+ * Model: sobel_frame
+ * Input: pool, source image and its format, output image, flags
+ * Output: 0, or -1 with errno set for bad arguments
+ * Desc: Splits the frame into row bands the way planBands does (a few per
+ *  worker, at least 8 rows) and runs them on the pool: gray conversion
+ *  into the pool's gray frame, then Sobel, or both per band through line
+ *  buffers with SOBEL_FUSED. Gray sources skip the conversion and are read
+ *  in place. The pool's scratch buffers only grow, so a stream of same
+ *  sized frames allocates on the first one only. If one cannot be grown
+ *  the frame fails with ENOMEM and the next call tries again.
+ ********************************************/
+int sobel_frame(sobel_pool_t *pool, sobel_format_t format, const void *src,
+                size_t src_stride, void *out, size_t out_stride,
+                int width, int height, int flags)
+{
+  frame_job_t job;
+  size_t gb = grayBytes(format);
+  if (pool == NULL || !validFormat(format, width, height) ||
+      !validImage(src, src_stride, width, pixelBytes(format), gb) ||
+      !validImage(out, out_stride, width, gb, gb)) {
+    return invalid();
+  }
+
+  int nthreads = pool->threads->nthreads;
+  memset(&job, 0, sizeof(job));
+  job.format = format;
+  job.src = (const uint8_t *)src;
+  job.src_stride = src_stride;
+  job.out = (uint8_t *)out;
+  job.out_stride = out_stride;
+  job.width = width;
+  job.height = height;
+  job.pool = pool;
+  job.band_rows = (height - 2) / (nthreads * 4);
+  if (job.band_rows < 8) {
+    job.band_rows = 8;
+  }
+  job.num_bands = (height - 2 + job.band_rows - 1) / job.band_rows;
+
+  if (isGray(format)) {
+    job.gray = (uint8_t *)src;
+    job.gray_stride = src_stride;
+    pool_run(pool->threads, sobelTask, &job, job.num_bands);
+    return 0;
+  }
+
+  if (flags & SOBEL_FUSED) {
+    size_t bytes = 3 * fpool_stride(width * gb);
+    if (pool->line_bytes < bytes) {
+      pool->line_bytes = 0;
+      for (int w = 0; w < nthreads; w++) {
+        if (scratch(&pool->lines[w], bytes) != 0) {
+          return -1;
+        }
+      }
+      pool->line_bytes = bytes;
+    }
+    pool_run(pool->threads, fusedTask, &job, job.num_bands);
+    return 0;
+  }
+
+  job.gray_stride = fpool_stride(width * gb);
+  if (pool->gray_bytes < job.gray_stride * height) {
+    pool->gray_bytes = 0;
+    if (scratch(&pool->gray, job.gray_stride * height) != 0) {
+      return -1;
+    }
+    pool->gray_bytes = job.gray_stride * height;
+  }
+  job.gray = pool->gray;
+  pool_run(pool->threads, grayTask, &job, job.num_bands);
+  pool_run(pool->threads, sobelTask, &job, job.num_bands);
+  return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef LIBSOBEL_H
+#define LIBSOBEL_H
+
+#include <stddef.h>
+
+// Embeddable Sobel library (libsobel.a / libsobel.so, see the Makefile).
+// The same row kernels and worker pool the sobel driver runs, behind a C
+// API on caller owned buffers: every image is a pointer, a width and height
+// in pixels and a row stride in bytes, so frames are processed in place
+// wherever they live (decoder output, a mapped file, a camera buffer) with
+// no copy and no cv::Mat. The library does not link OpenCV.
+//
+// Output is |Gx| + |Gy| of the gray image, as the driver computes it. The
+// one pixel border of the output, where the 3x3 window does not fit, is
+// set to 0. Functions return 0, or -1 with errno set to EINVAL for bad
+// arguments (unknown format, image under 3x3, a stride shorter than a row)
+// or ENOMEM when scratch memory cannot be had. The library never exits the
+// calling process.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SOBEL_API __attribute__((visibility("default")))
+
+// Input layouts. The 8-bit ones give 8-bit gray and output (saturated to
+// 255), the 16-bit ones 16-bit gray and output in native byte order (see
+// gray16_row/sobel16_row in sobel_kernels.h).
+typedef enum sobel_format_t {
+  SOBEL_BGR,     // packed B, G, R bytes
+  SOBEL_GRAY,    // 8-bit gray, e.g. the Y plane of I420/NV12
+  SOBEL_YUYV,    // packed 4:2:2 (YUY2); only the Y samples are used
+  SOBEL_BGR16,   // packed 16-bit B, G, R samples (10 to 16 bits used)
+  SOBEL_GRAY16   // 16-bit gray
+} sobel_format_t;
+
+// sobel_frame flags
+#define SOBEL_FUSED 1  // convert and filter each band through a three row
+                       // line buffer instead of a full gray frame
+
+// Pick the kernel backend by name (see sobel_backends), or the fastest one
+// this CPU supports for NULL. Returns the backend's name, or NULL if the
+// name is unknown or unsupported. Without a call the fastest is used.
+SOBEL_API const char *sobel_select_backend(const char *name);
+
+// Comma separated list of the backends built in
+SOBEL_API const char *sobel_backends(void);
+
+// Single threaded conversions on the calling thread. sobel_gray converts
+// any format to gray; sobel_magnitude takes a SOBEL_GRAY or SOBEL_GRAY16
+// image.
+SOBEL_API int sobel_gray(sobel_format_t format, const void *src, size_t src_stride,
+                         void *gray, size_t gray_stride, int width, int height);
+SOBEL_API int sobel_magnitude(sobel_format_t format, const void *gray, size_t gray_stride,
+                              void *out, size_t out_stride, int width, int height);
+
+// Worker pool plus the scratch buffers a frame needs (the gray frame, line
+// buffers), kept between frames and owned by the pool. nthreads counts the
+// calling thread, so 1 runs everything on the caller; 0 means one per
+// online CPU. A pool must only be used from the thread that created it; use
+// one pool per ingest thread. sobel_pool_create returns NULL with errno
+// ENOMEM, or pthread_create's error (e.g. EAGAIN) if the threads cannot be
+// started.
+typedef struct sobel_pool_t sobel_pool_t;
+SOBEL_API sobel_pool_t *sobel_pool_create(int nthreads);
+SOBEL_API int sobel_pool_threads(const sobel_pool_t *pool);
+SOBEL_API void sobel_pool_destroy(sobel_pool_t *pool);
+
+// The whole per frame pipeline: src (any format) to gray to Sobel output,
+// split into row bands over the pool's workers. Gray input is filtered in
+// place, without a gray copy.
+SOBEL_API int sobel_frame(sobel_pool_t *pool, sobel_format_t format, const void *src,
+                          size_t src_stride, void *out, size_t out_stride,
+                          int width, int height, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,34 +3,217 @@
 #include <unistd.h>
 #include <string.h>
 #include <locale.h>
+#include <ctype.h>
 #include <err.h>
+#include <sched.h>
 #include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "pc.h"
+#include "autotune.h"
+#include "affinity.h"
+#include "edge_map.h"
+#include <getopt.h>
 
 #define EPRINTF(...) fprintf(stderr, __VA_ARGS__)
+#define RT_DEFAULT_PRIO 10
 struct opts opts;
-char defaultVideo[] = {'b', 'a', 'x', 't', 'e', 'r', '.', 'a', 'v', 'i'};
+char defaultVideo[] = "baxter.avi";
 
 void printHelp(int argc, char **argv)
 {
   EPRINTF("EE 180 Lab2 driver\n");
-  EPRINTF("Usage: %s OPTS\n", argv[0]);
+  EPRINTF("Usage: %s OPTS [FILE...]\n", argv[0]);
   EPRINTF("OPTS can be a combination of the following:\n");
   EPRINTF("-n <num>  :  Number of frames after which program should quit. Must be a positive integer\n");
   EPRINTF("-m        :  Run the Multi-threaded version\n");
+  EPRINTF("-p        :  Run capture, grayscale, Sobel and display as concurrent pipeline stages\n");
+  EPRINTF("-t <num>  :  Number of worker threads for the multi-threaded version (implies -m unless -p is given; with -p they are shared by the compute stages). 0 uses every online CPU. Defaults to 2\n");
+  EPRINTF("-b <rows> :  Rows per band handed to a worker. By default a few bands per thread\n");
   EPRINTF("-f <file> :  Get input video from file. This is the default (defaults to 'baxter.avi' if unspecified)\n");
+  EPRINTF("            Several files (repeated -f, or trailing FILE arguments) are processed concurrently over one\n");
+  EPRINTF("            shared pool of -t workers; -n is then per stream and each stream gets its own output\n");
+  EPRINTF("            raw:<W>x<H>:<path> reads packed BGR frames and <path>.y4m (or y4m:<path>) YUV4MPEG2 through mmap,\n");
+  EPRINTF("            without decoding or copying. Y4M frames are used as gray frames straight from their Y plane\n");
+  EPRINTF("            yuv:<W>x<H>:<i420|nv12|yuyv>:<path> reads headerless YUV frames and v4l2:<device> a V4L2 camera\n");
+  EPRINTF("            in NV12, YUV420 or YUYV; both use the Y plane as the gray frame, with no conversion to or from BGR\n");
+  EPRINTF("            raw16:<W>x<H>:<path> reads 16-bit little endian BGR (e.g. 12-bit camera data), and Y4M may be 10 to\n");
+  EPRINTF("            16-bit (C420p12, Cmono16, ...). These run 16-bit kernels and output 16-bit |Gx|+|Gy|, not clamped to 255\n");
   EPRINTF("-w        :  Get input video from webcam (if connected to board). Must use either '-w' or '-f', not both\n");
+  EPRINTF("-r <W>x<H>:  Ask the capture device for this frame size. By default frames are processed at the source's own size\n");
+  EPRINTF("-F        :  Fuse grayscale and Sobel into one pass over a three-row line buffer\n");
+  EPRINTF("-o <sink> :  Where output frames go: window (default), null, raw:<path>, mmap:<path>, video:<path> or\n");
+  EPRINTF("            edges:<path>.\n");
+  EPRINTF("            mmap:<path> writes the same packed frames as raw:<path> through a shared file mapping.\n");
+  EPRINTF("            edges:<path> archives thresholded edge maps, bit packed or run length encoded, with a frame index\n");
+  EPRINTF("--edge-threshold <t>: Output pixels above <t> (0..254) are edges in the edges:<path> sink. Defaults to %d\n", EDGE_DEFAULT_THRESHOLD);
+  EPRINTF("--headless:  Never open a window or wait on cvWaitKey. Output defaults to the null sink\n");
+  EPRINTF("-e <list> :  Hardware counters to collect, comma separated, from: %s. Defaults to %s\n", pc_event_names(), PC_DEFAULT_EVENTS);
+  EPRINTF("--filter <name>: Edge/smoothing operator of the convolution engine, one of %s. Defaults to sobel\n", filters_available());
+  EPRINTF("--gradient:  Output the L2 gradient magnitude (16-bit) and an 8-bin orientation plane instead of |Gx|+|Gy|.\n");
+  EPRINTF("            Each output row holds the row's magnitudes followed by its orientation bytes. Output goes to null or raw:<path>\n");
+  EPRINTF("--incremental[=<sad>]: Only recompute tiles whose source changed since the previous frame. A tile counts as\n");
+  EPRINTF("            changed when the sum of absolute differences of its pixels exceeds <sad> (default 0: any change)\n");
+  EPRINTF("--tile <W>x<H>: Tile size for --incremental (default 64x16) and --tiled (default from the cache sizes)\n");
+  EPRINTF("--tiled   :  Run grayscale and Sobel per 2D tile sized to stay in L1/L2, instead of over full rows\n");
+  EPRINTF("--pyramid <levels>: Also run the Sobel stage on half, quarter, ... resolution copies of the frame, %d levels at\n", PYR_MAX_LEVELS);
+  EPRINTF("            most, downsampled during the grayscale pass. The output frame holds the full resolution result\n");
+  EPRINTF("            with the smaller levels stacked to its right\n");
+  EPRINTF("--autotune:  Time the kernel backends, modes (two-pass, -F, --tiled), thread counts and band/tile sizes on the\n");
+  EPRINTF("            first frame, save the fastest to the profile and run with it. Options given here are not varied\n");
+  EPRINTF("--profile <path>: Profile to write with --autotune, and to load otherwise when it exists. Settings on the\n");
+  EPRINTF("            command line override it. Defaults to %s; 'none' runs untuned\n", profile_default_path());
+  EPRINTF("--cpus <list>: Pin compute workers one per CPU, round robin over the list (e.g. 2-5,8). 'auto' uses the\n");
+  EPRINTF("            isolated CPUs (isolcpus) of this cpuset if there are any, otherwise the CPUs the process started on\n");
+  EPRINTF("--capture-cpu <n>: Pin the capture thread (in -m, also worker 0 of the pool) to CPU n\n");
+  EPRINTF("--output-cpu <n>: Pin the output writer thread (in -p, the display stage) to CPU n\n");
+  EPRINTF("--rt[=<prio>]: Run the pinned threads under SCHED_FIFO at <prio> (default %d). Needs CAP_SYS_NICE\n", RT_DEFAULT_PRIO);
+  EPRINTF("--target-fps <fps>: Pace frames to <fps> and run them on the fewest pool workers that keep up, parking the\n");
+  EPRINTF("            rest (implies -m; -t sets the most). Reports the energy per frame of the busy cores at their cpufreq clock\n");
+  EPRINTF("-k <name> :  Force a kernel backend (one of %s). Defaults to the fastest one this CPU supports\n", kernels_available());
 }
 
 void parseOpts(int argc, char **argv)
 {
   int c;
   int inputSrc = 0;
+  int fixed = 0; // settings the command line chose, see autotune.h
   memset(&opts, 0, sizeof(struct opts));
-  while ((c = getopt (argc, argv, "mwn:f:")) != -1) {
+  opts.numThreads = 2;
+  opts.captureCpu = opts.outputCpu = -1;
+  opts.edgeThreshold = EDGE_DEFAULT_THRESHOLD;
+  opts.inputs = (char **)calloc(argc, sizeof(char *));
+  static struct option long_opts[] = {
+    { "headless", no_argument, NULL, 'H' },
+    { "filter", required_argument, NULL, 'G' },
+    { "gradient", no_argument, NULL, 'L' },
+    { "incremental", optional_argument, NULL, 'I' },
+    { "tile", required_argument, NULL, 'T' },
+    { "pyramid", required_argument, NULL, 'Y' },
+    { "tiled", no_argument, NULL, 'B' },
+    { "autotune", no_argument, NULL, 'A' },
+    { "profile", required_argument, NULL, 'P' },
+    { "cpus", required_argument, NULL, 'C' },
+    { "capture-cpu", required_argument, NULL, 'U' },
+    { "output-cpu", required_argument, NULL, 'O' },
+    { "rt", optional_argument, NULL, 'R' },
+    { "edge-threshold", required_argument, NULL, 'E' },
+    { "target-fps", required_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 }
+  };
+  while ((c = getopt_long (argc, argv, "mpwFn:f:k:r:t:b:o:e:", long_opts, NULL)) != -1) {
     switch (c) {
       case 'm':
         opts.multiThreaded = 1;
         break;
+      case 'p':
+        opts.pipelined = 1;
+        break;
+      case 'o':
+        opts.sink = optarg;
+        break;
+      case 'H':
+        opts.headless = 1;
+        break;
+      case 'F':
+        opts.fused = 1;
+        fixed |= TUNE_MODE;
+        break;
+      case 'L':
+        opts.gradient = 1;
+        break;
+      case 'I':
+        opts.incremental = 1;
+        fixed |= TUNE_MODE;
+        opts.incrSad = optarg != NULL ? atol(optarg) : 0;
+        if (opts.incrSad < 0) {
+          EPRINTF("Invalid --incremental threshold: %s (must be >=0)\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'T':
+        if (sscanf(optarg, "%dx%d", &opts.tileWidth, &opts.tileHeight) != 2 ||
+            opts.tileWidth < 4 || opts.tileHeight < 4) {
+          EPRINTF("Invalid tile size: %s (expected <W>x<H>, each at least 4)\n", optarg);
+          exit(-1);
+        }
+        fixed |= TUNE_TILE;
+        break;
+      case 'A':
+        opts.autotune = 1;
+        break;
+      case 'P':
+        opts.profile = optarg;
+        break;
+      case 'C':
+        opts.cpus = optarg;
+        break;
+      case 'U':
+        opts.captureCpu = atoi(optarg);
+        if (opts.captureCpu < 0 || !isdigit(optarg[0])) {
+          EPRINTF("Invalid capture CPU: %s (must be >=0)\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'O':
+        opts.outputCpu = atoi(optarg);
+        if (opts.outputCpu < 0 || !isdigit(optarg[0])) {
+          EPRINTF("Invalid output CPU: %s (must be >=0)\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'R':
+        opts.rtPrio = optarg != NULL ? atoi(optarg) : RT_DEFAULT_PRIO;
+        if (opts.rtPrio < sched_get_priority_min(SCHED_FIFO) || opts.rtPrio > sched_get_priority_max(SCHED_FIFO)) {
+          EPRINTF("Invalid SCHED_FIFO priority: %s (must be %d..%d)\n", optarg,
+                  sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+          exit(-1);
+        }
+        break;
+      case 'E':
+        opts.edgeThreshold = atoi(optarg);
+        if (!isdigit(optarg[0]) || opts.edgeThreshold > 254) {
+          EPRINTF("Invalid edge threshold: %s (must be 0..254)\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'S':
+        opts.multiThreaded = 1;
+        opts.targetFps = atof(optarg);
+        if (opts.targetFps <= 0) {
+          EPRINTF("Invalid target frame rate: %s (must be > 0)\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'B':
+        opts.tiled = 1;
+        fixed |= TUNE_MODE;
+        break;
+      case 'Y':
+        opts.pyramid = atoi(optarg);
+        fixed |= TUNE_MODE;
+        if (opts.pyramid < 2 || opts.pyramid > PYR_MAX_LEVELS) {
+          EPRINTF("Invalid number of pyramid levels: %s (must be 2..%d)\n", optarg, PYR_MAX_LEVELS);
+          exit(-1);
+        }
+        break;
+      case 'G':
+        opts.filter = filter_select(optarg);
+        if (opts.filter < 0) {
+          EPRINTF("Unknown filter: %s (one of %s)\n", optarg, filters_available());
+          exit(-1);
+        }
+        break;
+      case 't':
+        opts.multiThreaded = 1;
+        opts.numThreads = atoi(optarg);
+        fixed |= TUNE_THREADS;
+        break;
+      case 'b':
+        opts.bandRows = atoi(optarg);
+        fixed |= TUNE_BANDS;
+        break;
       case 'w':
         opts.webcam = 1;
         inputSrc++;
@@ -39,11 +222,25 @@ void parseOpts(int argc, char **argv)
         opts.numFrames = atoi(optarg);
         break;
       case 'f':
-        opts.videoFile = optarg;
-        inputSrc++;
+        opts.inputs[opts.numInputs++] = optarg;
+        break;
+      case 'k':
+        opts.kernel = optarg;
+        fixed |= TUNE_KERNEL;
+        break;
+      case 'e':
+        opts.events = optarg;
+        break;
+      case 'r':
+        if (sscanf(optarg, "%dx%d", &opts.capWidth, &opts.capHeight) != 2 ||
+            opts.capWidth <= 0 || opts.capHeight <= 0) {
+          EPRINTF("Invalid capture size: %s (expected <W>x<H>, e.g. 1920x1080)\n", optarg);
+          exit(-1);
+        }
         break;
       case '?':
-        if (optopt == 'n' || optopt == 'f') {
+        if (optopt == 'n' || optopt == 'f' || optopt == 'k' || optopt == 'r' ||
+            optopt == 't' || optopt == 'b' || optopt == 'o' || optopt == 'e') {
           EPRINTF("Option %c requires an argument\n", optopt);
         }
         else if (isprint(optopt)) {
@@ -59,78 +256,197 @@ void parseOpts(int argc, char **argv)
     }
   }
 
+  for (int i = optind; i < argc; i++) {
+    opts.inputs[opts.numInputs++] = argv[i];
+  }
+  if (opts.numInputs > 0) {
+    opts.videoFile = opts.inputs[0];
+    inputSrc++;
+  }
+
   // Validate opts
   if (opts.numFrames <= 0) {
     EPRINTF("Invalid number of frames: %d (must be >0)\n", opts.numFrames);
     printHelp(argc, argv);
     exit(-1);
   }
+  if (opts.numThreads < 0 || opts.numThreads > POOL_MAX_THREADS) {
+    EPRINTF("Invalid number of threads: %d (must be 0..%d)\n", opts.numThreads, POOL_MAX_THREADS);
+    exit(-1);
+  }
+  if (opts.sink == NULL) {
+    opts.sink = (char *)(opts.headless || opts.gradient || opts.numInputs > 1 ? "null" : "window");
+  }
+  frame_sink_t sink;
+  if (sink_open(&sink, opts.sink, 0) != 0) {
+    EPRINTF("Invalid output sink: %s\n", opts.sink);
+    printHelp(argc, argv);
+    exit(-1);
+  }
+  if (opts.headless && sink.type == SINK_WINDOW) {
+    EPRINTF("--headless cannot be combined with the window sink\n");
+    exit(-1);
+  }
+  if (opts.numInputs > 1 && sink.type == SINK_WINDOW) {
+    EPRINTF("Several inputs cannot share the window sink; use -o null, raw:<path> or video:<path>\n");
+    exit(-1);
+  }
+  if (opts.fused && opts.filter != FILTER_SOBEL) {
+    EPRINTF("-F only fuses grayscale with Sobel; drop it to use --filter %s\n", filters[opts.filter].name);
+    exit(-1);
+  }
+  if (opts.gradient && (opts.fused || opts.filter != FILTER_SOBEL)) {
+    EPRINTF("--gradient is its own Sobel pass; it cannot be combined with -F or --filter\n");
+    exit(-1);
+  }
+  if (opts.gradient && (sink.type == SINK_WINDOW || sink.type == SINK_VIDEO || sink.type == SINK_EDGES)) {
+    EPRINTF("--gradient frames are not images; use -o null, raw:<path> or mmap:<path>\n");
+    exit(-1);
+  }
+  if (opts.incremental && (opts.fused || opts.pipelined || opts.numInputs > 1)) {
+    EPRINTF("--incremental keeps one frame's gray and Sobel buffers; it cannot be combined with -F, -p or several inputs\n");
+    exit(-1);
+  }
+  if (opts.tiled && (opts.fused || opts.incremental || opts.pyramid || opts.pipelined || opts.numInputs > 1)) {
+    EPRINTF("--tiled converts each tile itself; it cannot be combined with -F, --incremental, --pyramid, -p or several inputs\n");
+    exit(-1);
+  }
+  if (opts.pyramid && (opts.fused || opts.gradient || opts.incremental || opts.pipelined || opts.numInputs > 1)) {
+    EPRINTF("--pyramid cannot be combined with -F, --gradient, --incremental, -p or several inputs\n");
+    exit(-1);
+  }
+  int luma = 0;
+  for (int n = 0; n < opts.numInputs; n++) {
+    luma |= source_is_luma(opts.inputs[n]);
+  }
+  if (luma && (opts.fused || opts.tiled || opts.incremental || opts.pyramid || opts.autotune)) {
+    EPRINTF("Y4M, yuv: and v4l2: input is gray already; it cannot be combined with -F, --tiled, --incremental, --pyramid or --autotune\n");
+    exit(-1);
+  }
+  int deep = 0;
+  for (int n = 0; n < opts.numInputs; n++) {
+    deep |= source_bits(opts.inputs[n]) > 8;
+  }
+  if (deep && (opts.fused || opts.tiled || opts.incremental || opts.pyramid || opts.autotune ||
+               opts.gradient || opts.filter != FILTER_SOBEL)) {
+    EPRINTF("16-bit input only runs the two-pass Sobel; it cannot be combined with -F, --tiled, --incremental,\n"
+            "--pyramid, --autotune, --gradient or --filter\n");
+    exit(-1);
+  }
+  if (deep && (sink.type == SINK_VIDEO || sink.type == SINK_EDGES)) {
+    EPRINTF("16-bit input gives 16-bit output frames; use -o window, null, raw:<path> or mmap:<path>\n");
+    exit(-1);
+  }
+  if (opts.numInputs > 1 && opts.pipelined) {
+    EPRINTF("-p takes a single input\n");
+    exit(-1);
+  }
+  if (opts.targetFps > 0 && (opts.pipelined || opts.numInputs > 1)) {
+    EPRINTF("--target-fps governs the -m pool; it cannot be combined with -p or several inputs\n");
+    exit(-1);
+  }
   if (inputSrc == 0) {
-    if (opts.videoFile == NULL) {
-      opts.videoFile = defaultVideo;
-    }
+    opts.videoFile = defaultVideo;
+    opts.inputs[opts.numInputs++] = defaultVideo;
   } else if (inputSrc > 1) {
     EPRINTF("Both file and webcam options specified; please specify either -f or -w, not both\n");
     printHelp(argc, argv);
     exit(-1);
   }
+
+  if (pc_configure(opts.events != NULL ? opts.events : PC_DEFAULT_EVENTS) != 0) {
+    EPRINTF("Unknown hardware counter in '%s' (known: %s)\n", opts.events, pc_event_names());
+    exit(-1);
+  }
+
+  // Per host tuning: --autotune measures and saves a profile, otherwise a
+  // saved one fills in whatever the command line left open
+  const char *profile = opts.profile != NULL ? opts.profile : profile_default_path();
+  tune_profile_t tuned;
+  if (opts.autotune) {
+    if (kernels_select(opts.kernel) == NULL) {
+      EPRINTF("Kernel backend '%s' is unknown or not supported by this CPU (built: %s)\n",
+              opts.kernel, kernels_available());
+      exit(-1);
+    }
+    autotune(&tuned, fixed);
+    if (strcmp(profile, "none") != 0 && profile_save(profile, &tuned) != 0) {
+      warn("Cannot write profile %s", profile);
+    }
+    profile_apply(&tuned, fixed);
+  } else if (strcmp(profile, "none") != 0 && profile_load(profile, &tuned) == 0) {
+    profile_apply(&tuned, fixed);
+    EPRINTF("Using profile %s: %s %s, %d threads\n", profile, tuned.kernel,
+            tune_mode_name(tuned.mode), tuned.threads);
+  }
+
+  // Pick the SIMD backend for grayScale/sobelCalc
+  if (kernels_select(opts.kernel) == NULL) {
+    EPRINTF("Kernel backend '%s' is unknown or not supported by this CPU (built: %s)\n",
+            opts.kernel, kernels_available());
+    exit(-1);
+  }
+
+  // After tuning, so the tuner's own pools are not pinned
+  affinity_init();
   return;
 }
 
 int mainSingleThread()
 {
+  // One thread does everything: the capture CPU if given, else a compute one
+  affinity_pin_self(AFF_CAPTURE);
+  affinity_pin_self(AFF_COMPUTE);
   runSobelST();
   return 0;
 }
 
-// This mutex will be used to allow threads to contest for thread 0 status
-pthread_barrier_t endSobel;
-pthread_barrier_t barr_capture, barr_gray, barr_sobel, barr_display;
-pthread_mutex_t thread0 = PTHREAD_MUTEX_INITIALIZER;
-pthread_t thread0_id = 0;
 int mainMultiThread()
 {
-  // Thread variables
-  pthread_t sobel1, sobel2;
-
-  // Set up barriers to synchronize both threads
-  pthread_barrier_init(&endSobel, NULL, 2);
-  pthread_barrier_init(&barr_capture, NULL, 2);
-  pthread_barrier_init(&barr_gray, NULL, 2);
-  pthread_barrier_init(&barr_sobel, NULL, 2);
-  pthread_barrier_init(&barr_display, NULL, 2);
-
-  // Call threads
-  int ret;
-  if ( (ret = pthread_create( &sobel1, NULL, runSobelMT, NULL)) ){
-    printf("Thread creation failed: %d\n", ret);
-    exit(1);
-  }
-  if ( (ret = pthread_create( &sobel2, NULL, runSobelMT, NULL)) ){
-    printf("Thread creation failed: %d\n", ret);
-    exit(1);
-  }
-
-  // Wait for them to finish
-  pthread_join(sobel1, NULL);
-  pthread_join(sobel2, NULL);
-
-  // Destroy the barriers
-  pthread_barrier_destroy(&endSobel);
-  pthread_barrier_destroy(&barr_capture);
-  pthread_barrier_destroy(&barr_gray);
-  pthread_barrier_destroy(&barr_sobel);
-  pthread_barrier_destroy(&barr_display);
+  // Persistent workers shared by every frame. The calling thread captures
+  // and is worker 0, so it is placed as the capture thread first.
+  affinity_pin_self(AFF_CAPTURE);
+  thread_pool_t *pool = pool_create(opts.numThreads);
+  affinity_pool(pool);
+
+  runSobelMT(pool);
+
+  pool_destroy(pool);
 
   // Return ok if sobel returns correctly
   return 0;
 }
 
+int mainMultiStream()
+{
+  // One pool shared by every stream
+  affinity_pin_self(AFF_CAPTURE);
+  thread_pool_t *pool = pool_create(opts.numThreads);
+  affinity_pool(pool);
+
+  runSobelMulti(pool);
+
+  pool_destroy(pool);
+  return 0;
+}
+
+int mainPipeline()
+{
+  runSobelPipe();
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
   parseOpts(argc, argv);
 
-  if (opts.multiThreaded == 0) {
+  if (opts.numInputs > 1) {
+    mainMultiStream();
+  }
+  else if (opts.pipelined) {
+    mainPipeline();
+  }
+  else if (opts.multiThreaded == 0) {
     mainSingleThread();
   }
   else if (opts.multiThreaded == 1) {
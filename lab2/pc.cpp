@@ -1,187 +1,280 @@
 #include "pc.h"
 #include <stdio.h>
+#include <iostream>
 #include <stdlib.h>
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
 #include <time.h>
-#include <iostream>
-#include <fstream>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
-#include <locale.h>
+#include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include <err.h>
 
-#ifdef __arm__
-#include <perfmon/pfmlib.h>
-#include <perfmon/pfmlib_perf_event.h>
-#endif
+// Events pc_configure knows, named as perf(1) names them
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} pc_events[PC_NUM_EVENTS] = {
+  { "cycles",                PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "L1-dcache-load-misses", PERF_TYPE_HW_CACHE,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  { "LLC-load-misses",       PERF_TYPE_HW_CACHE,
+    PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  { "branches",              PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+  { "branch-misses",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "cache-references",      PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { "cache-misses",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+static int configured[PC_NUM_EVENTS];
+static int is_configured = 0;
+static int warned[PC_NUM_EVENTS];
 
-// Setup the counters and populate the counters struct with their data
-void pc_init(counters_t *counters, int pid)
+static uint64_t now_ns()
 {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-#ifndef __arm__
-  return;
+static int perf_event_open(struct perf_event_attr *attr, pid_t tid, int cpu, int group_fd, unsigned long flags)
+{
+  return syscall(__NR_perf_event_open, attr, tid, cpu, group_fd, flags);
+}
 
-#else
-  int ret;
-  ret = pfm_initialize();
+/*******************************************
+ * Model: pc_configure
+ * Input: comma separated event names
+ * Output: 0, or -1 if a name is unknown
+ * Desc: Picks the events every counters_t opened from now on will count
+ ********************************************/
+int pc_configure(const char *list)
+{
+  char *copy = strdup(list);
+  char *save = NULL;
+  int ret = 0;
 
-  if (ret != PFM_SUCCESS) {
-    errx(1, "cannot initialize library: %s", pfm_strerror(ret));
+  memset(configured, 0, sizeof(configured));
+  for (char *name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    int e;
+    for (e = 0; e < PC_NUM_EVENTS; e++) {
+      if (strcasecmp(name, pc_events[e].name) == 0) {
+        configured[e] = 1;
+        break;
+      }
+    }
+    if (e == PC_NUM_EVENTS) {
+      ret = -1;
+    }
   }
+  free(copy);
+  is_configured = 1;
+  return ret;
+}
 
-  // Set values for getting cycle count
-  memset(&counters->cycles.attr, 0, sizeof(counters->cycles.attr));
-  memset(&counters->l1_misses.attr, 0, sizeof(counters->l1_misses.attr));
-  memset(&counters->ic.attr, 0, sizeof(counters->ic.attr));
+const char *pc_event_names()
+{
+  static char names[256];
+
+  if (names[0] == '\0') {
+    for (int e = 0; e < PC_NUM_EVENTS; e++) {
+      strcat(names, e > 0 ? ", " : "");
+      strcat(names, pc_events[e].name);
+    }
+  }
+  return names;
+}
 
-  memset(&counters->cycles.arg, 0, sizeof(counters->cycles.arg));
-  memset(&counters->l1_misses.arg, 0, sizeof(counters->l1_misses.arg));
-  memset(&counters->ic.arg, 0, sizeof(counters->ic.arg));
+const char *pc_event_name(int event)
+{
+  return pc_events[event].name;
+}
 
-  counters->cycles.count = 0;
-  counters->l1_misses.count = 0;
-  counters->ic.count = 0;
+int pc_configured(int event)
+{
+  return configured[event];
+}
 
-  counters->cycles.arg.size = sizeof(counters->cycles.arg);
-  counters->l1_misses.arg.size = sizeof(counters->l1_misses.arg);
-  counters->ic.arg.size = sizeof(counters->ic.arg);
+// Open one event for a thread, user and kernel mode if allowed, else user
+// mode only (perf_event_paranoid >= 2)
+static int pc_open(int event, pid_t tid, int group_fd)
+{
+  struct perf_event_attr attr;
 
-  counters->cycles.arg.attr = &counters->cycles.attr;
-  counters->l1_misses.arg.attr = &counters->l1_misses.attr;
-  counters->ic.arg.attr = &counters->ic.attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = pc_events[event].type;
+  attr.config = pc_events[event].config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  // do not start immediately after perf_event_open(); the leader gates the group
+  attr.disabled = group_fd == -1;
 
-  // Get the encoding for the events
-  // cycles
-  ret = pfm_get_os_event_encoding("cycles", PFM_PLM0|PFM_PLM3, PFM_OS_PERF_EVENT, &counters->cycles.arg);
-  if (ret != PFM_SUCCESS) {
-    err(1,"Cycles: cannot get encoding %s", pfm_strerror(ret));
+  int fd = perf_event_open(&attr, tid, -1, group_fd, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = perf_event_open(&attr, tid, -1, group_fd, 0);
   }
-  // l1 cache misses
-  ret = pfm_get_os_event_encoding("l1-dcache-load-misses", PFM_PLM0|PFM_PLM3, PFM_OS_PERF_EVENT, &counters->l1_misses.arg);
-  if (ret != PFM_SUCCESS) {
-    err(1,"L1 Cache Misses:cannot get encoding %s", pfm_strerror(ret));
+  if (fd < 0 && !warned[event]) {
+    warned[event] = 1;
+    warn("perf counter %s unavailable", pc_events[event].name);
   }
+  return fd;
+}
 
-  // instruction count misses
-  ret = pfm_get_os_event_encoding("instructions", PFM_PLM0|PFM_PLM3, PFM_OS_PERF_EVENT, &counters->ic.arg);
-  if (ret != PFM_SUCCESS) {
-    err(1,"Instruction Count:cannot get encoding %s", pfm_strerror(ret));
-  }
-
-  // Set more options
-  counters->cycles.attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
-  counters->l1_misses.attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
-  counters->ic.attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
-
-  // do not start immediately after perf_event_open()
-  counters->cycles.attr.disabled = 1;
-  counters->l1_misses.attr.disabled = 1;
-  counters->ic.attr.disabled = 1;
-
-  // Open the counters
-  counters->cycles.fd = perf_event_open(&counters->cycles.attr, pid, -1, -1, 0);
-  if (counters->cycles.fd < 0) {
-    err(1, "Cycle: cannot create event");
+void pc_init(counters_t *counters, pid_t tid)
+{
+  if (!is_configured) {
+    pc_configure(PC_DEFAULT_EVENTS);
   }
+  counters->nthreads = 0;
+  memset(counters->open, 0, sizeof(counters->open));
+  memset(counters->count, 0, sizeof(counters->count));
+  counters->ns = 0;
+  pc_attach(counters, tid);
+}
 
-  counters->l1_misses.fd = perf_event_open(&counters->l1_misses.attr, pid, -1, -1, 0);
-  if (counters->l1_misses.fd < 0) {
-    err(1, "L1 miss: cannot create event");
+/*******************************************
+ * Model: pc_attach
+ * Input: counter set, thread id (0 for the calling thread)
+ * Output: None
+ * Desc: Opens one group with every configured event for the thread. The
+ *  first event that opens leads the group; events the host cannot count
+ *  are left out of it.
+ ********************************************/
+void pc_attach(counters_t *counters, pid_t tid)
+{
+  if (counters->nthreads >= PC_MAX_THREADS) {
+    errx(1, "pc_attach: more than %d threads", PC_MAX_THREADS);
   }
+  pc_group_t *g = &counters->groups[counters->nthreads++];
 
-  counters->ic.fd = perf_event_open(&counters->ic.attr, pid, -1, -1, 0);
-  if (counters->ic.fd < 0) {
-    err(1, "Instruction count: cannot create event");
+  g->nopen = 0;
+  for (int e = 0; e < PC_NUM_EVENTS; e++) {
+    if (!configured[e]) {
+      continue;
+    }
+    int fd = pc_open(e, tid, g->nopen > 0 ? g->fd[0] : -1);
+    if (fd >= 0) {
+      g->fd[g->nopen] = fd;
+      g->event[g->nopen] = e;
+      g->nopen++;
+      counters->open[e] = 1;
+    }
   }
-  return;
-#endif
 }
 
 void pc_start(counters_t *counters)
 {
-  counters->cycles.count = 0;
-  counters->l1_misses.count = 0;
-  counters->ic.count = 0;
-
-#ifndef __arm__
-  return;
-
-#else
-  int ret;
-  ret = ioctl(counters->cycles.fd, PERF_EVENT_IOC_RESET, 0);
-  if (ret) {
-    err(1, "ioctl(reset) failed");
-  }
+  memset(counters->count, 0, sizeof(counters->count));
 
-  ret = ioctl(counters->l1_misses.fd, PERF_EVENT_IOC_RESET, 0);
-  if (ret) {
-    err(1, "ioctl(reset) failed");
+  for (int t = 0; t < counters->nthreads; t++) {
+    pc_group_t *g = &counters->groups[t];
+    if (g->nopen == 0) {
+      continue;
+    }
+    if (ioctl(g->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP)) {
+      err(1, "ioctl(reset) failed");
+    }
+    if (ioctl(g->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+      err(1, "ioctl(enable) failed");
+    }
   }
+  counters->t_start = now_ns();
+}
 
-  ret = ioctl(counters->ic.fd, PERF_EVENT_IOC_RESET, 0);
-  if (ret) {
-    err(1, "ioctl(reset) failed");
-  }
+/*******************************************
+ * Model: pc_stop
+ * Input: counter set
+ * Output: None directly. Fills counters->count and counters->ns
+ * Desc: Stops every group and sums the counts over the threads. A group the
+ *  PMU could only schedule part of the time (more events than hardware
+ *  counters) is scaled up by enabled/running time.
+ ********************************************/
+void pc_stop(counters_t *counters)
+{
+  counters->ns = now_ns() - counters->t_start;
 
-  ret = ioctl(counters->cycles.fd, PERF_EVENT_IOC_ENABLE, 0);
-  if (ret) {
-    err(1, "ioctl(enable) failed");
+  for (int t = 0; t < counters->nthreads; t++) {
+    pc_group_t *g = &counters->groups[t];
+    if (g->nopen == 0) {
+      continue;
+    }
+    ioctl(g->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
   }
 
-  ret = ioctl(counters->l1_misses.fd, PERF_EVENT_IOC_ENABLE, 0);
-  if (ret) {
-    err(1, "ioctl(enable) failed");
-  }
+  for (int t = 0; t < counters->nthreads; t++) {
+    pc_group_t *g = &counters->groups[t];
+    // nr, time enabled, time running, one value per event
+    uint64_t values[3 + PC_NUM_EVENTS];
 
-  ret = ioctl(counters->ic.fd, PERF_EVENT_IOC_ENABLE, 0);
-  if (ret) {
-    err(1, "ioctl(enable) failed");
+    if (g->nopen == 0) {
+      continue;
+    }
+    if (read(g->fd[0], values, sizeof(values)) < (ssize_t)((3 + g->nopen) * sizeof(uint64_t))) {
+      continue;
+    }
+    double scale = values[2] ? (double)values[1] / values[2] : 0;
+    for (int k = 0; k < g->nopen; k++) {
+      counters->count[g->event[k]] += (uint64_t)(values[3 + k] * scale);
+    }
   }
-  return;
-#endif
 }
 
-void pc_stop(counters_t *counters)
+int pc_available(counters_t *counters, int event)
 {
-#ifndef __arm__
-  return;
-#else
-  ioctl(counters->cycles.fd, PERF_EVENT_IOC_DISABLE, 0);
-  ioctl(counters->l1_misses.fd, PERF_EVENT_IOC_DISABLE, 0);
-  ioctl(counters->ic.fd, PERF_EVENT_IOC_DISABLE, 0);
-
-  read(counters->cycles.fd, counters->cycles.values, sizeof(counters->cycles.values));
-  read(counters->l1_misses.fd, counters->l1_misses.values, sizeof(counters->l1_misses.values));
-  read(counters->ic.fd, counters->ic.values, sizeof(counters->ic.values));
-
-  if (counters->cycles.values[2]) {
-    counters->cycles.count = (uint64_t)((double)counters->cycles.values[0] *
-		     counters->cycles.values[1]/counters->cycles.values[2]);
-  }
-  else {
-    counters->cycles.count = (uint64_t)counters->cycles.values[0];
-  }
+  return counters->open[event];
+}
 
-  if (counters->l1_misses.values[2]) {
-    counters->l1_misses.count = (uint64_t)
-      ((double)counters->l1_misses.values[0] *
-       counters->l1_misses.values[1]/counters->l1_misses.values[2]);
-  }
-  else {
-    counters->l1_misses.count = (uint64_t)counters->l1_misses.values[0];
+void pc_close(counters_t *counters)
+{
+  for (int t = 0; t < counters->nthreads; t++) {
+    pc_group_t *g = &counters->groups[t];
+    for (int k = 0; k < g->nopen; k++) {
+      close(g->fd[k]);
+    }
+    g->nopen = 0;
   }
+  counters->nthreads = 0;
+}
 
-  if (counters->ic.values[2]) {
-    counters->ic.count = (uint64_t)((double)counters->ic.values[0] * 
-			    counters->ic.values[1]/counters->ic.values[2]);
+static void pc_line(std::ostream &out, const char *label, int available, double value)
+{
+  out << label << ", ";
+  if (available) {
+    out << value << std::endl;
+  } else {
+    out << "n/a" << std::endl;
   }
-  else {
-    counters->ic.count = (uint64_t)counters->ic.values[0];
+}
+
+/*******************************************
+ * Model: pc_report
+ * Input: output stream, counter set, totals over the run, frame count
+ * Output: None
+ * Desc: Derived ratios first, then every configured event per frame.
+ *  Events the host could not count are written as n/a rather than 0.
+ ********************************************/
+void pc_report(std::ostream &out, counters_t *counters, const uint64_t *totals, int frames)
+{
+  int cyc = pc_available(counters, PC_CYCLES);
+  int ins = pc_available(counters, PC_INSTRUCTIONS);
+  int l1 = pc_available(counters, PC_L1D_MISSES);
+
+  out << "\nHardware Stats (Cap + Gray + Sobel + Display, " << counters->nthreads
+      << (counters->nthreads == 1 ? " thread)" : " threads)") << std::endl;
+  pc_line(out, "Instructions per cycle", ins && cyc, pc_ratio(totals[PC_INSTRUCTIONS], totals[PC_CYCLES]));
+  pc_line(out, "L1 misses per frame", l1, pc_ratio(totals[PC_L1D_MISSES], frames));
+  pc_line(out, "L1 misses per instruction", l1 && ins, pc_ratio(totals[PC_L1D_MISSES], totals[PC_INSTRUCTIONS]));
+  pc_line(out, "Instruction count per frame", ins, pc_ratio(totals[PC_INSTRUCTIONS], frames));
+  for (int e = 0; e < PC_NUM_EVENTS; e++) {
+    if (configured[e]) {
+      out << pc_events[e].name;
+      pc_line(out, " per frame", pc_available(counters, e), pc_ratio(totals[e], frames));
+    }
   }
-  return;
-#endif
 }
@@ -1,31 +1,83 @@
 #ifndef PERF_COUNTER_H
  #define PERF_COUNTER_H
 
-  #ifdef __arm__
-    #include <perfmon/pfmlib.h>
-    #include <perfmon/pfmlib_perf_event.h>
-  #else
-struct pfm_perf_encode_arg_t{};
-struct perf_event_attr{};
-typedef unsigned long uint64_t;
-  #endif
-
-struct perf_counter_t{
-  struct perf_event_attr attr;
-  pfm_perf_encode_arg_t arg;
-  int fd;
-  uint64_t count, values[3];
+#include <stdint.h>
+#include <sys/types.h>
+#include <ostream>
+
+// Hardware counters through perf_event_open(2), on any Linux CPU. The events
+// to count are picked once with pc_configure. A counters_t holds one counter
+// group per measured thread (all events of a thread are scheduled onto the
+// PMU together, so their ratios are consistent) and pc_stop sums the groups,
+// so a pool's workers can be measured as one unit. Events the host does not
+// have, or is not allowed to count, read as 0; pc_available tells which.
+
+enum pc_event_t {
+  PC_CYCLES,
+  PC_INSTRUCTIONS,
+  PC_L1D_MISSES,
+  PC_LLC_MISSES,
+  PC_BRANCHES,
+  PC_BRANCH_MISSES,
+  PC_CACHE_REFS,
+  PC_CACHE_MISSES,
+  PC_NUM_EVENTS
+};
+
+#define PC_DEFAULT_EVENTS "cycles,instructions,L1-dcache-load-misses"
+#define PC_MAX_THREADS 256
+
+// The counters of one thread. fd[0] leads the group; event[k] is what fd[k]
+// counts, in the order the kernel reports the group's values.
+struct pc_group_t {
+  int nopen;
+  int fd[PC_NUM_EVENTS];
+  int event[PC_NUM_EVENTS];
 };
 
-struct counters_t{
-  perf_counter_t cycles;
-  perf_counter_t l1_misses;
-  perf_counter_t ic;
+struct counters_t {
+  int nthreads;
+  pc_group_t groups[PC_MAX_THREADS];
+  int open[PC_NUM_EVENTS];       // event could be opened for some thread
+  uint64_t count[PC_NUM_EVENTS]; // last start/stop interval, summed over threads
+  uint64_t ns;                   // wall time of the last interval
+  uint64_t t_start;
 };
 
+// Select the events to count from a comma separated list of names (see
+// pc_event_names). Returns -1 on an unknown name.
+int pc_configure(const char *list);
+const char *pc_event_names();
+const char *pc_event_name(int event);
+int pc_configured(int event);
+
+// Measure thread `tid` (0 for the calling thread). pc_init resets the set,
+// pc_attach adds one more thread to it.
+void pc_init(counters_t *counters, pid_t tid);
+void pc_attach(counters_t *counters, pid_t tid);
 
-void pc_init(counters_t *counters, int pid);
 void pc_start(counters_t *counters);
 void pc_stop(counters_t *counters);
 
+// Whether `event` is configured and could be opened on this host
+int pc_available(counters_t *counters, int event);
+
+void pc_close(counters_t *counters);
+
+// Add the last interval's counts to running totals
+static inline void pc_accumulate(counters_t *counters, uint64_t *totals)
+{
+  for (int e = 0; e < PC_NUM_EVENTS; e++) {
+    totals[e] += counters->count[e];
+  }
+}
+
+// Write the "Hardware Stats" section of a report from accumulated totals
+void pc_report(std::ostream &out, counters_t *counters, const uint64_t *totals, int frames);
+
+static inline double pc_ratio(double num, double den)
+{
+  return den > 0 ? num / den : 0;
+}
+
 #endif
@@ -1,48 +1,159 @@
-#ifndef SOBEL_ALG_H
-#define SOBEL_ALG_H
-
-#include <stdio.h>
-#include <stdlib.h>
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-#include <iostream>
-#include <fstream>
-#include <unistd.h>
-#include <string.h>
-#include <locale.h>
-#include <err.h>
-
-#define IMG_WIDTH 640
-#define IMG_HEIGHT 480
-#define STEP0 1920
-#define STEP1 3
-#define PROC_FREQ 866000000
-#define PROC_EPC 1.4
-#define NCORES 1
-
-using namespace cv;
-using namespace std;
-
-//This mutex will be used to allow threads to contest for thread 0 status
-extern pthread_barrier_t endSobel;
-extern pthread_barrier_t barr_capture, barr_gray, barr_sobel, barr_display;
-extern pthread_mutex_t thread0;
-extern pthread_t thread0_id;
-
-
-// Commandline options
-struct opts {
-  char *videoFile;
-  int webcam;
-  int numFrames;
-  int multiThreaded;
-};
-
-extern struct opts opts;
-
-void sobelCalc(Mat& img_gray, Mat& img_sobel_out, int startRow = 0, int endRow = 0);
-void grayScale(Mat& img, Mat& img_gray_out, int startRow = 0, int endRow = 0);
-
-void runSobelST();
-void *runSobelMT(void *ptr);
-#endif
+#ifndef SOBEL_ALG_H
+#define SOBEL_ALG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <err.h>
+#include "thread_pool.h"
+
+#define PROC_FREQ 866000000
+#define PROC_EPC 1.4
+#define NCORES 1
+
+// Phase times are reported in cycles of the nominal PROC_FREQ clock, taken
+// from wall time so they mean the same thing on hosts without a cycle counter
+// and when the counters are summed over several threads
+#define NS_TO_CYCLES(ns) ((ns) * (PROC_FREQ / 1e9))
+
+using namespace cv;
+using namespace std;
+
+// Commandline options
+struct opts {
+  char *videoFile;
+  char **inputs;  // every -f file and trailing argument; more than one runs multi-stream
+  int numInputs;
+  int webcam;
+  int numFrames;
+  int multiThreaded;
+  int pipelined; // capture/compute/display as concurrent pipeline stages
+  int headless;  // no window and no cvWaitKey
+  char *sink;    // output sink spec, see frame_sink.h
+  char *kernel;  // backend name from -k, NULL for auto detection
+  int fused;     // fused grayscale+Sobel instead of two full frame passes
+  int capWidth;  // capture size requested with -r, 0 to keep the source's own
+  int capHeight;
+  int numThreads; // workers for the multi-threaded version, 0 = one per CPU
+  int bandRows;   // rows per stealable band, 0 = pick from frame size and threads
+  char *events;   // hardware counters to collect, see pc.h
+  int filter;     // filter_t from --filter, FILTER_SOBEL by default
+  int gradient;   // L2 magnitude + orientation planes instead of |Gx|+|Gy|
+  int incremental; // recompute only tiles that changed since the last frame
+  long incrSad;    // per tile SAD above which a tile counts as changed
+  int tileWidth;   // --incremental/--tiled tile size, 0 for the mode's default
+  int tileHeight;
+  int pyramid;     // levels of the multi-scale pyramid, 0 for a single frame
+  int tiled;       // 2D cache blocked gray+Sobel instead of row bands
+  int autotune;    // measure and save the per host profile at startup
+  char *profile;   // profile path, NULL for the default (see autotune.h)
+  char *cpus;      // CPU list compute workers are pinned to (see affinity.h)
+  int captureCpu;  // CPU for the capture / output thread, -1 to leave unpinned
+  int outputCpu;
+  int rtPrio;      // SCHED_FIFO priority, 0 for normal scheduling
+  int edgeThreshold; // edges:<path> sink: pixels above this are edges
+  double targetFps;  // -m paced to this rate on the fewest workers, 0 = unpaced
+};
+
+extern struct opts opts;
+
+void sobelCalc(Mat& img_gray, Mat& img_sobel_out, int startRow = 0, int endRow = 0,
+               unsigned char *lines = NULL);
+void filterCalc(Mat& img_gray, Mat& img_out, int filter, int startRow = 0, int endRow = 0,
+                int *scratch = NULL);
+size_t lineBytes(int cols);
+void gradientCalc(Mat& img_gray, Mat& img_out, int startRow = 0, int endRow = 0);
+void gradientPlanes(Mat& img_out, Mat& mag, Mat& ori);
+void sobelSpan(Mat& img_gray, Mat& img_out, int row, int x0, int x1, unsigned char *lines = NULL);
+int sobelRadius();
+const char *filterName();
+const char *sobelStageName();
+void grayScale(Mat& img, Mat& img_gray_out, int startRow = 0, int endRow = 0);
+void sobelFused(Mat& img, Mat& img_sobel_out, int startRow = 0, int endRow = 0,
+                unsigned char *lines = NULL);
+
+// Frame pool backed images (see frame_pool.h)
+void poolMat(Mat& m, int rows, int cols, int type);
+void poolRelease(Mat& m);
+void outputMat(Mat& m, int rows, int cols, int depth = CV_8U);
+
+CvCapture *openCapture(const char *videoFile = NULL);
+
+// Cache blocked execution (--tiled), see sobel_tiled.cpp. Set src/sobel,
+// call tiledPlan every frame and run tiledBand over the tiles_x * tiles_y
+// tiles.
+struct tiled_job_t {
+  Mat *src, *sobel;
+  int rows, cols;
+  int tile_w, tile_h, tiles_x, tiles_y;
+  long l1, l2;                            // cache sizes the tiles were sized for
+  unsigned char *bufs[POOL_MAX_THREADS];  // per worker gray tile + halo
+  size_t buf_stride;
+  unsigned char *lines[POOL_MAX_THREADS]; // --filter scratch per worker
+};
+void tiledPlan(tiled_job_t *job, int nthreads);
+void tiledBand(void *arg, int tile, int worker);
+void tiledFree(tiled_job_t *job);
+
+// Multi-scale pyramid (--pyramid), see sobel_pyramid.cpp. gray[0] is the
+// frame's own gray image; sobel[l] are views into the composite output.
+#define PYR_MAX_LEVELS 4
+struct pyramid_t {
+  int levels;
+  Mat gray[PYR_MAX_LEVELS];
+  Mat sobel[PYR_MAX_LEVELS];
+};
+int pyramidCols(int cols);
+void pyramidPlan(pyramid_t *pyr, Mat& img_gray, Mat& img_out);
+void pyramidFree(pyramid_t *pyr);
+void pyramidGray(Mat& img, pyramid_t *pyr, int startRow = 0, int endRow = 0);
+void pyramidSobel(pyramid_t *pyr, int startRow = 0, int endRow = 0, unsigned char *lines = NULL);
+
+// One frame split into row bands for a thread_pool_t (see sobel_bands.cpp)
+struct band_job_t {
+  Mat *src, *gray, *sobel;
+  int band_rows, num_bands;
+  // Fused / filter line buffers, one per pool worker, allocated by planBands
+  unsigned char *lines[POOL_MAX_THREADS];
+  int line_width;
+  pyramid_t *pyr; // --pyramid levels for pyramidGrayBand/pyramidSobelBand
+};
+void planBands(band_job_t *job, int rows, int cols, int nthreads);
+void freeBands(band_job_t *job);
+void grayBand(void *arg, int band, int worker);
+void sobelBand(void *arg, int band, int worker);
+void fusedBand(void *arg, int band, int worker);
+void pyramidGrayBand(void *arg, int band, int worker);
+void pyramidSobelBand(void *arg, int band, int worker);
+
+// Incremental processing, see sobel_incr.cpp. Set src/gray/sobel, call
+// incrPlan every frame, run incrGrayBand then incrSobelBand over the
+// tiles_y tile rows and close the frame with incrEndFrame.
+struct incr_job_t {
+  Mat *src, *gray, *sobel;
+  int rows, cols;
+  int tile_w, tile_h, tiles_x, tiles_y;
+  unsigned char *prev;      // source pixels the current gray/Sobel were computed from
+  size_t prev_stride;
+  unsigned char *dirty;     // tiles_x * tiles_y flags of the current frame
+  int reset;                // every tile is dirty (first frame, new geometry)
+  unsigned char *lines[POOL_MAX_THREADS]; // --filter scratch per worker
+  unsigned long tiles, dirty_tiles;       // totals over the run, for the report
+};
+void incrPlan(incr_job_t *job, int nthreads);
+void incrGrayBand(void *arg, int band, int worker);
+void incrSobelBand(void *arg, int band, int worker);
+int incrEndFrame(incr_job_t *job);
+void incrFree(incr_job_t *job);
+
+void runSobelST();
+void runSobelMT(thread_pool_t *pool);
+void runSobelPipe();
+void runSobelMulti(thread_pool_t *pool);
+#endif
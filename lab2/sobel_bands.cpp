@@ -0,0 +1,117 @@
+#include "sobel_alg.h"
+#include "frame_pool.h"
+#include "sobel_kernels.h"
+
+// Sobel band b covers output rows [1 + b*band_rows, 1 + (b+1)*band_rows)
+// clipped to rows-1. Gray band b covers the same rows shifted up by one, so
+// the first band also converts row 0 and the last one row rows-1.
+static void bandRange(band_job_t *job, int band, int *start, int *end)
+{
+  *start = 1 + band * job->band_rows;
+  *end = *start + job->band_rows;
+  if (*end > job->src->rows - 1) {
+    *end = job->src->rows - 1;
+  }
+}
+
+static void grayRange(band_job_t *job, int band, int *start, int *end)
+{
+  *start = band * job->band_rows;
+  *end = (band == job->num_bands - 1) ? job->src->rows : *start + job->band_rows;
+}
+
+void grayBand(void *arg, int band, int worker)
+{
+  band_job_t *job = (band_job_t *)arg;
+  int start, end;
+  grayRange(job, band, &start, &end);
+  grayScale(*job->src, *job->gray, start, end);
+}
+
+void sobelBand(void *arg, int band, int worker)
+{
+  band_job_t *job = (band_job_t *)arg;
+  int start, end;
+  bandRange(job, band, &start, &end);
+  sobelCalc(*job->gray, *job->sobel, start, end, job->lines[worker]);
+}
+
+void fusedBand(void *arg, int band, int worker)
+{
+  band_job_t *job = (band_job_t *)arg;
+  int start, end;
+  bandRange(job, band, &start, &end);
+  sobelFused(*job->src, *job->sobel, start, end, job->lines[worker]);
+}
+
+// --pyramid bands both use the gray band rows: planBands makes them a
+// multiple of 2^(levels-1), so each band owns whole rows of every level
+void pyramidGrayBand(void *arg, int band, int worker)
+{
+  band_job_t *job = (band_job_t *)arg;
+  int start, end;
+  grayRange(job, band, &start, &end);
+  pyramidGray(*job->src, job->pyr, start, end);
+}
+
+void pyramidSobelBand(void *arg, int band, int worker)
+{
+  band_job_t *job = (band_job_t *)arg;
+  int start, end;
+  grayRange(job, band, &start, &end);
+  pyramidSobel(job->pyr, start, end, job->lines[worker]);
+}
+
+/*******************************************
+ * Model: planBands
+ * Input: frame geometry, number of workers sharing the frame
+ * Output: None directly. Sets up the band fields of job
+ * Desc: Picks the band height: a few bands per worker so idle workers
+ *  have something to steal, but not so thin that per-band overhead shows.
+ *  -b overrides it. With --pyramid the height is rounded up to a multiple
+ *  of 2^(levels-1) (see pyramidGray). For the fused path and the --filter
+ *  operators it also takes every worker's line buffers from the frame pool
+ *  now, so none is allocated mid-run. --tiled has its own per worker
+ *  buffers (see tiledPlan) and takes none here.
+ ********************************************/
+void planBands(band_job_t *job, int rows, int cols, int nthreads)
+{
+  job->band_rows = opts.bandRows;
+  if (job->band_rows <= 0) {
+    job->band_rows = (rows - 2) / (nthreads * 4);
+    if (job->band_rows < 8) {
+      job->band_rows = 8;
+    }
+  }
+  if (opts.pyramid > 1) {
+    int align = 1 << (opts.pyramid - 1);
+    job->band_rows = (job->band_rows + align - 1) / align * align;
+  }
+  job->num_bands = (rows - 2 + job->band_rows - 1) / job->band_rows;
+  if (job->num_bands < 1) {
+    job->num_bands = 1;
+  }
+
+  if ((opts.fused || opts.filter != FILTER_SOBEL) && !opts.tiled && job->line_width < cols) {
+    for (int w = 0; w < nthreads; w++) {
+      fpool_release(job->lines[w]);
+      job->lines[w] = (unsigned char *)fpool_acquire(lineBytes(cols));
+    }
+    job->line_width = cols;
+  }
+}
+
+/*******************************************
+ * Model: freeBands
+ * Input: band job
+ * Output: None
+ * Desc: Returns the line buffers taken by planBands to the frame pool
+ ********************************************/
+void freeBands(band_job_t *job)
+{
+  for (int w = 0; w < POOL_MAX_THREADS; w++) {
+    fpool_release(job->lines[w]);
+    job->lines[w] = NULL;
+  }
+  job->line_width = 0;
+}
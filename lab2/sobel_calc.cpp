@@ -1,170 +1,357 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "sobel_alg.h"
-#include <arm_neon.h>
+#include "sobel_kernels.h"
+#include "frame_pool.h"
 using namespace cv;
 
 /*******************************************
  * Model: grayScale
  * Input: Mat img
  * Output: None directly. Modifies a ref parameter img_gray_out
- * Desc: This module converts the image to grayscale
+ * Desc: This module converts the image to grayscale using the row kernel
+ *  of the backend picked at startup (see kernels_select). Geometry comes
+ *  from img itself and row strides are honoured, so any frame size works.
+ *  16-bit frames (CV_16UC3 in, CV_16UC1 out) use gray16_row.
  ********************************************/
 void grayScale(Mat& img, Mat& img_gray_out, int startRow, int endRow)
 {
-  unsigned char *img_data = img.data; // data at this pointer is BGR BGR BGR
-  unsigned char *gray_data = img_gray_out.data;
+  int width = img.cols;
 
   // if both are 0 then this is single thread
   if (startRow == 0 && endRow == 0) {
-    endRow = IMG_HEIGHT;
+    endRow = img.rows;
   }
 
-  // Convert row bounds into pixel index bounds - grayscalle buff is flat
-  int startPx = startRow * IMG_WIDTH;
-  int endPx = endRow * IMG_WIDTH;
-
-  // Process 8 pixels at a time using neon intrinsics
-  int i = startPx;
-  for (; i <= endPx - 8; i += 8) {
-    // Load 8 BGR (blue green red interleaved) pixels into separate B, G, R channels
-    uint8x8x3_t rgb = vld3_u8(&img_data[i * 3]); //vector load three 8bit uints
-
-    // Widen to 16-bit to avoid overflow
-    uint16x8_t b = vmovl_u8(rgb.val[0]);
-    uint16x8_t g = vmovl_u8(rgb.val[1]);
-    uint16x8_t r = vmovl_u8(rgb.val[2]);
-
-    // Fixed point grayscalle approximation:
-    // gray = (7 Blue + 38 Green + 19 Red) / 64
-    // 0.114 ~ 7/64, 0.587 ~ 38/64, 0.299 ~ 19/64
-
-    // Multiply the B G R channels and accumulate into gray vector
-    uint16x8_t gray = vmulq_n_u16(b, 7); // vector multiply qextended nconstant
-    gray = vmlaq_n_u16(gray, g, 38); // vector multiply accumulate
-    gray = vmlaq_n_u16(gray, r, 19);
-
-    // Divide by 64
-    gray = vshrq_n_u16(gray, 6); // vector shift right qextended nconstant
+  if (img.depth() == CV_16U) {
+    if (img.isContinuous() && img_gray_out.isContinuous()) {
+      kernels->gray16_row((const uint16_t *)img.ptr(startRow), (uint16_t *)img_gray_out.ptr(startRow),
+                          (endRow - startRow) * width);
+      return;
+    }
+    for (int i = startRow; i < endRow; i++) {
+      kernels->gray16_row((const uint16_t *)img.ptr(i), (uint16_t *)img_gray_out.ptr(i), width);
+    }
+    return;
+  }
 
-    // Narrow back to 8-bit and store
-    vst1_u8(&gray_data[i], vmovn_u16(gray)); // vector move narrow
+  // Packed frames are converted as one long row, which keeps the kernel in
+  // its vector loop across row boundaries
+  if (img.isContinuous() && img_gray_out.isContinuous()) {
+    kernels->gray_row(img.ptr(startRow), img_gray_out.ptr(startRow),
+                      (endRow - startRow) * width);
+    return;
   }
 
-  // individually handling pixels in case the total number of pixels don't split into 8 
-  for (; i < endPx; i++) {
-    int index = i * 3; // BGR index into color buffer is 3 bytes per pixel
-    gray_data[i] = ( // manual multiply add into division by 2^6 = 64
-      7 * img_data[index] + 
-      38 * img_data[index + 1] + 
-      19 * img_data[index + 2]) >> 6;
+  for (int i = startRow; i < endRow; i++) {
+    kernels->gray_row(img.ptr(i), img_gray_out.ptr(i), width);
   }
 }
 
 /*******************************************
  * Model: sobelCalc
- * Input: Mat img_in
+ * Input: Mat img_in, optional line buffers
  * Output: None directly. Modifies a ref parameter img_sobel_out
  * Desc: This module performs a sobel calculation on an image. It first
  *  converts the image to grayscale, calculates the gradient in the x
  *  direction, calculates the gradient in the y direction and sum it with Gx
- *  to finish the Sobel calculation
+ *  to finish the Sobel calculation. With --filter another operator of the
+ *  convolution engine runs instead (see filterCalc), using `lines`
+ *  (lineBytes(cols) bytes) as its scratch. With --gradient img_sobel_out
+ *  is a gradient frame (see gradientCalc). A 16-bit gray frame gives a
+ *  16-bit output frame (sobel16_row); only the plain Sobel is done on those.
+ ********************************************/
+void sobelCalc(Mat& img_gray, Mat& img_sobel_out, int startRow, int endRow, unsigned char *lines)
+{
+  int width = img_gray.cols;
+
+  if (opts.gradient) {
+    gradientCalc(img_gray, img_sobel_out, startRow, endRow);
+    return;
+  }
+  if (opts.filter != FILTER_SOBEL) {
+    filterCalc(img_gray, img_sobel_out, opts.filter, startRow, endRow, (int *)lines);
+    return;
+  }
+
+  // If both 0, process the whole image
+  if (startRow == 0 && endRow == 0) {
+    startRow = 1;
+    endRow = img_gray.rows - 1;
+  }
+
+  if (img_gray.depth() == CV_16U) {
+    for (int i = startRow; i < endRow; i++) {
+      kernels->sobel16_row((const uint16_t *)img_gray.ptr(i - 1), (const uint16_t *)img_gray.ptr(i),
+                           (const uint16_t *)img_gray.ptr(i + 1), (uint16_t *)img_sobel_out.ptr(i), width);
+    }
+    return;
+  }
+
+  for (int i = startRow; i < endRow; i++) {
+    kernels->sobel_row(img_gray.ptr(i - 1), img_gray.ptr(i), img_gray.ptr(i + 1),
+                       img_sobel_out.ptr(i), width);
+  }
+}
+
+/*******************************************
+ * Model: gradientCalc
+ * Input: Mat img_gray
+ * Output: None directly. Modifies a ref parameter img_out
+ * Desc: --gradient output: L2 magnitude and orientation bin of the Sobel
+ *  gradient (see grad_row in sobel_kernels.h) from one pass over the gray
+ *  rows. img_out is a gradient frame from outputMat, rows x 3*cols bytes:
+ *  each row holds the row's cols 16-bit magnitudes followed by its cols
+ *  orientation bytes, so both planes are plain strided images
+ *  (gradientPlanes) and sinks write them like any 8-bit frame.
  ********************************************/
-void sobelCalc(Mat& img_gray, Mat& img_sobel_out, int startRow, int endRow)
+void gradientCalc(Mat& img_gray, Mat& img_out, int startRow, int endRow)
 {
-  unsigned char *gray = img_gray.data; // gray is 1 byte per pixel
-  unsigned char *sobel = img_sobel_out.data; // likewise for sobel
+  int width = img_gray.cols;
 
   // If both 0, process the whole image
   if (startRow == 0 && endRow == 0) {
     startRow = 1;
-    endRow = IMG_HEIGHT - 1;
+    endRow = img_gray.rows - 1;
   }
 
   for (int i = startRow; i < endRow; i++) {
-    int j;
-
-    // precompute for readability and efficient reuse
-    int row = IMG_WIDTH * i;
-    int row_above = row - IMG_WIDTH;
-    int row_below = row + IMG_WIDTH;
-
-    // Process 8 pixels at a time using neon intrinsics. j runs over columns
-    // stops at IMG_WIDTH - 9 so that j+1 to j+9 are in bounds
-    // ie instead of stopping at IMG_WIDTH-1 due to 0 indexing, we stop 8 before that
-    for (j = 1; j <= IMG_WIDTH - 9; j += 8) {
-      // Load 8 pixels from each of the 9 positions since we don't need the middle
-      uint8x8_t top_l = vld1_u8(&gray[row_above+ j - 1]);
-      uint8x8_t top_m = vld1_u8(&gray[row_above+ j]);
-      uint8x8_t top_r = vld1_u8(&gray[row_above+ j + 1]);
-      uint8x8_t mid_l = vld1_u8(&gray[row + j - 1]);
-      uint8x8_t mid_r = vld1_u8(&gray[row + j + 1]);
-      uint8x8_t bot_l = vld1_u8(&gray[row_below+ j - 1]);
-      uint8x8_t bot_m = vld1_u8(&gray[row_below+ j]);
-      uint8x8_t bot_r = vld1_u8(&gray[row_below+ j + 1]);
-
-      // Widen to signed 16-bit for subtraction
-      int16x8_t p00 = vreinterpretq_s16_u16(vmovl_u8(top_l));
-      int16x8_t p01 = vreinterpretq_s16_u16(vmovl_u8(top_m));
-      int16x8_t p02 = vreinterpretq_s16_u16(vmovl_u8(top_r));
-      int16x8_t p10 = vreinterpretq_s16_u16(vmovl_u8(mid_l));
-      int16x8_t p12 = vreinterpretq_s16_u16(vmovl_u8(mid_r));
-      int16x8_t p20 = vreinterpretq_s16_u16(vmovl_u8(bot_l));
-      int16x8_t p21 = vreinterpretq_s16_u16(vmovl_u8(bot_m));
-      int16x8_t p22 = vreinterpretq_s16_u16(vmovl_u8(bot_r));
-
-      // Sobel Gx kernel:
-      //  [ -1  0 +1 ]
-      //  [ -2  0 +2 ]
-      //  [ -1  0 +1 ]
-      // Implement as (right column weighted sum) - (left column weighted sum).
-      // Gx = (p02 + 2*p12 + p22) - (p00 + 2*p10 + p20)
-      int16x8_t gx = vsubq_s16(
-          vaddq_s16(vaddq_s16(p02, vshlq_n_s16(p12, 1)), p22),
-          vaddq_s16(vaddq_s16(p00, vshlq_n_s16(p10, 1)), p20));
-
-      // Sobel Gy kernel:
-      //  [ -1 -2 -1 ]
-      //  [  0  0  0 ]
-      //  [ +1 +2 +1 ]
-      // Implement as (bottom row weighted sum) - (top row weighted sum).
-      // Gy = (p20 + 2*p21 + p22) - (p00 + 2*p01 + p02)
-      int16x8_t gy = vsubq_s16(
-          vaddq_s16(vaddq_s16(p20, vshlq_n_s16(p21, 1)), p22),
-          vaddq_s16(vaddq_s16(p00, vshlq_n_s16(p01, 1)), p02));
-
-      // |gx| + |gy| to approximate magnitudes
-      int16x8_t mag = vaddq_s16(vabsq_s16(gx), vabsq_s16(gy));
-
-      // Saturate/narrow signed 16-bit -> unsigned 8-bit.
-      // Negative becomes 0, >255 becomes 255.      
-      uint8x8_t result = vqmovun_s16(mag);
-
-      // Store 8 results
-      vst1_u8(&sobel[row + j], result);
+    unsigned char *out = img_out.ptr(i);
+    kernels->grad_row(img_gray.ptr(i - 1), img_gray.ptr(i), img_gray.ptr(i + 1),
+                      (uint16_t *)out, out + 2 * width, width);
+  }
+}
+
+void gradientPlanes(Mat& img_out, Mat& mag, Mat& ori)
+{
+  int cols = img_out.cols / 3;
+  mag = Mat(img_out.rows, cols, CV_16UC1, img_out.data, img_out.step);
+  ori = Mat(img_out.rows, cols, CV_8UC1, img_out.data + 2 * cols, img_out.step);
+}
+
+/*******************************************
+ * Model: filterCalc
+ * Input: Mat img_gray, filter (filter_t), optional scratch
+ * Output: None directly. Modifies a ref parameter img_out
+ * Desc: Runs one filter of the convolution engine over rows
+ *  [startRow, endRow), clipped to the rows the filter's radius allows; the
+ *  border of that width is left untouched, as with Sobel. `scratch` must
+ *  hold FILTER_SCRATCH_ROWS * img_gray.cols ints; if NULL a per thread
+ *  buffer from the frame pool is used.
+ ********************************************/
+// Per thread engine scratch from the frame pool for callers that pass none,
+// reused across frames and grown with the width
+static int *threadScratch(int width)
+{
+  static __thread int *scratch_data = NULL;
+  static __thread int scratch_width = 0;
+  if (scratch_width < width) {
+    fpool_release(scratch_data);
+    scratch_data = (int *)fpool_acquire(lineBytes(width));
+    scratch_width = width;
+  }
+  return scratch_data;
+}
+
+void filterCalc(Mat& img_gray, Mat& img_out, int filter, int startRow, int endRow, int *scratch)
+{
+  const unsigned char *rows[5];
+  int width = img_gray.cols;
+  int radius = filters[filter].radius;
+
+  // If both 0, process the whole image
+  if (startRow == 0 && endRow == 0) {
+    endRow = img_gray.rows;
+  }
+  if (startRow < radius) {
+    startRow = radius;
+  }
+  if (endRow > img_gray.rows - radius) {
+    endRow = img_gray.rows - radius;
+  }
+  if (startRow >= endRow) {
+    return;
+  }
+
+  if (scratch == NULL) {
+    scratch = threadScratch(width);
+  }
+
+  filter_row_fn row = kernels->filter_row[filter];
+  for (int i = startRow; i < endRow; i++) {
+    for (int k = 0; k <= 2 * radius; k++) {
+      rows[k] = img_gray.ptr(i - radius + k);
     }
+    row(rows, img_out.ptr(i), width, scratch);
+  }
+}
 
-    // individually handling pixels in case the total number of pixels don't split into 8 
-    for (; j < IMG_WIDTH - 1; j++) {
-      int idx_top = IMG_WIDTH * (i-1) + j;
-      int idx_mid = IMG_WIDTH * i + j;
-      int idx_bot = IMG_WIDTH * (i+1) + j;
-
-      // local 3x3 grid of scalars instead of bytevectors
-      int p00 = gray[idx_top - 1];
-      int p01 = gray[idx_top];
-      int p02 = gray[idx_top + 1];
-      int p10 = gray[idx_mid - 1];
-      int p12 = gray[idx_mid + 1];
-      int p20 = gray[idx_bot - 1];
-      int p21 = gray[idx_bot];
-      int p22 = gray[idx_bot + 1];
-
-      // same math process, magnitude and clamping
-      int gx = (p02 + (p12 << 1) + p22) - (p00 + (p10 << 1) + p20);
-      int gy = (p20 + (p21 << 1) + p22) - (p00 + (p01 << 1) + p02);
-
-      int magnitude = abs(gx) + abs(gy);
-      sobel[idx_mid] = (magnitude > 255) ? 255 : magnitude;
+/*******************************************
+ * Model: sobelSpan
+ * Input: Mat img_gray, output row, column range [x0, x1), optional scratch
+ * Output: None directly. Modifies columns [x0, x1) of row `row` of img_out
+ * Desc: The Sobel stage (Sobel, --gradient or the --filter operator) for
+ *  part of one row, for callers that only recompute some of the frame.
+ *  The range must keep sobelRadius() pixels clear of every frame edge.
+ *  The row kernels are simply pointed radius columns left of x0 with a
+ *  width that makes them stop at x1.
+ ********************************************/
+void sobelSpan(Mat& img_gray, Mat& img_out, int row, int x0, int x1, unsigned char *lines)
+{
+  int r = sobelRadius();
+  int base = x0 - r;
+  int width = x1 - x0 + 2 * r;
+
+  if (opts.gradient) {
+    unsigned char *out = img_out.ptr(row);
+    kernels->grad_row(img_gray.ptr(row - 1) + base, img_gray.ptr(row) + base,
+                      img_gray.ptr(row + 1) + base, (uint16_t *)out + base,
+                      out + 2 * img_gray.cols + base, width);
+  } else if (opts.filter != FILTER_SOBEL) {
+    const unsigned char *rows[5];
+    for (int k = 0; k <= 2 * r; k++) {
+      rows[k] = img_gray.ptr(row - r + k) + base;
     }
+    int *scratch = lines != NULL ? (int *)lines : threadScratch(img_gray.cols);
+    kernels->filter_row[opts.filter](rows, img_out.ptr(row) + base, width, scratch);
+  } else {
+    kernels->sobel_row(img_gray.ptr(row - 1) + base, img_gray.ptr(row) + base,
+                       img_gray.ptr(row + 1) + base, img_out.ptr(row) + base, width);
+  }
+}
+
+// Rows/columns of input each side of an output pixel the Sobel stage reads
+int sobelRadius()
+{
+  return opts.gradient ? 1 : filters[opts.filter].radius;
+}
+
+/*******************************************
+ * Model: lineBytes
+ * Input: frame width
+ * Output: bytes of per worker line buffers for that width
+ * Desc: Size of the `lines` argument of sobelFused and sobelCalc: three
+ *  gray rows for the fused ring, or the engine's int scratch rows
+ ********************************************/
+size_t lineBytes(int cols)
+{
+  size_t fused = 3 * fpool_stride(cols);
+  size_t scratch = fpool_stride(FILTER_SCRATCH_ROWS * sizeof(int) * cols);
+  return fused > scratch ? fused : scratch;
+}
+
+/*******************************************
+ * Model: sobelFused
+ * Input: Mat img (BGR), optional line buffers
+ * Output: None directly. Modifies a ref parameter img_sobel_out
+ * Desc: Single pass grayscale + Sobel. Gray rows are produced into a ring of
+ *  three line buffers, and each Sobel row is emitted as soon as the row
+ *  below it has been converted, so no full gray frame is ever written.
+ *  Rows [startRow, endRow) of the output are computed; a band converts the
+ *  one row of halo above and below it itself, so bands are independent.
+ *  `lines` must hold 3 * fpool_stride(img.cols) bytes; if NULL a per thread
+ *  buffer from the frame pool is used.
+ ********************************************/
+void sobelFused(Mat& img, Mat& img_sobel_out, int startRow, int endRow, unsigned char *lines)
+{
+  // Per thread line buffers from the frame pool, reused across frames and
+  // grown with the width
+  static __thread unsigned char *ring_data = NULL;
+  static __thread int ring_width = 0;
+  int width = img.cols;
+  unsigned char *ring[3];
+
+  // If both 0, process the whole image
+  if (startRow == 0 && endRow == 0) {
+    startRow = 1;
+    endRow = img.rows - 1;
+  }
+  if (startRow >= endRow) {
+    return;
+  }
+
+  // Rows are kept cache line aligned
+  size_t ring_stride = fpool_stride(width);
+  if (lines == NULL) {
+    if (ring_width < width) {
+      fpool_release(ring_data);
+      ring_data = (unsigned char *)fpool_acquire(3 * ring_stride);
+      ring_width = width;
+    }
+    lines = ring_data;
+  }
+  for (int k = 0; k < 3; k++) {
+    ring[k] = &lines[k * ring_stride];
   }
+
+  // gray row r lives in ring[r % 3]; prime the two rows above the first output
+  kernels->gray_row(img.ptr(startRow - 1), ring[(startRow - 1) % 3], width);
+  kernels->gray_row(img.ptr(startRow), ring[startRow % 3], width);
+
+  for (int i = startRow; i < endRow; i++) {
+    kernels->gray_row(img.ptr(i + 1), ring[(i + 1) % 3], width);
+    kernels->sobel_row(ring[(i - 1) % 3], ring[i % 3], ring[(i + 1) % 3],
+                       img_sobel_out.ptr(i), width);
+  }
+}
+
+/*******************************************
+ * Model: poolMat
+ * Input: Mat m, geometry and type
+ * Output: None directly. Points m at a pooled buffer
+ * Desc: Makes m a rows x cols image backed by the frame pool, with cache
+ *  line aligned rows. No-op if m already is one, so drivers can call it
+ *  every frame; on a geometry change the old buffer goes back to the pool.
+ *  A new image always starts out zeroed, recycled buffer or not, since the
+ *  kernels never write the output border.
+ ********************************************/
+void poolMat(Mat& m, int rows, int cols, int type)
+{
+  if (!m.empty() && m.rows == rows && m.cols == cols && m.type() == type &&
+      fpool_owns(m.data)) {
+    return;
+  }
+  poolRelease(m);
+
+  size_t stride = fpool_stride(cols * CV_ELEM_SIZE(type));
+  void *data = fpool_acquire(stride * rows);
+  memset(data, 0, stride * rows);
+  m = Mat(rows, cols, type, data, stride);
+}
+
+void poolRelease(Mat& m)
+{
+  if (!m.empty() && fpool_owns(m.data)) {
+    fpool_release(m.data);
+  }
+  m = Mat();
+}
+
+/*******************************************
+ * Model: outputMat
+ * Input: Mat m, frame geometry, sample depth of the input frame
+ * Output: None directly. Points m at a pooled buffer
+ * Desc: poolMat for the Sobel output of a rows x cols frame: 8-bit (16-bit
+ *  for 16-bit input), a gradient frame (3*cols bytes wide, see
+ *  gradientCalc) with --gradient, or the composite of every level (see
+ *  pyramidCols) with --pyramid
+ ********************************************/
+void outputMat(Mat& m, int rows, int cols, int depth)
+{
+  if (depth == CV_16U) {
+    poolMat(m, rows, cols, CV_16UC1);
+    return;
+  }
+  poolMat(m, rows, opts.gradient ? 3 * cols : pyramidCols(cols), CV_8UC1);
+}
+
+// Name of the Sobel stage of the drivers, for the reports
+const char *sobelStageName()
+{
+  return opts.fused ? "Gray+Sobel (fused)" : opts.tiled ? "Gray+Sobel (tiled)" : "Sobel";
+}
+
+// Name of what the Sobel stage computes, for the reports
+const char *filterName()
+{
+  return opts.gradient ? "sobel-l2" : filters[opts.filter].name;
 }
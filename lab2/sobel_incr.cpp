@@ -0,0 +1,187 @@
+#include <string.h>
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "frame_pool.h"
+
+// Incremental processing (--incremental). Mostly static cameras deliver
+// frames that differ from the last one in a few places, so the frame is cut
+// into tiles and each tile's source pixels are compared (SAD) against the
+// ones the current outputs were computed from. Only dirty tiles are
+// converted to gray; the Sobel stage is recomputed on dirty tiles plus the
+// halo of sobelRadius() pixels around them whose neighbourhood reaches into
+// a dirty tile. Everything else keeps last frame's gray and Sobel values,
+// which is why the drivers must keep passing the same gray/Sobel buffers.
+//
+// Both passes are split by tile row for a thread_pool_t: incrGrayBand for
+// every tile row, then incrSobelBand once all gray rows are done. A tile's
+// output is only ever written by the task of its own tile row.
+
+#define INCR_TILE_WIDTH 64
+#define INCR_TILE_HEIGHT 16
+
+static inline int tileIndex(incr_job_t *job, int ty, int tx)
+{
+  return ty * job->tiles_x + tx;
+}
+
+/*******************************************
+ * Model: incrPlan
+ * Input: job with src/gray/sobel set, number of workers
+ * Output: None directly. Sets up the tile grid of job
+ * Desc: Sizes the tile grid, the reference copy of the source and the
+ *  dirty flags from the frame. No-op unless the geometry changed; a change
+ *  (or the first frame) marks every tile dirty.
+ ********************************************/
+void incrPlan(incr_job_t *job, int nthreads)
+{
+  Mat& src = *job->src;
+  if (job->prev != NULL && src.rows == job->rows && src.cols == job->cols) {
+    return;
+  }
+  incrFree(job);
+
+  job->rows = src.rows;
+  job->cols = src.cols;
+  job->tile_w = opts.tileWidth > 0 ? opts.tileWidth : INCR_TILE_WIDTH;
+  job->tile_h = opts.tileHeight > 0 ? opts.tileHeight : INCR_TILE_HEIGHT;
+  job->tile_w = job->tile_w < src.cols ? job->tile_w : src.cols;
+  job->tile_h = job->tile_h < src.rows ? job->tile_h : src.rows;
+  job->tiles_x = (src.cols + job->tile_w - 1) / job->tile_w;
+  job->tiles_y = (src.rows + job->tile_h - 1) / job->tile_h;
+
+  job->prev_stride = fpool_stride(src.cols * src.elemSize());
+  job->prev = (unsigned char *)fpool_acquire(job->prev_stride * src.rows);
+  job->dirty = (unsigned char *)fpool_acquire(job->tiles_x * job->tiles_y);
+  if (opts.filter != FILTER_SOBEL) {
+    for (int w = 0; w < nthreads; w++) {
+      job->lines[w] = (unsigned char *)fpool_acquire(lineBytes(src.cols));
+    }
+  }
+  job->reset = 1;
+}
+
+/*******************************************
+ * Model: incrGrayBand
+ * Input: incr_job_t, tile row, worker
+ * Output: None directly. Updates the dirty flags, the reference copy and
+ *  the gray frame for the tiles of this row
+ * Desc: A tile is dirty if the SAD of its source bytes against the
+ *  reference exceeds the --incremental threshold (0: any change). Rows are
+ *  compared until the threshold is crossed, so a tile that changed near
+ *  its top costs little more than the changed rows. Dirty tiles become
+ *  the new reference and get their gray pixels recomputed; clean ones keep
+ *  the old reference, so slow drift still adds up to a recompute.
+ ********************************************/
+void incrGrayBand(void *arg, int band, int worker)
+{
+  incr_job_t *job = (incr_job_t *)arg;
+  Mat& src = *job->src;
+  Mat& gray = *job->gray;
+  size_t bpp = src.elemSize();
+  int y0 = band * job->tile_h;
+  int y1 = y0 + job->tile_h < job->rows ? y0 + job->tile_h : job->rows;
+
+  for (int tx = 0; tx < job->tiles_x; tx++) {
+    int x0 = tx * job->tile_w;
+    int x1 = x0 + job->tile_w < job->cols ? x0 + job->tile_w : job->cols;
+    int bytes = (x1 - x0) * bpp;
+    int dirty = job->reset;
+
+    uint64_t sad = 0;
+    for (int y = y0; y < y1 && !dirty; y++) {
+      sad += kernels->sad_row(src.ptr(y) + x0 * bpp, job->prev + y * job->prev_stride + x0 * bpp, bytes);
+      dirty = sad > (uint64_t)opts.incrSad;
+    }
+    job->dirty[tileIndex(job, band, tx)] = dirty;
+    if (!dirty) {
+      continue;
+    }
+
+    for (int y = y0; y < y1; y++) {
+      memcpy(job->prev + y * job->prev_stride + x0 * bpp, src.ptr(y) + x0 * bpp, bytes);
+      kernels->gray_row(src.ptr(y) + x0 * bpp, gray.ptr(y) + x0, x1 - x0);
+    }
+  }
+}
+
+/*******************************************
+ * Model: incrSobelBand
+ * Input: incr_job_t, tile row, worker
+ * Output: None directly. Updates the Sobel output of this row's tiles
+ * Desc: A dirty tile is recomputed whole. A clean tile next to dirty ones
+ *  only recomputes the strip of radius pixels along each dirty neighbour
+ *  (edge strips for the four sides, corners for the diagonals), which is
+ *  every pixel whose neighbourhood changed. Strips stay inside the tile,
+ *  so tasks never write the same pixel.
+ ********************************************/
+void incrSobelBand(void *arg, int band, int worker)
+{
+  incr_job_t *job = (incr_job_t *)arg;
+  int r = sobelRadius();
+  int ty = band;
+  int y0 = ty * job->tile_h;
+  int y1 = y0 + job->tile_h < job->rows ? y0 + job->tile_h : job->rows;
+
+  for (int tx = 0; tx < job->tiles_x; tx++) {
+    int x0 = tx * job->tile_w;
+    int x1 = x0 + job->tile_w < job->cols ? x0 + job->tile_w : job->cols;
+    int self = job->dirty[tileIndex(job, ty, tx)];
+
+    for (int dy = -1; dy <= 1; dy++) {
+      for (int dx = -1; dx <= 1; dx++) {
+        int ny = ty + dy, nx = tx + dx;
+        if (self != (dx == 0 && dy == 0) || ny < 0 || ny >= job->tiles_y ||
+            nx < 0 || nx >= job->tiles_x || !job->dirty[tileIndex(job, ny, nx)]) {
+          continue;
+        }
+
+        // Part of this tile within r pixels of the dirty neighbour (all of
+        // it for the tile itself), clipped to where the stage is defined.
+        // Tiles are at least r wide and high, bar the last row/column,
+        // so the neighbours' own tiles cover the rest of the halo.
+        int ry0 = dy > 0 && y1 - r > y0 ? y1 - r : y0;
+        int ry1 = dy < 0 && y0 + r < y1 ? y0 + r : y1;
+        int rx0 = dx > 0 && x1 - r > x0 ? x1 - r : x0;
+        int rx1 = dx < 0 && x0 + r < x1 ? x0 + r : x1;
+        ry0 = ry0 > r ? ry0 : r;
+        rx0 = rx0 > r ? rx0 : r;
+        ry1 = ry1 < job->rows - r ? ry1 : job->rows - r;
+        rx1 = rx1 < job->cols - r ? rx1 : job->cols - r;
+        for (int y = ry0; y < ry1 && rx0 < rx1; y++) {
+          sobelSpan(*job->gray, *job->sobel, y, rx0, rx1, job->lines[worker]);
+        }
+      }
+    }
+  }
+}
+
+/*******************************************
+ * Model: incrEndFrame
+ * Input: incr_job_t
+ * Output: number of dirty tiles in the frame just processed
+ * Desc: Adds the frame to the run's totals and clears the reset flag
+ ********************************************/
+int incrEndFrame(incr_job_t *job)
+{
+  int n = 0;
+  for (int t = 0; t < job->tiles_x * job->tiles_y; t++) {
+    n += job->dirty[t];
+  }
+  job->tiles += job->tiles_x * job->tiles_y;
+  job->dirty_tiles += n;
+  job->reset = 0;
+  return n;
+}
+
+void incrFree(incr_job_t *job)
+{
+  fpool_release(job->prev);
+  fpool_release(job->dirty);
+  for (int w = 0; w < POOL_MAX_THREADS; w++) {
+    fpool_release(job->lines[w]);
+    job->lines[w] = NULL;
+  }
+  job->prev = NULL;
+  job->dirty = NULL;
+  job->rows = job->cols = 0;
+}
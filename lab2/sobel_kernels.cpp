@@ -0,0 +1,92 @@
+#include <stddef.h>
+#include <string.h>
+#include "sobel_kernels.h"
+
+const sobel_kernels_t *kernels = &kernels_scalar;
+
+// Every backend built into this binary, fastest first
+static const sobel_kernels_t *const backends[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  &kernels_avx2,
+  &kernels_sse4,
+#endif
+#if defined(__arm__) || defined(__aarch64__)
+  &kernels_neon,
+#endif
+  &kernels_scalar,
+  NULL
+};
+
+/*******************************************
+ * Model: kernels_select
+ * Input: backend name, or NULL for automatic detection
+ * Output: the selected backend, NULL on failure
+ * Desc: Walks the backend list in order of preference and activates the
+ *  first one the running CPU supports (or the one asked for by name)
+ ********************************************/
+const sobel_kernels_t *kernels_select(const char *name)
+{
+  for (int i = 0; backends[i] != NULL; i++) {
+    const sobel_kernels_t *k = backends[i];
+    if (name != NULL && strcmp(name, k->name) != 0) {
+      continue;
+    }
+    if (!k->supported()) {
+      if (name != NULL) {
+        return NULL;
+      }
+      continue;
+    }
+    kernels = k;
+    return k;
+  }
+  return NULL;
+}
+
+const char *kernels_available()
+{
+  static char list[64];
+  if (list[0] == '\0') {
+    for (int i = 0; backends[i] != NULL; i++) {
+      if (i > 0) {
+        strcat(list, ",");
+      }
+      strcat(list, backends[i]->name);
+    }
+  }
+  return list;
+}
+
+const filter_info_t filters[FILTER_COUNT] = {
+  { "sobel", 1 },
+  { "scharr", 1 },
+  { "prewitt", 1 },
+  { "sobel5", 2 },
+  { "gauss3", 1 },
+  { "gauss5", 2 },
+  { "laplacian", 1 },
+};
+
+int filter_select(const char *name)
+{
+  for (int f = 0; f < FILTER_COUNT; f++) {
+    if (strcmp(name, filters[f].name) == 0) {
+      return f;
+    }
+  }
+  return -1;
+}
+
+const char *filters_available()
+{
+  static char list[128];
+  if (list[0] == '\0') {
+    for (int f = 0; f < FILTER_COUNT; f++) {
+      if (f > 0) {
+        strcat(list, ",");
+      }
+      strcat(list, filters[f].name);
+    }
+  }
+  return list;
+}
@@ -0,0 +1,137 @@
+#ifndef SOBEL_KERNELS_H
+#define SOBEL_KERNELS_H
+
+#include <stdint.h>
+
+// Row kernels. Every backend implements the same operations on a single
+// image row so the drivers can stay independent of the instruction set.
+//
+// gray_row:  converts `width` packed BGR pixels to 8-bit gray
+// sobel_row: computes |Gx| + |Gy| (saturated to 8 bits) for columns
+//            1 .. width-2 of `row`, using the rows directly above and below.
+//            Columns 0 and width-1 of `out` are left untouched.
+// grad_row:  same Sobel Gx, Gy, but writes the L2 magnitude
+//            sqrt(Gx^2 + Gy^2) rounded to nearest (0 .. 1443, 16 bits) and
+//            the gradient direction in 8 bins of 45 degrees: 0 is +x
+//            (brighter to the right), 2 is +y (brighter below), etc. Bins
+//            are centred on their direction and split where |Gy|/|Gx|
+//            crosses tan(22.5) = GRAD_TAN22 / 2^15 (or its inverse); flat
+//            pixels get bin 0. Same columns as sobel_row.
+// sad_row:   sum of absolute differences of `n` bytes, for change detection
+// down_row:  halves a gray image: out[j] is the rounded mean of the 2x2
+//            block at columns 2j, 2j+1 of rows r0 and r1, for `width`
+//            output pixels
+// luma_row:  extracts the Y samples of `width` packed YUYV (YUY2) pixels,
+//            i.e. every even byte, into a gray row
+// edge_row:  thresholds `width` Sobel output pixels into a bitmap of
+//            (width + 7) / 8 bytes: bit j % 8 of byte j / 8 is set when
+//            mag[j] > threshold. Unused bits of the last byte are zero.
+// gray16_row, sobel16_row: gray_row and sobel_row for 16-bit samples (10
+//            to 16 significant bits, e.g. 12-bit camera data). The Sobel
+//            magnitude is not clamped to the input's range, only to 16
+//            bits, so it is exact for inputs of up to 13 bits.
+typedef void (*gray_row_fn)(const uint8_t *bgr, uint8_t *gray, int width);
+typedef void (*sobel_row_fn)(const uint8_t *above, const uint8_t *row,
+                             const uint8_t *below, uint8_t *out, int width);
+typedef void (*grad_row_fn)(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                            uint16_t *mag, uint8_t *ori, int width);
+typedef uint32_t (*sad_row_fn)(const uint8_t *a, const uint8_t *b, int n);
+typedef void (*down_row_fn)(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int width);
+typedef void (*luma_row_fn)(const uint8_t *yuyv, uint8_t *gray, int width);
+typedef void (*edge_row_fn)(const uint8_t *mag, uint8_t *bits, int width, uint8_t threshold);
+typedef void (*gray16_row_fn)(const uint16_t *bgr, uint16_t *gray, int width);
+typedef void (*sobel16_row_fn)(const uint16_t *above, const uint16_t *row,
+                               const uint16_t *below, uint16_t *out, int width);
+
+#define GRAD_TAN22 13573
+#define GRAD_BINS 8
+
+// Filters of the convolution engine (conv_engine.h), selected with --filter.
+// A filter of radius r reads the 2r+1 rows rows[0..2r] and writes columns
+// r .. width-r-1 of the output row for rows[r]; `scratch` holds
+// FILTER_SCRATCH_ROWS * width ints.
+enum filter_t {
+  FILTER_SOBEL,
+  FILTER_SCHARR,
+  FILTER_PREWITT,
+  FILTER_SOBEL5,
+  FILTER_GAUSS3,
+  FILTER_GAUSS5,
+  FILTER_LAPLACIAN,
+  FILTER_COUNT
+};
+#define FILTER_SCRATCH_ROWS 2
+typedef void (*filter_row_fn)(const uint8_t *const *rows, uint8_t *out, int width, int *scratch);
+
+struct filter_info_t {
+  const char *name;
+  int radius;
+};
+extern const filter_info_t filters[FILTER_COUNT];
+
+// Index of the named filter, -1 if unknown
+int filter_select(const char *name);
+
+// Comma separated list of filter names, for help text
+const char *filters_available();
+
+struct sobel_kernels_t {
+  const char *name;
+  int (*supported)(void);  // nonzero if this CPU can run the backend
+  gray_row_fn gray_row;
+  sobel_row_fn sobel_row;
+  grad_row_fn grad_row;
+  sad_row_fn sad_row;
+  down_row_fn down_row;
+  luma_row_fn luma_row;
+  edge_row_fn edge_row;
+  gray16_row_fn gray16_row;
+  sobel16_row_fn sobel16_row;
+  filter_row_fn filter_row[FILTER_COUNT]; // see CONV_FILTER_TABLE
+};
+
+// Backends. Only the ones that match the build architecture are linked in.
+extern const sobel_kernels_t kernels_scalar;
+#if defined(__arm__) || defined(__aarch64__)
+extern const sobel_kernels_t kernels_neon;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+extern const sobel_kernels_t kernels_sse4;
+extern const sobel_kernels_t kernels_avx2;
+#endif
+
+// Backend used by grayScale()/sobelCalc(). Defaults to the scalar reference
+// until kernels_select() is called at startup.
+extern const sobel_kernels_t *kernels;
+
+// Pick a backend. With name == NULL the fastest backend this CPU supports is
+// chosen; otherwise the named one is used if the CPU supports it. Returns the
+// selection (also stored in `kernels`), or NULL if the name is unknown or
+// unsupported, in which case `kernels` is unchanged.
+const sobel_kernels_t *kernels_select(const char *name);
+
+// Comma separated list of backends built into this binary, for help text
+const char *kernels_available();
+
+// Saturation limit of a pixel type
+template <class T> struct pixel_traits;
+template <> struct pixel_traits<uint8_t> { enum { max = 0xFF }; };
+template <> struct pixel_traits<uint16_t> { enum { max = 0xFFFF }; };
+
+// Scalar spans shared by the SIMD backends to finish off row tails. Gray and
+// Sobel are templates on the input and output pixel types, instantiated for
+// uint8_t -> uint8_t and uint16_t -> uint16_t (see kernels_scalar.cpp).
+template <class in_t, class out_t>
+void gray_span_scalar(const in_t *bgr, out_t *gray, int start, int end);
+template <class in_t, class out_t>
+void sobel_span_scalar(const in_t *above, const in_t *row,
+                       const in_t *below, out_t *out, int start, int end);
+void grad_span_scalar(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                      uint16_t *mag, uint8_t *ori, int start, int end);
+uint32_t sad_span_scalar(const uint8_t *a, const uint8_t *b, int start, int end);
+void down_span_scalar(const uint8_t *r0, const uint8_t *r1, uint8_t *out, int start, int end);
+void luma_span_scalar(const uint8_t *yuyv, uint8_t *gray, int start, int end);
+// start must be a multiple of 8
+void edge_span_scalar(const uint8_t *mag, uint8_t *bits, uint8_t threshold, int start, int end);
+
+#endif
@@ -1,201 +1,264 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-#include <iostream>
-#include <fstream>
-#include <errno.h>
-#include <unistd.h>
-#include <string.h>
-#include <locale.h>
-#include <sys/ioctl.h>
-#include <err.h>
-
-#include "sobel_alg.h"
-#include "pc.h"
-
-using namespace cv;
-
-static ofstream results_file;
-
-/// Define image mats to pass between function calls
-// Global/shared state (shared by both threads):
-static Mat src;                 // latest captured color frame (written by thread0, read by both)
-static Mat img_gray, img_sobel; // shared intermediate + output buffers (both threads write disjoint rows)
-static float total_fps, total_ipc, total_epf;
-static float gray_total, sobel_total, cap_total, disp_total;
-static float sobel_ic_total, sobel_l1cm_total;
-
-// Termination flag set by thread0; volatile so the other thread observes updates.
-static volatile int is_mt_done = 0;
-
-
-/*******************************************
- * Model: runSobelMT
- * Input: None
- * Output: None
- * Desc: This method pulls in an image from the webcam, feeds it into the
- *   sobelCalc module, and displays the returned Sobel filtered image. This
- *   function processes NUM_ITER frames.
- ********************************************/
-void *runSobelMT(void *ptr)
-{
-  string top = "Sobel Top";
-  uint64_t cap_time = 0, gray_time = 0, sobel_time = 0, disp_time = 0, sobel_l1cm = 0, sobel_ic = 0;
-  pthread_t myID = pthread_self();
-  counters_t perf_counters;
-
-  // Allow the threads to contest for thread0 (controller thread) status
-  pthread_mutex_lock(&thread0);
-  if (thread0_id == 0) {
-    thread0_id = myID;
-  }
-  pthread_mutex_unlock(&thread0);
-
-  bool isThread0 = (myID == thread0_id);
-
-  // Determine row ranges for work splitting between threads
-  // Preclude data races by having threads write to disjoint row ranges
-  int gray_start, gray_end;
-  int sobel_start, sobel_end;
-
-  if (isThread0) { // the top half
-    gray_start  = 0;
-    gray_end    = IMG_HEIGHT / 2;
-    sobel_start = 1; // skip very first row (needs i-1)
-    sobel_end   = IMG_HEIGHT / 2; // stop before midpoint overlap
-  } else { // bottom half
-    gray_start  = IMG_HEIGHT / 2;
-    gray_end    = IMG_HEIGHT;
-    sobel_start = IMG_HEIGHT / 2; // start at midpoint
-    sobel_end   = IMG_HEIGHT - 1; // skip last row (needs i+1)
-  }
-
-  CvCapture* video_cap = NULL;
-
-  if (isThread0) { // controller thread initializes perf counters and I/O
-    pc_init(&perf_counters, 0);
-
-    if (opts.webcam) { // open either webcam or file input
-      video_cap = cvCreateCameraCapture(-1);
-    } else {
-      video_cap = cvCreateFileCapture(opts.videoFile);
-    }
-    // Force capture resolution of lab specs
-    cvSetCaptureProperty(video_cap, CV_CAP_PROP_FRAME_WIDTH, IMG_WIDTH);
-    cvSetCaptureProperty(video_cap, CV_CAP_PROP_FRAME_HEIGHT, IMG_HEIGHT);
-
-    // Allocate shared image buffers once
-    img_gray = Mat(IMG_HEIGHT, IMG_WIDTH, CV_8UC1);
-    img_sobel = Mat(IMG_HEIGHT, IMG_WIDTH, CV_8UC1);
-  }
-
-  int i = 0;
-
-  while (1) {
-    // ===== PHASE 1: CAPTURE (thread 0 only) =====
-    if (isThread0) {
-      pc_start(&perf_counters);
-      src = cvQueryFrame(video_cap); // write the shared src
-      pc_stop(&perf_counters);
-
-      // Save capture cycles, accumulate low level stats
-      cap_time = perf_counters.cycles.count;
-      sobel_l1cm = perf_counters.l1_misses.count;
-      sobel_ic = perf_counters.ic.count;
-    }
-
-    // barrier to start grayscale
-    pthread_barrier_wait(&barr_capture);
-
-    // run grayscale
-    if (isThread0) pc_start(&perf_counters); // measure only on thread0 to report
-
-    grayScale(src, img_gray, gray_start, gray_end); // each thread writes half
-
-    // barrier for completing grayscale
-    pthread_barrier_wait(&barr_gray);
-
-    if (isThread0) {
-      pc_stop(&perf_counters); 
-      gray_time = perf_counters.cycles.count;
-      sobel_l1cm += perf_counters.l1_misses.count;
-      sobel_ic += perf_counters.ic.count;
-    }
-
-    // starting sobel
-    if (isThread0) pc_start(&perf_counters);
-
-    sobelCalc(img_gray, img_sobel, sobel_start, sobel_end);
-
-    // barrier to complete sobel
-    pthread_barrier_wait(&barr_sobel);
-
-    if (isThread0) {
-      pc_stop(&perf_counters);
-      sobel_time = perf_counters.cycles.count;
-      sobel_l1cm += perf_counters.l1_misses.count;
-      sobel_ic += perf_counters.ic.count;
-
-      // display using 1st thread
-      pc_start(&perf_counters);
-      namedWindow(top, CV_WINDOW_AUTOSIZE);
-      imshow(top, img_sobel);
-      pc_stop(&perf_counters);
-
-      disp_time = perf_counters.cycles.count;
-      sobel_l1cm += perf_counters.l1_misses.count;
-      sobel_ic += perf_counters.ic.count;
-
-      cap_total += cap_time;
-      gray_total += gray_time;
-      sobel_total += sobel_time;
-      sobel_l1cm_total += sobel_l1cm;
-      sobel_ic_total += sobel_ic;
-      disp_total += disp_time;
-      total_fps += PROC_FREQ / float(cap_time + disp_time + gray_time + sobel_time);
-      total_ipc += float(sobel_ic / float(cap_time + disp_time + gray_time + sobel_time));
-      i++;
-
-      // Press q to exit
-      char c = cvWaitKey(10);
-      if (c == 'q' || i >= opts.numFrames) {
-        is_mt_done = 1;
-      }
-    }
-
-    // barrier for both threads to finish
-    pthread_barrier_wait(&barr_display);
-
-    if (is_mt_done) break;
-  }
-
-  // write and clean up report
-  if (isThread0) {
-    total_epf = PROC_EPC * 2 / (total_fps / i);
-    float total_time = float(gray_total + sobel_total + cap_total + disp_total);
-
-    results_file.open("mt_perf.csv", ios::out);
-    results_file << "Percent of time per function" << endl;
-    results_file << "Capture, " << (cap_total / total_time) * 100 << "%" << endl;
-    results_file << "Grayscale, " << (gray_total / total_time) * 100 << "%" << endl;
-    results_file << "Sobel, " << (sobel_total / total_time) * 100 << "%" << endl;
-    results_file << "Display, " << (disp_total / total_time) * 100 << "%" << endl;
-    results_file << "\nSummary" << endl;
-    results_file << "Frames per second, " << total_fps / i << endl;
-    results_file << "Cycles per frame, " << total_time / i << endl;
-    results_file << "Energy per frames (mJ), " << total_epf * 1000 << endl;
-    results_file << "Total frames, " << i << endl;
-    results_file << "\nHardware Stats (Cap + Gray + Sobel + Display)" << endl;
-    results_file << "Instructions per cycle, " << total_ipc / i << endl;
-    results_file << "L1 misses per frame, " << sobel_l1cm_total / i << endl;
-    results_file << "L1 misses per instruction, " << sobel_l1cm_total / sobel_ic_total << endl;
-    results_file << "Instruction count per frame, " << sobel_ic_total / i << endl;
-
-    cvReleaseCapture(&video_cap);
-    results_file.close();
-  }
-
-  pthread_barrier_wait(&endSobel);
-  return NULL;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <iostream>
+#include <fstream>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <sys/ioctl.h>
+#include <err.h>
+
+#include "sobel_alg.h"
+#include "pc.h"
+#include "sobel_kernels.h"
+#include "thread_pool.h"
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "frame_pool.h"
+#include "lat_hist.h"
+#include "affinity.h"
+#include "governor.h"
+
+using namespace cv;
+
+static ofstream results_file;
+
+/// Define image mats to pass between function calls
+// Global/shared state (shared by all workers):
+static Mat src;                 // latest captured color frame (written by the controller, read by all)
+static Mat img_gray, img_sobel; // shared intermediate + output buffers (workers write disjoint bands)
+static float total_epf;
+static lat_report_t lat;
+static double gray_total, sobel_total, cap_total, disp_total;
+static uint64_t hw_totals[PC_NUM_EVENTS];
+
+// Row bands of the current frame, handed to the pool as tasks
+static band_job_t job = { &src, &img_gray, &img_sobel, 0, 0, { NULL }, 0 };
+static incr_job_t incr;
+static pyramid_t pyr;
+static tiled_job_t tiled;
+
+
+/*******************************************
+ * Model: runSobelMT
+ * Input: pool of worker threads
+ * Output: None
+ * Desc: This method pulls in an image from the webcam, feeds it into the
+ *   sobelCalc module, and displays the returned Sobel filtered image. This
+ *   function processes NUM_ITER frames. Capture and display run on the
+ *   calling thread; grayscale and Sobel are split into row bands that the
+ *   pool's workers (the calling thread included) take and steal.
+ ********************************************/
+void runSobelMT(thread_pool_t *pool)
+{
+  frame_sink_t sink;
+  uint64_t cap_time = 0, gray_time = 0, sobel_time = 0, disp_time = 0;
+  counters_t perf_counters;
+  governor_t gov;
+  int rows = 0, cols = 0;
+
+  // The controller thread initializes perf counters and I/O. Every worker is
+  // counted, so the hardware stats cover the whole pool, not just this thread.
+  pc_init(&perf_counters, 0);
+  for (int w = 1; w < pool->nthreads; w++) {
+    pc_attach(&perf_counters, pool->tids[w]);
+  }
+  frame_source_t source;
+  source_open(&source);
+  sink_open(&sink, opts.sink, source.fps);
+  if (opts.targetFps > 0) {
+    gov_init(&gov, pool, opts.targetFps);
+  }
+
+  int i = 0;
+
+  while (1) {
+    // Wall time on the calling thread alone and on the whole pool, for the
+    // governor
+    double serial_ns = 0, banded_ns = 0;
+
+    // ===== PHASE 1: CAPTURE =====
+    pc_start(&perf_counters);
+    source_read(&source, src);
+    pc_stop(&perf_counters);
+    serial_ns += perf_counters.ns;
+
+    if (src.empty()) { // end of the video
+      break;
+    }
+
+    // Save capture cycles, accumulate low level stats
+    cap_time = NS_TO_CYCLES(perf_counters.ns);
+    lat_record_stage(&lat, LAT_CAPTURE, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+    pc_accumulate(&perf_counters, hw_totals);
+
+    // (Re)size the shared pooled buffers and bands to the frame; no-op when
+    // unchanged. A Y4M source's frame already is the gray frame.
+    if (src.channels() == 1) {
+      img_gray = src;
+    } else if (!opts.fused && !opts.tiled) {
+      poolMat(img_gray, src.rows, src.cols, CV_MAKETYPE(src.depth(), 1));
+    }
+    outputMat(img_sobel, src.rows, src.cols, src.depth());
+    // Both dimensions: the line buffers are sized by the width
+    if (src.rows != rows || src.cols != cols) {
+      rows = src.rows;
+      cols = src.cols;
+      planBands(&job, rows, cols, pool->nthreads);
+    }
+    if (opts.incremental) {
+      incr.src = &src;
+      incr.gray = &img_gray;
+      incr.sobel = &img_sobel;
+      incrPlan(&incr, pool->nthreads);
+    }
+    if (opts.pyramid) {
+      job.pyr = &pyr;
+      pyramidPlan(&pyr, img_gray, img_sobel);
+    }
+    if (opts.tiled) {
+      tiled.src = &src;
+      tiled.sobel = &img_sobel;
+      tiledPlan(&tiled, pool->nthreads);
+    }
+
+    // Per worker buffers onto their worker's NUMA node; no-op once there
+    affinity_place(pool, job.lines);
+    affinity_place(pool, incr.lines);
+    affinity_place(pool, tiled.bufs);
+    affinity_place(pool, tiled.lines);
+
+    // ===== PHASE 2: GRAYSCALE =====
+    // The fused and tiled paths have no separate gray phase; each band or
+    // tile converts its own halo instead.
+    if (!opts.fused && !opts.tiled) {
+      pc_start(&perf_counters);
+      if (opts.incremental) {
+        pool_run(pool, incrGrayBand, &incr, incr.tiles_y);
+      } else if (src.channels() == 3) {
+        pool_run(pool, opts.pyramid ? pyramidGrayBand : grayBand, &job, job.num_bands);
+      }
+      pc_stop(&perf_counters);
+
+      gray_time = NS_TO_CYCLES(perf_counters.ns);
+      banded_ns += perf_counters.ns;
+      lat_record_stage(&lat, LAT_GRAY, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+      pc_accumulate(&perf_counters, hw_totals);
+    }
+
+    // ===== PHASE 3: SOBEL =====
+    pc_start(&perf_counters);
+    if (opts.incremental) {
+      pool_run(pool, incrSobelBand, &incr, incr.tiles_y);
+      incrEndFrame(&incr);
+    } else if (opts.tiled) {
+      pool_run(pool, tiledBand, &tiled, tiled.tiles_x * tiled.tiles_y);
+    } else {
+      pool_run(pool, opts.fused ? fusedBand : opts.pyramid ? pyramidSobelBand : sobelBand,
+               &job, job.num_bands);
+    }
+    pc_stop(&perf_counters);
+
+    sobel_time = NS_TO_CYCLES(perf_counters.ns);
+    banded_ns += perf_counters.ns;
+    lat_record_stage(&lat, LAT_SOBEL, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+    pc_accumulate(&perf_counters, hw_totals);
+
+    // ===== PHASE 4: DISPLAY / OUTPUT =====
+    pc_start(&perf_counters);
+    sink_write(&sink, img_sobel);
+    pc_stop(&perf_counters);
+
+    disp_time = NS_TO_CYCLES(perf_counters.ns);
+    serial_ns += perf_counters.ns;
+    lat_record_stage(&lat, LAT_DISPLAY, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+    pc_accumulate(&perf_counters, hw_totals);
+
+    if (i == 0) {
+      fpool_mark_steady();
+    }
+
+    cap_total += cap_time;
+    gray_total += gray_time;
+    sobel_total += sobel_time;
+    disp_total += disp_time;
+    lat_end_frame(&lat);
+    i++;
+    if (opts.targetFps > 0) {
+      gov_end_frame(&gov, pool, serial_ns, banded_ns);
+    }
+
+    // Press q to exit
+    char c = sink_poll_key(&sink);
+    if (c == 'q' || i >= opts.numFrames) {
+      break;
+    }
+  }
+
+  // write and clean up report
+  // Frame rate over the total time rather than a mean of per-frame rates,
+  // which would overweight the fast frames and hide the slow ones
+  double total_time = gray_total + sobel_total + cap_total + disp_total;
+  double fps = PROC_FREQ * (double)i / total_time;
+  total_epf = PROC_EPC * pool->nthreads / fps;
+  // Paced frames: the rate actually delivered, and the energy of the cores
+  // that were busy rather than of every core for the whole run
+  if (opts.targetFps > 0) {
+    fps = gov_fps(&gov);
+    total_epf = gov_energy_per_frame(&gov);
+  }
+
+  results_file.open("mt_perf.csv", ios::out);
+  results_file << "Percent of time per function" << endl;
+  results_file << "Capture, " << (cap_total / total_time) * 100 << "%" << endl;
+  results_file << "Grayscale, " << (gray_total / total_time) * 100 << "%" << endl;
+  results_file << sobelStageName() << ", " << (sobel_total / total_time) * 100 << "%" << endl;
+  results_file << "Display, " << (disp_total / total_time) * 100 << "%" << endl;
+  results_file << "\nSummary" << endl;
+  results_file << "Frames per second, " << fps << endl;
+  results_file << "Frame latency p50 (ms), " << lat_percentile(&lat.ns[LAT_FRAME], 0.50) / 1e6 << endl;
+  results_file << "Frame latency p99 (ms), " << lat_percentile(&lat.ns[LAT_FRAME], 0.99) / 1e6 << endl;
+  results_file << "Frame latency max (ms), " << lat.ns[LAT_FRAME].max / 1e6 << endl;
+  results_file << "Cycles per frame, " << total_time / i << endl;
+  results_file << "Energy per frames (mJ), " << total_epf * 1000 << endl;
+  results_file << "Total frames, " << i << endl;
+  results_file << "Kernel, " << kernels->name << endl;
+  results_file << "Filter, " << filterName() << endl;
+  results_file << "Output, " << opts.sink << endl;
+  results_file << "Buffer pool allocations, " << fpool_stats().allocs << endl;
+  results_file << "Buffer pool allocations after first frame, " << fpool_stats().steady_allocs << endl;
+  results_file << "Threads, " << pool->nthreads << endl;
+  results_file << "Band rows, " << job.band_rows << endl;
+  results_file << "Stolen bands per frame, " << float(pool->steals) / i << endl;
+  if (opts.incremental) {
+    results_file << "Dirty tiles, " << (incr.tiles ? 100.0 * incr.dirty_tiles / incr.tiles : 0) << "%" << endl;
+  }
+  if (opts.pyramid) {
+    results_file << "Pyramid levels, " << pyr.levels << endl;
+  }
+  if (opts.tiled) {
+    results_file << "Tile size, " << tiled.tile_w << "x" << tiled.tile_h << endl;
+    results_file << "L1/L2 cache (KiB), " << tiled.l1 / 1024 << "/" << tiled.l2 / 1024 << endl;
+  }
+  if (opts.targetFps > 0) {
+    gov_report(&gov, results_file);
+  }
+  affinity_report(results_file);
+  pc_report(results_file, &perf_counters, hw_totals, i);
+
+  lat.has_cycles = pc_available(&perf_counters, PC_CYCLES);
+  const char *stages[LAT_NUM_STAGES] = { "Capture", "Grayscale", sobelStageName(), "Display", "Frame" };
+  lat_export(&lat, "mt", stages);
+
+  pc_close(&perf_counters);
+  sink_close(&sink);
+  freeBands(&job);
+  incrFree(&incr);
+  pyramidFree(&pyr);
+  tiledFree(&tiled);
+  source_close(&source);
+  results_file.close();
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <iostream>
+#include <fstream>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <err.h>
+
+#include "sobel_alg.h"
+#include "pc.h"
+#include "sobel_kernels.h"
+#include "thread_pool.h"
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "frame_pool.h"
+#include "affinity.h"
+
+using namespace cv;
+
+static ofstream results_file;
+
+// One input stream. A stream is handled by at most one worker at a time
+// (whoever wins `busy`), so its frames stay in order and its capture, buffers
+// and sink need no locking of their own.
+struct stream_t {
+  const char *path;
+  frame_source_t source;
+  Mat src;                  // first frame, read while sizing the buffers
+  int primed;               // src still holds a frame that was not processed
+  Mat gray, sobel;
+  char spec[256];           // this stream's sink spec
+  frame_sink_t sink;
+
+  int busy;                 // claimed by a worker
+  int done;
+  int frames;
+  double compute_ms;        // gray + Sobel time
+  double t_first, t_last;   // first frame's processing started, last frame written (ms)
+} __attribute__((aligned(64)));
+
+struct multi_job_t {
+  stream_t *streams;
+  int num_streams;
+  int next;                 // round-robin start point for the next claim
+  int remaining;            // streams not done yet
+  int started;              // streams that have written their first frame
+  unsigned char *lines[POOL_MAX_THREADS]; // fused / filter line buffers per worker
+  int line_width;
+};
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*******************************************
+ * Model: streamSinkSpec
+ * Input: the -o spec, stream number
+ * Output: None directly. Writes the stream's own spec into out
+ * Desc: Every stream gets its own output file: "raw:out.raw" becomes
+ *  "raw:out.3.raw" for stream 3 (the number goes before the extension, or
+ *  at the end if there is none). "null" is shared as is.
+ ********************************************/
+static void streamSinkSpec(char *out, size_t len, const char *spec, int index)
+{
+  const char *path = strchr(spec, ':');
+  if (path == NULL) {
+    snprintf(out, len, "%s", spec);
+    return;
+  }
+  path++;
+
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  if (dot == NULL || (slash != NULL && dot < slash) || dot == path) {
+    snprintf(out, len, "%s.%d", spec, index);
+  } else {
+    snprintf(out, len, "%.*s.%d%s", (int)(dot - spec), spec, index, dot);
+  }
+}
+
+/*******************************************
+ * Model: streamFrame
+ * Input: the job, a claimed stream, worker number
+ * Output: None
+ * Desc: Reads, filters and outputs the next frame of one stream. Marks the
+ *  stream done at the end of its input or after -n frames.
+ ********************************************/
+static void streamFrame(multi_job_t *job, stream_t *s, int worker)
+{
+  Mat src;
+
+  if (s->primed) {
+    src = s->src;
+    s->primed = 0;
+  } else if (s->frames < opts.numFrames) {
+    source_read(&s->source, src);
+  }
+  if (src.empty()) {
+    s->done = 1;
+    __atomic_sub_fetch(&job->remaining, 1, __ATOMIC_RELEASE);
+    return;
+  }
+
+  double t0 = now_ms();
+  if (s->frames == 0) {
+    s->t_first = t0; // from here, so opening and setup are not in the stream's rate
+  }
+  outputMat(s->sobel, src.rows, src.cols, src.depth()); // no-op unless the size changed
+  if (opts.fused) {
+    // A stream that grew past the widest first frame uses the per thread buffer
+    sobelFused(src, s->sobel, 0, 0, src.cols <= job->line_width ? job->lines[worker] : NULL);
+  } else if (src.channels() == 1) {
+    // Y4M: the frame is the gray frame
+    sobelCalc(src, s->sobel, 0, 0, src.cols <= job->line_width ? job->lines[worker] : NULL);
+  } else {
+    poolMat(s->gray, src.rows, src.cols, CV_MAKETYPE(src.depth(), 1));
+    grayScale(src, s->gray);
+    sobelCalc(s->gray, s->sobel, 0, 0, src.cols <= job->line_width ? job->lines[worker] : NULL);
+  }
+  s->compute_ms += now_ms() - t0;
+
+  sink_write(&s->sink, s->sobel);
+  s->t_last = now_ms();
+
+  // Every stream has sized its buffers and sink once all have written a frame
+  if (s->frames++ == 0 &&
+      __atomic_add_fetch(&job->started, 1, __ATOMIC_ACQ_REL) == job->num_streams) {
+    fpool_mark_steady();
+  }
+}
+
+/*******************************************
+ * Model: streamWorker
+ * Input: the job, task number (unused), worker number
+ * Output: None
+ * Desc: Run by every pool worker for the whole run. Repeatedly claims the
+ *  next idle stream, round-robin, and processes one frame of it, so a
+ *  worker never waits on a stream that somebody else is decoding and slow
+ *  streams do not hold back fast ones. Returns when all streams are done.
+ ********************************************/
+static void streamWorker(void *arg, int task, int worker)
+{
+  multi_job_t *job = (multi_job_t *)arg;
+  int idle = 0;
+
+  while (__atomic_load_n(&job->remaining, __ATOMIC_ACQUIRE) > 0) {
+    int n = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED) % job->num_streams;
+    stream_t *s = &job->streams[n];
+
+    if (__atomic_load_n(&s->busy, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&s->busy, 1, __ATOMIC_ACQUIRE)) {
+      // Every stream taken: more workers than runnable streams
+      if (++idle >= job->num_streams) {
+        sched_yield();
+        idle = 0;
+      }
+      continue;
+    }
+    idle = 0;
+    if (!s->done) {
+      streamFrame(job, s, worker);
+    }
+    __atomic_store_n(&s->busy, 0, __ATOMIC_RELEASE);
+  }
+}
+
+/*******************************************
+ * Model: runSobelMulti
+ * Input: pool of worker threads
+ * Output: None
+ * Desc: Processes every input given on the command line concurrently. All
+ *  streams share one pool; a worker takes one whole frame of one stream at
+ *  a time (capture, grayscale, Sobel, output), so there is no per-stream
+ *  thread and no per-stream copy of the workers. -n is per stream. Each
+ *  stream writes its own output and the report lists per-stream frame
+ *  rates next to the aggregate.
+ ********************************************/
+void runSobelMulti(thread_pool_t *pool)
+{
+  int nstreams = opts.numInputs;
+  stream_t *streams = new stream_t[nstreams];
+  static multi_job_t job;
+  int max_cols = 0;
+
+  // Open every input and read its first frame to size its buffers
+  for (int n = 0; n < nstreams; n++) {
+    stream_t *s = &streams[n];
+    s->path = opts.inputs[n];
+    source_open(&s->source, s->path);
+    source_read(&s->source, s->src);
+    s->primed = !s->src.empty();
+    s->done = s->busy = s->frames = 0;
+    s->compute_ms = 0;
+    s->t_first = s->t_last = 0;
+    if (s->primed) {
+      outputMat(s->sobel, s->src.rows, s->src.cols, s->src.depth());
+      if (!opts.fused && s->src.channels() == 3) {
+        poolMat(s->gray, s->src.rows, s->src.cols, CV_MAKETYPE(s->src.depth(), 1));
+      }
+      max_cols = s->src.cols > max_cols ? s->src.cols : max_cols;
+    }
+    streamSinkSpec(s->spec, sizeof(s->spec), opts.sink, n);
+    sink_open(&s->sink, s->spec, s->source.fps);
+  }
+
+  job.streams = streams;
+  job.num_streams = nstreams;
+  job.next = 0;
+  job.remaining = nstreams;
+  job.started = 0;
+  if ((opts.fused || opts.filter != FILTER_SOBEL) && max_cols > 0) {
+    for (int w = 0; w < pool->nthreads; w++) {
+      job.lines[w] = (unsigned char *)fpool_acquire(lineBytes(max_cols));
+    }
+    job.line_width = max_cols;
+    affinity_place(pool, job.lines);
+  }
+
+  // Count every worker over the whole run
+  counters_t perf_counters;
+  pc_init(&perf_counters, 0);
+  for (int w = 1; w < pool->nthreads; w++) {
+    pc_attach(&perf_counters, pool->tids[w]);
+  }
+
+  double t_start = now_ms();
+  pc_start(&perf_counters);
+  pool_run(pool, streamWorker, &job, pool->nthreads);
+  pc_stop(&perf_counters);
+  double t_end = now_ms();
+
+  int total_frames = 0;
+  double compute_total = 0;
+  for (int n = 0; n < nstreams; n++) {
+    total_frames += streams[n].frames;
+    compute_total += streams[n].compute_ms;
+  }
+
+  results_file.open("multi_perf.csv", ios::out);
+  results_file << "Summary" << endl;
+  results_file << "Aggregate frames per second, " << total_frames / ((t_end - t_start) / 1000.0) << endl;
+  results_file << "Streams, " << nstreams << endl;
+  results_file << "Total frames, " << total_frames << endl;
+  results_file << "Compute time per frame (ms), " << compute_total / total_frames << endl;
+  results_file << "Kernel, " << kernels->name << endl;
+  results_file << "Filter, " << filterName() << endl;
+  results_file << "Output, " << opts.sink << endl;
+  results_file << "Buffer pool allocations, " << fpool_stats().allocs << endl;
+  results_file << "Buffer pool allocations after first frame, " << fpool_stats().steady_allocs << endl;
+  results_file << "Threads, " << pool->nthreads << endl;
+  results_file << "Mode, " << (opts.fused ? "Gray+Sobel (fused)" : "Gray, Sobel") << endl;
+  affinity_report(results_file);
+  results_file << "\nPer stream" << endl;
+  results_file << "Stream, Input, Output, Frames, Frames per second, Compute time per frame (ms)" << endl;
+  for (int n = 0; n < nstreams; n++) {
+    stream_t *s = &streams[n];
+    double secs = (s->t_last - s->t_first) / 1000.0;
+    results_file << n << ", " << s->path << ", " << s->spec << ", " << s->frames << ", "
+                 << (secs > 0 ? s->frames / secs : 0) << ", "
+                 << (s->frames > 0 ? s->compute_ms / s->frames : 0) << endl;
+  }
+  pc_report(results_file, &perf_counters, perf_counters.count, total_frames);
+  pc_close(&perf_counters);
+  results_file.close();
+
+  for (int n = 0; n < nstreams; n++) {
+    sink_close(&streams[n].sink);
+    poolRelease(streams[n].gray);
+    poolRelease(streams[n].sobel);
+    source_close(&streams[n].source);
+  }
+  for (int w = 0; w < pool->nthreads; w++) {
+    fpool_release(job.lines[w]);
+    job.lines[w] = NULL;
+  }
+  delete[] streams;
+}
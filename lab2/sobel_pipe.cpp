@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <iostream>
+#include <fstream>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "spsc_ring.h"
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "frame_pool.h"
+#include "lat_hist.h"
+#include "affinity.h"
+#include "pc.h"
+
+using namespace cv;
+
+static ofstream results_file;
+
+// Frames in flight: one per stage, so every stage can be busy at once
+#define PIPE_SLOTS 4
+
+// A preallocated frame travelling down the pipeline. Buffers come from the
+// frame pool, are sized on the first frame and reused for the whole run.
+struct frame_slot_t {
+  Mat src, gray, sobel;
+  int last;                     // end of stream marker, carries no frame
+  double t_capture;             // when capture of this frame started (ms)
+  double cap_ms, gray_ms, sobel_ms;
+};
+
+static frame_slot_t slots[PIPE_SLOTS];
+
+// One ring per consuming stage. Every ring has exactly one producer stage and
+// one consumer stage. to_capture returns displayed slots to the capture stage.
+static spsc_ring_t to_capture, to_gray, to_sobel, to_display;
+
+// Opened by the capture stage. Closed only once every stage has finished,
+// since slots may still point into a mapped file after capture ends.
+static frame_source_t source;
+
+// Set by the display stage when 'q' is pressed
+static int stop_capture = 0;
+
+// Compute workers per stage
+static int gray_threads, sobel_threads;
+
+// Stage busy times and capture to display latency. Stages overlap here, so
+// the frame latency is measured end to end rather than summed.
+static lat_report_t lat;
+
+// Hardware counters, one set per stage: the stage's own thread plus its pool
+// workers, counted around each frame's work but not the ring waits. Indexed
+// like the report's stage names.
+enum { PIPE_CAPTURE, PIPE_GRAY, PIPE_SOBEL, PIPE_DISPLAY, PIPE_NUM_STAGES };
+static counters_t stage_counters[PIPE_NUM_STAGES];
+static uint64_t stage_totals[PIPE_NUM_STAGES][PC_NUM_EVENTS];
+
+// Start counting a stage on the calling thread and `pool`'s workers
+static void stageCounters(int stage, thread_pool_t *pool)
+{
+  pc_init(&stage_counters[stage], 0);
+  for (int w = 1; pool != NULL && w < pool->nthreads; w++) {
+    pc_attach(&stage_counters[stage], pool->tids[w]);
+  }
+}
+
+static double now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*******************************************
+ * Model: captureStage
+ * Input: None
+ * Output: None
+ * Desc: Reads frames into free slots and passes them on. A mapped file's
+ *  frames stay valid for the whole run, so the slot just points at them.
+ *  cvQueryFrame, V4L2 and YUYV unpacking reuse their buffer for the next
+ *  frame, so those frames are copied into the slot's own pooled buffer.
+ *  Sends a last marker at the end of the input, after -n frames or
+ *  when the display stage asks to stop. A Y4M source's frames are gray
+ *  already; they travel in src and the gray stage passes them through.
+ ********************************************/
+static void *captureStage(void *ptr)
+{
+  spsc_ring_t *next = opts.fused ? &to_sobel : &to_gray;
+  affinity_pin_self(AFF_CAPTURE);
+  source_open(&source);
+  int zero_copy = source_frames_persist(&source);
+  stageCounters(PIPE_CAPTURE, NULL);
+
+  for (int n = 0; ; n++) {
+    frame_slot_t *slot = (frame_slot_t *)spsc_pop_wait(&to_capture);
+    Mat frame;
+
+    slot->t_capture = now_ms();
+    pc_start(&stage_counters[PIPE_CAPTURE]);
+    if (n < opts.numFrames && !__atomic_load_n(&stop_capture, __ATOMIC_ACQUIRE)) {
+      source_read(&source, frame);
+    }
+    if (frame.empty()) {
+      pc_stop(&stage_counters[PIPE_CAPTURE]);
+      slot->last = 1;
+      spsc_push_wait(next, slot);
+      break;
+    }
+    if (n == 0) {
+      // Size every slot up front. The other slots are all still queued
+      // here in to_capture, so no other stage can be touching them.
+      for (int s = 0; s < PIPE_SLOTS; s++) {
+        if (!zero_copy) {
+          poolMat(slots[s].src, frame.rows, frame.cols, frame.type());
+        }
+        if (!opts.fused && frame.channels() == 3) {
+          poolMat(slots[s].gray, frame.rows, frame.cols, CV_MAKETYPE(frame.depth(), 1));
+        }
+        outputMat(slots[s].sobel, frame.rows, frame.cols, frame.depth());
+      }
+    }
+    if (zero_copy) {
+      slot->src = frame;
+    } else {
+      poolMat(slot->src, frame.rows, frame.cols, frame.type()); // no-op unless the size changed
+      frame.copyTo(slot->src);
+    }
+    pc_stop(&stage_counters[PIPE_CAPTURE]);
+    pc_accumulate(&stage_counters[PIPE_CAPTURE], stage_totals[PIPE_CAPTURE]);
+    slot->cap_ms = now_ms() - slot->t_capture;
+    spsc_push_wait(next, slot);
+  }
+
+  return NULL;
+}
+
+/*******************************************
+ * Model: grayStage
+ * Input: None
+ * Output: None
+ * Desc: Converts each frame to grayscale, split into bands over this
+ *  stage's own pool
+ ********************************************/
+static void *grayStage(void *ptr)
+{
+  thread_pool_t *pool = pool_create(gray_threads);
+  affinity_pool(pool);
+  stageCounters(PIPE_GRAY, pool);
+  band_job_t job = { NULL, NULL, NULL, 0, 0, { NULL }, 0 };
+  int rows = 0, cols = 0;
+
+  while (1) {
+    frame_slot_t *slot = (frame_slot_t *)spsc_pop_wait(&to_gray);
+    if (!slot->last && slot->src.channels() == 1) {
+      slot->gray_ms = 0;
+    } else if (!slot->last) {
+      double t0 = now_ms();
+      pc_start(&stage_counters[PIPE_GRAY]);
+      poolMat(slot->gray, slot->src.rows, slot->src.cols, CV_MAKETYPE(slot->src.depth(), 1));
+      // Both dimensions: the line buffers are sized by the width
+      if (slot->src.rows != rows || slot->src.cols != cols) {
+        rows = slot->src.rows;
+        cols = slot->src.cols;
+        planBands(&job, rows, cols, pool->nthreads);
+        affinity_place(pool, job.lines);
+      }
+      job.src = &slot->src;
+      job.gray = &slot->gray;
+      pool_run(pool, grayBand, &job, job.num_bands);
+      pc_stop(&stage_counters[PIPE_GRAY]);
+      pc_accumulate(&stage_counters[PIPE_GRAY], stage_totals[PIPE_GRAY]);
+      slot->gray_ms = now_ms() - t0;
+    }
+    spsc_push_wait(&to_sobel, slot);
+    if (slot->last) {
+      break;
+    }
+  }
+
+  freeBands(&job);
+  pool_destroy(pool);
+  return NULL;
+}
+
+/*******************************************
+ * Model: sobelStage
+ * Input: None
+ * Output: None
+ * Desc: Runs Sobel (or fused grayscale+Sobel) on each frame, split into
+ *  bands over this stage's own pool
+ ********************************************/
+static void *sobelStage(void *ptr)
+{
+  thread_pool_t *pool = pool_create(sobel_threads);
+  affinity_pool(pool);
+  stageCounters(PIPE_SOBEL, pool);
+  band_job_t job = { NULL, NULL, NULL, 0, 0, { NULL }, 0 };
+  int rows = 0, cols = 0;
+
+  while (1) {
+    frame_slot_t *slot = (frame_slot_t *)spsc_pop_wait(&to_sobel);
+    if (!slot->last) {
+      double t0 = now_ms();
+      pc_start(&stage_counters[PIPE_SOBEL]);
+      outputMat(slot->sobel, slot->src.rows, slot->src.cols, slot->src.depth());
+      // Both dimensions: the line buffers are sized by the width
+      if (slot->src.rows != rows || slot->src.cols != cols) {
+        rows = slot->src.rows;
+        cols = slot->src.cols;
+        planBands(&job, rows, cols, pool->nthreads);
+        affinity_place(pool, job.lines);
+      }
+      job.src = &slot->src;
+      job.gray = slot->src.channels() == 1 ? &slot->src : &slot->gray;
+      job.sobel = &slot->sobel;
+      pool_run(pool, opts.fused ? fusedBand : sobelBand, &job, job.num_bands);
+      pc_stop(&stage_counters[PIPE_SOBEL]);
+      pc_accumulate(&stage_counters[PIPE_SOBEL], stage_totals[PIPE_SOBEL]);
+      slot->sobel_ms = now_ms() - t0;
+    }
+    spsc_push_wait(&to_display, slot);
+    if (slot->last) {
+      break;
+    }
+  }
+
+  freeBands(&job);
+  pool_destroy(pool);
+  return NULL;
+}
+
+/*******************************************
+ * Model: runSobelPipe
+ * Input: None
+ * Output: None
+ * Desc: Runs capture, grayscale, Sobel and display as concurrent stages
+ *  connected by SPSC rings of preallocated frame slots, so frame N+1 is
+ *  decoded while frame N is filtered and frame N-1 is displayed. Display
+ *  stays on the calling thread because highgui wants the main thread.
+ ********************************************/
+void runSobelPipe()
+{
+  frame_sink_t sink;
+  pthread_t cap_thread, gray_thread, sobel_thread;
+  double cap_total = 0, gray_total = 0, sobel_total = 0, disp_total = 0, latency_total = 0;
+  int ret, i = 0;
+
+  // Split the compute workers between the two compute stages
+  int nthreads = opts.numThreads > 0 ? opts.numThreads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (opts.fused) {
+    gray_threads = 0;
+    sobel_threads = nthreads;
+  } else {
+    gray_threads = nthreads / 2 > 0 ? nthreads / 2 : 1;
+    sobel_threads = nthreads - gray_threads > 0 ? nthreads - gray_threads : 1;
+  }
+
+  spsc_init(&to_capture, PIPE_SLOTS);
+  spsc_init(&to_gray, PIPE_SLOTS);
+  spsc_init(&to_sobel, PIPE_SLOTS);
+  spsc_init(&to_display, PIPE_SLOTS);
+  for (int s = 0; s < PIPE_SLOTS; s++) {
+    spsc_push(&to_capture, &slots[s]);
+  }
+
+  // The capture stage owns the capture, so the output frame rate is only a
+  // default here; it matters for the video sink alone
+  sink_open(&sink, opts.sink, 0);
+
+  if ( (ret = pthread_create(&cap_thread, NULL, captureStage, NULL)) ) {
+    errx(1, "Thread creation failed: %d", ret);
+  }
+  if (!opts.fused && (ret = pthread_create(&gray_thread, NULL, grayStage, NULL)) ) {
+    errx(1, "Thread creation failed: %d", ret);
+  }
+  if ( (ret = pthread_create(&sobel_thread, NULL, sobelStage, NULL)) ) {
+    errx(1, "Thread creation failed: %d", ret);
+  }
+
+  double t_first = 0, t_end = 0;
+  affinity_pin_self(AFF_OUTPUT);
+  stageCounters(PIPE_DISPLAY, NULL);
+
+  // Display / output stage
+  while (1) {
+    frame_slot_t *slot = (frame_slot_t *)spsc_pop_wait(&to_display);
+    if (slot->last) {
+      break;
+    }
+
+    double t0 = now_ms();
+    pc_start(&stage_counters[PIPE_DISPLAY]);
+    sink_write(&sink, slot->sobel);
+    pc_stop(&stage_counters[PIPE_DISPLAY]);
+    pc_accumulate(&stage_counters[PIPE_DISPLAY], stage_totals[PIPE_DISPLAY]);
+    t_end = now_ms();
+
+    if (i == 0) {
+      t_first = slot->t_capture;
+      fpool_mark_steady();
+    }
+    cap_total += slot->cap_ms;
+    gray_total += slot->gray_ms;
+    sobel_total += slot->sobel_ms;
+    disp_total += t_end - t0;
+    latency_total += t_end - slot->t_capture;
+    lat_record(&lat.ns[LAT_CAPTURE], slot->cap_ms * 1e6);
+    if (!opts.fused) {
+      lat_record(&lat.ns[LAT_GRAY], slot->gray_ms * 1e6);
+    }
+    lat_record(&lat.ns[LAT_SOBEL], slot->sobel_ms * 1e6);
+    lat_record(&lat.ns[LAT_DISPLAY], (t_end - t0) * 1e6);
+    lat_record(&lat.ns[LAT_FRAME], (t_end - slot->t_capture) * 1e6);
+    i++;
+
+    spsc_push_wait(&to_capture, slot);
+
+    // Press q to exit
+    char c = sink_poll_key(&sink);
+    if (c == 'q') {
+      __atomic_store_n(&stop_capture, 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  sink_close(&sink);
+  pthread_join(cap_thread, NULL);
+  if (!opts.fused) {
+    pthread_join(gray_thread, NULL);
+  }
+  pthread_join(sobel_thread, NULL);
+  source_close(&source);
+
+  // Throughput is bounded by the slowest stage rather than the sum of stages.
+  // An input without frames reports zeros rather than dividing by zero.
+  const char *names[] = { "Capture", "Grayscale", opts.fused ? "Gray+Sobel (fused)" : "Sobel", "Display" };
+  double frames = i ? i : 1;
+  double elapsed = t_end - t_first;
+  double per_frame[] = { cap_total / frames, gray_total / frames, sobel_total / frames, disp_total / frames };
+  int slowest = 0;
+  for (int s = 1; s < 4; s++) {
+    if (per_frame[s] > per_frame[slowest]) {
+      slowest = s;
+    }
+  }
+
+  results_file.open("pipe_perf.csv", ios::out);
+  results_file << "Busy time per frame per stage (ms)" << endl;
+  for (int s = 0; s < 4; s++) {
+    results_file << names[s] << ", " << per_frame[s] << endl;
+  }
+  results_file << "\nSummary" << endl;
+  results_file << "Frames per second, " << (elapsed > 0 ? i / (elapsed / 1000.0) : 0) << endl;
+  results_file << "Slowest stage, " << names[slowest] << endl;
+  results_file << "Slowest stage bound (fps), " << (per_frame[slowest] > 0 ? 1000.0 / per_frame[slowest] : 0) << endl;
+  results_file << "Capture to display latency (ms), " << latency_total / frames << endl;
+  results_file << "Capture to display latency p50 (ms), " << lat_percentile(&lat.ns[LAT_FRAME], 0.50) / 1e6 << endl;
+  results_file << "Capture to display latency p99 (ms), " << lat_percentile(&lat.ns[LAT_FRAME], 0.99) / 1e6 << endl;
+  results_file << "Capture to display latency max (ms), " << lat.ns[LAT_FRAME].max / 1e6 << endl;
+  results_file << "Total frames, " << i << endl;
+  results_file << "Kernel, " << kernels->name << endl;
+  results_file << "Filter, " << filterName() << endl;
+  results_file << "Output, " << opts.sink << endl;
+  results_file << "Buffer pool allocations, " << fpool_stats().allocs << endl;
+  results_file << "Buffer pool allocations after first frame, " << fpool_stats().steady_allocs << endl;
+  results_file << "Compute threads (gray/sobel), " << gray_threads << "/" << sobel_threads << endl;
+  results_file << "Frame slots, " << PIPE_SLOTS << endl;
+  affinity_report(results_file);
+
+  // One report over every stage's threads. The stages were counted apart,
+  // so sum their totals; an event is available if any stage could count it.
+  static counters_t all_counters;
+  uint64_t hw_totals[PC_NUM_EVENTS] = { 0 };
+  all_counters.nthreads = 0;
+  memset(all_counters.open, 0, sizeof(all_counters.open));
+  for (int s = 0; s < PIPE_NUM_STAGES; s++) {
+    all_counters.nthreads += stage_counters[s].nthreads;
+    for (int e = 0; e < PC_NUM_EVENTS; e++) {
+      all_counters.open[e] |= stage_counters[s].open[e];
+      hw_totals[e] += stage_totals[s][e];
+    }
+  }
+  pc_report(results_file, &all_counters, hw_totals, i);
+  if (pc_available(&all_counters, PC_CYCLES)) {
+    results_file << "\nCycles per frame per stage" << endl;
+    for (int s = 0; s < PIPE_NUM_STAGES; s++) {
+      results_file << names[s] << ", " << pc_ratio(stage_totals[s][PC_CYCLES], i) << endl;
+    }
+  }
+  results_file.close();
+  for (int s = 0; s < PIPE_NUM_STAGES; s++) {
+    pc_close(&stage_counters[s]);
+  }
+
+  const char *stages[LAT_NUM_STAGES] = { names[0], names[1], names[2], names[3], "Capture to display" };
+  lat_export(&lat, "pipe", stages);
+}
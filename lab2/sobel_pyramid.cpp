@@ -0,0 +1,121 @@
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+
+// Multi-scale pyramid (--pyramid). Level 0 is the frame itself and each
+// further level halves it with a 2x2 mean (down_row). The downsampled rows
+// are produced while the gray conversion walks the frame: as soon as a pair
+// of level l rows exists, the level l+1 row under them is written, so each
+// row is read back from cache rather than in a separate pass per level.
+//
+// The Sobel stage (or --filter operator) then runs on every level, into one
+// composite output frame: level 0 on the left, the smaller levels stacked
+// top to bottom in a column of width cols/2 on its right. Every level's gray
+// buffer comes from the frame pool, like the rest of the frame buffers.
+
+/*******************************************
+ * Model: pyramidCols
+ * Input: frame width
+ * Output: width of the composite output frame
+ * Desc: Level 0 plus the column of smaller levels next to it
+ ********************************************/
+int pyramidCols(int cols)
+{
+  return opts.pyramid > 1 ? cols + cols / 2 : cols;
+}
+
+/*******************************************
+ * Model: pyramidPlan
+ * Input: pyramid, full size gray frame, composite output frame
+ * Output: None directly. Sets up the levels of pyr
+ * Desc: Sizes the levels from the gray frame and points each level's
+ *  Sobel output at its place in img_out. Levels stop at opts.pyramid or
+ *  once a level would be smaller than 3x3. The pooled level buffers are
+ *  kept, so after the first frame this allocates nothing.
+ ********************************************/
+void pyramidPlan(pyramid_t *pyr, Mat& img_gray, Mat& img_out)
+{
+  int rows = img_gray.rows, cols = img_gray.cols;
+  int y = 0;
+
+  pyr->gray[0] = img_gray;
+  pyr->sobel[0] = Mat(rows, cols, CV_8UC1, img_out.data, img_out.step);
+  for (pyr->levels = 1; pyr->levels < opts.pyramid; pyr->levels++) {
+    int l = pyr->levels;
+    if ((rows >> l) < 3 || (cols >> l) < 3) {
+      break;
+    }
+    poolMat(pyr->gray[l], rows >> l, cols >> l, CV_8UC1);
+    pyr->sobel[l] = Mat(rows >> l, cols >> l, CV_8UC1, img_out.ptr(y) + cols, img_out.step);
+    y += rows >> l;
+  }
+}
+
+void pyramidFree(pyramid_t *pyr)
+{
+  for (int l = 1; l < PYR_MAX_LEVELS; l++) {
+    poolRelease(pyr->gray[l]);
+  }
+  pyr->levels = 0;
+}
+
+// Level `level` row y was just written: once it completes a pair, produce
+// the row of the next level below it, and so on down the pyramid
+static void pyramidDown(pyramid_t *pyr, int level, int y)
+{
+  while (level + 1 < pyr->levels && (y & 1) && (y >> 1) < pyr->gray[level + 1].rows) {
+    Mat& from = pyr->gray[level];
+    Mat& to = pyr->gray[level + 1];
+    kernels->down_row(from.ptr(y - 1), from.ptr(y), to.ptr(y >> 1), to.cols);
+    level++;
+    y >>= 1;
+  }
+}
+
+/*******************************************
+ * Model: pyramidGray
+ * Input: Mat img (BGR), pyramid from pyramidPlan
+ * Output: None directly. Writes the gray rows of every level
+ * Desc: Converts rows [startRow, endRow) of img into level 0 and writes
+ *  the rows of the smaller levels they cover. startRow must be a multiple
+ *  of 2^(levels-1), so a band never needs a row of another band; endRow
+ *  too, unless it is the last row.
+ ********************************************/
+void pyramidGray(Mat& img, pyramid_t *pyr, int startRow, int endRow)
+{
+  Mat& gray = pyr->gray[0];
+
+  // if both are 0 then this is single thread
+  if (startRow == 0 && endRow == 0) {
+    endRow = img.rows;
+  }
+
+  for (int i = startRow; i < endRow; i++) {
+    kernels->gray_row(img.ptr(i), gray.ptr(i), img.cols);
+    pyramidDown(pyr, 0, i);
+  }
+}
+
+/*******************************************
+ * Model: pyramidSobel
+ * Input: pyramid from pyramidPlan, optional line buffers
+ * Output: None directly. Writes every level into the composite output
+ * Desc: sobelCalc on each level, for the level rows that gray rows
+ *  [startRow, endRow) of level 0 cover (see pyramidGray). The one pixel
+ *  border of every level is left untouched, as with a single frame.
+ ********************************************/
+void pyramidSobel(pyramid_t *pyr, int startRow, int endRow, unsigned char *lines)
+{
+  // If both 0, process the whole image
+  if (startRow == 0 && endRow == 0) {
+    endRow = pyr->gray[0].rows;
+  }
+
+  for (int l = 0; l < pyr->levels; l++) {
+    int start = startRow >> l, end = endRow >> l;
+    start = start > 1 ? start : 1;
+    end = end < pyr->gray[l].rows - 1 ? end : pyr->gray[l].rows - 1;
+    if (start < end) {
+      sobelCalc(pyr->gray[l], pyr->sobel[l], start, end, lines);
+    }
+  }
+}
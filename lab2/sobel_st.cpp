@@ -1,140 +1,231 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-#include <iostream>
-#include <fstream>
-#include <errno.h>
-#include <unistd.h>
-#include <string.h>
-#include <locale.h>
-#include <sys/ioctl.h>
-#include <err.h>
-
-#include "sobel_alg.h"
-#include "pc.h"
-
-// Replaces img.step[0] and img.step[1] calls in sobel calc
-
-using namespace std;
-using namespace cv;
-
-static ofstream results_file;
-
-// Define image mats to pass between function calls
-static Mat img_gray, img_sobel;
-static float total_fps, total_ipc, total_epf;
-static float gray_total, sobel_total, cap_total, disp_total;
-static float sobel_ic_total, sobel_l1cm_total;
-
-/*******************************************
- * Model: runSobelST
- * Input: None
- * Output: None
- * Desc: This method pulls in an image from the webcam, feeds it into the
- *   sobelCalc module, and displays the returned Sobel filtered image. This
- *   function processes NUM_ITER frames.
- ********************************************/
-void runSobelST()
-{
-  // Set up variables for computing Sobel
-  string top = "Sobel Top";
-  Mat src;
-  uint64_t cap_time, gray_time, sobel_time, disp_time, sobel_l1cm, sobel_ic;
-
-  counters_t perf_counters;
-
-  pc_init(&perf_counters, getpid());
-
-  // Start algorithm
-  CvCapture* video_cap;
-
-  if (opts.webcam) {
-    video_cap = cvCreateCameraCapture(-1);
-  } else {
-    video_cap = cvCreateFileCapture(opts.videoFile);
-  }
-  cvSetCaptureProperty(video_cap, CV_CAP_PROP_FRAME_WIDTH, IMG_WIDTH);
-  cvSetCaptureProperty(video_cap, CV_CAP_PROP_FRAME_HEIGHT, IMG_HEIGHT);
-
-  // Keep track of the frames
-  int i = 0;
-
-  while (1) {
-    // Allocate memory to hold grayscale and sobel images
-    img_gray = Mat(IMG_HEIGHT, IMG_WIDTH, CV_8UC1);
-    img_sobel = Mat(IMG_HEIGHT, IMG_WIDTH, CV_8UC1);
-
-    pc_start(&perf_counters);
-    src = cvQueryFrame(video_cap);
-    pc_stop(&perf_counters);
-
-    cap_time = perf_counters.cycles.count;
-    sobel_l1cm = perf_counters.l1_misses.count;
-    sobel_ic = perf_counters.ic.count;
-
-    pc_start(&perf_counters);
-    grayScale(src, img_gray, 0,0);
-    pc_stop(&perf_counters);
-
-    gray_time = perf_counters.cycles.count;
-    sobel_l1cm += perf_counters.l1_misses.count;
-    sobel_ic += perf_counters.ic.count;
-
-    pc_start(&perf_counters);
-    sobelCalc(img_gray, img_sobel);
-    pc_stop(&perf_counters);
-
-    sobel_time = perf_counters.cycles.count;
-    sobel_l1cm += perf_counters.l1_misses.count;
-    sobel_ic += perf_counters.ic.count;
-
-    pc_start(&perf_counters);
-    namedWindow(top, CV_WINDOW_AUTOSIZE);
-    imshow(top, img_sobel);
-    pc_stop(&perf_counters);
-
-    disp_time = perf_counters.cycles.count;
-    sobel_l1cm += perf_counters.l1_misses.count;
-    sobel_ic += perf_counters.ic.count;
-
-    cap_total += cap_time;
-    gray_total += gray_time;
-    sobel_total += sobel_time;
-    sobel_l1cm_total += sobel_l1cm;
-    sobel_ic_total += sobel_ic;
-    disp_total += disp_time;
-    total_fps += PROC_FREQ/float(cap_time + disp_time + gray_time + sobel_time);
-    total_ipc += float(sobel_ic/float(cap_time + disp_time + gray_time + sobel_time));
-    i++;
-
-    // Press q to exit
-    char c = cvWaitKey(10);
-    if (c == 'q' || i >= opts.numFrames) {
-      break;
-    }
-  }
-
-  total_epf = PROC_EPC*NCORES/(total_fps/i);
-  float total_time = float(gray_total + sobel_total + cap_total + disp_total);
-
-  results_file.open("st_perf.csv", ios::out);
-  results_file << "Percent of time per function" << endl;
-  results_file << "Capture, " << (cap_total/total_time)*100 << "%" << endl;
-  results_file << "Grayscale, " << (gray_total/total_time)*100 << "%" << endl;
-  results_file << "Sobel, " << (sobel_total/total_time)*100 << "%" << endl;
-  results_file << "Display, " << (disp_total/total_time)*100 << "%" << endl;
-  results_file << "\nSummary" << endl;
-  results_file << "Frames per second, " << total_fps/i << endl;
-  results_file << "Cycles per frame, " << total_time/i << endl;
-  results_file << "Energy per frames (mJ), " << total_epf*1000 << endl;
-  results_file << "Total frames, " << i << endl;
-  results_file << "\nHardware Stats (Cap + Gray + Sobel + Display)" << endl;
-  results_file << "Instructions per cycle, " << total_ipc/i << endl;
-  results_file << "L1 misses per frame, " << sobel_l1cm_total/i << endl;
-  results_file << "L1 misses per instruction, " << sobel_l1cm_total/sobel_ic_total << endl;
-  results_file << "Instruction count per frame, " << sobel_ic_total/i << endl;
-
-  cvReleaseCapture(&video_cap);
-  results_file.close();
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include <iostream>
+#include <fstream>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <locale.h>
+#include <sys/ioctl.h>
+#include <err.h>
+
+#include "sobel_alg.h"
+#include "pc.h"
+#include "sobel_kernels.h"
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "frame_pool.h"
+#include "lat_hist.h"
+#include "affinity.h"
+
+using namespace std;
+using namespace cv;
+
+static ofstream results_file;
+
+// Define image mats to pass between function calls
+static Mat img_gray, img_sobel;
+static float total_epf;
+static lat_report_t lat;
+static double gray_total, sobel_total, cap_total, disp_total;
+static uint64_t hw_totals[PC_NUM_EVENTS];
+static incr_job_t incr;
+static pyramid_t pyr;
+static tiled_job_t tiled;
+
+/*******************************************
+ * Model: runSobelST
+ * Input: None
+ * Output: None
+ * Desc: This method pulls in an image from the webcam, feeds it into the
+ *   sobelCalc module, and displays the returned Sobel filtered image. This
+ *   function processes NUM_ITER frames.
+ ********************************************/
+void runSobelST()
+{
+  // Set up variables for computing Sobel
+  frame_sink_t sink;
+  Mat src;
+  uint64_t cap_time, gray_time, sobel_time, disp_time;
+
+  counters_t perf_counters;
+
+  pc_init(&perf_counters, 0);
+
+  // Start algorithm
+  frame_source_t source;
+  source_open(&source);
+  sink_open(&sink, opts.sink, source.fps);
+
+  // Keep track of the frames
+  int i = 0;
+
+  while (1) {
+    pc_start(&perf_counters);
+    source_read(&source, src);
+    pc_stop(&perf_counters);
+
+    // End of the video
+    if (src.empty()) {
+      break;
+    }
+
+    // Grayscale and sobel images come from the frame pool, sized from the
+    // frame itself; after the first frame this is a no-op. The fused and
+    // tiled paths never materialise the gray frame. src only wraps the
+    // capture's own buffer (or the mapped file), so it costs no allocation
+    // either. A Y4M source's frame already is the gray frame.
+    if (src.channels() == 1) {
+      img_gray = src;
+    } else if (!opts.fused && !opts.tiled) {
+      poolMat(img_gray, src.rows, src.cols, CV_MAKETYPE(src.depth(), 1));
+    }
+    outputMat(img_sobel, src.rows, src.cols, src.depth());
+    if (opts.incremental) {
+      incr.src = &src;
+      incr.gray = &img_gray;
+      incr.sobel = &img_sobel;
+      incrPlan(&incr, 1);
+    }
+    if (opts.pyramid) {
+      pyramidPlan(&pyr, img_gray, img_sobel);
+    }
+    if (opts.tiled) {
+      tiled.src = &src;
+      tiled.sobel = &img_sobel;
+      tiledPlan(&tiled, 1);
+    }
+
+    cap_time = NS_TO_CYCLES(perf_counters.ns);
+    lat_record_stage(&lat, LAT_CAPTURE, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+    pc_accumulate(&perf_counters, hw_totals);
+
+    if (opts.fused) {
+      // Single pass; its whole cost is reported under Sobel
+      gray_time = 0;
+
+      pc_start(&perf_counters);
+      sobelFused(src, img_sobel);
+      pc_stop(&perf_counters);
+    } else if (opts.tiled) {
+      // Each tile converts its own gray input; reported under Sobel too
+      gray_time = 0;
+
+      pc_start(&perf_counters);
+      for (int t = 0; t < tiled.tiles_x * tiled.tiles_y; t++) {
+        tiledBand(&tiled, t, 0);
+      }
+      pc_stop(&perf_counters);
+    } else {
+      pc_start(&perf_counters);
+      if (opts.incremental) {
+        for (int ty = 0; ty < incr.tiles_y; ty++) {
+          incrGrayBand(&incr, ty, 0);
+        }
+      } else if (opts.pyramid) {
+        pyramidGray(src, &pyr);
+      } else if (src.channels() == 3) {
+        grayScale(src, img_gray, 0,0);
+      }
+      pc_stop(&perf_counters);
+
+      gray_time = NS_TO_CYCLES(perf_counters.ns);
+      lat_record_stage(&lat, LAT_GRAY, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+      pc_accumulate(&perf_counters, hw_totals);
+
+      pc_start(&perf_counters);
+      if (opts.incremental) {
+        for (int ty = 0; ty < incr.tiles_y; ty++) {
+          incrSobelBand(&incr, ty, 0);
+        }
+        incrEndFrame(&incr);
+      } else if (opts.pyramid) {
+        pyramidSobel(&pyr);
+      } else {
+        sobelCalc(img_gray, img_sobel);
+      }
+      pc_stop(&perf_counters);
+    }
+
+    sobel_time = NS_TO_CYCLES(perf_counters.ns);
+    lat_record_stage(&lat, LAT_SOBEL, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+    pc_accumulate(&perf_counters, hw_totals);
+
+    pc_start(&perf_counters);
+    sink_write(&sink, img_sobel);
+    pc_stop(&perf_counters);
+
+    disp_time = NS_TO_CYCLES(perf_counters.ns);
+    lat_record_stage(&lat, LAT_DISPLAY, perf_counters.ns, perf_counters.count[PC_CYCLES]);
+    pc_accumulate(&perf_counters, hw_totals);
+
+    if (i == 0) {
+      fpool_mark_steady();
+    }
+
+    cap_total += cap_time;
+    gray_total += gray_time;
+    sobel_total += sobel_time;
+    disp_total += disp_time;
+    lat_end_frame(&lat);
+    i++;
+
+    // Press q to exit
+    char c = sink_poll_key(&sink);
+    if (c == 'q' || i >= opts.numFrames) {
+      break;
+    }
+  }
+
+  // Frame rate over the total time rather than a mean of per-frame rates,
+  // which would overweight the fast frames and hide the slow ones
+  double total_time = gray_total + sobel_total + cap_total + disp_total;
+  double fps = PROC_FREQ * (double)i / total_time;
+  total_epf = PROC_EPC * NCORES / fps;
+
+  results_file.open("st_perf.csv", ios::out);
+  results_file << "Percent of time per function" << endl;
+  results_file << "Capture, " << (cap_total/total_time)*100 << "%" << endl;
+  results_file << "Grayscale, " << (gray_total/total_time)*100 << "%" << endl;
+  results_file << sobelStageName() << ", " << (sobel_total/total_time)*100 << "%" << endl;
+  results_file << "Display, " << (disp_total/total_time)*100 << "%" << endl;
+  results_file << "\nSummary" << endl;
+  results_file << "Frames per second, " << fps << endl;
+  results_file << "Frame latency p50 (ms), " << lat_percentile(&lat.ns[LAT_FRAME], 0.50) / 1e6 << endl;
+  results_file << "Frame latency p99 (ms), " << lat_percentile(&lat.ns[LAT_FRAME], 0.99) / 1e6 << endl;
+  results_file << "Frame latency max (ms), " << lat.ns[LAT_FRAME].max / 1e6 << endl;
+  results_file << "Cycles per frame, " << total_time/i << endl;
+  results_file << "Energy per frames (mJ), " << total_epf*1000 << endl;
+  results_file << "Total frames, " << i << endl;
+  results_file << "Kernel, " << kernels->name << endl;
+  results_file << "Filter, " << filterName() << endl;
+  results_file << "Output, " << opts.sink << endl;
+  results_file << "Buffer pool allocations, " << fpool_stats().allocs << endl;
+  results_file << "Buffer pool allocations after first frame, " << fpool_stats().steady_allocs << endl;
+  if (opts.incremental) {
+    results_file << "Dirty tiles, " << (incr.tiles ? 100.0 * incr.dirty_tiles / incr.tiles : 0) << "%" << endl;
+  }
+  if (opts.pyramid) {
+    results_file << "Pyramid levels, " << pyr.levels << endl;
+  }
+  if (opts.tiled) {
+    results_file << "Tile size, " << tiled.tile_w << "x" << tiled.tile_h << endl;
+    results_file << "L1/L2 cache (KiB), " << tiled.l1 / 1024 << "/" << tiled.l2 / 1024 << endl;
+  }
+  affinity_report(results_file);
+  pc_report(results_file, &perf_counters, hw_totals, i);
+
+  lat.has_cycles = pc_available(&perf_counters, PC_CYCLES);
+  const char *stages[LAT_NUM_STAGES] = { "Capture", "Grayscale", sobelStageName(), "Display", "Frame" };
+  lat_export(&lat, "st", stages);
+
+  incrFree(&incr);
+  pyramidFree(&pyr);
+  tiledFree(&tiled);
+  pc_close(&perf_counters);
+  sink_close(&sink);
+  source_close(&source);
+  results_file.close();
+}
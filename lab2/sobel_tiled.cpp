@@ -0,0 +1,162 @@
+#include <unistd.h>
+#include "sobel_alg.h"
+#include "sobel_kernels.h"
+#include "frame_pool.h"
+
+// Cache blocked execution (--tiled). The row walk of sobelCalc keeps 2r+1
+// gray rows, the engine's int scratch rows and the output row of the whole
+// frame width in flight, which no longer fits L1 at 4K for the --filter
+// operators, and the two pass mode streams a full gray frame through memory
+// in between. Here the frame is cut into 2D tiles instead. A task converts
+// its tile plus the radius pixels of halo around it into a per worker gray
+// buffer and runs the Sobel stage straight out of that buffer, so the gray
+// input is produced and consumed while it is in cache and never written to
+// a frame. The halo is converted by both neighbours; that is the price for
+// tiles that are independent of each other.
+
+#define TILED_DEFAULT_L1 (32 * 1024)
+#define TILED_DEFAULT_L2 (256 * 1024)
+#define TILED_MIN_WIDTH 64
+#define TILED_MIN_HEIGHT 8
+
+// Data cache size of the given level in bytes, or `fallback` if the host
+// does not report it
+static long cacheSize(int level, long fallback)
+{
+  long size = -1;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+  size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+#endif
+  if (size <= 0) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", level);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+      char unit = 0;
+      if (fscanf(f, "%ld%c", &size, &unit) >= 1 && (unit == 'K' || unit == 'k')) {
+        size *= 1024;
+      }
+      fclose(f);
+    }
+  }
+  return size > 0 ? size : fallback;
+}
+
+/*******************************************
+ * Model: tiledPlan
+ * Input: job with src/sobel set, number of workers
+ * Output: None directly. Sets up the tile grid of job
+ * Desc: Picks the tile size from the host's caches unless --tile gives
+ *  one. The width is what keeps everything one output row touches (the
+ *  BGR row converted for it, 2r+1 gray rows, the engine's int scratch and
+ *  the output row) within half of L1; the height then keeps the tile's BGR
+ *  input, gray buffer and output within half of L2, and is lowered towards
+ *  TILED_MIN_HEIGHT until every worker has a few tiles to steal. Worker
+ *  buffers come from the frame pool. No-op unless the geometry changed.
+ ********************************************/
+void tiledPlan(tiled_job_t *job, int nthreads)
+{
+  Mat& src = *job->src;
+  if (job->bufs[0] != NULL && src.rows == job->rows && src.cols == job->cols) {
+    return;
+  }
+  tiledFree(job);
+
+  int r = sobelRadius();
+  job->rows = src.rows;
+  job->cols = src.cols;
+  job->l1 = cacheSize(1, TILED_DEFAULT_L1);
+  job->l2 = cacheSize(2, TILED_DEFAULT_L2);
+
+  job->tile_w = opts.tileWidth;
+  job->tile_h = opts.tileHeight;
+  if (job->tile_w <= 0) {
+    int in_bytes = src.elemSize();
+    int row_bytes = in_bytes + (2 * r + 1) +
+                    (opts.filter != FILTER_SOBEL ? FILTER_SCRATCH_ROWS * sizeof(int) : 0) +
+                    (opts.gradient ? 3 : 1);
+    job->tile_w = job->l1 / 2 / row_bytes / 64 * 64;
+    job->tile_w = job->tile_w > TILED_MIN_WIDTH ? job->tile_w : TILED_MIN_WIDTH;
+    job->tile_w = job->tile_w < src.cols ? job->tile_w : src.cols;
+
+    // BGR in, gray buffer and output per tile pixel
+    job->tile_h = job->l2 / 2 / ((in_bytes + 1 + (opts.gradient ? 3 : 1)) * job->tile_w);
+    int tiles_x = (src.cols + job->tile_w - 1) / job->tile_w;
+    int balanced = src.rows * tiles_x / (4 * nthreads);
+    job->tile_h = job->tile_h < balanced ? job->tile_h : balanced;
+    job->tile_h = job->tile_h > TILED_MIN_HEIGHT ? job->tile_h : TILED_MIN_HEIGHT;
+  }
+  job->tile_w = job->tile_w < src.cols ? job->tile_w : src.cols;
+  job->tile_h = job->tile_h < src.rows ? job->tile_h : src.rows;
+  job->tiles_x = (src.cols + job->tile_w - 1) / job->tile_w;
+  job->tiles_y = (src.rows + job->tile_h - 1) / job->tile_h;
+
+  job->buf_stride = fpool_stride(job->tile_w + 2 * r);
+  for (int w = 0; w < nthreads; w++) {
+    job->bufs[w] = (unsigned char *)fpool_acquire(job->buf_stride * (job->tile_h + 2 * r));
+    if (opts.filter != FILTER_SOBEL) {
+      job->lines[w] = (unsigned char *)fpool_acquire(lineBytes(job->tile_w + 2 * r));
+    }
+  }
+}
+
+/*******************************************
+ * Model: tiledBand
+ * Input: tiled_job_t, tile index (row major), worker
+ * Output: None directly. Writes the tile's part of the Sobel output
+ * Desc: Converts the tile and its halo, clipped to the frame, into the
+ *  worker's buffer, then runs the row kernels over the buffer. Buffer
+ *  column 0 is frame column bx0, so kernels run on the buffer width write
+ *  exactly the tile's columns, and the frame border stays untouched as
+ *  with sobelCalc.
+ ********************************************/
+void tiledBand(void *arg, int tile, int worker)
+{
+  tiled_job_t *job = (tiled_job_t *)arg;
+  Mat& src = *job->src;
+  Mat& out = *job->sobel;
+  int r = sobelRadius();
+  int x0 = tile % job->tiles_x * job->tile_w;
+  int y0 = tile / job->tiles_x * job->tile_h;
+  int x1 = x0 + job->tile_w < job->cols ? x0 + job->tile_w : job->cols;
+  int y1 = y0 + job->tile_h < job->rows ? y0 + job->tile_h : job->rows;
+  int bx0 = x0 > r ? x0 - r : 0, by0 = y0 > r ? y0 - r : 0;
+  int bx1 = x1 + r < job->cols ? x1 + r : job->cols;
+  int by1 = y1 + r < job->rows ? y1 + r : job->rows;
+  int width = bx1 - bx0;
+  unsigned char *buf = job->bufs[worker];
+  size_t bpp = src.elemSize();
+
+  for (int y = by0; y < by1; y++) {
+    kernels->gray_row(src.ptr(y) + bx0 * bpp, buf + (y - by0) * job->buf_stride, width);
+  }
+
+  int start = y0 > r ? y0 : r;
+  int end = y1 < job->rows - r ? y1 : job->rows - r;
+  const unsigned char *rows[5];
+  for (int y = start; y < end; y++) {
+    for (int k = 0; k <= 2 * r; k++) {
+      rows[k] = buf + (y - r + k - by0) * job->buf_stride;
+    }
+    unsigned char *o = out.ptr(y);
+    if (opts.gradient) {
+      kernels->grad_row(rows[0], rows[1], rows[2], (uint16_t *)o + bx0,
+                        o + 2 * job->cols + bx0, width);
+    } else if (opts.filter != FILTER_SOBEL) {
+      kernels->filter_row[opts.filter](rows, o + bx0, width, (int *)job->lines[worker]);
+    } else {
+      kernels->sobel_row(rows[0], rows[1], rows[2], o + bx0, width);
+    }
+  }
+}
+
+void tiledFree(tiled_job_t *job)
+{
+  for (int w = 0; w < POOL_MAX_THREADS; w++) {
+    fpool_release(job->bufs[w]);
+    fpool_release(job->lines[w]);
+    job->bufs[w] = NULL;
+    job->lines[w] = NULL;
+  }
+  job->rows = job->cols = 0;
+}
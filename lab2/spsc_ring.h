@@ -0,0 +1,87 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <sched.h>
+
+// Lock-free single-producer/single-consumer ring of pointers. Exactly one
+// thread may push and exactly one (other) thread may pop. The producer only
+// writes `tail`, the consumer only writes `head`; each keeps a cached copy of
+// the other's index so the shared cache line is only touched when the ring
+// looks full (producer) or empty (consumer).
+
+#define SPSC_MAX 64       // capacity limit, must be a power of two
+#define SPSC_CACHE_LINE 64
+#define SPSC_SPINS 1000   // polls before a blocked side starts yielding the CPU
+
+struct spsc_ring_t {
+  // consumer side
+  unsigned head __attribute__((aligned(SPSC_CACHE_LINE)));
+  unsigned tail_cache;
+  // producer side
+  unsigned tail __attribute__((aligned(SPSC_CACHE_LINE)));
+  unsigned head_cache;
+  // read-only after init
+  unsigned mask __attribute__((aligned(SPSC_CACHE_LINE)));
+  void *items[SPSC_MAX];
+};
+
+// capacity must be a power of two no larger than SPSC_MAX
+static inline void spsc_init(spsc_ring_t *r, unsigned capacity)
+{
+  r->head = r->tail_cache = 0;
+  r->tail = r->head_cache = 0;
+  r->mask = capacity - 1;
+}
+
+// Returns 0 if the ring is full
+static inline int spsc_push(spsc_ring_t *r, void *item)
+{
+  unsigned tail = r->tail;
+  if (tail - r->head_cache > r->mask) {
+    r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail - r->head_cache > r->mask) {
+      return 0;
+    }
+  }
+  r->items[tail & r->mask] = item;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE); // publish the item
+  return 1;
+}
+
+// Returns NULL if the ring is empty
+static inline void *spsc_pop(spsc_ring_t *r)
+{
+  unsigned head = r->head;
+  if (head == r->tail_cache) {
+    r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head == r->tail_cache) {
+      return NULL;
+    }
+  }
+  void *item = r->items[head & r->mask];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE); // hand the slot back
+  return item;
+}
+
+// Blocking variants: spin briefly, then yield until the other side catches up
+static inline void spsc_push_wait(spsc_ring_t *r, void *item)
+{
+  for (int spins = 0; !spsc_push(r, item); spins++) {
+    if (spins >= SPSC_SPINS) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void *spsc_pop_wait(spsc_ring_t *r)
+{
+  void *item;
+  for (int spins = 0; (item = spsc_pop(r)) == NULL; spins++) {
+    if (spins >= SPSC_SPINS) {
+      sched_yield();
+    }
+  }
+  return item;
+}
+
+#endif
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "thread_pool.h"
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+// Sleep while *addr == val; returns at once if it already differs
+static inline void futex_wait(void *addr, int val)
+{
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(void *addr, int n)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*******************************************
+ * Model: pool_work
+ * Input: pool, index of the calling worker
+ * Output: None
+ * Desc: Drains the worker's own task range, then steals from the other
+ *  workers' ranges in round robin order. Owner and thieves claim tasks with
+ *  the same atomic increment, so every task runs exactly once.
+ ********************************************/
+static void pool_work(thread_pool_t *pool, int self)
+{
+  int n = pool->active;
+
+  for (int k = 0; k < n; k++) {
+    pool_cursor_t *c = &pool->cursors[(self + k) % n];
+    while (1) {
+      int task = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+      if (task >= c->end) {
+        break;
+      }
+      if (k > 0) {
+        __atomic_fetch_add(&pool->steals, 1, __ATOMIC_RELAXED);
+      }
+      pool->fn(pool->arg, task, self);
+    }
+  }
+}
+
+/*******************************************
+ * Model: pool_wait_job
+ * Input: pool, last generation the worker ran
+ * Output: the new generation
+ * Desc: Spins, then sleeps on the generation futex. The sleeper count and
+ *  the generation are accessed sequentially consistent on both sides: a
+ *  worker counts itself before its last look at the generation, pool_run
+ *  bumps the generation before looking at the count, so either the worker
+ *  sees the new job or pool_run sees the worker and wakes it.
+ ********************************************/
+static unsigned pool_wait_job(thread_pool_t *pool, unsigned seen)
+{
+  unsigned gen;
+
+  for (int i = 0; i < pool->spin; i++) {
+    if ((gen = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE)) != seen) {
+      return gen;
+    }
+    cpu_relax();
+  }
+  while ((gen = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE)) == seen) {
+    __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->generation, __ATOMIC_SEQ_CST) == seen) {
+      futex_wait(&pool->generation, (int)seen);
+    }
+    __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+  }
+  return gen;
+}
+
+// Publish a new generation (job or quit) and wake whoever sleeps on it
+static void pool_publish(thread_pool_t *pool)
+{
+  __atomic_add_fetch(&pool->generation, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    futex_wake(&pool->generation, INT_MAX);
+  }
+}
+
+// Report a job (or a resume) as done; same pairing as pool_wait_job, with
+// the thread in pool_wait_done as the sleeper
+static void pool_ack(thread_pool_t *pool)
+{
+  if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST)) {
+    futex_wake(&pool->pending, 1);
+  }
+}
+
+/*******************************************
+ * Model: pool_park
+ * Input: pool, index of the calling worker
+ * Output: the generation to wait for jobs after
+ * Desc: Sleeps while the worker is outside the active set, then
+ *  acknowledges the resume. pool_set_active waits for that, so no job is
+ *  published before the worker is back, and it waits for exactly the jobs
+ *  after resume_gen.
+ ********************************************/
+static unsigned pool_park(thread_pool_t *pool, int self)
+{
+  int active;
+  while (self >= (active = __atomic_load_n(&pool->active, __ATOMIC_ACQUIRE))) {
+    futex_wait(&pool->active, active);
+  }
+  unsigned gen = __atomic_load_n(&pool->resume_gen, __ATOMIC_RELAXED);
+  pool_ack(pool);
+  return gen;
+}
+
+// Wait until every pool thread of the current job has reported completion
+static void pool_wait_done(thread_pool_t *pool)
+{
+  int pending;
+  for (int i = 0; i < pool->spin; i++) {
+    if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) {
+      return;
+    }
+    cpu_relax();
+  }
+  __atomic_store_n(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+  while ((pending = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST)) > 0) {
+    futex_wait(&pool->pending, pending);
+  }
+  __atomic_store_n(&pool->waiting, 0, __ATOMIC_RELAXED);
+}
+
+// Body of every pool thread: wait until a new job is published, work on it,
+// report completion, repeat until the pool is destroyed. A job without a
+// function is pool_set_active parking the workers beyond `active`.
+static void *pool_thread(void *ptr)
+{
+  pool_worker_t *worker = (pool_worker_t *)ptr;
+  thread_pool_t *pool = worker->pool;
+  unsigned seen = 0;
+  int park;
+
+  pool->tids[worker->id] = syscall(SYS_gettid);
+  __atomic_add_fetch(&pool->ready, 1, __ATOMIC_RELEASE);
+  futex_wake(&pool->ready, 1);
+  while (1) {
+    seen = pool_wait_job(pool, seen);
+    if (__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+
+    park = pool->fn == NULL && worker->id >= pool->active;
+    if (pool->fn != NULL) {
+      pool_work(pool, worker->id);
+    }
+
+    pool_ack(pool);
+    if (park) {
+      seen = pool_park(pool, worker->id);
+    }
+  }
+  return NULL;
+}
+
+/*******************************************
+ * Model: pool_try_create
+ * Input: number of workers, <= 0 for one per online CPU
+ * Output: the pool, or NULL with errno set
+ * Desc: pool_create without exiting, for the library: ENOMEM if the pool
+ *  cannot be allocated, or pthread_create's error (e.g. EAGAIN) if a
+ *  thread cannot be started, in which case the threads already started
+ *  are stopped again.
+ ********************************************/
+thread_pool_t *pool_try_create(int nthreads)
+{
+  thread_pool_t *pool;
+
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > POOL_MAX_THREADS) {
+    nthreads = POOL_MAX_THREADS;
+  }
+
+  if (posix_memalign((void **)&pool, POOL_CACHE_LINE, sizeof(*pool)) != 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(pool, 0, sizeof(*pool));
+  pool->nthreads = nthreads;
+  pool->active = nthreads;
+  pool->spin = nthreads <= sysconf(_SC_NPROCESSORS_ONLN) ? POOL_SPIN : 0;
+  for (int i = 0; i < nthreads; i++) {
+    pool->nodes[i] = -1;
+  }
+
+  // Worker 0 is whoever calls pool_run, so only spawn the others
+  for (int i = 1; i < nthreads; i++) {
+    int ret;
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    if ( (ret = pthread_create(&pool->threads[i], NULL, pool_thread, &pool->workers[i])) ) {
+      // Stop threads 1 .. i-1; a thread not yet waiting sees the quit
+      // generation as soon as it starts
+      pool->nthreads = pool->active = i;
+      pool_destroy(pool);
+      errno = ret;
+      return NULL;
+    }
+  }
+
+  // Wait until every thread has published its tid
+  pool->tids[0] = syscall(SYS_gettid);
+  int ready;
+  while ((ready = __atomic_load_n(&pool->ready, __ATOMIC_ACQUIRE)) < nthreads - 1) {
+    futex_wait(&pool->ready, ready);
+  }
+  return pool;
+}
+
+thread_pool_t *pool_create(int nthreads)
+{
+  thread_pool_t *pool = pool_try_create(nthreads);
+  if (pool == NULL) {
+    err(1, "pool_create: cannot create a pool of %d threads", nthreads);
+  }
+  return pool;
+}
+
+/*******************************************
+ * Model: pool_run
+ * Input: pool, task function and its argument, number of tasks
+ * Output: None
+ * Desc: Splits [0, ntasks) into one contiguous share per worker, wakes the
+ *  pool threads, works on share 0 itself and waits for the rest. The job
+ *  fields are written before the generation is bumped and so are visible
+ *  to every worker that sees the new generation.
+ ********************************************/
+void pool_run(thread_pool_t *pool, pool_task_fn fn, void *arg, int ntasks)
+{
+  int n = pool->active;
+
+  pool->fn = fn;
+  pool->arg = arg;
+  for (int w = 0; w < n; w++) {
+    pool->cursors[w].next = (int)((long)ntasks * w / n);
+    pool->cursors[w].end = (int)((long)ntasks * (w + 1) / n);
+  }
+
+  if (n == 1) {
+    pool_work(pool, 0);
+    return;
+  }
+
+  __atomic_store_n(&pool->pending, n - 1, __ATOMIC_RELAXED);
+  pool_publish(pool);
+
+  pool_work(pool, 0);
+  pool_wait_done(pool);
+}
+
+/*******************************************
+ * Model: pool_set_active
+ * Input: pool, number of workers to run jobs on
+ * Output: None
+ * Desc: Narrowing publishes a job without a function to the workers active
+ *  so far; those past the new count acknowledge it like any job and go to
+ *  sleep in pool_park. Widening records the current generation and raises
+ *  the count, waking the parked workers, and waits until each has
+ *  acknowledged its resume; they then wait for jobs from that generation
+ *  on, so they cannot miss the next one. Either way every worker is where
+ *  the new count says when this returns.
+ ********************************************/
+void pool_set_active(thread_pool_t *pool, int n)
+{
+  int old = pool->active;
+
+  if (n < 1) {
+    n = 1;
+  }
+  if (n > pool->nthreads) {
+    n = pool->nthreads;
+  }
+  if (n > old) {
+    __atomic_store_n(&pool->resume_gen, __atomic_load_n(&pool->generation, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->pending, n - old, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->active, n, __ATOMIC_SEQ_CST);
+    futex_wake(&pool->active, INT_MAX);
+    pool_wait_done(pool);
+  } else if (n < old) {
+    pool->fn = NULL;
+    pool->active = n;
+    __atomic_store_n(&pool->pending, old - 1, __ATOMIC_RELAXED);
+    pool_publish(pool);
+    pool_wait_done(pool);
+  }
+}
+
+void pool_destroy(thread_pool_t *pool)
+{
+  // Parked workers come back first so that they see the quit
+  pool_set_active(pool, pool->nthreads);
+  __atomic_store_n(&pool->quit, 1, __ATOMIC_RELEASE);
+  pool_publish(pool);
+
+  for (int i = 1; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool);
+}
@@ -0,0 +1,99 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+// Persistent worker pool. Workers are created once and sleep between jobs.
+// A job is `ntasks` independent tasks (e.g. row bands of a frame). Each worker
+// starts on its own contiguous share of the tasks and, once that is drained,
+// steals the remaining tasks of slower workers, so one slow band no longer
+// holds the whole frame back.
+//
+// Dispatch and completion are two atomic counters rather than a mutex and
+// condition variables: pool_run publishes a job by bumping `generation`
+// (release) and waits for `pending` to drop to 0; workers wait for the
+// generation to change (acquire) and decrement pending when done. Both
+// sides spin for a while first, then sleep on the counter with a futex, so
+// back to back jobs (gray, then Sobel) cost no system calls when the
+// workers have CPUs of their own, and idle workers still sleep.
+//
+// pool_set_active narrows jobs to the first n workers, e.g. to run on
+// fewer cores when fewer are enough (see governor.h). Workers beyond n are
+// parked: they sleep on a futex of their own, which job dispatch never
+// wakes, until the pool is widened again.
+
+// Called once per task. `worker` is 0 for the calling thread, 1..n-1 for pool threads.
+typedef void (*pool_task_fn)(void *arg, int task, int worker);
+
+#define POOL_MAX_THREADS 256
+#define POOL_CACHE_LINE 64
+// Polls of a counter before falling back to the futex. Not used when the
+// pool has more threads than there are CPUs: the thread being waited on
+// may then need the spinner's CPU.
+#define POOL_SPIN 4096
+
+// Task cursor of one worker: it owns tasks [next, end). Padded to a cache
+// line so owners and thieves of different workers do not false-share.
+struct pool_cursor_t {
+  int next;
+  int end;
+  char pad[POOL_CACHE_LINE - 2 * sizeof(int)];
+} __attribute__((aligned(POOL_CACHE_LINE)));
+
+struct thread_pool_t;
+
+struct pool_worker_t {
+  thread_pool_t *pool;
+  int id;
+};
+
+struct thread_pool_t {
+  int nthreads;               // including the thread that calls pool_run
+  pthread_t threads[POOL_MAX_THREADS];
+  pid_t tids[POOL_MAX_THREADS]; // kernel thread ids, e.g. to attach counters
+  int nodes[POOL_MAX_THREADS];  // NUMA node a worker is pinned to, -1 if not pinned
+  pool_worker_t workers[POOL_MAX_THREADS];
+  pool_cursor_t cursors[POOL_MAX_THREADS];
+
+  // Current job
+  pool_task_fn fn;
+  void *arg;
+
+  // Dispatch/completion handshake. The counters double as futex words and
+  // sit on their own cache lines, apart from the job fields above.
+  int spin;                   // polls before sleeping, POOL_SPIN or 0
+  int quit;
+  int active;                 // workers that take jobs (futex word parked workers sleep on)
+  unsigned resume_gen;        // generation current when the pool was last widened
+  unsigned generation __attribute__((aligned(POOL_CACHE_LINE))); // bumped for every job
+  int sleepers;               // workers asleep (or about to be) on generation
+  int pending __attribute__((aligned(POOL_CACHE_LINE))); // pool threads still working on the job
+  int waiting;                // pool_run asleep (or about to be) on pending
+  int ready;                  // pool threads that have published their tid
+
+  // Tasks each worker took from someone else's share, for the reports
+  unsigned long steals;
+};
+
+// Create a pool of `nthreads` workers in total (the caller of pool_run is one
+// of them, so nthreads - 1 threads are spawned). nthreads <= 0 means one per
+// online CPU.
+thread_pool_t *pool_create(int nthreads);
+
+// The same, returning NULL with errno set instead of exiting when memory or
+// threads run out
+thread_pool_t *pool_try_create(int nthreads);
+
+// Run fn(arg, task, worker) for every task in [0, ntasks) and return when all
+// of them have finished. Must only be called from the thread that created the pool.
+void pool_run(thread_pool_t *pool, pool_task_fn fn, void *arg, int ntasks);
+
+// Run jobs on workers 0 .. n-1 only (clamped to 1 .. nthreads) and park the
+// rest. Returns once workers being parked have acknowledged it. Same
+// thread rule as pool_run.
+void pool_set_active(thread_pool_t *pool, int n);
+
+void pool_destroy(thread_pool_t *pool);
+
+#endif